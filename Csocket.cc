@@ -42,6 +42,10 @@
 #ifdef __NetBSD__
 #include <sys/param.h>
 #endif /* __NetBSD__ */
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#endif /* _WIN32 */
 
 #ifdef HAVE_LIBSSL
 #include <stdio.h>
@@ -87,6 +91,27 @@
 
 #define CS_SRANDBUFFER 128
 
+#if defined( __linux__ ) && defined( _GNU_SOURCE ) && defined( SOCK_NONBLOCK ) && defined( SOCK_CLOEXEC )
+#define CS_HAVE_ACCEPT4
+#endif /* accept4 */
+
+#if defined( __linux__ ) && defined( _GNU_SOURCE ) && defined( MSG_WAITFORONE )
+#define CS_HAVE_MMSG
+#endif /* recvmmsg/sendmmsg */
+
+#if defined( CS_HAVE_MMSG ) && defined( UDP_SEGMENT ) && defined( UDP_GRO )
+#define CS_HAVE_UDP_OFFLOAD
+#endif /* UDP GSO/GRO */
+
+#if defined( __linux__ ) && defined( _GNU_SOURCE ) && defined( SPLICE_F_NONBLOCK )
+#define CS_HAVE_SPLICE
+#endif /* splice */
+
+//! what Csock::Proxy() asks for as the pipe size, the kernel may round it or refuse
+#define CS_SPLICE_PIPE_SIZE ( 256 * 1024 )
+//! the watermark Csock::Proxy() sets when the data is copied and none was set
+#define CS_PROXY_BUFFER ( 256 * 1024 )
+
 /*
  * timeradd/timersub is missing on solaris' sys/time.h, provide
  * some fallback macros
@@ -213,6 +238,87 @@ static inline void set_close_on_exec( cs_sock_t fd )
 }
 #endif /* _WIN32 */
 
+#if defined( TCP_CORK )
+#define CS_TCP_CORK TCP_CORK
+#elif defined( TCP_NOPUSH )
+#define CS_TCP_CORK TCP_NOPUSH
+#endif /* TCP_CORK */
+
+//! holds back partial frames while corked, uncorking pushes out whatever is pending
+static inline void set_cork( cs_sock_t fd, bool bCork )
+{
+#ifdef CS_TCP_CORK
+	int iCork = ( bCork ? 1 : 0 );
+	setsockopt( fd, IPPROTO_TCP, CS_TCP_CORK, ( char * )&iCork, sizeof( iCork ) ); // Ignore errors, not every fd is a tcp socket
+#endif /* CS_TCP_CORK */
+}
+
+//! one int socket option, for CSSockTuning
+static inline bool set_int_option( cs_sock_t fd, int iLevel, int iName, int iValue, const char * pszName )
+{
+	if( setsockopt( fd, iLevel, iName, ( char * )&iValue, sizeof( iValue ) ) == 0 )
+		return( true );
+	PERROR( pszName );
+	return( false );
+}
+
+#ifdef CS_HAVE_UDP_OFFLOAD
+//! receive slot size while GRO is on, the kernel coalesces up to 64k into one slot
+#define CS_DGRAM_GRO_SLOT 65535
+//! the kernels limit on segments per GSO send
+#define CS_DGRAM_GSO_SEGS 64
+
+//! control buffer for one UDP_SEGMENT/UDP_GRO message, the union keeps it aligned for cmsghdr
+union CSDgramControl
+{
+	char			m_szBuf[CMSG_SPACE( sizeof( int ) )];
+	struct cmsghdr	m_cAlign;
+};
+#endif /* CS_HAVE_UDP_OFFLOAD */
+
+//! fills in a datagram destination from a numeric address, IPv4 addresses are mapped when the socket is IPv6
+static bool datagram_address( const CS_STRING & sIP, uint16_t uPort, bool bIPv6, struct sockaddr_storage & cAddr, socklen_t & iAddrLen )
+{
+	memset( &cAddr, 0, sizeof( cAddr ) );
+#ifdef HAVE_IPV6
+	if( bIPv6 )
+	{
+		struct sockaddr_in6 * pAddr6 = ( struct sockaddr_in6 * )&cAddr;
+		pAddr6->sin6_family = AF_INET6;
+		pAddr6->sin6_port = htons( uPort );
+		if( inet_pton( AF_INET6, sIP.c_str(), &pAddr6->sin6_addr ) <= 0 )
+		{
+			// a dual stack socket reaches IPv4 peers through ::ffff:a.b.c.d
+			struct in_addr cAddr4;
+			if( inet_pton( AF_INET, sIP.c_str(), &cAddr4 ) <= 0 )
+				return( false );
+			pAddr6->sin6_addr.s6_addr[10] = 0xff;
+			pAddr6->sin6_addr.s6_addr[11] = 0xff;
+			memcpy( &pAddr6->sin6_addr.s6_addr[12], &cAddr4, sizeof( cAddr4 ) );
+		}
+		iAddrLen = ( socklen_t )sizeof( struct sockaddr_in6 );
+		return( true );
+	}
+#endif /* HAVE_IPV6 */
+	struct sockaddr_in * pAddr = ( struct sockaddr_in * )&cAddr;
+	pAddr->sin_family = AF_INET;
+	pAddr->sin_port = htons( uPort );
+	if( inet_pton( AF_INET, sIP.c_str(), &pAddr->sin_addr ) <= 0 )
+		return( false );
+	iAddrLen = ( socklen_t )sizeof( struct sockaddr_in );
+	return( true );
+}
+
+//! true for errors that only mean try again later
+static inline bool datagram_would_block( int iErrno )
+{
+#ifdef _WIN32
+	return( iErrno == WSAEWOULDBLOCK || iErrno == WSAEINTR );
+#else
+	return( iErrno == EAGAIN || iErrno == EWOULDBLOCK || iErrno == EINTR );
+#endif /* _WIN32 */
+}
+
 void CSSockAddr::SinFamily()
 {
 #ifdef HAVE_IPV6
@@ -417,8 +523,9 @@ void CGetAddrInfo::Init()
 	memset( ( struct addrinfo * )&m_cHints, '\0', sizeof( m_cHints ) );
 	m_cHints.ai_family = m_csSockAddr.GetAFRequire();
 
-	m_cHints.ai_socktype = SOCK_STREAM;
-	m_cHints.ai_protocol = IPPROTO_TCP;
+	bool bDatagram = ( m_pSock && m_pSock->IsDatagram() );
+	m_cHints.ai_socktype = ( bDatagram ? SOCK_DGRAM : SOCK_STREAM );
+	m_cHints.ai_protocol = ( bDatagram ? IPPROTO_UDP : IPPROTO_TCP );
 #ifdef AI_ADDRCONFIG
 	// this is suppose to eliminate host from appearing that this system can not support
 	m_cHints.ai_flags = AI_ADDRCONFIG;
@@ -447,13 +554,15 @@ int CGetAddrInfo::Finish()
 	{
 		std::list<struct addrinfo *> lpTryAddrs;
 		bool bFound = false;
+		int iSockType = m_cHints.ai_socktype;
+		int iProtocol = m_cHints.ai_protocol;
 		for( struct addrinfo * pRes = m_pAddrRes; pRes; pRes = pRes->ai_next )
 		{
 			// pass through the list building out a lean list of candidates to try. AI_CONFIGADDR doesn't always seem to work
 #ifdef __sun
-			if( ( pRes->ai_socktype != SOCK_STREAM ) || ( pRes->ai_protocol != IPPROTO_TCP && pRes->ai_protocol != IPPROTO_IP ) )
+			if( ( pRes->ai_socktype != iSockType ) || ( pRes->ai_protocol != iProtocol && pRes->ai_protocol != IPPROTO_IP ) )
 #else
-			if( ( pRes->ai_socktype != SOCK_STREAM ) || ( pRes->ai_protocol != IPPROTO_TCP ) )
+			if( ( pRes->ai_socktype != iSockType ) || ( pRes->ai_protocol != iProtocol ) )
 #endif /* __sun work around broken impl of getaddrinfo */
 				continue;
 
@@ -609,6 +718,131 @@ void ShutdownCsocket()
 #ifdef _WIN32
 	WSACleanup();
 #endif /* _WIN32 */
+	TrimCsockPool();
+}
+
+// size classes for the Csock free lists, objects are rounded up to a multiple of CS_POOL_ALIGN
+#define CS_POOL_CLASSES 8
+#define CS_POOL_ALIGN 64
+
+#if defined( _MSC_VER )
+#define CS_THREAD_LOCAL __declspec( thread )
+#else
+#define CS_THREAD_LOCAL __thread
+#endif /* _MSC_VER */
+
+struct CSPoolFreeBlock
+{
+	CSPoolFreeBlock * m_pNext;
+};
+
+struct CSPoolClass
+{
+	size_t m_uSize;
+	size_t m_uCount;
+	CSPoolFreeBlock * m_pHead;
+};
+
+static size_t s_uCsockPoolMax = 0;
+static CS_THREAD_LOCAL CSPoolClass s_aCsockPool[CS_POOL_CLASSES];
+
+static inline size_t CSPoolRoundSize( size_t uSize )
+{
+	return( ( uSize + CS_POOL_ALIGN - 1 ) & ~( ( size_t )CS_POOL_ALIGN - 1 ) );
+}
+
+void SetCsockPoolSize( size_t uMaxCached )
+{
+	s_uCsockPoolMax = uMaxCached;
+	if( uMaxCached == 0 )
+		TrimCsockPool();
+}
+
+void TrimCsockPool()
+{
+	for( size_t a = 0; a < CS_POOL_CLASSES; ++a )
+	{
+		CSPoolClass & cClass = s_aCsockPool[a];
+		while( cClass.m_pHead )
+		{
+			CSPoolFreeBlock * pBlock = cClass.m_pHead;
+			cClass.m_pHead = pBlock->m_pNext;
+			::operator delete( pBlock );
+		}
+		cClass.m_uCount = 0;
+		cClass.m_uSize = 0;
+	}
+}
+
+//! a cached block of the (already rounded) size, or NULL
+static void * CSPoolTake( size_t uSize )
+{
+	if( s_uCsockPoolMax == 0 )
+		return( NULL );
+	for( size_t a = 0; a < CS_POOL_CLASSES; ++a )
+	{
+		CSPoolClass & cClass = s_aCsockPool[a];
+		if( cClass.m_uSize == uSize && cClass.m_pHead )
+		{
+			CSPoolFreeBlock * pBlock = cClass.m_pHead;
+			cClass.m_pHead = pBlock->m_pNext;
+			cClass.m_uCount--;
+			return( pBlock );
+		}
+	}
+	return( NULL );
+}
+
+void * Csock::operator new( size_t uSize )
+{
+	uSize = CSPoolRoundSize( uSize );
+	void * pBlock = CSPoolTake( uSize );
+	if( pBlock )
+		return( pBlock );
+	// always allocate the rounded size, so any block can go back on the free list of its class
+	return( ::operator new( uSize ) );
+}
+
+void * Csock::operator new( size_t uSize, const std::nothrow_t & ) CS_NOTHROW
+{
+	uSize = CSPoolRoundSize( uSize );
+	void * pBlock = CSPoolTake( uSize );
+	if( pBlock )
+		return( pBlock );
+	return( ::operator new( uSize, std::nothrow ) );
+}
+
+void Csock::operator delete( void * pData, const std::nothrow_t & ) CS_NOTHROW
+{
+	// only reached when a constructor throws, the size isn't known here so it goes straight back to the heap
+	::operator delete( pData );
+}
+
+void Csock::operator delete( void * pData, size_t uSize )
+{
+	if( !pData )
+		return;
+
+	if( s_uCsockPoolMax > 0 )
+	{
+		uSize = CSPoolRoundSize( uSize );
+		for( size_t a = 0; a < CS_POOL_CLASSES; ++a )
+		{
+			CSPoolClass & cClass = s_aCsockPool[a];
+			if( cClass.m_uSize == 0 )
+				cClass.m_uSize = uSize; // claim an unused class
+			if( cClass.m_uSize != uSize )
+				continue;
+			if( cClass.m_uCount >= s_uCsockPoolMax )
+				break;
+			CSPoolFreeBlock * pBlock = ( CSPoolFreeBlock * )pData;
+			pBlock->m_pNext = cClass.m_pHead;
+			cClass.m_pHead = pBlock;
+			cClass.m_uCount++;
+			return;
+		}
+	}
+	::operator delete( pData );
 }
 
 #ifdef HAVE_LIBSSL
@@ -678,12 +912,375 @@ void CSAdjustTVTimeout( struct timeval & tv, long iTimeoutMS )
 		if( iCurTimeout > iTimeoutMS )
 		{
 			tv.tv_sec = iTimeoutMS / 1000;
-			tv.tv_usec = iTimeoutMS % 1000;
+			tv.tv_usec = ( iTimeoutMS % 1000 ) * 1000;
 		}
 	}
 }
 
+CSTokenBucket::CSTokenBucket()
+{
+	m_uRate = 0;
+	m_uBurst = 0;
+	m_uTokens = 0;
+	m_iLastRefill = 0;
+	m_pParent = NULL;
+}
+
+void CSTokenBucket::SetRate( uint64_t uBytesPerSec, uint64_t uBurst )
+{
+	m_uRate = uBytesPerSec;
+	m_uBurst = ( uBurst ? uBurst : uBytesPerSec );
+	m_uTokens = m_uBurst * 1000; // start out full
+	m_iLastRefill = millitime();
+}
+
+uint64_t CSTokenBucket::Tokens( uint64_t iNOW ) const
+{
+	uint64_t uCap = m_uBurst * 1000;
+	if( m_uTokens >= uCap )
+		return( uCap );
+	if( iNOW <= m_iLastRefill )
+		return( m_uTokens );
+	// a millisecond refills m_uRate thousandths of a byte, check against the cap first so this can't overflow
+	uint64_t iElapsed = iNOW - m_iLastRefill;
+	if( iElapsed >= ( uCap - m_uTokens ) / m_uRate + 1 )
+		return( uCap );
+	uint64_t uTokens = m_uTokens + iElapsed * m_uRate;
+	return( uTokens < uCap ? uTokens : uCap );
+}
+
+bool CSTokenBucket::IsShaping() const
+{
+	for( const CSTokenBucket * pBucket = this; pBucket; pBucket = pBucket->m_pParent )
+	{
+		if( pBucket->m_uRate > 0 )
+			return( true );
+	}
+	return( false );
+}
+
+uint64_t CSTokenBucket::Available( uint64_t iNOW ) const
+{
+	uint64_t uAvail = ~( uint64_t )0;
+	for( const CSTokenBucket * pBucket = this; pBucket; pBucket = pBucket->m_pParent )
+	{
+		if( pBucket->m_uRate == 0 )
+			continue;
+		uint64_t uTokens = pBucket->Tokens( iNOW ) / 1000;
+		if( uTokens < uAvail )
+			uAvail = uTokens;
+	}
+	return( uAvail );
+}
+
+void CSTokenBucket::Consume( uint64_t uBytes, uint64_t iNOW )
+{
+	for( CSTokenBucket * pBucket = this; pBucket; pBucket = pBucket->m_pParent )
+	{
+		if( pBucket->m_uRate == 0 )
+			continue;
+		uint64_t uTokens = pBucket->Tokens( iNOW );
+		pBucket->m_uTokens = ( uTokens > uBytes * 1000 ? uTokens - uBytes * 1000 : 0 );
+		pBucket->m_iLastRefill = iNOW;
+	}
+}
+
+uint64_t CSTokenBucket::MillisUntil( uint64_t uBytes, uint64_t iNOW ) const
+{
+	uint64_t iWait = 0;
+	for( const CSTokenBucket * pBucket = this; pBucket; pBucket = pBucket->m_pParent )
+	{
+		if( pBucket->m_uRate == 0 )
+			continue;
+		uint64_t uNeed = ( uBytes < pBucket->m_uBurst ? uBytes : pBucket->m_uBurst ) * 1000;
+		uint64_t uTokens = pBucket->Tokens( iNOW );
+		if( uTokens >= uNeed )
+			continue;
+		uint64_t iBucketWait = ( uNeed - uTokens + pBucket->m_uRate - 1 ) / pBucket->m_uRate;
+		if( iBucketWait > iWait )
+			iWait = iBucketWait;
+	}
+	return( iWait );
+}
+
+CSSockStats::CSSockStats()
+{
+	Reset();
+}
+
+void CSSockStats::Reset()
+{
+	m_iSockets = 0;
+	m_iRetired = 0;
+	m_iBytesRead = 0;
+	m_iBytesWritten = 0;
+	m_iReadCalls = 0;
+	m_iWriteCalls = 0;
+	m_iReadEAGAIN = 0;
+	m_iWriteEAGAIN = 0;
+	m_uSendQueue = 0;
+	m_uPeakSendQueue = 0;
+	m_iReadShapedMS = 0;
+	m_iWriteShapedMS = 0;
+	m_iReadShapedSince = 0;
+	m_iWriteShapedSince = 0;
+	m_iSSLHandshakes = 0;
+	m_iSSLHandshakeUS = 0;
+	m_iSSLHandshakeStart = 0;
+	m_iDNSLookups = 0;
+	m_iDNSUS = 0;
+	m_iDNSStart = 0;
+	m_iFastOpenTries = 0;
+	m_iFastOpens = 0;
+	m_iWindowStart = 0;
+	m_iWindowRead = 0;
+	m_iWindowWritten = 0;
+	m_fReadRate = 0;
+	m_fWriteRate = 0;
+}
+
+void CSSockStats::Add( const CSSockStats & cStats )
+{
+	m_iSockets += cStats.m_iSockets;
+	m_iRetired += cStats.m_iRetired;
+	m_iBytesRead += cStats.m_iBytesRead;
+	m_iBytesWritten += cStats.m_iBytesWritten;
+	m_iReadCalls += cStats.m_iReadCalls;
+	m_iWriteCalls += cStats.m_iWriteCalls;
+	m_iReadEAGAIN += cStats.m_iReadEAGAIN;
+	m_iWriteEAGAIN += cStats.m_iWriteEAGAIN;
+	m_uSendQueue += cStats.m_uSendQueue;
+	if( cStats.m_uPeakSendQueue > m_uPeakSendQueue )
+		m_uPeakSendQueue = cStats.m_uPeakSendQueue;
+	m_iReadShapedMS += cStats.m_iReadShapedMS;
+	m_iWriteShapedMS += cStats.m_iWriteShapedMS;
+	m_iSSLHandshakes += cStats.m_iSSLHandshakes;
+	m_iSSLHandshakeUS += cStats.m_iSSLHandshakeUS;
+	m_iDNSLookups += cStats.m_iDNSLookups;
+	m_iDNSUS += cStats.m_iDNSUS;
+	m_iFastOpenTries += cStats.m_iFastOpenTries;
+	m_iFastOpens += cStats.m_iFastOpens;
+	m_fReadRate += cStats.m_fReadRate;
+	m_fWriteRate += cStats.m_fWriteRate;
+}
+
+void CSSockStats::Roll( uint64_t iNOW )
+{
+	if( m_iWindowStart == 0 || iNOW < m_iWindowStart )
+	{
+		m_iWindowStart = iNOW;
+		return;
+	}
+	uint64_t iElapsed = iNOW - m_iWindowStart;
+	if( iElapsed < 1000 )
+		return;
+
+	// each whole second the window spans weighs the old average down by another 3/4
+	double fKeep = 1.0;
+	for( uint64_t iSecs = iElapsed / 1000; iSecs > 0 && fKeep > 0.0001; --iSecs )
+		fKeep *= 0.75;
+
+	double fRead = ( double )m_iWindowRead * 1000.0 / ( double )iElapsed;
+	double fWrite = ( double )m_iWindowWritten * 1000.0 / ( double )iElapsed;
+	// the first sample seeds the average, so it doesn't have to climb up from 0
+	m_fReadRate = ( m_fReadRate == 0 ? fRead : m_fReadRate * fKeep + fRead * ( 1.0 - fKeep ) );
+	m_fWriteRate = ( m_fWriteRate == 0 ? fWrite : m_fWriteRate * fKeep + fWrite * ( 1.0 - fKeep ) );
+
+	m_iWindowStart = iNOW;
+	m_iWindowRead = 0;
+	m_iWindowWritten = 0;
+}
+
+void CSSockStats::Retire()
+{
+	m_iSockets = 0;
+	m_iRetired = 1;
+	m_uSendQueue = 0;
+	m_fReadRate = 0;
+	m_fWriteRate = 0;
+}
+
+CSSockTuning::CSSockTuning()
+{
+	m_iSendBuffer = -1;
+	m_iRecvBuffer = -1;
+	m_iNoDelay = -1;
+	m_iQuickAck = -1;
+	m_iKeepAlive = -1;
+	m_iKeepIdle = -1;
+	m_iKeepInterval = -1;
+	m_iKeepCount = -1;
+	m_iNotSentLowat = -1;
+	m_iBusyPoll = -1;
+	m_iTOS = -1;
+}
+
+void CSSockTuning::SetKeepAlive( bool b, int iIdle, int iInterval, int iCount )
+{
+	m_iKeepAlive = ( b ? 1 : 0 );
+	m_iKeepIdle = iIdle;
+	m_iKeepInterval = iInterval;
+	m_iKeepCount = iCount;
+}
+
+bool CSSockTuning::IsEmpty() const
+{
+	return( m_iSendBuffer < 0 && m_iRecvBuffer < 0 && m_iNoDelay < 0 && m_iQuickAck < 0 && m_iKeepAlive < 0
+		&& m_iNotSentLowat < 0 && m_iBusyPoll < 0 && m_iTOS < 0 );
+}
+
+bool CSSockTuning::Apply( cs_sock_t iSock, bool bTCP, bool bIPv6, bool bAccepted ) const
+{
+	bool bRet = true;
+#ifdef TCP_QUICKACK
+	if( bTCP && m_iQuickAck >= 0 )
+		bRet &= set_int_option( iSock, IPPROTO_TCP, TCP_QUICKACK, m_iQuickAck, "TCP_QUICKACK" );
+#endif /* TCP_QUICKACK */
+	if( bAccepted )
+		return( bRet );
+
+	if( m_iSendBuffer >= 0 )
+		bRet &= set_int_option( iSock, SOL_SOCKET, SO_SNDBUF, m_iSendBuffer, "SO_SNDBUF" );
+	if( m_iRecvBuffer >= 0 )
+		bRet &= set_int_option( iSock, SOL_SOCKET, SO_RCVBUF, m_iRecvBuffer, "SO_RCVBUF" );
+#ifdef SO_BUSY_POLL
+	if( m_iBusyPoll >= 0 )
+		bRet &= set_int_option( iSock, SOL_SOCKET, SO_BUSY_POLL, m_iBusyPoll, "SO_BUSY_POLL" );
+#endif /* SO_BUSY_POLL */
+	if( m_iTOS >= 0 )
+	{
+#if defined( HAVE_IPV6 ) && defined( IPV6_TCLASS )
+		if( bIPv6 )
+			bRet &= set_int_option( iSock, IPPROTO_IPV6, IPV6_TCLASS, m_iTOS, "IPV6_TCLASS" );
+		else
+#endif /* HAVE_IPV6 && IPV6_TCLASS */
+			bRet &= set_int_option( iSock, IPPROTO_IP, IP_TOS, m_iTOS, "IP_TOS" );
+	}
+	if( !bTCP )
+		return( bRet );
+
+	if( m_iNoDelay >= 0 )
+		bRet &= set_int_option( iSock, IPPROTO_TCP, TCP_NODELAY, m_iNoDelay, "TCP_NODELAY" );
+	if( m_iKeepAlive >= 0 )
+		bRet &= set_int_option( iSock, SOL_SOCKET, SO_KEEPALIVE, m_iKeepAlive, "SO_KEEPALIVE" );
+	if( m_iKeepAlive > 0 )
+	{
+#ifdef TCP_KEEPIDLE
+		if( m_iKeepIdle > 0 )
+			bRet &= set_int_option( iSock, IPPROTO_TCP, TCP_KEEPIDLE, m_iKeepIdle, "TCP_KEEPIDLE" );
+#endif /* TCP_KEEPIDLE */
+#ifdef TCP_KEEPINTVL
+		if( m_iKeepInterval > 0 )
+			bRet &= set_int_option( iSock, IPPROTO_TCP, TCP_KEEPINTVL, m_iKeepInterval, "TCP_KEEPINTVL" );
+#endif /* TCP_KEEPINTVL */
+#ifdef TCP_KEEPCNT
+		if( m_iKeepCount > 0 )
+			bRet &= set_int_option( iSock, IPPROTO_TCP, TCP_KEEPCNT, m_iKeepCount, "TCP_KEEPCNT" );
+#endif /* TCP_KEEPCNT */
+	}
+#ifdef TCP_NOTSENT_LOWAT
+	if( m_iNotSentLowat >= 0 )
+		bRet &= set_int_option( iSock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, m_iNotSentLowat, "TCP_NOTSENT_LOWAT" );
+#endif /* TCP_NOTSENT_LOWAT */
+	return( bRet );
+}
+
 #define CS_UNKNOWN_ERROR "Unknown Error"
+
+#ifdef CSOCK_LOOP_STATS
+#define CS_STATS_MARK( iVar ) uint64_t iVar = microtime()
+#define CS_STATS_PHASE( ePhase, iStart, iEnd ) m_cLoopStats.RecordPhase( CSLoopStats::ePhase, iStart, iEnd )
+
+void CSHistogram::Reset()
+{
+	memset( m_aiBuckets, 0, sizeof( m_aiBuckets ) );
+	m_iCount = 0;
+	m_iMin = 0;
+	m_iMax = 0;
+	m_iTotal = 0;
+}
+
+size_t CSHistogram::BucketIndex( uint64_t iValue )
+{
+	if( iValue < CS_HIST_SUB_BUCKETS )
+		return( ( size_t )iValue );
+	size_t uMSB = 0;
+	for( uint64_t iTmp = iValue; iTmp > 1; iTmp >>= 1 )
+		++uMSB;
+	// CS_HIST_SUB_BUCKETS == 2^4, keep the top 5 bits
+	size_t uShift = uMSB - 4;
+	size_t uIdx = ( uShift + 1 ) * CS_HIST_SUB_BUCKETS + ( size_t )( ( iValue >> uShift ) - CS_HIST_SUB_BUCKETS );
+	return( uIdx < CS_HIST_BUCKETS ? uIdx : CS_HIST_BUCKETS - 1 );
+}
+
+uint64_t CSHistogram::BucketValue( size_t uIdx )
+{
+	if( uIdx < CS_HIST_SUB_BUCKETS )
+		return( uIdx );
+	size_t uShift = uIdx / CS_HIST_SUB_BUCKETS - 1;
+	uint64_t iLow = ( uint64_t )( CS_HIST_SUB_BUCKETS + uIdx % CS_HIST_SUB_BUCKETS ) << uShift;
+	return( iLow + ( ( uint64_t )1 << uShift ) - 1 );
+}
+
+void CSHistogram::Record( uint64_t iValue )
+{
+	m_aiBuckets[BucketIndex( iValue )]++;
+	if( m_iCount == 0 || iValue < m_iMin )
+		m_iMin = iValue;
+	if( iValue > m_iMax )
+		m_iMax = iValue;
+	m_iCount++;
+	m_iTotal += iValue;
+}
+
+uint64_t CSHistogram::GetPercentile( double fPercentile ) const
+{
+	if( m_iCount == 0 )
+		return( 0 );
+	uint64_t iWanted = ( uint64_t )( ( double )m_iCount * fPercentile / 100.0 + 0.5 );
+	if( iWanted == 0 )
+		iWanted = 1;
+	uint64_t iSeen = 0;
+	for( size_t a = 0; a < CS_HIST_BUCKETS; ++a )
+	{
+		iSeen += m_aiBuckets[a];
+		if( iSeen >= iWanted )
+		{
+			uint64_t iValue = BucketValue( a );
+			return( iValue < m_iMax ? iValue : m_iMax );
+		}
+	}
+	return( m_iMax );
+}
+
+const char * CSLoopStats::GetPhaseName( EPhase ePhase )
+{
+	switch( ePhase )
+	{
+		case LPH_CONNSTATE: return( "connstate" );
+		case LPH_GATHER: return( "gather" );
+		case LPH_SELECTWAIT: return( "selectwait" );
+		case LPH_DISPATCH: return( "dispatch" );
+		case LPH_READ: return( "read" );
+		case LPH_TIMEOUTS: return( "timeouts" );
+		case LPH_CRON: return( "cron" );
+		case LPH_FLUSH: return( "flush" );
+		case LPH_TOTAL: return( "total" );
+		default: break;
+	}
+	return( "unknown" );
+}
+
+void CSLoopStats::Reset()
+{
+	for( size_t a = 0; a < LPH_COUNT; ++a )
+		m_acPhases[a].Reset();
+	m_cEvents.Reset();
+}
+#else
+#define CS_STATS_MARK( iVar )
+#define CS_STATS_PHASE( ePhase, iStart, iEnd )
+#endif /* CSOCK_LOOP_STATS */
 static const char * CS_StrError( int iErrno, char * pszBuff, size_t uBuffLen )
 {
 #if defined( sgi ) || defined(__sun) || (defined(__NetBSD_Version__) && __NetBSD_Version__ < 4000000000)
@@ -751,6 +1348,13 @@ win32_gettimeofday( struct timeval* now, void* )
 }
 #endif
 
+uint64_t microtime()
+{
+	struct timeval tv;
+	CS_GETTIMEOFDAY( &tv, NULL );
+	return( ( uint64_t )tv.tv_sec * 1000000 + ( uint64_t )tv.tv_usec );
+}
+
 #ifndef _NO_CSOCKET_NS // some people may not want to use a namespace
 }
 using namespace Csocket;
@@ -900,7 +1504,10 @@ void CSockCommon::CheckFDs( const std::map< cs_sock_t, short > & miiReadyFds )
 	for( size_t uMon = 0; uMon < m_vcMonitorFD.size(); ++uMon )
 	{
 		if( !m_vcMonitorFD[uMon]->IsEnabled() || !m_vcMonitorFD[uMon]->CheckFDs( miiReadyFds ) )
+		{
+			CS_Delete( m_vcMonitorFD[uMon] );
 			m_vcMonitorFD.erase( m_vcMonitorFD.begin() + uMon-- );
+		}
 	}
 }
 
@@ -1048,8 +1655,26 @@ Csock::~Csock()
 #ifdef HAVE_LIBSSL
 	FREE_SSL();
 	FREE_CTX();
+	SetSSLProfile( NULL );
 #endif /* HAVE_LIBSSL */
 
+	SetUpstream( NULL );
+	if( m_pDownstream )
+	{
+		// not through SetUpstream(), that would start reads again on this half destroyed socket
+		m_pDownstream->m_pUpstream = NULL;
+		m_pDownstream = NULL;
+	}
+	if( m_pProxyPeer )
+	{
+		// the other side goes too, after it has written what we sent it
+		if( !m_pProxyPeer->IsClosed() )
+			m_pProxyPeer->Close( CLT_AFTERWRITE );
+		m_pProxyPeer->m_pProxyPeer = NULL;
+		m_pProxyPeer = NULL;
+	}
+	CloseSplicePipe();
+
 	CloseSocksFD();
 
 #ifdef _WIN32
@@ -1073,6 +1698,8 @@ void Csock::CloseSocksFD()
 
 	m_iReadSock = CS_INVALID_SOCK;
 	m_iWriteSock = CS_INVALID_SOCK;
+	// closing took them out of the epoll set
+	m_bEdgeArmed = false;
 }
 
 
@@ -1088,6 +1715,9 @@ void Csock::Dereference()
 	// don't delete and erase, just erase since they were moved to the copied sock
 	m_vcCrons.clear();
 	m_vcMonitorFD.clear();
+	m_pProxyPeer = NULL;
+	m_aiSplicePipe[0] = m_aiSplicePipe[1] = -1;
+	m_uSpliceQueued = 0;
 	Close( CLT_DEREFERENCE );
 }
 
@@ -1102,35 +1732,81 @@ void Csock::Copy( const Csock & cCopy )
 	m_iWriteSock	= cCopy.m_iWriteSock;
 	m_iTimeout		= cCopy.m_iTimeout;
 	m_iMaxConns		= cCopy.m_iMaxConns;
+	m_uAcceptBatch	= cCopy.m_uAcceptBatch;
+	m_bFastOpen		= cCopy.m_bFastOpen;
+	m_bFastOpenPending	= cCopy.m_bFastOpenPending;
+	m_iFastOpenQueue	= cCopy.m_iFastOpenQueue;
+	m_bExclusiveAccept	= cCopy.m_bExclusiveAccept;
+	m_bReadReady	= cCopy.m_bReadReady;
+	m_bWriteReady	= cCopy.m_bWriteReady;
+	m_iEdgeRSock	= cCopy.m_iEdgeRSock;
+	m_iEdgeWSock	= cCopy.m_iEdgeWSock;
+	m_bEdgeArmed	= cCopy.m_bEdgeArmed;
+	m_iEdgeWant		= cCopy.m_iEdgeWant;
+	m_cTuning			= cCopy.m_cTuning;
 	m_iConnType		= cCopy.m_iConnType;
 	m_iMethod		= cCopy.m_iMethod;
 	m_bUseSSL			= cCopy.m_bUseSSL;
 	m_bIsConnected	= cCopy.m_bIsConnected;
 	m_bsslEstablished	= cCopy.m_bsslEstablished;
 	m_bEnableReadLine	= cCopy.m_bEnableReadLine;
+	m_uFrameHeader		= cCopy.m_uFrameHeader;
+	m_bFrameBigEndian	= cCopy.m_bFrameBigEndian;
+	m_uMaxFrame			= cCopy.m_uMaxFrame;
+	m_bDatagram			= cCopy.m_bDatagram;
+	m_bDatagramOffload	= cCopy.m_bDatagramOffload;
+	m_bDatagramGSO		= cCopy.m_bDatagramGSO;
+	m_uDatagramBatch	= cCopy.m_uDatagramBatch;
+	m_uMaxDatagram		= cCopy.m_uMaxDatagram;
+	m_vDatagrams		= cCopy.m_vDatagrams;
 	m_bPauseRead		= cCopy.m_bPauseRead;
+	m_bBackPressure		= cCopy.m_bBackPressure;
 	m_shostname		= cCopy.m_shostname;
 	m_sbuffer		= cCopy.m_sbuffer;
 	m_sSockName		= cCopy.m_sSockName;
-	m_sKeyFile		= cCopy.m_sKeyFile;
-	m_sDHParamFile		= cCopy.m_sDHParamFile;
-	m_sPemFile		= cCopy.m_sPemFile;
-	m_sCipherType	= cCopy.m_sCipherType;
 	m_sParentName	= cCopy.m_sParentName;
 	m_sSend			= cCopy.m_sSend;
-	m_sPemPass		= cCopy.m_sPemPass;
 	m_sLocalIP		= cCopy.m_sLocalIP;
 	m_sRemoteIP		= cCopy.m_sRemoteIP;
 	m_eCloseType	= cCopy.m_eCloseType;
 
 	m_iMaxMilliSeconds	= cCopy.m_iMaxMilliSeconds;
-	m_iLastSendTime		= cCopy.m_iLastSendTime;
 	m_iBytesRead		= cCopy.m_iBytesRead;
 	m_iBytesWritten		= cCopy.m_iBytesWritten;
 	m_iStartTime		= cCopy.m_iStartTime;
 	m_iMaxBytes			= cCopy.m_iMaxBytes;
-	m_iLastSend			= cCopy.m_iLastSend;
+	m_cReadBucket		= cCopy.m_cReadBucket;
+	m_cWriteBucket		= cCopy.m_cWriteBucket;
+	m_cStats			= cCopy.m_cStats;
 	m_uSendBufferPos	= cCopy.m_uSendBufferPos;
+	m_uNotSentLowat		= cCopy.m_uNotSentLowat;
+	m_vSendMarks		= cCopy.m_vSendMarks;
+	m_iSendBase			= cCopy.m_iSendBase;
+	m_iUrgentEnd		= cCopy.m_iUrgentEnd;
+	m_bCoalesceWrites	= cCopy.m_bCoalesceWrites;
+	m_bCoalesceCork		= cCopy.m_bCoalesceCork;
+	m_bCorked			= cCopy.m_bCorked;
+	m_bWritePending		= cCopy.m_bWritePending;
+	m_uCoalesceThreshold	= cCopy.m_uCoalesceThreshold;
+	m_uWriteHighWater	= cCopy.m_uWriteHighWater;
+	m_uWriteLowWater	= cCopy.m_uWriteLowWater;
+	m_bWriteBufferFull	= cCopy.m_bWriteBufferFull;
+	// the links move to the copy, the original is on its way out
+	SetUpstream( cCopy.m_pUpstream );
+	if( cCopy.m_pDownstream )
+		cCopy.m_pDownstream->SetUpstream( this );
+	// so does a proxy pairing and whatever is in its pipe, Dereference() lets go of them in the original
+	m_pProxyPeer		= cCopy.m_pProxyPeer;
+	if( m_pProxyPeer )
+		m_pProxyPeer->m_pProxyPeer = this;
+	CloseSplicePipe();
+	m_aiSplicePipe[0]	= cCopy.m_aiSplicePipe[0];
+	m_aiSplicePipe[1]	= cCopy.m_aiSplicePipe[1];
+	m_uSpliceQueued		= cCopy.m_uSpliceQueued;
+	m_uSpliceSize		= cCopy.m_uSpliceSize;
+	m_sPoolKey			= cCopy.m_sPoolKey;
+	m_bPoolIdle			= cCopy.m_bPoolIdle;
+	m_iPoolIdleSince	= cCopy.m_iPoolIdleSince;
 	m_iMaxStoredBufferLength	= cCopy.m_iMaxStoredBufferLength;
 	m_iTimeoutType		= cCopy.m_iTimeoutType;
 
@@ -1148,7 +1824,7 @@ void Csock::Copy( const Csock & cCopy )
 	m_bNoSSLCompression = cCopy.m_bNoSSLCompression;
 	m_bSSLCipherServerPreference = cCopy.m_bSSLCipherServerPreference;
 	m_uDisableProtocols = cCopy.m_uDisableProtocols;
-	m_iRequireClientCertFlags = cCopy.m_iRequireClientCertFlags;
+	SetSSLProfile( cCopy.m_pSSLProfile );
 	m_sSSLBuffer	= cCopy.m_sSSLBuffer;
 
 	FREE_SSL();
@@ -1184,64 +1860,119 @@ void Csock::Copy( const Csock & cCopy )
 
 }
 
-Csock & Csock::operator<<( const CS_STRING & s )
-{
-	Write( s );
-	return( *this );
-}
+CSWriteBatch Csock::operator<<( const CS_STRING & s ) { return( CSWriteBatch( *this ) << s ); }
+CSWriteBatch Csock::operator<<( const char * psz ) { return( CSWriteBatch( *this ) << psz ); }
+CSWriteBatch Csock::operator<<( ostream & ( *io )( ostream & ) ) { return( CSWriteBatch( *this ) << io ); }
+CSWriteBatch Csock::operator<<( int32_t i ) { return( CSWriteBatch( *this ) << i ); }
+CSWriteBatch Csock::operator<<( uint32_t i ) { return( CSWriteBatch( *this ) << i ); }
+CSWriteBatch Csock::operator<<( int64_t i ) { return( CSWriteBatch( *this ) << i ); }
+CSWriteBatch Csock::operator<<( uint64_t i ) { return( CSWriteBatch( *this ) << i ); }
+CSWriteBatch Csock::operator<<( float i ) { return( CSWriteBatch( *this ) << i ); }
+CSWriteBatch Csock::operator<<( double i ) { return( CSWriteBatch( *this ) << i ); }
 
-Csock & Csock::operator<<( ostream & ( *io )( ostream & ) )
+//! "00" through "99", so integers are formatted two digits per division
+static const char s_szDigitPairs[] =
+	"00010203040506070809"
+	"10111213141516171819"
+	"20212223242526272829"
+	"30313233343536373839"
+	"40414243444546474849"
+	"50515253545556575859"
+	"60616263646566676869"
+	"70717273747576777879"
+	"80818283848586878889"
+	"90919293949596979899";
+
+//! formats u so that it ends right before pEnd, returns where it starts
+static inline char * format_uint( uint64_t u, char * pEnd )
 {
-	Write( "\r\n" );
-	return( *this );
+	while( u >= 100 )
+	{
+		const char * pPair = s_szDigitPairs + ( u % 100 ) * 2;
+		u /= 100;
+		*--pEnd = pPair[1];
+		*--pEnd = pPair[0];
+	}
+	if( u >= 10 )
+	{
+		const char * pPair = s_szDigitPairs + u * 2;
+		*--pEnd = pPair[1];
+		*--pEnd = pPair[0];
+	}
+	else
+	{
+		*--pEnd = ( char )( '0' + u );
+	}
+	return( pEnd );
 }
 
-Csock & Csock::operator<<( int32_t i )
+CSWriteBatch::CSWriteBatch( const CSWriteBatch & cCopy ) : m_pSock( cCopy.m_pSock ), m_uLen( cCopy.m_uLen )
 {
-	stringstream s;
-	s << i;
-	Write( s.str() );
-	return( *this );
+	memcpy( m_szBuf, cCopy.m_szBuf, m_uLen );
+	cCopy.m_uLen = 0;
 }
 
-Csock & Csock::operator<<( uint32_t i )
+CSWriteBatch & CSWriteBatch::operator<<( int64_t i )
 {
-	stringstream s;
-	s << i;
-	Write( s.str() );
+	char szBuf[24];
+	char * pEnd = szBuf + sizeof( szBuf );
+	// negate in unsigned so INT64_MIN survives
+	char * pStart = format_uint( i < 0 ? ( uint64_t )0 - ( uint64_t )i : ( uint64_t )i, pEnd );
+	if( i < 0 )
+		*--pStart = '-';
+	Append( pStart, ( size_t )( pEnd - pStart ) );
 	return( *this );
 }
 
-Csock & Csock::operator<<( int64_t i )
+CSWriteBatch & CSWriteBatch::operator<<( uint64_t i )
 {
-	stringstream s;
-	s << i;
-	Write( s.str() );
+	char szBuf[24];
+	char * pEnd = szBuf + sizeof( szBuf );
+	char * pStart = format_uint( i, pEnd );
+	Append( pStart, ( size_t )( pEnd - pStart ) );
 	return( *this );
 }
 
-Csock & Csock::operator<<( uint64_t i )
+CSWriteBatch & CSWriteBatch::operator<<( double i )
 {
-	stringstream s;
-	s << i;
-	Write( s.str() );
+	// %g is what a default stringstream produces
+	char szBuf[32];
+	int iLen = snprintf( szBuf, sizeof( szBuf ), "%g", i );
+	if( iLen > 0 )
+		Append( szBuf, ( size_t )iLen < sizeof( szBuf ) ? ( size_t )iLen : sizeof( szBuf ) - 1 );
 	return( *this );
 }
 
-Csock & Csock::operator<<( float i )
+void CSWriteBatch::Append( const char * pData, size_t uLen )
 {
-	stringstream s;
-	s << i;
-	Write( s.str() );
-	return( *this );
+	if( m_uLen + uLen > sizeof( m_szBuf ) )
+	{
+		Flush();
+		if( uLen > sizeof( m_szBuf ) )
+		{
+			m_pSock->Write( pData, uLen );
+			return;
+		}
+	}
+	memcpy( m_szBuf + m_uLen, pData, uLen );
+	m_uLen += uLen;
 }
 
-Csock & Csock::operator<<( double i )
+void CSWriteBatch::Flush()
 {
-	stringstream s;
-	s << i;
-	Write( s.str() );
-	return( *this );
+	if( m_uLen == 0 )
+		return;
+	size_t uLen = m_uLen;
+	m_uLen = 0;
+#ifdef HAVE_ICU
+	if( !m_pSock->GetEncoding().empty() )
+	{
+		// the string overload is the one that converts to the sockets encoding
+		m_pSock->Write( CS_STRING( m_szBuf, uLen ) );
+		return;
+	}
+#endif /* HAVE_ICU */
+	m_pSock->Write( m_szBuf, uLen );
 }
 
 bool Csock::Connect()
@@ -1267,6 +1998,23 @@ bool Csock::Connect()
 
 	m_iConnType = OUTBOUND;
 
+#ifdef TCP_FASTOPEN_CONNECT
+	if( m_bFastOpen && !m_bDatagram )
+	{
+		// with a cached cookie connect() doesn't send anything, the SYN goes out with the first write()
+		const int on = 1;
+		if( setsockopt( m_iReadSock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, ( char * )&on, sizeof( on ) ) == 0 )
+		{
+			m_bFastOpenPending = true;
+			m_cStats.m_iFastOpenTries++;
+		}
+		else
+		{
+			CS_DEBUG( "TCP_FASTOPEN_CONNECT failed. ERRNO [" << GetSockError() << "] FD [" << m_iReadSock << "]" );
+		}
+	}
+#endif /* TCP_FASTOPEN_CONNECT */
+
 	int ret = -1;
 	if( !GetIPv6() )
 		ret = connect( m_iReadSock, ( struct sockaddr * )m_address.GetSockAddr(), m_address.GetSockAddrLen() );
@@ -1488,10 +2236,28 @@ bool Csock::Listen( uint16_t iPort, int iMaxConns, const CS_STRING & sBindHost,
 	}
 #endif /* HAVE_IPV6 */
 
-	if( listen( m_iReadSock, iMaxConns ) == -1 )
+	if( m_bDatagram )
 	{
-		CallSockError( GetSockError() );
-		return( false );
+		// nothing to accept, the bound socket is ready for datagrams right away
+		m_bIsConnected = true;
+	}
+	else
+	{
+#ifdef TCP_FASTOPEN
+		if( m_iFastOpenQueue > 0 && setsockopt( m_iReadSock, IPPROTO_TCP, TCP_FASTOPEN, ( char * )&m_iFastOpenQueue, sizeof( m_iFastOpenQueue ) ) != 0 )
+			PERROR( "TCP_FASTOPEN" );
+#endif /* TCP_FASTOPEN */
+#ifdef TCP_SAVED_SYN
+		// keeps the SYN's headers for the accepted socket, that's how a Fast Open try is told from a plain connect
+		const int iSaveSYN = 1;
+		if( m_iFastOpenQueue > 0 && setsockopt( m_iReadSock, IPPROTO_TCP, TCP_SAVE_SYN, ( char * )&iSaveSYN, sizeof( iSaveSYN ) ) != 0 )
+			PERROR( "TCP_SAVE_SYN" );
+#endif /* TCP_SAVED_SYN */
+		if( listen( m_iReadSock, iMaxConns ) == -1 )
+		{
+			CallSockError( GetSockError() );
+			return( false );
+		}
 	}
 
 	// set it none blocking
@@ -1510,29 +2276,103 @@ bool Csock::Listen( uint16_t iPort, int iMaxConns, const CS_STRING & sBindHost,
 	return( true );
 }
 
-cs_sock_t Csock::Accept( CS_STRING & sHost, uint16_t & iRPort )
+bool Csock::SetTuning( const CSSockTuning & cTuning )
 {
-	cs_sock_t iSock = CS_INVALID_SOCK;
-	struct sockaddr_storage cAddr;
-	socklen_t iAddrLen = sizeof( cAddr );
-	iSock = accept( m_iReadSock, ( struct sockaddr * )&cAddr, &iAddrLen );
-	if( iSock != CS_INVALID_SOCK && getpeername( iSock, ( struct sockaddr * )&cAddr, &iAddrLen ) == 0 )
+	m_cTuning = cTuning;
+	if( m_iReadSock == CS_INVALID_SOCK )
+		return( true );
+	return( m_cTuning.Apply( m_iReadSock, !m_bDatagram, GetIPv6() ) );
+}
+
+void Csock::CheckFastOpen()
+{
+#if defined( TCP_INFO ) && defined( TCPI_OPT_SYN_DATA )
+	struct tcp_info cInfo;
+	socklen_t iLen = sizeof( cInfo );
+	if( getsockopt( m_iReadSock, IPPROTO_TCP, TCP_INFO, &cInfo, &iLen ) != 0 )
 	{
-		ConvertAddress( &cAddr, iAddrLen, sHost, &iRPort );
+		m_bFastOpenPending = false;
+		return;
 	}
+	// the SYN went out with the first write and the SYN-ACK isn't back yet
+	if( cInfo.tcpi_state == TCP_SYN_SENT )
+		return;
+	m_bFastOpenPending = false;
+	if( cInfo.tcpi_options & TCPI_OPT_SYN_DATA )
+		m_cStats.m_iFastOpens++;
+#else
+	m_bFastOpenPending = false;
+#endif /* TCP_INFO && TCPI_OPT_SYN_DATA */
+}
 
-	if( iSock != CS_INVALID_SOCK )
+//! true if the SYN that opened the accepted iSock carried data, going by the headers TCP_SAVE_SYN kept of it
+static bool CSSYNHadData( cs_sock_t iSock )
+{
+#ifdef TCP_SAVED_SYN
+	unsigned char aSYN[256];
+	socklen_t iLen = sizeof( aSYN );
+	if( getsockopt( iSock, IPPROTO_TCP, TCP_SAVED_SYN, aSYN, &iLen ) != 0 || iLen < 20 )
+		return( false );
+	size_t uIPHeader = 0, uIPLen = 0;
+	if( ( aSYN[0] >> 4 ) == 4 )
+	{
+		uIPHeader = ( size_t )( aSYN[0] & 0x0f ) * 4;
+		uIPLen = ( size_t )( aSYN[2] << 8 | aSYN[3] );
+	}
+	else if( ( aSYN[0] >> 4 ) == 6 && aSYN[6] == IPPROTO_TCP )
 	{
-		// Make it close-on-exec
-		set_close_on_exec( iSock );
+		// the payload length leaves out the fixed header, extension headers aren't looked at
+		uIPHeader = 40;
+		uIPLen = 40 + ( size_t )( aSYN[4] << 8 | aSYN[5] );
+	}
+	if( uIPHeader == 0 || uIPHeader + 13 > ( size_t )iLen )
+		return( false );
+	size_t uTCPHeader = ( size_t )( aSYN[uIPHeader + 12] >> 4 ) * 4;
+	return( uIPLen > uIPHeader + uTCPHeader );
+#else
+	return( false );
+#endif /* TCP_SAVED_SYN */
+}
 
-		// make it none blocking
-		set_non_blocking( iSock );
+cs_sock_t Csock::Accept( CS_STRING & sHost, uint16_t & iRPort )
+{
+	cs_sock_t iSock = CS_INVALID_SOCK;
+	struct sockaddr_storage cAddr;
+	socklen_t iAddrLen = sizeof( cAddr );
+#ifdef CS_HAVE_ACCEPT4
+	// non blocking and close-on-exec in the same syscall
+	iSock = accept4( m_iReadSock, ( struct sockaddr * )&cAddr, &iAddrLen, SOCK_NONBLOCK|SOCK_CLOEXEC );
+	if( iSock == CS_INVALID_SOCK && errno == ENOSYS )
+#endif /* CS_HAVE_ACCEPT4 */
+	{
+		iSock = accept( m_iReadSock, ( struct sockaddr * )&cAddr, &iAddrLen );
+		if( iSock != CS_INVALID_SOCK )
+		{
+			// Make it close-on-exec
+			set_close_on_exec( iSock );
+
+			// make it none blocking
+			set_non_blocking( iSock );
+		}
+	}
+	if( iSock == CS_INVALID_SOCK && GetSockError() == EAGAIN )
+		m_bReadReady = false;
+
+	if( iSock != CS_INVALID_SOCK )
+	{
+		// accept() filled in the peer address, no need for getpeername()
+		ConvertAddress( &cAddr, iAddrLen, sHost, &iRPort );
 
 		if( !ConnectionFrom( sHost, iRPort ) )
 		{
 			CS_CLOSE( iSock );
 			iSock = CS_INVALID_SOCK;
+			// no error, so a caller can tell a connection that was turned away from a failed or empty accept()
+#ifdef _WIN32
+			::WSASetLastError( 0 );
+#else
+			errno = 0;
+#endif /* _WIN32 */
 		}
 
 	}
@@ -1569,12 +2409,28 @@ static int __SNICallBack( SSL *pSSL, int *piAD, void *pData )
 #endif /* SSL_CTX_set_tlsext_servername_callback */
 #endif /* HAVE_LIBSSL */
 
+#ifdef HAVE_LIBSSL
+void Csock::SSLHandshakeDone()
+{
+	if( m_cStats.m_iSSLHandshakeStart == 0 )
+		return;
+	uint64_t iNOW = microtime();
+	if( iNOW > m_cStats.m_iSSLHandshakeStart )
+		m_cStats.m_iSSLHandshakeUS += iNOW - m_cStats.m_iSSLHandshakeStart;
+	m_cStats.m_iSSLHandshakes++;
+	m_cStats.m_iSSLHandshakeStart = 0;
+}
+#endif /* HAVE_LIBSSL */
+
 bool Csock::AcceptSSL()
 {
 #ifdef HAVE_LIBSSL
 	if( !m_ssl )
+	{
 		if( !SSLServerSetup() )
 			return( false );
+		m_cStats.m_iSSLHandshakeStart = microtime();
+	}
 
 #if defined( SSL_CTX_set_tlsext_servername_callback )
 	SSL_CTX_set_tlsext_servername_callback( m_ssl_ctx, __SNICallBack );
@@ -1585,6 +2441,7 @@ bool Csock::AcceptSSL()
 
 	if( err == 1 )
 	{
+		SSLHandshakeDone();
 		return( true );
 	}
 
@@ -1605,9 +2462,9 @@ bool Csock::ConfigureCTXOptions( SSL_CTX * pCTX )
 {
 	if( pCTX )
 	{
-		if( SSL_CTX_set_cipher_list( pCTX, m_sCipherType.c_str() ) <= 0 )
+		if( SSL_CTX_set_cipher_list( pCTX, GetCipher().c_str() ) <= 0 )
 		{
-			CS_DEBUG( "Could not assign cipher [" << m_sCipherType << "]" );
+			CS_DEBUG( "Could not assign cipher [" << GetCipher() << "]" );
 			return( false );
 		}
 
@@ -1774,7 +2631,7 @@ bool Csock::SSLClientSetup()
 
 	SSL_CTX_set_default_verify_paths( m_ssl_ctx );
 
-	if( !m_sPemFile.empty() )
+	if( !GetPemLocation().empty() )
 	{
 		// are we sending a client cerificate ?
 		SSL_CTX_set_default_passwd_cb( m_ssl_ctx, _PemPassCB );
@@ -1782,12 +2639,12 @@ bool Csock::SSLClientSetup()
 
 		//
 		// set up the CTX
-		if( SSL_CTX_use_certificate_file( m_ssl_ctx, m_sPemFile.c_str() , SSL_FILETYPE_PEM ) <= 0 )
+		if( SSL_CTX_use_certificate_file( m_ssl_ctx, GetPemLocation().c_str() , SSL_FILETYPE_PEM ) <= 0 )
 		{
-			CS_DEBUG( "Error with SSLCert file [" << m_sPemFile << "]" );
+			CS_DEBUG( "Error with SSLCert file [" << GetPemLocation() << "]" );
 			SSLErrors( __FILE__, __LINE__ );
 		}
-        CS_STRING privKeyFile = m_sKeyFile.empty() ? m_sPemFile : m_sKeyFile;
+        CS_STRING privKeyFile = GetKeyLocation().empty() ? GetPemLocation() : GetKeyLocation();
 		if( SSL_CTX_use_PrivateKey_file( m_ssl_ctx, privKeyFile.c_str(), SSL_FILETYPE_PEM ) <= 0 )
 		{
 			CS_DEBUG( "Error with SSLKey file [" << privKeyFile << "]" );
@@ -1842,31 +2699,31 @@ SSL_CTX * Csock::SetupServerCTX()
 	SSL_CTX_set_default_passwd_cb( pCTX, _PemPassCB );
 	SSL_CTX_set_default_passwd_cb_userdata( pCTX, ( void * )this );
 
-	if( m_sPemFile.empty() || access( m_sPemFile.c_str(), R_OK ) != 0 )
+	if( GetPemLocation().empty() || access( GetPemLocation().c_str(), R_OK ) != 0 )
 	{
-		CS_DEBUG( "Empty, missing, or bad pemfile ... [" << m_sPemFile << "]" );
+		CS_DEBUG( "Empty, missing, or bad pemfile ... [" << GetPemLocation() << "]" );
 		SSL_CTX_free( pCTX );
 		return( NULL );
 	}
 
-	if( ! m_sKeyFile.empty() && access( m_sKeyFile.c_str(), R_OK ) != 0 )
+	if( ! GetKeyLocation().empty() && access( GetKeyLocation().c_str(), R_OK ) != 0 )
 	{
-		CS_DEBUG( "Bad keyfile ... [" << m_sKeyFile << "]" );
+		CS_DEBUG( "Bad keyfile ... [" << GetKeyLocation() << "]" );
 		SSL_CTX_free( pCTX );
 		return( NULL );
 	}
 
 	//
 	// set up the CTX
-	if( SSL_CTX_use_certificate_chain_file( pCTX, m_sPemFile.c_str() ) <= 0 )
+	if( SSL_CTX_use_certificate_chain_file( pCTX, GetPemLocation().c_str() ) <= 0 )
 	{
-		CS_DEBUG( "Error with SSLCert file [" << m_sPemFile << "]" );
+		CS_DEBUG( "Error with SSLCert file [" << GetPemLocation() << "]" );
 		SSLErrors( __FILE__, __LINE__ );
 		SSL_CTX_free( pCTX );
 		return( NULL );
 	}
 
-    CS_STRING privKeyFile = m_sKeyFile.empty() ? m_sPemFile : m_sKeyFile;
+    CS_STRING privKeyFile = GetKeyLocation().empty() ? GetPemLocation() : GetKeyLocation();
 	if( SSL_CTX_use_PrivateKey_file( pCTX, privKeyFile.c_str(), SSL_FILETYPE_PEM ) <= 0 )
 	{
 		CS_DEBUG( "Error with SSLKey file [" << privKeyFile << "]" );
@@ -1877,7 +2734,7 @@ SSL_CTX * Csock::SetupServerCTX()
 
 	// check to see if this pem file contains a DH structure for use with DH key exchange
 	// https://github.com/znc/znc/pull/46
-	CS_STRING DHParamFile = m_sDHParamFile.empty() ? m_sPemFile : m_sDHParamFile;
+	CS_STRING DHParamFile = GetDHParamLocation().empty() ? GetPemLocation() : GetDHParamLocation();
 	FILE *dhParamsFile = fopen( DHParamFile.c_str(), "r" );
 	if( !dhParamsFile )
 	{
@@ -1894,7 +2751,7 @@ SSL_CTX * Csock::SetupServerCTX()
 		SSL_CTX_set_options( pCTX, SSL_OP_SINGLE_DH_USE );
 		if( !SSL_CTX_set_tmp_dh( pCTX, dhParams ) )
 		{
-			CS_DEBUG( "Error setting ephemeral DH parameters from [" << m_sPemFile << "]" );
+			CS_DEBUG( "Error setting ephemeral DH parameters from [" << GetPemLocation() << "]" );
 			SSLErrors( __FILE__, __LINE__ );
 			DH_free( dhParams );
 			SSL_CTX_free( pCTX );
@@ -1907,6 +2764,8 @@ SSL_CTX * Csock::SetupServerCTX()
 		// Presumably PEM_read_DHparams failed, as there was no DH structure. Clearing those errors here so they are removed off the stack
 		ERR_clear_error();
 	}
+#else
+	fclose( dhParamsFile );
 #endif /* OPENSSL_VERSION_NUMBER < 0x30000000L */
 
 #ifndef OPENSSL_NO_ECDH
@@ -1976,9 +2835,9 @@ bool Csock::SSLServerSetup()
 	SSL_set_rfd( m_ssl, ( int )m_iReadSock );
 	SSL_set_wfd( m_ssl, ( int )m_iWriteSock );
 	SSL_set_accept_state( m_ssl );
-	if( m_iRequireClientCertFlags )
+	if( GetRequireClientCertFlags() )
 	{
-		SSL_set_verify( m_ssl, m_iRequireClientCertFlags, m_pCerVerifyCB );
+		SSL_set_verify( m_ssl, GetRequireClientCertFlags(), m_pCerVerifyCB );
 	}
 	SSL_set_info_callback( m_ssl, _InfoCallback );
 	SSL_set_ex_data( m_ssl, GetCsockSSLIdx(), this );
@@ -2005,8 +2864,12 @@ bool Csock::ConnectSSL()
 #ifdef HAVE_LIBSSL
 	if( m_iReadSock == CS_INVALID_SOCK )
 		return( false ); // this should be long passed at this point
-	if( !m_ssl && !SSLClientSetup() )
-		return( false );
+	if( !m_ssl )
+	{
+		if( !SSLClientSetup() )
+			return( false );
+		m_cStats.m_iSSLHandshakeStart = microtime();
+	}
 
 	bool bPass = true;
 
@@ -2031,6 +2894,7 @@ bool Csock::ConnectSSL()
 	else
 	{
 		bPass = true;
+		SSLHandshakeDone();
 	}
 
 	if( m_eConState != CST_OK )
@@ -2094,19 +2958,70 @@ static bool isUTF8( const CS_STRING& src, CS_STRING& target)
 }
 #endif /* HAVE_ICU */
 
+//! adds up how long shaping held a socket back, from the first refusal until it is allowed again
+static inline void TrackShaping( bool bAllow, uint64_t iNOW, uint64_t & iSince, uint64_t & iTotal )
+{
+	if( !bAllow )
+	{
+		if( iSince == 0 )
+			iSince = iNOW;
+	}
+	else if( iSince != 0 )
+	{
+		iTotal += iNOW - iSince;
+		iSince = 0;
+	}
+}
+
 bool Csock::AllowWrite( uint64_t & iNOW ) const
 {
-	if( m_iMaxBytes > 0 && m_iMaxMilliSeconds > 0 )
+	if( !m_cWriteBucket.IsShaping() )
+	{
+		m_cStats.m_iWriteShapedSince = 0;
+		return( true );
+	}
+	if( iNOW == 0 )
+		iNOW = millitime();
+	// wait for a decent chunk instead of trickling out a few bytes at a time
+	size_t uPending = m_sSend.size() - m_uSendBufferPos;
+	bool bAllow = ( m_cWriteBucket.MillisUntil( uPending < CS_BLOCKSIZE ? uPending : CS_BLOCKSIZE, iNOW ) == 0 );
+	TrackShaping( bAllow, iNOW, m_cStats.m_iWriteShapedSince, m_cStats.m_iWriteShapedMS );
+	return( bAllow );
+}
+
+bool Csock::AllowRead( uint64_t & iNOW ) const
+{
+	if( !m_cReadBucket.IsShaping() )
+	{
+		m_cStats.m_iReadShapedSince = 0;
+		return( true );
+	}
+	if( iNOW == 0 )
+		iNOW = millitime();
+	bool bAllow = ( m_cReadBucket.MillisUntil( CS_BLOCKSIZE, iNOW ) == 0 );
+	TrackShaping( bAllow, iNOW, m_cStats.m_iReadShapedSince, m_cStats.m_iReadShapedMS );
+	return( bAllow );
+}
+
+uint64_t Csock::GetShapingDelay( uint64_t & iNOW ) const
+{
+	uint64_t iDelay = 0;
+	size_t uPending = m_sSend.size() - m_uSendBufferPos;
+	if( uPending > 0 && m_cWriteBucket.IsShaping() )
 	{
 		if( iNOW == 0 )
 			iNOW = millitime();
-
-		if( m_iLastSend <  m_iMaxBytes )
-			return( true ); // allow sending if our out buffer was less than what we can send
-		if( ( iNOW - m_iLastSendTime ) < m_iMaxMilliSeconds )
-			return( false );
+		iDelay = m_cWriteBucket.MillisUntil( uPending < CS_BLOCKSIZE ? uPending : CS_BLOCKSIZE, iNOW );
 	}
-	return( true );
+	if( !IsReadPaused() && m_cReadBucket.IsShaping() )
+	{
+		if( iNOW == 0 )
+			iNOW = millitime();
+		uint64_t iReadDelay = m_cReadBucket.MillisUntil( CS_BLOCKSIZE, iNOW );
+		if( iReadDelay > 0 && ( iDelay == 0 || iReadDelay < iDelay ) )
+			iDelay = iReadDelay;
+	}
+	return( iDelay );
 }
 
 void Csock::ShrinkSendBuff()
@@ -2115,6 +3030,7 @@ void Csock::ShrinkSendBuff()
 	{
 		// just doing this to keep m_sSend from growing out of control
 		m_sSend.erase( 0, m_uSendBufferPos );
+		m_iSendBase += m_uSendBufferPos;
 		m_uSendBufferPos = 0;
 	}
 }
@@ -2123,17 +3039,107 @@ void Csock::IncBuffPos( size_t uBytes )
 	m_uSendBufferPos += uBytes;
 	if( m_uSendBufferPos >= m_sSend.size() )
 	{
+		m_iSendBase += m_sSend.size();
 		m_uSendBufferPos = 0;
 		m_sSend.clear();
 	}
+	if( !m_vSendMarks.empty() )
+		TrimSendMarks();
+}
+
+void Csock::TrimSendMarks()
+{
+	uint64_t iSent = m_iSendBase + m_uSendBufferPos;
+	while( !m_vSendMarks.empty() && m_vSendMarks.front() <= iSent )
+		m_vSendMarks.pop_front();
+}
+
+bool Csock::SetLowLatency( size_t uNotSentLowat )
+{
+	if( m_bDatagram )
+		return( false );
+	if( m_uNotSentLowat == 0 && uNotSentLowat > 0 && m_sSend.size() > m_uSendBufferPos )
+		m_vSendMarks.push_back( m_iSendBase + m_sSend.size() ); // whatever is queued already counts as one message
+	else if( uNotSentLowat == 0 )
+		m_vSendMarks.clear();
+	m_uNotSentLowat = uNotSentLowat;
+
+	// 0 puts the socket back on the net.ipv4.tcp_notsent_lowat default
+	CSSockTuning cTuning( m_cTuning );
+	cTuning.SetNotSentLowat( ( int )std::min( uNotSentLowat, ( size_t )0x7fffffff ) );
+	return( SetTuning( cTuning ) );
+}
+
+bool Csock::WriteUrgent( const char * data, size_t len )
+{
+	if( m_uNotSentLowat == 0 || len == 0 )
+		return( Write( data, len ) );
+
+	// the kernel has everything up to m_uSendBufferPos, and SSL_write() has to be retried with what it was given
+	uint64_t iAt = m_iSendBase + m_uSendBufferPos;
+#ifdef HAVE_LIBSSL
+	iAt += m_sSSLBuffer.size();
+#endif /* HAVE_LIBSSL */
+	// urgent data stays in order
+	if( m_iUrgentEnd > iAt )
+		iAt = m_iUrgentEnd;
+	// the marks are in order, the first one at or past iAt is where the partly sent message ends
+	std::deque<uint64_t>::iterator it = std::lower_bound( m_vSendMarks.begin(), m_vSendMarks.end(), iAt );
+	iAt = ( it != m_vSendMarks.end() ? *it : m_iSendBase + m_sSend.size() );
+
+	m_sSend.insert( ( size_t )( iAt - m_iSendBase ), data, len );
+	if( m_sSend.size() - m_uSendBufferPos > m_cStats.m_uPeakSendQueue )
+		m_cStats.m_uPeakSendQueue = m_sSend.size() - m_uSendBufferPos;
+	// whatever ended past the insertion moved back by len, and the urgent data is a message of its own
+	it = std::upper_bound( m_vSendMarks.begin(), m_vSendMarks.end(), iAt );
+	for( std::deque<uint64_t>::iterator itShift = it; itShift != m_vSendMarks.end(); ++itShift )
+		*itShift += len;
+	m_iUrgentEnd = iAt + len;
+	m_vSendMarks.insert( it, m_iUrgentEnd );
+
+	// an empty write sends what's queued, coalescing or not
+	return( Write( "", 0 ) );
 }
 
 bool Csock::Write( const char *data, size_t len )
 {
+	bool bRet = WriteSendBuffer( data, len );
+	// spliced data goes out behind anything Write() queued before it
+	if( bRet && m_uSpliceQueued > 0 && m_sSend.empty() )
+		bRet = SpliceWrite();
+	if( m_uWriteHighWater > 0 )
+		CheckWriteWatermarks();
+	return( bRet );
+}
+
+bool Csock::WriteSendBuffer( const char *data, size_t len )
+{
+	if( m_bDatagram )
+		return( len > 0 ? SendDatagram( data, len ) : WriteDatagrams() );
+
 	if( len > 0 )
 	{
 		ShrinkSendBuff();
 		m_sSend.append( data, len );
+		if( m_sSend.size() > m_cStats.m_uPeakSendQueue )
+			m_cStats.m_uPeakSendQueue = m_sSend.size();
+		if( m_uNotSentLowat > 0 )
+			m_vSendMarks.push_back( m_iSendBase + m_sSend.size() );
+
+		if( m_bCoalesceWrites )
+		{
+			// the manager calls Flush() at the end of the Loop() iteration
+			m_bWritePending = true;
+			if( m_sSend.size() - m_uSendBufferPos < m_uCoalesceThreshold )
+				return( true );
+
+			// crossed the threshold, send what we have but hold the tail end back until Flush()
+			if( m_bCoalesceCork && !m_bCorked && m_iWriteSock != CS_INVALID_SOCK )
+			{
+				set_cork( m_iWriteSock, true );
+				m_bCorked = true;
+			}
+		}
 	}
 
 	if( m_sSend.empty() )
@@ -2144,6 +3150,7 @@ bool Csock::Write( const char *data, size_t len )
 
 	// rate shaping
 	size_t iBytesToSend = 0;
+	uint64_t iNOW = 0;
 
 	size_t uBytesInSend = m_sSend.size() - m_uSendBufferPos;
 
@@ -2155,26 +3162,13 @@ bool Csock::Write( const char *data, size_t len )
 	}
 	else
 #endif /* HAVE_LIBSSL */
-		if( m_iMaxBytes > 0 && m_iMaxMilliSeconds > 0 )
+		if( m_cWriteBucket.IsShaping() )
 		{
-			uint64_t iNOW = millitime();
-			// figure out the shaping here
-			// if NOW - m_iLastSendTime > m_iMaxMilliSeconds then send a full length of ( iBytesToSend )
-			if( ( iNOW - m_iLastSendTime ) > m_iMaxMilliSeconds )
-			{
-				m_iLastSendTime = iNOW;
-				iBytesToSend = m_iMaxBytes;
-				m_iLastSend = 0;
-			}
-			else   // otherwise send m_iMaxBytes - m_iLastSend
-				iBytesToSend = m_iMaxBytes - m_iLastSend;
+			iNOW = millitime();
+			uint64_t uAvail = m_cWriteBucket.Available( iNOW );
 
 			// take which ever is lesser
-			if( uBytesInSend < iBytesToSend )
-				iBytesToSend = uBytesInSend;
-
-			// add up the bytes sent
-			m_iLastSend += iBytesToSend;
+			iBytesToSend = ( uBytesInSend < uAvail ? uBytesInSend : ( size_t )uAvail );
 
 			// so, are we ready to send anything ?
 			if( iBytesToSend == 0 )
@@ -2198,6 +3192,7 @@ bool Csock::Write( const char *data, size_t len )
 			m_sSSLBuffer.append( m_sSend.data() + m_uSendBufferPos, iBytesToSend );
 
 		int iErr = SSL_write( m_ssl, m_sSSLBuffer.data(), ( int )m_sSSLBuffer.length() );
+		m_cStats.m_iWriteCalls++;
 
 		if( iErr < 0 && GetSockError() == ECONNREFUSED )
 		{
@@ -2210,6 +3205,7 @@ bool Csock::Write( const char *data, size_t len )
 		{
 			case SSL_ERROR_NONE:
 				m_bsslEstablished = true;
+				SSLHandshakeDone();
 				// all ok
 				break;
 
@@ -2221,10 +3217,14 @@ bool Csock::Write( const char *data, size_t len )
 
 			case SSL_ERROR_WANT_READ:
 				// retry
+				m_cStats.m_iWriteEAGAIN++;
+				m_bReadReady = false;
 				break;
 
 			case SSL_ERROR_WANT_WRITE:
 				// retry
+				m_cStats.m_iWriteEAGAIN++;
+				m_bWriteReady = false;
 				break;
 
 			case SSL_ERROR_SSL:
@@ -2238,12 +3238,15 @@ bool Csock::Write( const char *data, size_t len )
 		{
 			m_sSSLBuffer.clear();
 			IncBuffPos( ( size_t )iErr );
+			if( m_cWriteBucket.IsShaping() )
+				m_cWriteBucket.Consume( ( uint64_t )iErr, iNOW ? iNOW : millitime() );
 			// reset the timer on successful write (we have to set it here because the write
 			// bit might not always be set, so need to trigger)
 			if( TMO_WRITE & GetTimeoutType() )
 				ResetTimer();
 
 			m_iBytesWritten += ( uint64_t )iErr;
+			m_cStats.m_iWindowWritten += ( uint64_t )iErr;
 		}
 
 		return( true );
@@ -2254,6 +3257,7 @@ bool Csock::Write( const char *data, size_t len )
 #else
 	cs_ssize_t bytes = write( m_iWriteSock, m_sSend.data() + m_uSendBufferPos, iBytesToSend );
 #endif /* _WIN32 */
+	m_cStats.m_iWriteCalls++;
 
 	if( bytes == -1 && GetSockError() == ECONNREFUSED )
 	{
@@ -2268,17 +3272,275 @@ bool Csock::Write( const char *data, size_t len )
 	if( bytes <= 0 && GetSockError() != EAGAIN )
 		return( false );
 #endif /* _WIN32 */
+	if( bytes < 0 )
+		m_cStats.m_iWriteEAGAIN++;
+	// a short write means the kernel buffer is full, the edge when it drains says when to go on
+	if( bytes < ( cs_ssize_t )iBytesToSend )
+		m_bWriteReady = false;
 
 	// delete the bytes we sent
 	if( bytes > 0 )
 	{
 		IncBuffPos( ( size_t )bytes );
+		if( m_cWriteBucket.IsShaping() )
+			m_cWriteBucket.Consume( ( uint64_t )bytes, iNOW ? iNOW : millitime() );
 		if( TMO_WRITE & GetTimeoutType() )
 			ResetTimer();	// reset the timer on successful write
 		m_iBytesWritten += ( uint64_t )bytes;
+		m_cStats.m_iWindowWritten += ( uint64_t )bytes;
+	}
+
+	return( true );
+}
+
+void Csock::SetWriteBufferWatermarks( size_t uHigh, size_t uLow )
+{
+	m_uWriteHighWater = uHigh;
+	m_uWriteLowWater = ( uLow ? uLow : uHigh / 2 );
+	CheckWriteWatermarks();
+}
+
+void Csock::CheckWriteWatermarks()
+{
+	size_t uQueued = GetWriteBufferSize();
+	if( !m_bWriteBufferFull )
+	{
+		if( m_uWriteHighWater > 0 && uQueued >= m_uWriteHighWater )
+			SetWriteBufferFull();
+	}
+	else if( m_uWriteHighWater == 0 || uQueued <= m_uWriteLowWater )
+	{
+		m_bWriteBufferFull = false;
+		WriteBufferDrained();
+		// last, unpausing hands the upstream whatever it has buffered and that may land right back here
+		if( m_pUpstream )
+			m_pUpstream->SetBackPressure( false );
+	}
+}
+
+void Csock::SetWriteBufferFull()
+{
+	m_bWriteBufferFull = true;
+	if( m_pUpstream )
+		m_pUpstream->SetBackPressure( true );
+	WriteBufferFull();
+}
+
+void Csock::SetBackPressure( bool b )
+{
+	if( b == m_bBackPressure )
+		return;
+	m_bBackPressure = b;
+	// reads only start again if the caller didn't PauseRead() in the meantime
+	if( !b && !m_bPauseRead )
+	{
+		ResetTimer();
+		PushBuff( "", 0, true );
+	}
+}
+
+void Csock::SetUpstream( Csock * pUpstream )
+{
+	if( m_pUpstream )
+	{
+		Csock * pOld = m_pUpstream;
+		m_pUpstream = NULL;
+		pOld->m_pDownstream = NULL;
+		if( m_bWriteBufferFull )
+			pOld->SetBackPressure( false );
+	}
+	if( !pUpstream )
+		return;
+	if( pUpstream->m_pDownstream )
+		pUpstream->m_pDownstream->SetUpstream( NULL );
+	m_pUpstream = pUpstream;
+	pUpstream->m_pDownstream = this;
+	if( m_bWriteBufferFull )
+		pUpstream->SetBackPressure( true );
+}
+
+bool Csock::Proxy( Csock * pPeer, bool bSplice )
+{
+	if( !pPeer || pPeer == this || m_pProxyPeer || pPeer->m_pProxyPeer || m_bDatagram || pPeer->m_bDatagram )
+		return( false );
+	m_pProxyPeer = pPeer;
+	pPeer->m_pProxyPeer = this;
+	if( !bSplice || m_bUseSSL || pPeer->m_bUseSSL || !OpenSplicePipe() || !pPeer->OpenSplicePipe() )
+	{
+		CloseSplicePipe();
+		pPeer->CloseSplicePipe();
+	}
+
+	Csock * apSides[2] = { this, pPeer };
+	for( size_t a = 0; a < 2; ++a )
+	{
+		Csock * pSide = apSides[a];
+		if( pSide->m_uSpliceSize > 0 )
+		{
+			// reads stop once the pipe is full, they have to be paused by then
+			if( pSide->m_uWriteHighWater == 0 || pSide->m_uWriteHighWater > pSide->m_uSpliceSize )
+				pSide->SetWriteBufferWatermarks( pSide->m_uSpliceSize );
+		}
+		else if( pSide->m_uWriteHighWater == 0 )
+		{
+			pSide->SetWriteBufferWatermarks( CS_PROXY_BUFFER );
+		}
 	}
+	SetUpstream( pPeer );
+	pPeer->SetUpstream( this );
+	return( true );
+}
 
+bool Csock::OpenSplicePipe()
+{
+#ifdef CS_HAVE_SPLICE
+	if( m_aiSplicePipe[0] != -1 )
+		return( true );
+	if( pipe2( m_aiSplicePipe, O_NONBLOCK|O_CLOEXEC ) != 0 )
+	{
+		m_aiSplicePipe[0] = m_aiSplicePipe[1] = -1;
+		return( false );
+	}
+	int iSize = -1;
+#if defined( F_SETPIPE_SZ ) && defined( F_GETPIPE_SZ )
+	fcntl( m_aiSplicePipe[1], F_SETPIPE_SZ, CS_SPLICE_PIPE_SIZE );
+	iSize = fcntl( m_aiSplicePipe[1], F_GETPIPE_SZ );
+#endif /* F_SETPIPE_SZ && F_GETPIPE_SZ */
+	m_uSpliceSize = ( iSize > 0 ? ( size_t )iSize : 65536 );
+	m_uSpliceQueued = 0;
 	return( true );
+#else
+	return( false );
+#endif /* CS_HAVE_SPLICE */
+}
+
+void Csock::CloseSplicePipe()
+{
+#ifdef CS_HAVE_SPLICE
+	if( m_aiSplicePipe[0] != -1 )
+	{
+		close( m_aiSplicePipe[0] );
+		close( m_aiSplicePipe[1] );
+		m_aiSplicePipe[0] = m_aiSplicePipe[1] = -1;
+	}
+#endif /* CS_HAVE_SPLICE */
+	m_uSpliceQueued = 0;
+	m_uSpliceSize = 0;
+}
+
+cs_ssize_t Csock::SpliceRead( size_t uLen )
+{
+#ifdef CS_HAVE_SPLICE
+	Csock * pPeer = m_pProxyPeer;
+	size_t uSpace = pPeer->m_uSpliceSize - pPeer->m_uSpliceQueued;
+	if( uLen > uSpace )
+		uLen = uSpace;
+	if( uLen == 0 )
+		return( READ_EAGAIN );
+
+	cs_ssize_t bytes = splice( m_iReadSock, NULL, pPeer->m_aiSplicePipe[1], NULL, uLen, SPLICE_F_MOVE|SPLICE_F_NONBLOCK );
+	m_cStats.m_iReadCalls++;
+	if( bytes == -1 )
+	{
+		if( GetSockError() == ECONNREFUSED )
+			return( READ_CONNREFUSED );
+		if( GetSockError() == ETIMEDOUT )
+			return( READ_TIMEDOUT );
+		if( GetSockError() != EINTR && GetSockError() != EAGAIN )
+			return( READ_ERR );
+		m_cStats.m_iReadEAGAIN++;
+		// with data in the pipe the EAGAIN may be the pipe being full, the socket could still have more
+		if( GetSockError() == EAGAIN && pPeer->m_uSpliceQueued == 0 )
+			m_bReadReady = false;
+		// a pipe holds pages, not bytes, so small segments can fill it before the byte count says so. wait for it to drain
+		if( pPeer->m_uSpliceQueued > 0 && !pPeer->m_bWriteBufferFull )
+			pPeer->SetWriteBufferFull();
+		return( READ_EAGAIN );
+	}
+	if( bytes > 0 )
+	{
+		m_iBytesRead += ( uint64_t )bytes;
+		m_cStats.m_iWindowRead += ( uint64_t )bytes;
+		pPeer->m_uSpliceQueued += ( size_t )bytes;
+		// send it on now rather than on the next trip through select, a failure there is the peer's to report
+		pPeer->Write( NULL, 0 );
+	}
+	return( bytes );
+#else
+	return( READ_ERR );
+#endif /* CS_HAVE_SPLICE */
+}
+
+bool Csock::SpliceWrite()
+{
+#ifdef CS_HAVE_SPLICE
+	if( m_eConState != CST_OK || m_iWriteSock == CS_INVALID_SOCK )
+		return( true );
+
+	size_t uBytes = m_uSpliceQueued;
+	uint64_t iNOW = 0;
+	if( m_cWriteBucket.IsShaping() )
+	{
+		iNOW = millitime();
+		uint64_t uAvail = m_cWriteBucket.Available( iNOW );
+		if( uAvail < ( uint64_t )uBytes )
+			uBytes = ( size_t )uAvail;
+		if( uBytes == 0 )
+			return( true );
+	}
+
+	cs_ssize_t bytes = splice( m_aiSplicePipe[0], NULL, m_iWriteSock, NULL, uBytes, SPLICE_F_MOVE|SPLICE_F_NONBLOCK );
+	m_cStats.m_iWriteCalls++;
+	if( bytes == -1 )
+	{
+		if( GetSockError() == EINTR || GetSockError() == EAGAIN )
+		{
+			m_cStats.m_iWriteEAGAIN++;
+			if( GetSockError() == EAGAIN )
+				m_bWriteReady = false;
+			return( true );
+		}
+		if( GetSockError() == ECONNREFUSED )
+			ConnectionRefused();
+		return( false );
+	}
+	m_uSpliceQueued -= ( size_t )bytes;
+	if( iNOW )
+		m_cWriteBucket.Consume( ( uint64_t )bytes, iNOW );
+	if( TMO_WRITE & GetTimeoutType() )
+		ResetTimer();
+	m_iBytesWritten += ( uint64_t )bytes;
+	m_cStats.m_iWindowWritten += ( uint64_t )bytes;
+	return( true );
+#else
+	return( true );
+#endif /* CS_HAVE_SPLICE */
+}
+
+void Csock::EnableWriteCoalescing( size_t uThreshold, bool bCork )
+{
+	m_bCoalesceWrites = true;
+	m_uCoalesceThreshold = uThreshold;
+	m_bCoalesceCork = bCork;
+}
+
+void Csock::DisableWriteCoalescing()
+{
+	m_bCoalesceWrites = false;
+	m_bCoalesceCork = false;
+}
+
+bool Csock::Flush()
+{
+	m_bWritePending = false;
+	bool bRet = Write( NULL, 0 );
+	if( m_bCorked )
+	{
+		m_bCorked = false;
+		if( m_iWriteSock != CS_INVALID_SOCK )
+			set_cork( m_iWriteSock, false );
+	}
+	return( bRet );
 }
 
 bool Csock::Write( const CS_STRING & sData )
@@ -2315,7 +3577,10 @@ cs_ssize_t Csock::Read( char *data, size_t len )
 
 		bytes = SSL_read( m_ssl, data, ( int )len );
 		if( bytes >= 0 )
+		{
 			m_bsslEstablished = true; // this means all is good in the realm of ssl
+			SSLHandshakeDone();
+		}
 	}
 	else
 #endif /* HAVE_LIBSSL */
@@ -2324,6 +3589,7 @@ cs_ssize_t Csock::Read( char *data, size_t len )
 #else
 		bytes = read( m_iReadSock, data, len );
 #endif /* _WIN32 */
+	m_cStats.m_iReadCalls++;
 	if( bytes == -1 )
 	{
 		if( GetSockError() == ECONNREFUSED )
@@ -2333,31 +3599,447 @@ cs_ssize_t Csock::Read( char *data, size_t len )
 			return( READ_TIMEDOUT );
 
 		if( GetSockError() == EINTR || GetSockError() == EAGAIN )
+		{
+			m_cStats.m_iReadEAGAIN++;
+#ifdef HAVE_LIBSSL
+			if( m_ssl )
+				SSLWouldBlock( SSL_get_error( m_ssl, ( int )bytes ) );
+			else
+#endif /* HAVE_LIBSSL */
+			if( GetSockError() == EAGAIN )
+				m_bReadReady = false;
 			return( READ_EAGAIN );
+		}
 
 #ifdef _WIN32
 		if( GetSockError() == WSAEWOULDBLOCK )
+		{
+			m_cStats.m_iReadEAGAIN++;
 			return( READ_EAGAIN );
+		}
 #endif /* _WIN32 */
 
 #ifdef HAVE_LIBSSL
 		if( m_ssl )
 		{
-			int iErr = SSL_get_error( m_ssl, ( int )bytes );
-			if( iErr != SSL_ERROR_WANT_READ && iErr != SSL_ERROR_WANT_WRITE )
-				return( READ_ERR );
-			else
-				return( READ_EAGAIN );
+			int iErr = SSL_get_error( m_ssl, ( int )bytes );
+			if( iErr != SSL_ERROR_WANT_READ && iErr != SSL_ERROR_WANT_WRITE )
+				return( READ_ERR );
+			m_cStats.m_iReadEAGAIN++;
+			SSLWouldBlock( iErr );
+			return( READ_EAGAIN );
+		}
+#else
+		return( READ_ERR );
+#endif /* HAVE_LIBSSL */
+	}
+
+	if( bytes > 0 ) // becareful not to add negative bytes :P
+	{
+		m_iBytesRead += ( uint64_t )bytes;
+		m_cStats.m_iWindowRead += ( uint64_t )bytes;
+	}
+	// a short read took all there was, the next edge says when there's more. TLS records don't work that way
+	if( !m_bUseSSL && ( size_t )bytes < len )
+		m_bReadReady = false;
+
+	return( bytes );
+}
+
+#ifdef HAVE_LIBSSL
+void Csock::SSLWouldBlock( int iSSLError )
+{
+	if( iSSLError == SSL_ERROR_WANT_READ )
+		m_bReadReady = false;
+	else if( iSSLError == SSL_ERROR_WANT_WRITE )
+		m_bWriteReady = false;
+}
+#endif /* HAVE_LIBSSL */
+
+void Csock::SetDatagramBatch( u_int uBatch )
+{
+	m_uDatagramBatch = ( uBatch == 0 ? 1 : ( uBatch > CS_DGRAM_MAX_BATCH ? CS_DGRAM_MAX_BATCH : uBatch ) );
+}
+
+void Csock::SetMaxDatagramSize( u_int uSize )
+{
+	m_uMaxDatagram = ( uSize == 0 ? 1 : ( uSize > 65535 ? 65535 : uSize ) );
+}
+
+bool Csock::SetDatagramOffload( bool b )
+{
+#ifdef CS_HAVE_UDP_OFFLOAD
+	if( m_bDatagram && m_iReadSock != CS_INVALID_SOCK )
+	{
+		const int iOn = ( b ? 1 : 0 );
+		if( setsockopt( m_iReadSock, SOL_UDP, UDP_GRO, ( char * )&iOn, sizeof( iOn ) ) != 0 )
+			return( false );
+	}
+	m_bDatagramOffload = b;
+	m_bDatagramGSO = b;
+	return( true );
+#else
+	return( !b );
+#endif /* CS_HAVE_UDP_OFFLOAD */
+}
+
+bool Csock::SendDatagram( const char * pData, size_t uLen, const CS_STRING & sIP, uint16_t uPort )
+{
+	if( !m_bDatagram || uLen > CS_DGRAM_MAX_SIZE )
+		return( false );
+
+	CSDatagram cDatagram;
+	cDatagram.m_iAddrLen = 0;
+	if( !sIP.empty() && !datagram_address( sIP, uPort, GetIPv6(), cDatagram.m_cAddr, cDatagram.m_iAddrLen ) )
+		return( false );
+
+	// payloads sit back to back in m_sSend, so a GSO run is one contiguous slice
+	cDatagram.m_uOffset = m_sSend.size();
+	cDatagram.m_uLen = uLen;
+	if( uLen > 0 )
+		m_sSend.append( pData, uLen );
+	m_vDatagrams.push_back( cDatagram );
+	if( m_sSend.size() > m_cStats.m_uPeakSendQueue )
+		m_cStats.m_uPeakSendQueue = m_sSend.size();
+
+	// the manager flushes at the end of the Loop() iteration, every full batch goes out right away
+	m_bWritePending = true;
+	if( m_vDatagrams.size() % m_uDatagramBatch == 0 )
+		return( WriteDatagrams() );
+	return( true );
+}
+
+bool Csock::DatagramError( int iErrno )
+{
+	// ICMP feedback and trouble with a single datagram, the socket itself is still good
+	if( iErrno == ECONNREFUSED || iErrno == EHOSTUNREACH || iErrno == ENETUNREACH || iErrno == EMSGSIZE
+		|| iErrno == EACCES || iErrno == EPERM || iErrno == ENOBUFS
+#ifdef _WIN32
+		|| iErrno == WSAECONNRESET || iErrno == WSAEMSGSIZE
+#endif /* _WIN32 */
+		)
+	{
+		CallSockError( iErrno );
+		return( true );
+	}
+	return( false );
+}
+
+cs_ssize_t Csock::ReadDatagrams()
+{
+	size_t uSlot = m_uMaxDatagram;
+#ifdef CS_HAVE_UDP_OFFLOAD
+	if( m_bDatagramOffload )
+		uSlot = CS_DGRAM_GRO_SLOT;
+#endif /* CS_HAVE_UDP_OFFLOAD */
+	CSCharBuffer cBuff( uSlot * m_uDatagramBatch );
+	struct sockaddr_storage acAddrs[CS_DGRAM_MAX_BATCH];
+	socklen_t aiAddrLen[CS_DGRAM_MAX_BATCH];
+	size_t auLen[CS_DGRAM_MAX_BATCH], auSegment[CS_DGRAM_MAX_BATCH];
+	bool abTruncated[CS_DGRAM_MAX_BATCH];
+	int iCount = 0;
+	int iErrno = 0;
+
+#ifdef CS_HAVE_MMSG
+	struct mmsghdr acMsgs[CS_DGRAM_MAX_BATCH];
+	struct iovec acIOV[CS_DGRAM_MAX_BATCH];
+#ifdef CS_HAVE_UDP_OFFLOAD
+	CSDgramControl acControl[CS_DGRAM_MAX_BATCH];
+#endif /* CS_HAVE_UDP_OFFLOAD */
+	memset( acMsgs, 0, sizeof( acMsgs[0] ) * m_uDatagramBatch );
+	for( u_int a = 0; a < m_uDatagramBatch; ++a )
+	{
+		acIOV[a].iov_base = cBuff() + a * uSlot;
+		acIOV[a].iov_len = uSlot;
+		acMsgs[a].msg_hdr.msg_iov = &acIOV[a];
+		acMsgs[a].msg_hdr.msg_iovlen = 1;
+		acMsgs[a].msg_hdr.msg_name = &acAddrs[a];
+		acMsgs[a].msg_hdr.msg_namelen = sizeof( acAddrs[a] );
+#ifdef CS_HAVE_UDP_OFFLOAD
+		if( m_bDatagramOffload )
+		{
+			acMsgs[a].msg_hdr.msg_control = acControl[a].m_szBuf;
+			acMsgs[a].msg_hdr.msg_controllen = sizeof( acControl[a].m_szBuf );
+		}
+#endif /* CS_HAVE_UDP_OFFLOAD */
+	}
+
+	iCount = recvmmsg( m_iReadSock, acMsgs, m_uDatagramBatch, 0, NULL );
+	m_cStats.m_iReadCalls++;
+	if( iCount == -1 )
+	{
+		iErrno = GetSockError();
+		iCount = 0;
+	}
+	for( int a = 0; a < iCount; ++a )
+	{
+		aiAddrLen[a] = acMsgs[a].msg_hdr.msg_namelen;
+		auLen[a] = auSegment[a] = acMsgs[a].msg_len;
+		abTruncated[a] = ( ( acMsgs[a].msg_hdr.msg_flags & MSG_TRUNC ) != 0 );
+#ifdef CS_HAVE_UDP_OFFLOAD
+		if( m_bDatagramOffload )
+		{
+			// GRO handed over a train of equally sized datagrams, the last one may be shorter
+			for( struct cmsghdr * pCmsg = CMSG_FIRSTHDR( &acMsgs[a].msg_hdr ); pCmsg; pCmsg = CMSG_NXTHDR( &acMsgs[a].msg_hdr, pCmsg ) )
+			{
+				if( pCmsg->cmsg_level == SOL_UDP && pCmsg->cmsg_type == UDP_GRO )
+				{
+					int iSegment = 0;
+					memcpy( &iSegment, CMSG_DATA( pCmsg ), sizeof( iSegment ) );
+					if( iSegment > 0 )
+						auSegment[a] = ( size_t )iSegment;
+				}
+			}
+		}
+#endif /* CS_HAVE_UDP_OFFLOAD */
+	}
+#else
+	for( u_int a = 0; a < m_uDatagramBatch; ++a )
+	{
+		aiAddrLen[a] = sizeof( acAddrs[a] );
+		int iFlags = 0;
+#ifdef MSG_TRUNC
+		// asks for the real length, so a datagram bigger than the slot shows
+		iFlags = MSG_TRUNC;
+#endif /* MSG_TRUNC */
+		cs_ssize_t iBytes = recvfrom( m_iReadSock, cBuff() + a * uSlot, uSlot, iFlags, ( struct sockaddr * )&acAddrs[a], &aiAddrLen[a] );
+		m_cStats.m_iReadCalls++;
+		if( iBytes == -1 )
+		{
+			// whatever went wrong after the first one shows up again on the next wakeup
+			if( a == 0 )
+				iErrno = GetSockError();
+			break;
+		}
+		abTruncated[a] = ( ( size_t )iBytes > uSlot );
+		auLen[a] = auSegment[a] = ( abTruncated[a] ? uSlot : ( size_t )iBytes );
+		iCount++;
+	}
+#endif /* CS_HAVE_MMSG */
+
+	if( iCount == 0 )
+	{
+		if( datagram_would_block( iErrno ) )
+		{
+			m_cStats.m_iReadEAGAIN++;
+			if( iErrno != EINTR )
+				m_bReadReady = false;
+			return( READ_EAGAIN );
+		}
+		return( DatagramError( iErrno ) ? READ_EAGAIN : READ_ERR );
+	}
+
+	cs_ssize_t iTotal = 0;
+	CS_STRING sIP;
+	uint16_t uPort = 0;
+	int iLast = -1;
+	for( int a = 0; a < iCount && !IsClosed(); ++a )
+	{
+		// a burst usually comes from one source, only convert the address when it changes
+		if( iLast < 0 || aiAddrLen[a] != aiAddrLen[iLast] || memcmp( &acAddrs[a], &acAddrs[iLast], aiAddrLen[a] ) != 0 )
+		{
+			sIP.clear();
+			uPort = 0;
+			if( aiAddrLen[a] > 0 )
+				ConvertAddress( &acAddrs[a], aiAddrLen[a], sIP, &uPort );
+			iLast = a;
+		}
+
+		// the tail of it is gone, passing on the front would look like a whole datagram
+		if( abTruncated[a] )
+		{
+			CallSockError( EMSGSIZE );
+			continue;
+		}
+
+		const char * pData = cBuff() + a * uSlot;
+		iTotal += ( cs_ssize_t )auLen[a];
+		if( auLen[a] == 0 )
+			ReadDatagram( pData, 0, sIP, uPort );
+		for( size_t uPos = 0; uPos < auLen[a] && !IsClosed(); uPos += auSegment[a] )
+			ReadDatagram( pData + uPos, ( auLen[a] - uPos < auSegment[a] ? auLen[a] - uPos : auSegment[a] ), sIP, uPort );
+	}
+
+	m_iBytesRead += ( uint64_t )iTotal;
+	m_cStats.m_iWindowRead += ( uint64_t )iTotal;
+	return( iTotal );
+}
+
+bool Csock::WriteDatagrams()
+{
+	if( m_vDatagrams.empty() || m_eConState != CST_OK )
+		return( true );
+
+	uint64_t iNOW = 0;
+	uint64_t uAvail = 0;
+	if( m_cWriteBucket.IsShaping() )
+	{
+		iNOW = millitime();
+		uAvail = m_cWriteBucket.Available( iNOW );
+	}
+
+	bool bRet = true;
+	size_t uNext = 0;
+	uint64_t iWritten = 0;
+	while( uNext < m_vDatagrams.size() )
+	{
+#ifdef CS_HAVE_MMSG
+		struct mmsghdr acMsgs[CS_DGRAM_MAX_BATCH];
+		struct iovec acIOV[CS_DGRAM_MAX_BATCH];
+		size_t auRun[CS_DGRAM_MAX_BATCH];
+#ifdef CS_HAVE_UDP_OFFLOAD
+		CSDgramControl acControl[CS_DGRAM_MAX_BATCH];
+#endif /* CS_HAVE_UDP_OFFLOAD */
+		u_int uMsgs = 0;
+		size_t uPos = uNext;
+		uint64_t uBytes = 0;
+		while( uMsgs < m_uDatagramBatch && uPos < m_vDatagrams.size() )
+		{
+			CSDatagram & cFirst = m_vDatagrams[uPos];
+			size_t uRun = 1;
+			size_t uRunLen = cFirst.m_uLen;
+#ifdef CS_HAVE_UDP_OFFLOAD
+			if( m_bDatagramGSO && cFirst.m_uLen > 0 )
+			{
+				// equally sized datagrams to the same peer go out as one GSO message, only the last may be shorter
+				while( uPos + uRun < m_vDatagrams.size() && uRun < CS_DGRAM_GSO_SEGS )
+				{
+					const CSDatagram & cNext = m_vDatagrams[uPos + uRun];
+					if( cNext.m_uLen == 0 || cNext.m_uLen > cFirst.m_uLen || uRunLen + cNext.m_uLen > CS_DGRAM_MAX_SIZE
+						|| cNext.m_iAddrLen != cFirst.m_iAddrLen || memcmp( &cNext.m_cAddr, &cFirst.m_cAddr, cFirst.m_iAddrLen ) != 0 )
+						break;
+					uRunLen += cNext.m_uLen;
+					uRun++;
+					if( cNext.m_uLen < cFirst.m_uLen )
+						break;
+				}
+			}
+#endif /* CS_HAVE_UDP_OFFLOAD */
+			if( iNOW && iWritten + uBytes + uRunLen > uAvail )
+				break;
+
+			memset( &acMsgs[uMsgs], 0, sizeof( acMsgs[uMsgs] ) );
+			acIOV[uMsgs].iov_base = ( void * )( m_sSend.data() + cFirst.m_uOffset );
+			acIOV[uMsgs].iov_len = uRunLen;
+			acMsgs[uMsgs].msg_hdr.msg_iov = &acIOV[uMsgs];
+			acMsgs[uMsgs].msg_hdr.msg_iovlen = 1;
+			if( cFirst.m_iAddrLen > 0 )
+			{
+				acMsgs[uMsgs].msg_hdr.msg_name = &cFirst.m_cAddr;
+				acMsgs[uMsgs].msg_hdr.msg_namelen = cFirst.m_iAddrLen;
+			}
+#ifdef CS_HAVE_UDP_OFFLOAD
+			if( uRun > 1 )
+			{
+				acMsgs[uMsgs].msg_hdr.msg_control = acControl[uMsgs].m_szBuf;
+				acMsgs[uMsgs].msg_hdr.msg_controllen = CMSG_SPACE( sizeof( uint16_t ) );
+				struct cmsghdr * pCmsg = CMSG_FIRSTHDR( &acMsgs[uMsgs].msg_hdr );
+				pCmsg->cmsg_level = SOL_UDP;
+				pCmsg->cmsg_type = UDP_SEGMENT;
+				pCmsg->cmsg_len = CMSG_LEN( sizeof( uint16_t ) );
+				uint16_t uSegment = ( uint16_t )cFirst.m_uLen;
+				memcpy( CMSG_DATA( pCmsg ), &uSegment, sizeof( uSegment ) );
+			}
+#endif /* CS_HAVE_UDP_OFFLOAD */
+			auRun[uMsgs++] = uRun;
+			uPos += uRun;
+			uBytes += uRunLen;
+		}
+		if( uMsgs == 0 )
+			break; // out of tokens, Select() wakes us up once they refill
+
+		int iSent = sendmmsg( m_iWriteSock, acMsgs, uMsgs, 0 );
+		m_cStats.m_iWriteCalls++;
+		if( iSent == -1 )
+		{
+			int iErrno = GetSockError();
+			if( datagram_would_block( iErrno ) )
+			{
+				m_cStats.m_iWriteEAGAIN++;
+				if( iErrno != EINTR )
+					m_bWriteReady = false;
+				break;
+			}
+#ifdef CS_HAVE_UDP_OFFLOAD
+			if( auRun[0] > 1 && ( iErrno == EIO || iErrno == EINVAL ) )
+			{
+				// the device or the path MTU can't take it, send one datagram per message from here on
+				m_bDatagramGSO = false;
+				continue;
+			}
+#endif /* CS_HAVE_UDP_OFFLOAD */
+			if( !DatagramError( iErrno ) )
+			{
+				bRet = false;
+				break;
+			}
+			uNext += auRun[0]; // dropped
+			continue;
+		}
+		for( int a = 0; a < iSent; ++a )
+		{
+			iWritten += acMsgs[a].msg_len;
+			uNext += auRun[a];
 		}
 #else
-		return( READ_ERR );
-#endif /* HAVE_LIBSSL */
+		const CSDatagram & cDatagram = m_vDatagrams[uNext];
+		if( iNOW && iWritten + cDatagram.m_uLen > uAvail )
+			break;
+
+		cs_ssize_t iBytes = 0;
+		if( cDatagram.m_iAddrLen > 0 )
+			iBytes = sendto( m_iWriteSock, m_sSend.data() + cDatagram.m_uOffset, cDatagram.m_uLen, 0, ( const struct sockaddr * )&cDatagram.m_cAddr, cDatagram.m_iAddrLen );
+		else
+			iBytes = send( m_iWriteSock, m_sSend.data() + cDatagram.m_uOffset, cDatagram.m_uLen, 0 );
+		m_cStats.m_iWriteCalls++;
+		if( iBytes == -1 )
+		{
+			int iErrno = GetSockError();
+			if( datagram_would_block( iErrno ) )
+			{
+				m_cStats.m_iWriteEAGAIN++;
+				if( iErrno != EINTR )
+					m_bWriteReady = false;
+				break;
+			}
+			if( !DatagramError( iErrno ) )
+			{
+				bRet = false;
+				break;
+			}
+		}
+		else
+		{
+			iWritten += ( uint64_t )iBytes;
+		}
+		uNext++;
+#endif /* CS_HAVE_MMSG */
 	}
 
-	if( bytes > 0 ) // becareful not to add negative bytes :P
-		m_iBytesRead += ( uint64_t )bytes;
+	if( uNext == m_vDatagrams.size() )
+	{
+		m_vDatagrams.clear();
+		m_sSend.clear();
+	}
+	else if( uNext > 0 )
+	{
+		size_t uShift = m_vDatagrams[uNext].m_uOffset;
+		m_vDatagrams.erase( m_vDatagrams.begin(), m_vDatagrams.begin() + uNext );
+		for( size_t a = 0; a < m_vDatagrams.size(); ++a )
+			m_vDatagrams[a].m_uOffset -= uShift;
+		m_sSend.erase( 0, uShift );
+	}
 
-	return( bytes );
+	if( iWritten > 0 )
+	{
+		if( iNOW )
+			m_cWriteBucket.Consume( iWritten, iNOW );
+		if( TMO_WRITE & GetTimeoutType() )
+			ResetTimer();
+		m_iBytesWritten += iWritten;
+		m_cStats.m_iWindowWritten += iWritten;
+	}
+	return( bRet );
 }
 
 CS_STRING Csock::GetLocalIP() const
@@ -2414,11 +4096,14 @@ cs_sock_t & Csock::GetSock() { return( m_iReadSock ); }
 const cs_sock_t & Csock::GetSock() const { return( m_iReadSock ); }
 void Csock::ResetTimer() { m_iLastCheckTimeoutTime = 0; m_iTcount = 0; }
 void Csock::PauseRead() { m_bPauseRead = true; }
-bool Csock::IsReadPaused() const { return( m_bPauseRead ); }
+bool Csock::IsReadPaused() const { return( m_bPauseRead || m_bBackPressure ); }
 
 void Csock::UnPauseRead()
 {
 	m_bPauseRead = false;
+	// a full downstream still holds it, SetBackPressure() picks up from here once that drains
+	if( m_bBackPressure )
+		return;
 	ResetTimer();
 	PushBuff( "", 0, true );
 }
@@ -2494,6 +4179,12 @@ bool Csock::CheckTimeout( time_t iNow )
 
 void Csock::PushBuff( const char *data, size_t len, bool bStartAtZero )
 {
+	if( m_uFrameHeader > 0 )
+	{
+		PushFrames( data, len );
+		return;
+	}
+
 	if( !m_bEnableReadLine )
 		return;	// If the ReadLine event is disabled, just ditch here
 
@@ -2502,7 +4193,7 @@ void Csock::PushBuff( const char *data, size_t len, bool bStartAtZero )
 	if( data )
 		m_sbuffer.append( data, len );
 
-	while( !m_bPauseRead && GetCloseType() == CLT_DONT )
+	while( !IsReadPaused() && GetCloseType() == CLT_DONT )
 	{
 		CS_STRING::size_type iFind = m_sbuffer.find( "\n", iStartPos );
 
@@ -2541,6 +4232,108 @@ void Csock::PushBuff( const char *data, size_t len, bool bStartAtZero )
 		ReachedMaxBuffer(); // call the max read buffer event
 }
 
+uint64_t Csock::FrameLength( const char * pHeader ) const
+{
+	const unsigned char * pBytes = ( const unsigned char * )pHeader;
+	uint64_t uLen = 0;
+	for( u_int a = 0; a < m_uFrameHeader; ++a )
+	{
+		if( m_bFrameBigEndian )
+			uLen = ( uLen << 8 ) | pBytes[a];
+		else
+			uLen |= ( uint64_t )pBytes[a] << ( 8 * a );
+	}
+	return( uLen );
+}
+
+size_t Csock::ParseFrames( const char * data, size_t len )
+{
+	size_t uUsed = 0;
+	// ReadFrame() may pause, close or switch framing off, look again after every frame
+	while( m_uFrameHeader > 0 && !IsReadPaused() && GetCloseType() == CLT_DONT && len - uUsed >= m_uFrameHeader )
+	{
+		uint64_t uFrame = FrameLength( data + uUsed );
+		if( m_uMaxFrame > 0 && uFrame > m_uMaxFrame )
+		{
+			ReachedMaxBuffer();
+			m_sbuffer.clear();
+			Close();
+			return( len );
+		}
+		if( len - uUsed - m_uFrameHeader < uFrame )
+			break;
+		uUsed += m_uFrameHeader;
+		ReadFrame( data + uUsed, ( size_t )uFrame );
+		uUsed += ( size_t )uFrame;
+	}
+	return( uUsed );
+}
+
+void Csock::PushFrames( const char * data, size_t len )
+{
+	if( !m_sbuffer.empty() )
+	{
+		// only top the buffered frame up with what it is missing, whatever follows can be handed over straight from data
+		if( m_sbuffer.size() < m_uFrameHeader )
+		{
+			size_t uTake = m_uFrameHeader - m_sbuffer.size();
+			if( uTake > len )
+				uTake = len;
+			m_sbuffer.append( data, uTake );
+			data += uTake;
+			len -= uTake;
+		}
+		if( m_sbuffer.size() >= m_uFrameHeader )
+		{
+			uint64_t uFrame = FrameLength( m_sbuffer.data() );
+			if( m_uMaxFrame == 0 || uFrame <= m_uMaxFrame )
+			{
+				uint64_t uTotal = m_uFrameHeader + uFrame;
+				if( uTotal > m_sbuffer.size() )
+				{
+					size_t uTake = ( uTotal - m_sbuffer.size() < len ? ( size_t )( uTotal - m_sbuffer.size() ) : len );
+					m_sbuffer.append( data, uTake );
+					data += uTake;
+					len -= uTake;
+				}
+			}
+		}
+
+		// ReadFrame() gets a pointer into the buffered frame, EnableReadLine() and friends clear m_sbuffer, so parse it out of reach
+		CS_STRING sBuffered;
+		sBuffered.swap( m_sbuffer );
+		size_t uUsed = ParseFrames( sBuffered.data(), sBuffered.size() );
+		if( m_uFrameHeader == 0 )
+		{
+			// ReadFrame() switched framing off, what's left is the start of whatever comes next
+			if( uUsed < sBuffered.size() )
+				PushBuff( sBuffered.data() + uUsed, sBuffered.size() - uUsed );
+			if( len > 0 )
+				PushBuff( data, len );
+			return;
+		}
+		if( GetCloseType() != CLT_DONT )
+			return;
+		if( uUsed < sBuffered.size() )
+		{
+			m_sbuffer.assign( sBuffered, uUsed, CS_STRING::npos );
+			m_sbuffer.append( data, len );
+			return;
+		}
+	}
+
+	if( len == 0 )
+		return;
+
+	size_t uUsed = ParseFrames( data, len );
+	if( uUsed == len || GetCloseType() != CLT_DONT )
+		return;
+	if( m_uFrameHeader == 0 )
+		PushBuff( data + uUsed, len - uUsed ); // a preamble of frames followed by lines, IE
+	else
+		m_sbuffer.append( data + uUsed, len - uUsed );
+}
+
 #ifdef HAVE_ICU
 void Csock::IcuExtToUCallback(
 		UConverterToUnicodeArgs* toArgs,
@@ -2646,6 +4439,28 @@ void Csock::ResetBytesRead() { m_iBytesRead = 0; }
 uint64_t Csock::GetBytesWritten() const { return( m_iBytesWritten ); }
 void Csock::ResetBytesWritten() { m_iBytesWritten = 0; }
 
+void Csock::GetStats( CSSockStats & cStats ) const
+{
+	uint64_t iNOW = millitime();
+	cStats = m_cStats;
+	cStats.Roll( iNOW );
+	cStats.m_iSockets = 1;
+	cStats.m_iBytesRead = m_iBytesRead;
+	cStats.m_iBytesWritten = m_iBytesWritten;
+	cStats.m_uSendQueue = m_sSend.size() - m_uSendBufferPos;
+	// count a stretch of shaping that is still going on
+	if( cStats.m_iReadShapedSince != 0 && iNOW > cStats.m_iReadShapedSince )
+		cStats.m_iReadShapedMS += iNOW - cStats.m_iReadShapedSince;
+	if( cStats.m_iWriteShapedSince != 0 && iNOW > cStats.m_iWriteShapedSince )
+		cStats.m_iWriteShapedMS += iNOW - cStats.m_iWriteShapedSince;
+}
+
+void Csock::ResetStats()
+{
+	m_cStats.Reset();
+	m_cStats.m_uPeakSendQueue = m_sSend.size() - m_uSendBufferPos;
+}
+
 double Csock::GetAvgRead( uint64_t iSample ) const
 {
 	uint64_t iDifference = ( millitime() - m_iStartTime );
@@ -2666,6 +4481,12 @@ double Csock::GetAvgWrite( uint64_t iSample ) const
 	return( ( ( double )m_iBytesWritten / ( ( double )iDifference / ( double )iSample ) ) );
 }
 
+void Csock::SetRemoteAddress( const CS_STRING & sIP, uint16_t uPort )
+{
+	m_sRemoteIP = sIP;
+	m_iRemotePort = uPort;
+}
+
 uint16_t Csock::GetRemotePort() const
 {
 	if( m_iRemotePort > 0 )
@@ -2703,20 +4524,91 @@ bool Csock::GetSSL() const { return( m_bUseSSL ); }
 void Csock::SetSSL( bool b ) { m_bUseSSL = b; }
 
 #ifdef HAVE_LIBSSL
-void Csock::SetCipher( const CS_STRING & sCipher ) { m_sCipherType = sCipher; }
-const CS_STRING & Csock::GetCipher() const { return( m_sCipherType ); }
+CSSSLProfile::CSSSLProfile()
+{
+	m_uRefs = 1;
+	m_sCipherType = "ALL";
+	m_iRequireClientCertFlags = 0;
+}
+
+CSSSLProfile::CSSSLProfile( const CSListener & cListen )
+{
+	m_uRefs = 1;
+	m_sCipherType = cListen.GetCipher();
+	m_sDHParamFile = cListen.GetDHParamLocation();
+	m_sKeyFile = cListen.GetKeyLocation();
+	m_sPemFile = cListen.GetPemLocation();
+	m_sPemPass = cListen.GetPemPass();
+	m_iRequireClientCertFlags = cListen.GetRequireClientCertFlags();
+}
+
+CSSSLProfile::CSSSLProfile( const CSConnection & cCon )
+{
+	m_uRefs = 1;
+	m_sCipherType = ( cCon.GetCipher().empty() ? "ALL" : cCon.GetCipher() );
+	if( !cCon.GetPemLocation().empty() )
+	{
+		m_sDHParamFile = cCon.GetDHParamLocation();
+		m_sKeyFile = cCon.GetKeyLocation();
+		m_sPemFile = cCon.GetPemLocation();
+		m_sPemPass = cCon.GetPemPass();
+	}
+	m_iRequireClientCertFlags = 0;
+}
+
+CSSSLProfile::CSSSLProfile( const CSSSLProfile & cCopy )
+{
+	m_uRefs = 1;
+	m_sCipherType = cCopy.m_sCipherType;
+	m_sDHParamFile = cCopy.m_sDHParamFile;
+	m_sKeyFile = cCopy.m_sKeyFile;
+	m_sPemFile = cCopy.m_sPemFile;
+	m_sPemPass = cCopy.m_sPemPass;
+	m_iRequireClientCertFlags = cCopy.m_iRequireClientCertFlags;
+}
+
+const CSSSLProfile & Csock::SSLProfile() const
+{
+	static const CSSSLProfile s_cDefaults;
+	return( m_pSSLProfile ? *m_pSSLProfile : s_cDefaults );
+}
+
+CSSSLProfile & Csock::MutableSSLProfile()
+{
+	if( !m_pSSLProfile || m_pSSLProfile->IsShared() )
+	{
+		CSSSLProfile * pProfile = new CSSSLProfile( SSLProfile() );
+		SetSSLProfile( pProfile );
+		pProfile->UnRef();
+	}
+	return( *m_pSSLProfile );
+}
+
+void Csock::SetSSLProfile( CSSSLProfile * pProfile )
+{
+	if( pProfile == m_pSSLProfile )
+		return;
+	if( pProfile )
+		pProfile->Ref();
+	if( m_pSSLProfile )
+		m_pSSLProfile->UnRef();
+	m_pSSLProfile = pProfile;
+}
+
+void Csock::SetCipher( const CS_STRING & sCipher ) { MutableSSLProfile().m_sCipherType = sCipher; }
+const CS_STRING & Csock::GetCipher() const { return( SSLProfile().m_sCipherType ); }
 
-void Csock::SetDHParamLocation( const CS_STRING & sDHParamFile ) { m_sDHParamFile = sDHParamFile; }
-const CS_STRING & Csock::GetDHParamLocation() const { return( m_sDHParamFile ); }
+void Csock::SetDHParamLocation( const CS_STRING & sDHParamFile ) { MutableSSLProfile().m_sDHParamFile = sDHParamFile; }
+const CS_STRING & Csock::GetDHParamLocation() const { return( SSLProfile().m_sDHParamFile ); }
 
-void Csock::SetKeyLocation( const CS_STRING & sKeyFile ) { m_sKeyFile = sKeyFile; }
-const CS_STRING & Csock::GetKeyLocation() const { return( m_sKeyFile ); }
+void Csock::SetKeyLocation( const CS_STRING & sKeyFile ) { MutableSSLProfile().m_sKeyFile = sKeyFile; }
+const CS_STRING & Csock::GetKeyLocation() const { return( SSLProfile().m_sKeyFile ); }
 
-void Csock::SetPemLocation( const CS_STRING & sPemFile ) { m_sPemFile = sPemFile; }
-const CS_STRING & Csock::GetPemLocation() const { return( m_sPemFile ); }
+void Csock::SetPemLocation( const CS_STRING & sPemFile ) { MutableSSLProfile().m_sPemFile = sPemFile; }
+const CS_STRING & Csock::GetPemLocation() const { return( SSLProfile().m_sPemFile ); }
 
-void Csock::SetPemPass( const CS_STRING & sPassword ) { m_sPemPass = sPassword; }
-const CS_STRING & Csock::GetPemPass() const { return( m_sPemPass ); }
+void Csock::SetPemPass( const CS_STRING & sPassword ) { MutableSSLProfile().m_sPemPass = sPassword; }
+const CS_STRING & Csock::GetPemPass() const { return( SSLProfile().m_sPemPass ); }
 
 void Csock::SetSSLMethod( int iMethod ) { m_iMethod = iMethod; }
 int Csock::GetSSLMethod() const { return( m_iMethod ); }
@@ -2753,9 +4645,18 @@ bool Csock::HasWriteBuffer() const
 {
 	// the fact that this has data in it is good enough. Checking m_uSendBufferPos is a moot point
 	// since once m_uSendBufferPos is at the same position as m_sSend it's cleared (in Write)
-	return( !m_sSend.empty() );
+	return( !m_sSend.empty() || !m_vDatagrams.empty() || m_uSpliceQueued > 0 );
+}
+void Csock::ClearWriteBuffer()
+{
+	m_iSendBase += m_sSend.size();
+	m_vSendMarks.clear();
+	m_sSend.clear();
+	m_vDatagrams.clear();
+	m_uSendBufferPos = 0;
+	if( m_bWriteBufferFull )
+		CheckWriteWatermarks();
 }
-void Csock::ClearWriteBuffer() { m_sSend.clear(); m_uSendBufferPos = 0; }
 bool Csock::SslIsEstablished() const { return ( m_bsslEstablished ); }
 
 bool Csock::ConnectInetd( bool bIsSSL, const CS_STRING & sHostname )
@@ -2922,8 +4823,9 @@ long Csock::GetPeerFingerprint( CS_STRING & sFP ) const
 
 	return( SSL_get_verify_result( m_ssl ) );
 }
-u_int Csock::GetRequireClientCertFlags() const { return( m_iRequireClientCertFlags ); }
-void Csock::SetRequiresClientCert( bool bRequiresCert ) { m_iRequireClientCertFlags = ( bRequiresCert ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT|SSL_VERIFY_PEER : 0 ); }
+u_int Csock::GetRequireClientCertFlags() const { return( SSLProfile().m_iRequireClientCertFlags ); }
+void Csock::SetRequiresClientCert( bool bRequiresCert ) { SetRequireClientCertFlags( bRequiresCert ? SSL_VERIFY_FAIL_IF_NO_PEER_CERT|SSL_VERIFY_PEER : 0 ); }
+void Csock::SetRequireClientCertFlags( uint32_t iRequireClientCertFlags ) { MutableSSLProfile().m_iRequireClientCertFlags = iRequireClientCertFlags; }
 
 #endif /* HAVE_LIBSSL */
 
@@ -2934,19 +4836,54 @@ void Csock::SetRate( u_int iBytes, uint64_t iMilliseconds )
 {
 	m_iMaxBytes = iBytes;
 	m_iMaxMilliSeconds = iMilliseconds;
+	if( iBytes > 0 && iMilliseconds > 0 )
+	{
+		uint64_t uBytesPerSec = ( uint64_t )iBytes * 1000 / iMilliseconds;
+		m_cWriteBucket.SetRate( uBytesPerSec ? uBytesPerSec : 1, iBytes );
+	}
+	else
+	{
+		m_cWriteBucket.SetRate( 0 );
+	}
 }
 
+void Csock::SetWriteRate( uint64_t uBytesPerSec, uint64_t uBurst ) { m_cWriteBucket.SetRate( uBytesPerSec, uBurst ); }
+void Csock::SetReadRate( uint64_t uBytesPerSec, uint64_t uBurst ) { m_cReadBucket.SetRate( uBytesPerSec, uBurst ); }
+
 u_int Csock::GetRateBytes() const { return( m_iMaxBytes ); }
 uint64_t Csock::GetRateTime() const { return( m_iMaxMilliSeconds ); }
 
 
-void Csock::EnableReadLine() { m_bEnableReadLine = true; }
+void Csock::EnableReadLine()
+{
+	DisableReadFrame();
+	m_bEnableReadLine = true;
+}
 void Csock::DisableReadLine()
 {
 	m_bEnableReadLine = false;
 	m_sbuffer.clear();
 }
 
+bool Csock::EnableReadFrame( u_int uHeaderBytes, bool bBigEndian, uint64_t uMaxFrame )
+{
+	if( uHeaderBytes != 1 && uHeaderBytes != 2 && uHeaderBytes != 4 && uHeaderBytes != 8 )
+		return( false );
+	DisableReadLine();
+	m_uFrameHeader = uHeaderBytes;
+	m_bFrameBigEndian = bBigEndian;
+	m_uMaxFrame = uMaxFrame;
+	return( true );
+}
+
+void Csock::DisableReadFrame()
+{
+	if( m_uFrameHeader == 0 )
+		return;
+	m_uFrameHeader = 0;
+	m_sbuffer.clear();
+}
+
 void Csock::ReachedMaxBuffer()
 {
 	std::cerr << "Warning, Max Buffer length Warning Threshold has been hit" << endl;
@@ -3124,6 +5061,9 @@ int Csock::DNSLookup( EDNSLType eDNSLType )
 		m_bindhost.SinPort( 0 );
 	}
 
+	if( m_cStats.m_iDNSStart == 0 )
+		m_cStats.m_iDNSStart = microtime();
+
 	int iRet = ETIMEDOUT;
 	if( eDNSLType == DNS_VHOST )
 	{
@@ -3144,6 +5084,15 @@ int Csock::DNSLookup( EDNSLType eDNSLType )
 		iRet = GetAddrInfo( m_shostname, m_address );
 	}
 
+	if( iRet != EAGAIN )
+	{
+		uint64_t iNOW = microtime();
+		if( iNOW > m_cStats.m_iDNSStart )
+			m_cStats.m_iDNSUS += iNOW - m_cStats.m_iDNSStart;
+		m_cStats.m_iDNSLookups++;
+		m_cStats.m_iDNSStart = 0;
+	}
+
 	if( iRet == 0 )
 	{
 		if( !CreateSocksFD() )
@@ -3235,7 +5184,7 @@ cs_sock_t Csock::CreateSocket( bool bListen, bool bUnix )
 #else
 		domain = PF_INET;
 #endif /* HAVE_IPV6 */
-		protocol = IPPROTO_TCP;
+		protocol = ( m_bDatagram ? IPPROTO_UDP : IPPROTO_TCP );
 	}
 	else
 	{
@@ -3246,12 +5195,25 @@ cs_sock_t Csock::CreateSocket( bool bListen, bool bUnix )
 		return CS_INVALID_SOCK;
 #endif
 	}
-	cs_sock_t iRet = socket( domain, SOCK_STREAM, protocol );
+	cs_sock_t iRet = socket( domain, ( m_bDatagram ? SOCK_DGRAM : SOCK_STREAM ), protocol );
 
 	if( iRet != CS_INVALID_SOCK )
 	{
 		set_close_on_exec( iRet );
 
+		// before connect() and listen(), the buffer sizes decide the window scale
+		if( !bUnix )
+			m_cTuning.Apply( iRet, !m_bDatagram, GetIPv6() );
+
+#ifdef CS_HAVE_UDP_OFFLOAD
+		if( m_bDatagramOffload )
+		{
+			const int on = 1;
+			if( setsockopt( iRet, SOL_UDP, UDP_GRO, ( char * ) &on, sizeof( on ) ) != 0 )
+				PERROR( "UDP_GRO" );
+		}
+#endif /* CS_HAVE_UDP_OFFLOAD */
+
 		if( bListen )
 		{
 			const int on = 1;
@@ -3271,7 +5233,7 @@ void Csock::Init( const CS_STRING & sHostname, uint16_t uPort, int iTimeout )
 #ifdef HAVE_LIBSSL
 	m_ssl = NULL;
 	m_ssl_ctx = NULL;
-	m_iRequireClientCertFlags = 0;
+	m_pSSLProfile = NULL;
 	m_uDisableProtocols = 0;
 	m_bNoSSLCompression = false;
 	m_bSSLCipherServerPreference = false;
@@ -3281,6 +5243,42 @@ void Csock::Init( const CS_STRING & sHostname, uint16_t uPort, int iTimeout )
 	m_iWriteSock = CS_INVALID_SOCK;
 	m_iTimeout = iTimeout;
 	m_iMaxConns = SOMAXCONN;
+	m_uAcceptBatch = 1;
+	m_bFastOpen = false;
+	m_bFastOpenPending = false;
+	m_iFastOpenQueue = 0;
+	m_bExclusiveAccept = false;
+	m_bReadReady = false;
+	m_bWriteReady = false;
+	m_iEdgeRSock = CS_INVALID_SOCK;
+	m_iEdgeWSock = CS_INVALID_SOCK;
+	m_bEdgeArmed = false;
+	m_bEdgeQueued = false;
+	m_iEdgeWant = 0;
+	m_bDatagram = false;
+	m_bDatagramOffload = false;
+	m_bDatagramGSO = false;
+	m_uDatagramBatch = 32;
+	m_uMaxDatagram = 2048;
+	m_bCoalesceWrites = false;
+	m_bCoalesceCork = false;
+	m_bCorked = false;
+	m_bWritePending = false;
+	m_uCoalesceThreshold = 0;
+	m_uWriteHighWater = 0;
+	m_uWriteLowWater = 0;
+	m_bWriteBufferFull = false;
+	m_uNotSentLowat = 0;
+	m_iSendBase = 0;
+	m_iUrgentEnd = 0;
+	m_pUpstream = NULL;
+	m_pDownstream = NULL;
+	m_pProxyPeer = NULL;
+	m_aiSplicePipe[0] = m_aiSplicePipe[1] = -1;
+	m_uSpliceQueued = 0;
+	m_uSpliceSize = 0;
+	m_bPoolIdle = false;
+	m_iPoolIdleSince = 0;
 	m_bUseSSL = false;
 	m_bIsConnected = false;
 	m_uPort = uPort;
@@ -3298,14 +5296,17 @@ void Csock::Init( const CS_STRING & sHostname, uint16_t uPort, int iTimeout )
 	 * https://www.openssl.org/docs/ssl/SSL_CTX_new.html
 	 */
 	m_iMethod = SSL23;
-	m_sCipherType = "ALL";
 	m_iMaxBytes = 0;
 	m_iMaxMilliSeconds = 0;
-	m_iLastSendTime = 0;
-	m_iLastSend = 0;
+	m_cReadBucket = CSTokenBucket();
+	m_cWriteBucket = CSTokenBucket();
+	m_cStats.Reset();
 	m_uSendBufferPos = 0;
 	m_bsslEstablished = false;
 	m_bEnableReadLine = false;
+	m_uFrameHeader = 0;
+	m_bFrameBigEndian = true;
+	m_uMaxFrame = 0;
 	m_iMaxStoredBufferLength = 1024;
 	m_iConnType = INBOUND;
 	m_iRemotePort = 0;
@@ -3314,6 +5315,7 @@ void Csock::Init( const CS_STRING & sHostname, uint16_t uPort, int iTimeout )
 	m_iBytesWritten = 0;
 	m_iStartTime = millitime();
 	m_bPauseRead = false;
+	m_bBackPressure = false;
 	m_iTimeoutType = TMO_ALL;
 	m_eConState = CST_OK;	// default should be ok
 	m_iDNSTryCount = 0;
@@ -3335,6 +5337,59 @@ void Csock::Init( const CS_STRING & sHostname, uint16_t uPort, int iTimeout )
 #endif /* HAVE_ICU */
 }
 
+CSManagerStats::CSManagerStats()
+{
+	for( size_t a = 0; a < sizeof( m_aiSocketsByType ) / sizeof( m_aiSocketsByType[0] ); ++a )
+		m_aiSocketsByType[a] = 0;
+	for( size_t a = 0; a < sizeof( m_aiSocketsByState ) / sizeof( m_aiSocketsByState[0] ); ++a )
+		m_aiSocketsByState[a] = 0;
+	m_iAccepts = 0;
+	m_iUpdated = 0;
+}
+
+uint64_t CSManagerStats::GetSocketsByType( int iType ) const
+{
+	if( iType < 0 || iType > Csock::INBOUND )
+		return( 0 );
+	return( m_aiSocketsByType[iType] );
+}
+
+uint64_t CSManagerStats::GetSocketsByState( int iState ) const
+{
+	if( iState < 0 || iState > Csock::CST_OK )
+		return( 0 );
+	return( m_aiSocketsByState[iState] );
+}
+
+CSPoolStats::CSPoolStats()
+{
+	m_iHits = 0;
+	m_iMisses = 0;
+	m_iRefused = 0;
+	m_iIdleTimeouts = 0;
+	m_iProbeFailures = 0;
+	m_iIdle = 0;
+	m_iActive = 0;
+}
+
+double CSPoolStats::GetHitRate() const
+{
+	if( m_iHits + m_iMisses == 0 )
+		return( 0.0 );
+	return( ( double )m_iHits / ( double )( m_iHits + m_iMisses ) );
+}
+
+void CSPoolStats::Add( const CSPoolStats & cStats )
+{
+	m_iHits += cStats.m_iHits;
+	m_iMisses += cStats.m_iMisses;
+	m_iRefused += cStats.m_iRefused;
+	m_iIdleTimeouts += cStats.m_iIdleTimeouts;
+	m_iProbeFailures += cStats.m_iProbeFailures;
+	m_iIdle += cStats.m_iIdle;
+	m_iActive += cStats.m_iActive;
+}
+
 ////////////////////////// CSocketManager //////////////////////////
 CSocketManager::CSocketManager() : std::vector<Csock *>(), CSockCommon()
 {
@@ -3343,11 +5398,26 @@ CSocketManager::CSocketManager() : std::vector<Csock *>(), CSockCommon()
 	m_iSelectWait = 100000; // Default of 100 milliseconds
 	m_iBytesRead = 0;
 	m_iBytesWritten = 0;
+	m_uPoolMaxPerKey = 0;
+	m_uPoolMaxIdle = 16;
+	m_uPoolIdleTimeout = 60;
+#ifdef CSOCK_USE_EPOLL
+	m_iEpollFD = -1; // created with the first socket, so managers of forked workers don't share one
+	m_vEpollEvents.resize( 64 );
+#endif /* CSOCK_USE_EPOLL */
 }
 
 CSocketManager::~CSocketManager()
 {
 	clear();
+#ifdef HAVE_LIBSSL
+	for( std::map<CS_STRING, CSSSLProfile *>::iterator it = m_mspSSLProfiles.begin(); it != m_mspSSLProfiles.end(); ++it )
+		it->second->UnRef();
+#endif /* HAVE_LIBSSL */
+#ifdef CSOCK_USE_EPOLL
+	if( m_iEpollFD >= 0 )
+		close( m_iEpollFD );
+#endif /* CSOCK_USE_EPOLL */
 }
 
 void CSocketManager::clear()
@@ -3363,49 +5433,237 @@ void CSocketManager::Cleanup()
 	clear();
 }
 
-Csock * CSocketManager::GetSockObj( const CS_STRING & sHostname, uint16_t uPort, int iTimeout )
+Csock * CSocketManager::GetSockObj( const CS_STRING & sHostname, uint16_t uPort, int iTimeout )
+{
+	return( new Csock( sHostname, uPort, iTimeout ) );
+}
+
+void CSocketManager::Connect( const CSConnection & cCon, Csock * pcSock )
+{
+	// create the new object
+	if( !pcSock )
+		pcSock = GetSockObj( cCon.GetHostname(), cCon.GetPort(), cCon.GetTimeout() );
+	else
+	{
+		pcSock->SetHostName( cCon.GetHostname() );
+		pcSock->SetPort( cCon.GetPort() );
+		pcSock->SetTimeout( cCon.GetTimeout() );
+	}
+
+	if( cCon.GetAFRequire() != CSSockAddr::RAF_ANY )
+		pcSock->SetAFRequire( cCon.GetAFRequire() );
+
+	// bind the vhost
+	pcSock->SetBindHost( cCon.GetBindHost() );
+	if( cCon.GetDatagram() )
+		pcSock->SetDatagram( true );
+	if( cCon.GetFastOpen() )
+		pcSock->SetFastOpen( true );
+	if( !cCon.GetTuning().IsEmpty() )
+		pcSock->SetTuning( cCon.GetTuning() );
+
+#ifdef HAVE_LIBSSL
+	pcSock->SetSSL( cCon.GetIsSSL() );
+	if( cCon.GetIsSSL() && !pcSock->GetSSLProfile() )
+	{
+		// outbound sockets with the same settings share a profile, @see CSSSLProfile
+		pcSock->SetSSLProfile( GetSSLProfile( cCon ) );
+	}
+	else if( cCon.GetIsSSL() )
+	{
+		if( !cCon.GetPemLocation().empty() )
+		{
+			pcSock->SetDHParamLocation( cCon.GetDHParamLocation() );
+			pcSock->SetKeyLocation( cCon.GetKeyLocation() );
+			pcSock->SetPemLocation( cCon.GetPemLocation() );
+			pcSock->SetPemPass( cCon.GetPemPass() );
+		}
+		if( !cCon.GetCipher().empty() )
+			pcSock->SetCipher( cCon.GetCipher() );
+	}
+#endif /* HAVE_LIBSSL */
+
+	pcSock->SetType( Csock::OUTBOUND );
+
+	pcSock->SetConState( Csock::CST_START );
+	AddSock( pcSock, cCon.GetSockName() );
+}
+
+#ifdef HAVE_LIBSSL
+CSSSLProfile * CSocketManager::GetSSLProfile( const CSConnection & cCon )
+{
+	// only what CSSSLProfile( cCon ) looks at, NUL can't show up inside any of it
+	CS_STRING sKey( cCon.GetCipher() );
+	if( !cCon.GetPemLocation().empty() )
+	{
+		sKey.append( 1, '\0' ).append( cCon.GetDHParamLocation() ).append( 1, '\0' ).append( cCon.GetKeyLocation() );
+		sKey.append( 1, '\0' ).append( cCon.GetPemLocation() ).append( 1, '\0' ).append( cCon.GetPemPass() );
+	}
+	std::map<CS_STRING, CSSSLProfile *>::iterator it = m_mspSSLProfiles.find( sKey );
+	if( it == m_mspSSLProfiles.end() )
+		it = m_mspSSLProfiles.insert( std::make_pair( sKey, new CSSSLProfile( cCon ) ) ).first;
+	return( it->second );
+}
+#endif /* HAVE_LIBSSL */
+
+CS_STRING CSocketManager::GetPoolKey( const CSConnection & cCon )
+{
+	char szPort[8];
+	snprintf( szPort, sizeof( szPort ), "%u", ( u_int )cCon.GetPort() );
+	CS_STRING sKey( cCon.GetHostname() );
+	sKey.append( 1, ' ' ).append( szPort ).append( cCon.GetIsSSL() ? " ssl" : " plain" );
+	if( !cCon.GetBindHost().empty() )
+		sKey.append( " from " ).append( cCon.GetBindHost() );
+	return( sKey );
+}
+
+bool CSocketManager::ConnectPooled( const CSConnection & cCon, Csock * pcSock )
+{
+	CS_STRING sKey = GetPoolKey( cCon );
+	CSPool & cPool = m_mscPools[sKey];
+	if( m_uPoolMaxPerKey && cPool.m_uConns >= m_uPoolMaxPerKey )
+	{
+		cPool.m_cStats.m_iRefused++;
+		CS_Delete( pcSock );
+		return( false );
+	}
+	if( !pcSock )
+		pcSock = GetSockObj( cCon.GetHostname(), cCon.GetPort(), cCon.GetTimeout() );
+	pcSock->m_sPoolKey = sKey;
+	cPool.m_uConns++;
+	Connect( cCon, pcSock );
+	return( true );
+}
+
+Csock * CSocketManager::AcquireSock( const CSConnection & cCon )
+{
+	CSPool & cPool = m_mscPools[GetPoolKey( cCon )];
+	while( !cPool.m_vIdle.empty() )
+	{
+		// the most recently used one is the least likely to have been dropped by the server
+		Csock * pcSock = cPool.m_vIdle.back();
+		cPool.m_vIdle.pop_back();
+		pcSock->m_bPoolIdle = false;
+		if( !ProbePooled( pcSock ) )
+		{
+			cPool.m_cStats.m_iProbeFailures++;
+			pcSock->Close();
+			continue;
+		}
+		cPool.m_cStats.m_iHits++;
+		pcSock->ResetTimer();
+		return( pcSock );
+	}
+	cPool.m_cStats.m_iMisses++;
+	return( NULL );
+}
+
+void CSocketManager::ReleaseSock( Csock * pcSock )
 {
-	return( new Csock( sHostname, uPort, iTimeout ) );
+	if( !pcSock || pcSock->m_bPoolIdle )
+		return;
+	std::map<CS_STRING, CSPool>::iterator it = m_mscPools.find( pcSock->m_sPoolKey );
+	// part of a line or frame that was never delivered means the exchange isn't over, it's out of step with the server
+	if( it == m_mscPools.end() || pcSock->IsClosed() || !pcSock->IsConnected() || pcSock->GetConState() != Csock::CST_OK
+		|| pcSock->GetProxyPeer() || !pcSock->m_sbuffer.empty() || it->second.m_vIdle.size() >= m_uPoolMaxIdle )
+	{
+		pcSock->Close( Csock::CLT_AFTERWRITE );
+		return;
+	}
+	// the next user gets it without links to sockets of the last one
+	pcSock->SetUpstream( NULL );
+	if( pcSock->m_pDownstream )
+		pcSock->m_pDownstream->SetUpstream( NULL );
+	// it has to be watched for the server closing it
+	if( pcSock->IsReadPaused() )
+		pcSock->UnPauseRead();
+	pcSock->m_bPoolIdle = true;
+	pcSock->m_iPoolIdleSince = millitime();
+	it->second.m_vIdle.push_back( pcSock );
 }
 
-void CSocketManager::Connect( const CSConnection & cCon, Csock * pcSock )
+void CSocketManager::GetPoolStats( CSPoolStats & cStats ) const
 {
-	// create the new object
-	if( !pcSock )
-		pcSock = GetSockObj( cCon.GetHostname(), cCon.GetPort(), cCon.GetTimeout() );
-	else
+	cStats = CSPoolStats();
+	CSPoolStats cPoolStats;
+	for( std::map<CS_STRING, CSPool>::const_iterator it = m_mscPools.begin(); it != m_mscPools.end(); ++it )
 	{
-		pcSock->SetHostName( cCon.GetHostname() );
-		pcSock->SetPort( cCon.GetPort() );
-		pcSock->SetTimeout( cCon.GetTimeout() );
+		GetPoolStats( it->second, cPoolStats );
+		cStats.Add( cPoolStats );
 	}
+}
 
-	if( cCon.GetAFRequire() != CSSockAddr::RAF_ANY )
-		pcSock->SetAFRequire( cCon.GetAFRequire() );
+bool CSocketManager::GetPoolStats( const CSConnection & cCon, CSPoolStats & cStats ) const
+{
+	std::map<CS_STRING, CSPool>::const_iterator it = m_mscPools.find( GetPoolKey( cCon ) );
+	if( it == m_mscPools.end() )
+	{
+		cStats = CSPoolStats();
+		return( false );
+	}
+	GetPoolStats( it->second, cStats );
+	return( true );
+}
 
-	// bind the vhost
-	pcSock->SetBindHost( cCon.GetBindHost() );
+void CSocketManager::GetPoolStats( const CSPool & cPool, CSPoolStats & cStats ) const
+{
+	cStats = cPool.m_cStats;
+	cStats.m_iIdle = cPool.m_vIdle.size();
+	cStats.m_iActive = cPool.m_uConns - cPool.m_vIdle.size();
+}
 
+bool CSocketManager::ProbePooled( Csock * pcSock )
+{
+	if( pcSock->IsClosed() || !pcSock->IsConnected() || pcSock->GetConState() != Csock::CST_OK )
+		return( false );
 #ifdef HAVE_LIBSSL
-	pcSock->SetSSL( cCon.GetIsSSL() );
-	if( cCon.GetIsSSL() )
+	if( pcSock->GetSSL() && pcSock->GetPending() > 0 )
+		return( false ); // decrypted and waiting, it's a reply to nothing
+#endif /* HAVE_LIBSSL */
+
+	char chPeek = 0;
+	cs_ssize_t iRet = recv( pcSock->GetRSock(), &chPeek, 1, MSG_PEEK );
+	if( iRet < 0 )
 	{
-		if( !cCon.GetPemLocation().empty() )
+#ifdef _WIN32
+		return( GetSockError() == WSAEWOULDBLOCK );
+#else
+		if( GetSockError() == EAGAIN || GetSockError() == EWOULDBLOCK )
 		{
-			pcSock->SetDHParamLocation( cCon.GetDHParamLocation() );
-			pcSock->SetKeyLocation( cCon.GetKeyLocation() );
-			pcSock->SetPemLocation( cCon.GetPemLocation() );
-			pcSock->SetPemPass( cCon.GetPemPass() );
+			pcSock->m_bReadReady = false;
+			return( true );
 		}
-		if( !cCon.GetCipher().empty() )
-			pcSock->SetCipher( cCon.GetCipher() );
+		return( false );
+#endif /* _WIN32 */
 	}
-#endif /* HAVE_LIBSSL */
+	if( iRet == 0 )
+		return( false );
 
-	pcSock->SetType( Csock::OUTBOUND );
+#ifdef HAVE_LIBSSL
+	if( pcSock->GetSSL() )
+	{
+		// TLS 1.3 servers send session tickets after the handshake, SSL_read() takes them and finds no data
+		CSCharBuffer cBuff( CS_BLOCKSIZE );
+		return( pcSock->Read( cBuff(), CS_BLOCKSIZE ) == Csock::READ_EAGAIN );
+	}
+#endif /* HAVE_LIBSSL */
+	return( false );
+}
 
-	pcSock->SetConState( Csock::CST_START );
-	AddSock( pcSock, cCon.GetSockName() );
+void CSocketManager::UnlinkPooled( Csock * pcSock )
+{
+	std::map<CS_STRING, CSPool>::iterator it = m_mscPools.find( pcSock->m_sPoolKey );
+	if( it == m_mscPools.end() )
+		return;
+	CSPool & cPool = it->second;
+	if( cPool.m_uConns > 0 )
+		cPool.m_uConns--;
+	if( pcSock->m_bPoolIdle )
+	{
+		std::vector<Csock *>::iterator itIdle = std::find( cPool.m_vIdle.begin(), cPool.m_vIdle.end(), pcSock );
+		if( itIdle != cPool.m_vIdle.end() )
+			cPool.m_vIdle.erase( itIdle );
+	}
 }
 
 bool CSocketManager::Listen( const CSListener & cListen, Csock * pcSock, uint16_t * piRandPort )
@@ -3427,16 +5685,21 @@ bool CSocketManager::Listen( const CSListener & cListen, Csock * pcSock, uint16_
 		pcSock->SetIPv6( true );
 	}
 #endif /* HAVE_IPV6 */
+	pcSock->SetAcceptBatch( cListen.GetAcceptBatch() );
+	pcSock->SetFastOpenQueue( cListen.GetFastOpenQueue() );
+	pcSock->SetExclusiveAccept( cListen.GetExclusiveAccept() );
+	if( !cListen.GetTuning().IsEmpty() )
+		pcSock->SetTuning( cListen.GetTuning() );
+	if( cListen.GetDatagram() )
+		pcSock->SetDatagram( true );
 #ifdef HAVE_LIBSSL
 	pcSock->SetSSL( cListen.GetIsSSL() );
 	if( cListen.GetIsSSL() && !cListen.GetPemLocation().empty() )
 	{
-		pcSock->SetDHParamLocation( cListen.GetDHParamLocation() );
-		pcSock->SetKeyLocation( cListen.GetKeyLocation() );
-		pcSock->SetPemLocation( cListen.GetPemLocation() );
-		pcSock->SetPemPass( cListen.GetPemPass() );
-		pcSock->SetCipher( cListen.GetCipher() );
-		pcSock->SetRequireClientCertFlags( cListen.GetRequireClientCertFlags() );
+		// accepted sockets share this profile, @see CSSSLProfile
+		CSSSLProfile * pProfile = new CSSSLProfile( cListen );
+		pcSock->SetSSLProfile( pProfile );
+		pProfile->UnRef();
 	}
 #endif /* HAVE_LIBSSL */
 
@@ -3477,6 +5740,7 @@ bool CSocketManager::HasFDs() const
 
 void CSocketManager::Loop()
 {
+	CS_STATS_MARK( iLoopStart );
 	for( size_t a = 0; a < this->size(); ++a )
 	{
 		Csock * pcSock = this->at( a );
@@ -3544,9 +5808,13 @@ void CSocketManager::Loop()
 #endif /* HAVE_LIBSSL */
 	}
 
+	CS_STATS_MARK( iSelectStart );
+	CS_STATS_PHASE( LPH_CONNSTATE, iLoopStart, iSelectStart );
+
 	std::map<Csock *, EMessages> mpeSocks;
 	Select( mpeSocks );
 
+	CS_STATS_MARK( iReadStart );
 	switch( m_errno )
 	{
 	case SUCCESS:
@@ -3558,25 +5826,79 @@ void CSocketManager::Loop()
 
 			if( iErrno == SUCCESS )
 			{
+				if( pcSock->IsPoolIdle() )
+				{
+					// nobody asked it anything, so the server is closing it or out of step
+					if( !ProbePooled( pcSock ) )
+					{
+						m_mscPools[pcSock->GetPoolKey()].m_cStats.m_iProbeFailures++;
+						DelSockByAddr( pcSock );
+					}
+					continue;
+				}
+
+				// a proxy that is paused only got here because it can write, reading would outrun its peer
+				if( pcSock->GetProxyPeer() && pcSock->IsReadPaused() )
+					continue;
+
 				// read in data
 				// if this is a
 				int iLen = 0;
+				bool bSpliced = pcSock->IsSpliced();
 
 				if( pcSock->GetSSL() )
 					iLen = pcSock->GetPending();
 
 				if( iLen <= 0 )
-					iLen = CS_BLOCKSIZE;
+					iLen = ( bSpliced ? CS_SPLICE_PIPE_SIZE : CS_BLOCKSIZE ); // a splice takes as much as the pipe has room for
+
+				CSTokenBucket & cReadBucket = pcSock->GetReadBucket();
+				uint64_t iNOW = 0;
+				if( pcSock->IsConnected() && cReadBucket.IsShaping() )
+				{
+					iNOW = millitime();
+					uint64_t uAvail = cReadBucket.Available( iNOW );
+					if( uAvail == 0 )
+						continue; // throttled, Select() wakes up again once the tokens refill
+					if( uAvail < ( uint64_t )iLen )
+						iLen = ( int )uAvail;
+				}
+
+				if( pcSock->IsDatagram() )
+				{
+					if( !pcSock->IsConnected() )
+					{
+						pcSock->SetIsConnected( true );
+						pcSock->Connected();
+					}
+					// datagrams can't be cut short, shaping only delays the next batch
+					cs_ssize_t bytes = pcSock->ReadDatagrams();
+					if( bytes == Csock::READ_ERR )
+					{
+						pcSock->CallSockError( GetSockError() );
+						DelSockByAddr( pcSock );
+					}
+					else if( bytes > 0 )
+					{
+						if( iNOW )
+							cReadBucket.Consume( ( uint64_t )bytes, iNOW );
+						if( Csock::TMO_READ & pcSock->GetTimeoutType() )
+							pcSock->ResetTimer();
+					}
+					continue;
+				}
 
-				CSCharBuffer cBuff( iLen );
+				CSCharBuffer cBuff( bSpliced ? 1 : iLen );
 
-				cs_ssize_t bytes = pcSock->Read( cBuff(), iLen );
+				cs_ssize_t bytes = ( bSpliced ? pcSock->SpliceRead( ( size_t )iLen ) : pcSock->Read( cBuff(), iLen ) );
 
 				if( bytes != Csock::READ_TIMEDOUT && bytes != Csock::READ_CONNREFUSED && bytes != Csock::READ_ERR && !pcSock->IsConnected() )
 				{
 					pcSock->SetIsConnected( true );
 					pcSock->Connected();
 				}
+				if( pcSock->m_bFastOpenPending && bytes != Csock::READ_ERR && bytes != Csock::READ_CONNREFUSED )
+					pcSock->CheckFastOpen(); // the handshake is done, so the SYN-ACK said whether the data was taken
 
 				switch( bytes )
 				{
@@ -3625,9 +5947,18 @@ void CSocketManager::Loop()
 
 					default:
 					{
+						if( iNOW )
+							cReadBucket.Consume( ( uint64_t )bytes, iNOW );
 						if( Csock::TMO_READ & pcSock->GetTimeoutType() )
 							pcSock->ResetTimer();	// reset the timeout timer
 
+						if( bSpliced )
+							break; // already on its way out the other side
+						if( pcSock->GetProxyPeer() )
+						{
+							pcSock->GetProxyPeer()->Write( cBuff(), ( size_t )bytes );
+							break;
+						}
 						pcSock->ReadData( cBuff(), bytes );	// Call ReadData() before PushBuff() so that it is called before the ReadLine() event - LD  07/18/05
 						pcSock->PushBuff( cBuff(), bytes );
 						break;
@@ -3651,6 +5982,9 @@ void CSocketManager::Loop()
 		break;
 	}
 
+	CS_STATS_MARK( iTimeoutsStart );
+	CS_STATS_PHASE( LPH_READ, iReadStart, iTimeoutsStart );
+
 	uint64_t iMilliNow = millitime();
 	if( ( iMilliNow - m_iCallTimeouts ) >= 1000 )
 	{
@@ -3658,15 +5992,46 @@ void CSocketManager::Loop()
 		// call timeout on all the sockets that recieved no data
 		for( size_t i = 0; i < this->size(); ++i )
 		{
-			if( this->at( i )->GetConState() != Csock::CST_OK )
+			Csock * pcSock = this->at( i );
+			if( pcSock->GetConState() != Csock::CST_OK )
 				continue;
 
-			if( this->at( i )->CheckTimeout( ( time_t )( iMilliNow / 1000 ) ) )
+			if( pcSock->IsPoolIdle() )
+			{
+				// the pool's idle timeout replaces the socket's own while it waits
+				if( m_uPoolIdleTimeout && iMilliNow - pcSock->m_iPoolIdleSince >= ( uint64_t )m_uPoolIdleTimeout * 1000 )
+				{
+					m_mscPools[pcSock->GetPoolKey()].m_cStats.m_iIdleTimeouts++;
+					DelSock( i-- );
+				}
+				continue;
+			}
+
+			if( pcSock->CheckTimeout( ( time_t )( iMilliNow / 1000 ) ) )
 				DelSock( i-- );
 		}
+		RefreshStats( iMilliNow );
 	}
+	CS_STATS_MARK( iCronStart );
+	CS_STATS_PHASE( LPH_TIMEOUTS, iTimeoutsStart, iCronStart );
+
 	// run any Manager Crons we may have
 	Cron();
+
+	CS_STATS_MARK( iFlushStart );
+	CS_STATS_PHASE( LPH_CRON, iCronStart, iFlushStart );
+
+	// push out everything that was coalesced during this iteration
+	for( size_t i = 0; i < this->size(); ++i )
+	{
+		Csock * pcSock = this->at( i );
+		if( pcSock->HasPendingWrite() && !pcSock->Flush() )
+			DelSock( i-- ); // write failed, sock died :(
+	}
+
+	CS_STATS_MARK( iLoopEnd );
+	CS_STATS_PHASE( LPH_FLUSH, iFlushStart, iLoopEnd );
+	CS_STATS_PHASE( LPH_TOTAL, iLoopStart, iLoopEnd );
 }
 
 void CSocketManager::DynamicSelectLoop( uint64_t iLowerBounds, uint64_t iUpperBounds, time_t iMaxResolution )
@@ -3693,9 +6058,58 @@ void CSocketManager::DynamicSelectLoop( uint64_t iLowerBounds, uint64_t iUpperBo
 void CSocketManager::AddSock( Csock * pcSock, const CS_STRING & sSockName )
 {
 	pcSock->SetSockName( sSockName );
+	LinkShaping( pcSock );
 	this->push_back( pcSock );
 }
 
+void CSocketManager::LinkShaping( Csock * pcSock )
+{
+	CSTokenBucket * pReadBucket = &m_cGlobalReadBucket;
+	CSTokenBucket * pWriteBucket = &m_cGlobalWriteBucket;
+	const CS_STRING & sParent = pcSock->GetParentSockName();
+	if( !sParent.empty() )
+	{
+		std::map<CS_STRING, CSTokenBucket>::iterator it = m_mscListenerReadBuckets.find( sParent );
+		if( it != m_mscListenerReadBuckets.end() )
+			pReadBucket = &it->second;
+		it = m_mscListenerWriteBuckets.find( sParent );
+		if( it != m_mscListenerWriteBuckets.end() )
+			pWriteBucket = &it->second;
+	}
+	pcSock->GetReadBucket().SetParent( pReadBucket );
+	pcSock->GetWriteBucket().SetParent( pWriteBucket );
+}
+
+CSTokenBucket & CSocketManager::GetListenerBucket( std::map<CS_STRING, CSTokenBucket> & mscBuckets, CSTokenBucket & cGlobal, const CS_STRING & sListener )
+{
+	std::map<CS_STRING, CSTokenBucket>::iterator it = mscBuckets.find( sListener );
+	if( it == mscBuckets.end() )
+	{
+		it = mscBuckets.insert( std::make_pair( sListener, CSTokenBucket() ) ).first;
+		it->second.SetParent( &cGlobal );
+		// sockets accepted before the limit existed need to be chained under it
+		for( size_t i = 0; i < this->size(); ++i )
+		{
+			if( this->at( i )->GetParentSockName() == sListener )
+				LinkShaping( this->at( i ) );
+		}
+	}
+	return( it->second );
+}
+
+void CSocketManager::SetListenerWriteRate( const CS_STRING & sListener, uint64_t uBytesPerSec, uint64_t uBurst )
+{
+	GetListenerBucket( m_mscListenerWriteBuckets, m_cGlobalWriteBucket, sListener ).SetRate( uBytesPerSec, uBurst );
+}
+
+void CSocketManager::SetListenerReadRate( const CS_STRING & sListener, uint64_t uBytesPerSec, uint64_t uBurst )
+{
+	GetListenerBucket( m_mscListenerReadBuckets, m_cGlobalReadBucket, sListener ).SetRate( uBytesPerSec, uBurst );
+}
+
+void CSocketManager::SetGlobalWriteRate( uint64_t uBytesPerSec, uint64_t uBurst ) { m_cGlobalWriteBucket.SetRate( uBytesPerSec, uBurst ); }
+void CSocketManager::SetGlobalReadRate( uint64_t uBytesPerSec, uint64_t uBurst ) { m_cGlobalReadBucket.SetRate( uBytesPerSec, uBurst ); }
+
 Csock * CSocketManager::FindSockByRemotePort( uint16_t iPort )
 {
 	for( size_t i = 0; i < this->size(); ++i )
@@ -3792,7 +6206,21 @@ void CSocketManager::DelSock( size_t iPos )
 
 		m_iBytesRead += pSock->GetBytesRead();
 		m_iBytesWritten += pSock->GetBytesWritten();
+
+		if( pSock->GetType() != Csock::LISTENER || pSock->IsDatagram() )
+		{
+			CSSockStats cStats;
+			pSock->GetStats( cStats );
+			cStats.Retire();
+			m_mscRetiredStats[pSock->GetParentSockName()].Add( cStats );
+			m_cRetiredStats.Add( cStats );
+		}
+		if( !pSock->GetPoolKey().empty() )
+			UnlinkPooled( pSock );
 	}
+#ifdef CSOCK_USE_EPOLL
+	EdgeForget( pSock );
+#endif /* CSOCK_USE_EPOLL */
 
 	CS_Delete( pSock );
 	this->erase( this->begin() + iPos );
@@ -3809,6 +6237,21 @@ bool CSocketManager::SwapSockByIdx( Csock * pNewSock, size_t iOrginalSockIdx )
 	Csock * pSock = this->at( iOrginalSockIdx );
 	pNewSock->Copy( *pSock );
 	pSock->Dereference();
+#ifdef CSOCK_USE_EPOLL
+	// the registration goes with the fds
+	if( pNewSock->m_bEdgeArmed )
+	{
+		m_mpEdgeSocks[pNewSock->m_iEdgeRSock] = pNewSock;
+		m_mpEdgeSocks[pNewSock->m_iEdgeWSock] = pNewSock;
+	}
+	pSock->m_iEdgeRSock = pSock->m_iEdgeWSock = CS_INVALID_SOCK;
+	pSock->m_bEdgeArmed = false;
+#endif /* CSOCK_USE_EPOLL */
+	if( pNewSock->IsPoolIdle() )
+	{
+		std::vector<Csock *> & vIdle = m_mscPools[pNewSock->GetPoolKey()].m_vIdle;
+		std::replace( vIdle.begin(), vIdle.end(), pSock, pNewSock );
+	}
 	this->at( iOrginalSockIdx ) = ( Csock * )pNewSock;
 	this->push_back( ( Csock * )pSock ); // this allows it to get cleaned up
 	return( true );
@@ -3824,6 +6267,54 @@ bool CSocketManager::SwapSockByAddr( Csock * pNewSock, Csock * pOrigSock )
 	return( false );
 }
 
+void CSocketManager::GetListenerStats( const CS_STRING & sListener, CSSockStats & cStats ) const
+{
+	cStats.Reset();
+	std::map<CS_STRING, CSSockStats>::const_iterator it = m_mscRetiredStats.find( sListener );
+	if( it != m_mscRetiredStats.end() )
+		cStats.Add( it->second );
+
+	CSSockStats cSockStats;
+	for( size_t a = 0; a < this->size(); ++a )
+	{
+		const Csock * pcSock = this->at( a );
+		if( pcSock->GetType() == Csock::LISTENER || pcSock->GetParentSockName() != sListener )
+			continue;
+		pcSock->GetStats( cSockStats );
+		cStats.Add( cSockStats );
+	}
+}
+
+void CSocketManager::RefreshStats( uint64_t iNOW )
+{
+	CSManagerStats & cStats = m_cManagerStats;
+	for( size_t a = 0; a <= Csock::INBOUND; ++a )
+		cStats.m_aiSocketsByType[a] = 0;
+	for( size_t a = 0; a <= Csock::CST_OK; ++a )
+		cStats.m_aiSocketsByState[a] = 0;
+	cStats.m_cTotals = m_cRetiredStats;
+	cStats.m_iUpdated = iNOW;
+
+	CSSockStats cSockStats;
+	for( size_t a = 0; a < this->size(); ++a )
+	{
+		Csock * pcSock = this->at( a );
+		if( pcSock->GetCloseType() == Csock::CLT_DEREFERENCE )
+			continue;
+		pcSock->RollStats( iNOW );
+		int iType = pcSock->GetType();
+		if( iType >= 0 && iType <= Csock::INBOUND )
+			cStats.m_aiSocketsByType[iType]++;
+		int iState = pcSock->GetConState();
+		if( iState >= 0 && iState <= Csock::CST_OK )
+			cStats.m_aiSocketsByState[iState]++;
+		if( iType == Csock::LISTENER && !pcSock->IsDatagram() )
+			continue;
+		pcSock->GetStats( cSockStats );
+		cStats.m_cTotals.Add( cSockStats );
+	}
+}
+
 uint64_t CSocketManager::GetBytesRead() const
 {
 	// Start with the total bytes read from destroyed sockets
@@ -3865,10 +6356,227 @@ bool CSocketManager::FDHasCheck( cs_sock_t iFd, std::map< cs_sock_t, short > & m
 	return( false );
 }
 
+#ifdef CSOCK_USE_EPOLL
+void CSocketManager::EdgeWatch( Csock * pcSock )
+{
+	// Select() works out what it wants again every time
+	pcSock->m_iEdgeWant = 0;
+	cs_sock_t iRSock = pcSock->GetRSock();
+	cs_sock_t iWSock = pcSock->GetWSock();
+	if( iRSock == CS_INVALID_SOCK || iWSock == CS_INVALID_SOCK )
+		return;
+	// once per set of fds, if epoll wouldn't take them they're left to poll()
+	if( iRSock == pcSock->m_iEdgeRSock && iWSock == pcSock->m_iEdgeWSock )
+		return;
+
+	if( m_iEpollFD < 0 )
+	{
+		m_iEpollFD = epoll_create1( EPOLL_CLOEXEC );
+		if( m_iEpollFD < 0 )
+		{
+			CS_DEBUG( "epoll_create1() failed, falling back to poll()" );
+			return;
+		}
+	}
+	EdgeForget( pcSock );
+	pcSock->m_iEdgeRSock = iRSock;
+	pcSock->m_iEdgeWSock = iWSock;
+	pcSock->m_bReadReady = false;
+	pcSock->m_bWriteReady = false;
+
+	// what's ready already is reported by the first epoll_wait()
+	struct epoll_event cEvent;
+	memset( &cEvent, 0, sizeof( cEvent ) );
+	cEvent.events = EPOLLIN|EPOLLET;
+	cEvent.data.fd = iRSock;
+	if( pcSock->GetType() == Csock::LISTENER && !pcSock->IsDatagram() )
+	{
+#ifdef EPOLLEXCLUSIVE
+		if( pcSock->GetExclusiveAccept() )
+			cEvent.events |= EPOLLEXCLUSIVE;
+#endif /* EPOLLEXCLUSIVE */
+	}
+	else if( iRSock == iWSock )
+	{
+		cEvent.events |= EPOLLOUT;
+	}
+	// EEXIST is a dereferenced socket's fd that was handed on before the socket was deleted
+	if( epoll_ctl( m_iEpollFD, EPOLL_CTL_ADD, iRSock, &cEvent ) != 0 && ( errno != EEXIST || epoll_ctl( m_iEpollFD, EPOLL_CTL_MOD, iRSock, &cEvent ) != 0 ) )
+	{
+		CS_DEBUG( "epoll_ctl( " << iRSock << " ) failed, errno: " << GetSockError() );
+		return;
+	}
+	if( iRSock != iWSock )
+	{
+		cEvent.events = EPOLLOUT|EPOLLET;
+		cEvent.data.fd = iWSock;
+		if( epoll_ctl( m_iEpollFD, EPOLL_CTL_ADD, iWSock, &cEvent ) != 0 && ( errno != EEXIST || epoll_ctl( m_iEpollFD, EPOLL_CTL_MOD, iWSock, &cEvent ) != 0 ) )
+		{
+			CS_DEBUG( "epoll_ctl( " << iWSock << " ) failed, errno: " << GetSockError() );
+			epoll_ctl( m_iEpollFD, EPOLL_CTL_DEL, iRSock, &cEvent );
+			return;
+		}
+	}
+	pcSock->m_bEdgeArmed = true;
+	m_mpEdgeSocks[iRSock] = pcSock;
+	m_mpEdgeSocks[iWSock] = pcSock;
+}
+
+void CSocketManager::EdgeForget( Csock * pcSock )
+{
+	cs_sock_t aiFDs[2] = { pcSock->m_iEdgeRSock, pcSock->m_iEdgeWSock };
+	for( size_t a = 0; a < 2; ++a )
+	{
+		std::map<cs_sock_t, Csock *>::iterator it = m_mpEdgeSocks.find( aiFDs[a] );
+		if( it == m_mpEdgeSocks.end() || it->second != pcSock )
+			continue;
+		m_mpEdgeSocks.erase( it );
+		// closing the fd does this, a dereferenced socket's fds live on somewhere else
+		if( pcSock->m_bEdgeArmed && pcSock->GetRSock() == CS_INVALID_SOCK )
+		{
+			struct epoll_event cEvent;
+			epoll_ctl( m_iEpollFD, EPOLL_CTL_DEL, aiFDs[a], &cEvent );
+		}
+	}
+	if( pcSock->m_bEdgeQueued )
+	{
+		m_vEdgeReady.erase( std::find( m_vEdgeReady.begin(), m_vEdgeReady.end(), pcSock ) );
+		pcSock->m_bEdgeQueued = false;
+	}
+	pcSock->m_bEdgeArmed = false;
+}
+
+Csock * CSocketManager::EdgeSock( cs_sock_t iFd ) const
+{
+	std::map<cs_sock_t, Csock *>::const_iterator it = m_mpEdgeSocks.find( iFd );
+	if( it == m_mpEdgeSocks.end() || !it->second->m_bEdgeArmed )
+		return( NULL );
+	return( it->second );
+}
+
+void CSocketManager::EdgeQueue( Csock * pcSock )
+{
+	if( pcSock->m_bEdgeQueued )
+		return;
+	if( ( ( pcSock->m_iEdgeWant & ECT_Read ) && pcSock->m_bReadReady ) || ( ( pcSock->m_iEdgeWant & ECT_Write ) && pcSock->m_bWriteReady ) )
+	{
+		pcSock->m_bEdgeQueued = true;
+		m_vEdgeReady.push_back( pcSock );
+	}
+}
+
+void CSocketManager::EdgeDrop()
+{
+	for( size_t a = 0; a < m_vEdgeReady.size(); ++a )
+		m_vEdgeReady[a]->m_bEdgeQueued = false;
+	m_vEdgeReady.clear();
+}
+#endif /* CSOCK_USE_EPOLL */
+
+void CSocketManager::WatchFD( Csock * pcSock, cs_sock_t iFd, std::map< cs_sock_t, short > & miiReadyFds, ECheckType eType )
+{
+#ifdef CSOCK_USE_EPOLL
+	if( pcSock->m_bEdgeArmed )
+	{
+		pcSock->m_iEdgeWant = ( short )( pcSock->m_iEdgeWant | eType );
+		EdgeQueue( pcSock );
+		return;
+	}
+#endif /* CSOCK_USE_EPOLL */
+	FDSetCheck( iFd, miiReadyFds, eType );
+}
+
 int CSocketManager::Select( std::map< cs_sock_t, short > & miiReadyFds, struct timeval *tvtimeout )
 {
 	AssignFDs( miiReadyFds, tvtimeout );
-#ifdef CSOCK_USE_POLL
+#ifdef CSOCK_USE_EPOLL
+	// the sockets in the epoll set aren't in miiReadyFds, the ones that want what they're ready for wait in m_vEdgeReady
+	int iTimeout = ( int )( tvtimeout->tv_usec / 1000 );
+	iTimeout += ( int )( tvtimeout->tv_sec * 1000 );
+	if( !m_vEdgeReady.empty() )
+		iTimeout = 0;
+	if( m_iEpollFD < 0 && miiReadyFds.empty() )
+		return( select( 0, NULL, NULL, NULL, tvtimeout ) );
+
+	int iRet = 0;
+	if( !miiReadyFds.empty() )
+	{
+		// what isn't in the epoll set waits with it in poll(), the edges are picked up after without waiting again
+		struct pollfd * pFDs = ( struct pollfd * )malloc( sizeof( struct pollfd ) * ( miiReadyFds.size() + 1 ) );
+		size_t uCurrPoll = 0;
+		for( std::map< cs_sock_t, short >::iterator it = miiReadyFds.begin(); it != miiReadyFds.end(); ++it, ++uCurrPoll )
+		{
+			pFDs[uCurrPoll].fd = it->first;
+			pFDs[uCurrPoll].events = ( short )( ( it->second & ECT_Read ? POLLIN : 0 ) | ( it->second & ECT_Write ? POLLOUT : 0 ) );
+			pFDs[uCurrPoll].revents = 0;
+		}
+		if( m_iEpollFD >= 0 )
+		{
+			pFDs[uCurrPoll].fd = m_iEpollFD;
+			pFDs[uCurrPoll].events = POLLIN;
+			pFDs[uCurrPoll++].revents = 0;
+		}
+		if( poll( pFDs, uCurrPoll, iTimeout ) < 0 )
+		{
+			free( pFDs );
+			miiReadyFds.clear();
+			EdgeDrop();
+			return( -1 );
+		}
+		uCurrPoll = 0;
+		for( std::map< cs_sock_t, short >::iterator it = miiReadyFds.begin(); it != miiReadyFds.end(); ++it, ++uCurrPoll )
+		{
+			short iEvents = 0;
+			if( pFDs[uCurrPoll].revents & ( POLLIN|POLLERR|POLLHUP|POLLNVAL ) )
+				iEvents |= ECT_Read;
+			if( pFDs[uCurrPoll].revents & POLLOUT )
+				iEvents |= ECT_Write;
+			it->second = iEvents;
+			if( iEvents )
+				iRet++;
+		}
+		free( pFDs );
+		iTimeout = 0;
+	}
+
+	if( m_iEpollFD >= 0 )
+	{
+		// room for an edge from every fd, every Loop() costs a pass over all the sockets so it had better take them all
+		if( m_vEpollEvents.size() < m_mpEdgeSocks.size() )
+			m_vEpollEvents.resize( m_mpEdgeSocks.size() );
+		struct epoll_event * acEvents = &m_vEpollEvents[0];
+		int iEvents = epoll_wait( m_iEpollFD, acEvents, ( int )m_vEpollEvents.size(), iTimeout );
+		if( iEvents < 0 )
+		{
+			miiReadyFds.clear();
+			EdgeDrop();
+			return( -1 );
+		}
+		for( int a = 0; a < iEvents; ++a )
+		{
+			Csock * pcSock = EdgeSock( acEvents[a].data.fd );
+			if( !pcSock )
+				continue;
+			if( ( acEvents[a].events & ( EPOLLIN|EPOLLERR|EPOLLHUP ) ) && acEvents[a].data.fd == pcSock->m_iEdgeRSock )
+				pcSock->m_bReadReady = true;
+			if( ( acEvents[a].events & ( EPOLLOUT|EPOLLERR|EPOLLHUP ) ) && acEvents[a].data.fd == pcSock->m_iEdgeWSock )
+				pcSock->m_bWriteReady = true;
+			EdgeQueue( pcSock );
+		}
+	}
+
+	for( size_t a = 0; a < m_vEdgeReady.size(); ++a )
+	{
+		Csock * pcSock = m_vEdgeReady[a];
+		pcSock->m_bEdgeQueued = false;
+		if( ( pcSock->m_iEdgeWant & ECT_Read ) && pcSock->m_bReadReady )
+			FDSetCheck( pcSock->m_iEdgeRSock, miiReadyFds, ECT_Read );
+		if( ( pcSock->m_iEdgeWant & ECT_Write ) && pcSock->m_bWriteReady )
+			FDSetCheck( pcSock->m_iEdgeWSock, miiReadyFds, ECT_Write );
+		iRet++;
+	}
+	m_vEdgeReady.clear();
+#elif defined( CSOCK_USE_POLL )
 	if( miiReadyFds.empty() )
 		return( select( 0, NULL, NULL, NULL, tvtimeout ) );
 
@@ -3949,6 +6657,7 @@ int CSocketManager::Select( std::map< cs_sock_t, short > & miiReadyFds, struct t
 
 void CSocketManager::Select( std::map<Csock *, EMessages> & mpeSocks )
 {
+	CS_STATS_MARK( iGatherStart );
 	mpeSocks.clear();
 	struct timeval tv;
 
@@ -4017,6 +6726,9 @@ void CSocketManager::Select( std::map<Csock *, EMessages> & mpeSocks )
 
 		if( pcSock->GetConState() != Csock::CST_OK )
 			continue;
+#ifdef CSOCK_USE_EPOLL
+		EdgeWatch( pcSock );
+#endif /* CSOCK_USE_EPOLL */
 
 		bHasAvailSocks = true;
 
@@ -4032,32 +6744,41 @@ void CSocketManager::Select( std::map<Csock *, EMessages> & mpeSocks )
 			continue;	// invalid sock fd
 		}
 
-		if( pcSock->GetType() != Csock::LISTENER )
+		if( pcSock->GetType() != Csock::LISTENER || pcSock->IsDatagram() )
 		{
 			bool bHasWriteBuffer = pcSock->HasWriteBuffer();
 
-			if( !bIsReadPaused )
-				FDSetCheck( iRSock, miiReadyFds, ECT_Read );
+			if( !bIsReadPaused && ( !pcSock->IsConnected() || pcSock->AllowRead( iNOW ) ) )
+				WatchFD( pcSock, iRSock, miiReadyFds, ECT_Read );
+
+			// wake up exactly when a throttled socket gets its tokens back
+			uint64_t iShapingDelay = pcSock->GetShapingDelay( iNOW );
+			if( iShapingDelay > 0 )
+				CSAdjustTVTimeout( tv, ( long )iShapingDelay );
 
 			if( pcSock->AllowWrite( iNOW ) && ( !pcSock->IsConnected() || bHasWriteBuffer ) )
 			{
 				if( !pcSock->IsConnected() )
 				{
 					// set the write bit if not connected yet
-					FDSetCheck( iWSock, miiReadyFds, ECT_Write );
+					WatchFD( pcSock, iWSock, miiReadyFds, ECT_Write );
 				}
 				else if( bHasWriteBuffer && !pcSock->GetSSL() )
 				{
 					// always set the write bit if there is data to send when NOT ssl
-					FDSetCheck( iWSock, miiReadyFds, ECT_Write );
+					WatchFD( pcSock, iWSock, miiReadyFds, ECT_Write );
 				}
 				else if( bHasWriteBuffer && pcSock->GetSSL() && pcSock->SslIsEstablished() )
 				{
 					// ONLY set the write bit if there is data to send and the SSL handshake is finished
-					FDSetCheck( iWSock, miiReadyFds, ECT_Write );
+					WatchFD( pcSock, iWSock, miiReadyFds, ECT_Write );
 				}
 			}
 
+			// the first write took the Fast Open SYN out, the socket turns writable once the handshake is done
+			if( pcSock->m_bFastOpenPending && pcSock->IsConnected() && !bHasWriteBuffer && pcSock->GetBytesWritten() > 0 )
+				WatchFD( pcSock, iWSock, miiReadyFds, ECT_Write );
+
 			if( pcSock->GetSSL() && !pcSock->SslIsEstablished() && bHasWriteBuffer )
 			{
 				// if this is an unestabled SSL session with data to send ... try sending it
@@ -4077,12 +6798,12 @@ void CSocketManager::Select( std::map<Csock *, EMessages> & mpeSocks )
 		}
 		else
 		{
-			FDSetCheck( iRSock, miiReadyFds, ECT_Read );
+			WatchFD( pcSock, iRSock, miiReadyFds, ECT_Read );
 		}
 
 		if( pcSock->GetSSL() && pcSock->GetType() != Csock::LISTENER )
 		{
-			if( pcSock->GetPending() > 0 && !pcSock->IsReadPaused() )
+			if( pcSock->GetPending() > 0 && !pcSock->IsReadPaused() && pcSock->AllowRead( iNOW ) )
 				SelectSock( mpeSocks, SUCCESS, pcSock );
 		}
 	}
@@ -4101,8 +6822,17 @@ void CSocketManager::Select( std::map<Csock *, EMessages> & mpeSocks )
 		tv.tv_sec = 0;
 	}
 
+	CS_STATS_MARK( iWaitStart );
+	CS_STATS_PHASE( LPH_GATHER, iGatherStart, iWaitStart );
+
 	iSel = Select( miiReadyFds, &tv );
 
+	CS_STATS_MARK( iDispatchStart );
+	CS_STATS_PHASE( LPH_SELECTWAIT, iWaitStart, iDispatchStart );
+#ifdef CSOCK_LOOP_STATS
+	m_cLoopStats.RecordEvents( iSel > 0 ? ( uint64_t )iSel : 0 );
+#endif /* CSOCK_LOOP_STATS */
+
 	if( iSel == 0 )
 	{
 		if( mpeSocks.empty() )
@@ -4211,18 +6941,40 @@ void CSocketManager::Select( std::map<Csock *, EMessages> & mpeSocks )
 			else
 				iErrno = SELECT_ERROR;
 
-			if( pcSock->GetType() != Csock::LISTENER )
+			if( pcSock->GetType() != Csock::LISTENER || pcSock->IsDatagram() )
 			{
 				SelectSock( mpeSocks, iErrno, pcSock );
 			}
 			else // someone is coming in!
 			{
-				CS_STRING sHost;
-				uint16_t port;
-				cs_sock_t inSock = pcSock->Accept( sHost, port );
-
-				if( inSock != CS_INVALID_SOCK )
+				// drain up to GetAcceptBatch() pending connections per wakeup
+				for( u_int uAccepts = 0; uAccepts < pcSock->GetAcceptBatch(); ++uAccepts )
 				{
+					CS_STRING sHost;
+					uint16_t port;
+					cs_sock_t inSock = pcSock->Accept( sHost, port );
+
+					if( inSock == CS_INVALID_SOCK )
+					{
+						int iAcceptErr = GetSockError();
+						// ConnectionFrom() turned this one away, the ones queued behind it still get their turn
+						if( iAcceptErr == 0 )
+						{
+							if( pcSock->IsClosed() )
+								break;
+							continue;
+						}
+#ifdef _WIN32
+						if( iAcceptErr != WSAEWOULDBLOCK )
+#else /* _WIN32 */
+						if( iAcceptErr != EAGAIN )
+#endif /* _WIN32 */
+						{
+							pcSock->CallSockError( iAcceptErr );
+						}
+						break;
+					}
+
 					if( Csock::TMO_ACCEPT & pcSock->GetTimeoutType() )
 						pcSock->ResetTimer();	// let them now it got dinged
 
@@ -4236,6 +6988,14 @@ void CSocketManager::Select( std::map<Csock *, EMessages> & mpeSocks )
 					NewpcSock->SetRSock( inSock );
 					NewpcSock->SetWSock( inSock );
 					NewpcSock->SetIPv6( pcSock->GetIPv6() );
+					// the listener's options carry over with accept(), only set what doesn't
+					if( !pcSock->GetTuning().IsEmpty() )
+					{
+						NewpcSock->m_cTuning = pcSock->GetTuning();
+						NewpcSock->m_cTuning.Apply( inSock, !NewpcSock->m_bDatagram, NewpcSock->GetIPv6(), true );
+					}
+					// accept() already told us who this is, spare GetRemoteIP() the getpeername()
+					NewpcSock->SetRemoteAddress( sHost, port );
 
 					bool bAddSock = true;
 #ifdef HAVE_LIBSSL
@@ -4243,18 +7003,23 @@ void CSocketManager::Select( std::map<Csock *, EMessages> & mpeSocks )
 					// is this ssl ?
 					if( pcSock->GetSSL() )
 					{
-						NewpcSock->SetCipher( pcSock->GetCipher() );
-						NewpcSock->SetDHParamLocation( pcSock->GetDHParamLocation() );
-						NewpcSock->SetKeyLocation( pcSock->GetKeyLocation() );
-						NewpcSock->SetPemLocation( pcSock->GetPemLocation() );
-						NewpcSock->SetPemPass( pcSock->GetPemPass() );
-						NewpcSock->SetRequireClientCertFlags( pcSock->GetRequireClientCertFlags() );
+						NewpcSock->SetSSLProfile( pcSock->GetSSLProfile() );
 						bAddSock = NewpcSock->AcceptSSL();
 					}
 
 #endif /* HAVE_LIBSSL */
 					if( bAddSock )
 					{
+						m_cManagerStats.m_iAccepts++;
+						if( pcSock->GetFastOpenQueue() > 0 )
+						{
+							// TCP_INFO knows if the SYN's data was taken, the saved SYN if there was any. a SYN that
+							// can't be looked at only counts as a try when its data was taken
+							uint64_t iFastOpens = NewpcSock->m_cStats.m_iFastOpens;
+							NewpcSock->CheckFastOpen();
+							if( CSSYNHadData( inSock ) || NewpcSock->m_cStats.m_iFastOpens > iFastOpens )
+								NewpcSock->m_cStats.m_iFastOpenTries++;
+						}
 						// set the name of the listener
 						NewpcSock->SetParentSockName( pcSock->GetSockName() );
 						NewpcSock->SetRate( pcSock->GetRateBytes(), pcSock->GetRateTime() );
@@ -4263,9 +7028,12 @@ void CSocketManager::Select( std::map<Csock *, EMessages> & mpeSocks )
 #endif
 						if( NewpcSock->GetSockName().empty() )
 						{
-							std::stringstream s;
-							s << sHost << ":" << port;
-							AddSock( NewpcSock,  s.str() );
+							char szPort[8];
+							snprintf( szPort, sizeof( szPort ), "%u", ( unsigned int )port );
+							// built in place, so short names stay inside the strings own small buffer
+							CS_STRING sSockName( sHost );
+							sSockName.append( 1, ':' ).append( szPort );
+							AddSock( NewpcSock, sSockName );
 						}
 						else
 						{
@@ -4276,18 +7044,16 @@ void CSocketManager::Select( std::map<Csock *, EMessages> & mpeSocks )
 					{
 						CS_Delete( NewpcSock );
 					}
-				}
-#ifdef _WIN32
-				else if( GetSockError() != WSAEWOULDBLOCK )
-#else /* _WIN32 */
-				else if( GetSockError() != EAGAIN )
-#endif /* _WIN32 */
-				{
-					pcSock->CallSockError( GetSockError() );
+
+					if( pcSock->IsClosed() )
+						break; // GetSockObj() and friends may close the listener
 				}
 			}
 		}
 	}
+
+	CS_STATS_MARK( iDispatchEnd );
+	CS_STATS_PHASE( LPH_DISPATCH, iDispatchStart, iDispatchEnd );
 }
 
 inline void MinimizeTime( timeval& min, const timeval& another )
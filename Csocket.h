@@ -110,11 +110,13 @@
 
 #include <vector>
 #include <list>
+#include <deque>
 #include <iostream>
 #include <sstream>
 #include <string>
 #include <set>
 #include <map>
+#include <new>
 
 #ifndef CS_STRING
 #	ifdef _HAS_CSTRING_
@@ -136,6 +138,14 @@
 #define CS_EXPORT
 #endif /* CS_EXPORT */
 
+#ifndef CS_NOTHROW
+#if __cplusplus >= 201103L
+#	define CS_NOTHROW noexcept
+#else
+#	define CS_NOTHROW throw()
+#endif /* __cplusplus >= 201103L */
+#endif /* CS_NOTHROW */
+
 #ifndef PERROR
 #ifdef __DEBUG__
 #	define PERROR( f ) __Perror( f, __FILE__, __LINE__ )
@@ -163,6 +173,14 @@ typedef ssize_t cs_ssize_t;
 #define HAVE_UNIX_SOCKET
 #endif
 
+#ifdef CSOCK_USE_EPOLL
+// edge triggered epoll for the sockets, fds that aren't sockets in the manager still go through poll()
+#ifndef CSOCK_USE_POLL
+#define CSOCK_USE_POLL
+#endif /* CSOCK_USE_POLL */
+#include <sys/epoll.h>
+#endif /* CSOCK_USE_EPOLL */
+
 #ifdef CSOCK_USE_POLL
 #include <poll.h>
 #endif /* CSOCK_USE_POLL */
@@ -255,6 +273,7 @@ private:
 
 
 class Csock;
+class CSWriteBatch;
 
 
 /**
@@ -316,6 +335,10 @@ Csock * GetCsockFromCTX( X509_STORE_CTX * pCTX );
 
 
 const uint32_t CS_BLOCKSIZE = 4096;
+//! the most datagrams moved per recvmmsg()/sendmmsg() call, @see Csock::SetDatagramBatch
+const u_int CS_DGRAM_MAX_BATCH = 64;
+//! the largest UDP payload over IPv4
+const size_t CS_DGRAM_MAX_SIZE = 65507;
 template <class T> inline void CS_Delete( T * & p ) { if( p ) { delete p; p = NULL; } }
 
 #ifdef HAVE_LIBSSL
@@ -348,6 +371,18 @@ bool InitCsocket();
  */
 void ShutdownCsocket();
 
+/**
+ * @brief sets how many freed Csock objects are kept per size class for reuse
+ * @param uMaxCached the maximum amount of cached blocks per size class, 0 (the default) disables pooling
+ *
+ * Csock overrides operator new/delete, so every Csock derivative (IE those created by CSocketManager::GetSockObj
+ * and Csock::GetSockObj on accept) is recycled out of a free list instead of going back to the heap. This cuts
+ * down on allocator churn during connect floods. The free lists are kept per thread.
+ */
+void SetCsockPoolSize( size_t uMaxCached );
+//! releases any Csock blocks cached by the calling thread, ShutdownCsocket() calls this
+void TrimCsockPool();
+
 //! @todo need to make this sock specific via getsockopt
 inline int GetSockError()
 {
@@ -381,6 +416,8 @@ inline void TFD_CLR( cs_sock_t iSock, fd_set *set )
 
 void __Perror( const CS_STRING & s, const char * pszFile, uint32_t iLineNo );
 uint64_t millitime();
+//! same as millitime() in microseconds
+uint64_t microtime();
 
 
 /**
@@ -546,11 +583,268 @@ protected:
 };
 
 
+/**
+ * @class CSTokenBucket
+ * @brief token bucket used for rate shaping, refills at a steady rate up to a burst size
+ *
+ * Buckets chain to a parent (socket -> listener -> manager), a socket may only move as many bytes as every
+ * bucket along the chain allows. A bucket with a rate of 0 doesn't limit anything, but still defers to its parent.
+ */
+class CS_EXPORT CSTokenBucket
+{
+public:
+	CSTokenBucket();
+
+	/**
+	 * @param uBytesPerSec refill rate, 0 turns shaping off for this bucket
+	 * @param uBurst the most bytes that can go out at once, 0 means one second worth of uBytesPerSec
+	 */
+	void SetRate( uint64_t uBytesPerSec, uint64_t uBurst = 0 );
+	uint64_t GetRate() const { return( m_uRate ); }
+	uint64_t GetBurst() const { return( m_uBurst ); }
+
+	void SetParent( CSTokenBucket * pParent ) { m_pParent = pParent; }
+	CSTokenBucket * GetParent() const { return( m_pParent ); }
+
+	//! true if this bucket or one of its parents limits anything
+	bool IsShaping() const;
+	//! bytes that can be moved right now along the whole chain
+	uint64_t Available( uint64_t iNOW ) const;
+	//! takes uBytes out of every bucket along the chain
+	void Consume( uint64_t uBytes, uint64_t iNOW );
+	//! milliseconds until uBytes (capped at each bucket's burst) are available along the whole chain
+	uint64_t MillisUntil( uint64_t uBytes, uint64_t iNOW ) const;
+
+private:
+	//! tokens in this bucket alone, in thousandths of a byte so a millisecond of refill is exact
+	uint64_t Tokens( uint64_t iNOW ) const;
+
+	uint64_t		m_uRate, m_uBurst, m_uTokens, m_iLastRefill;
+	CSTokenBucket *	m_pParent;
+};
+
+/**
+ * @class CSSockStats
+ * @brief traffic and latency counters of a socket, or the sum of several
+ *
+ * @see Csock::GetStats, CSocketManager::GetListenerStats
+ */
+class CS_EXPORT CSSockStats
+{
+public:
+	CSSockStats();
+
+	void Reset();
+	/**
+	 * @brief adds cStats to these stats, used to aggregate sockets
+	 *
+	 * counters, queue depths and throughput are summed, the peak send queue is the largest of the two
+	 */
+	void Add( const CSSockStats & cStats );
+
+	//! number of open sockets these stats cover
+	uint64_t GetSockets() const { return( m_iSockets ); }
+	//! number of closed sockets these stats still account for
+	uint64_t GetRetired() const { return( m_iRetired ); }
+
+	uint64_t GetBytesRead() const { return( m_iBytesRead ); }
+	uint64_t GetBytesWritten() const { return( m_iBytesWritten ); }
+	//! read()/SSL_read() calls made
+	uint64_t GetReadCalls() const { return( m_iReadCalls ); }
+	//! write()/SSL_write() calls made
+	uint64_t GetWriteCalls() const { return( m_iWriteCalls ); }
+	//! reads that would have blocked
+	uint64_t GetReadEAGAIN() const { return( m_iReadEAGAIN ); }
+	//! writes that would have blocked
+	uint64_t GetWriteEAGAIN() const { return( m_iWriteEAGAIN ); }
+
+	//! bytes waiting in the send buffer
+	uint64_t GetSendQueue() const { return( m_uSendQueue ); }
+	//! the most bytes that were ever waiting in the send buffer
+	uint64_t GetPeakSendQueue() const { return( m_uPeakSendQueue ); }
+
+	//! milliseconds reading was held back by rate shaping
+	uint64_t GetReadShapedMS() const { return( m_iReadShapedMS ); }
+	//! milliseconds writing was held back by rate shaping
+	uint64_t GetWriteShapedMS() const { return( m_iWriteShapedMS ); }
+
+	//! completed SSL handshakes
+	uint64_t GetSSLHandshakes() const { return( m_iSSLHandshakes ); }
+	//! total time spent in SSL handshakes in microseconds, divide by GetSSLHandshakes() for the average
+	uint64_t GetSSLHandshakeUS() const { return( m_iSSLHandshakeUS ); }
+
+	//! completed DNS lookups, the bind host and the destination count separately
+	uint64_t GetDNSLookups() const { return( m_iDNSLookups ); }
+	//! total time spent resolving in microseconds, divide by GetDNSLookups() for the average
+	uint64_t GetDNSUS() const { return( m_iDNSUS ); }
+
+	//! connections that went out with TCP Fast Open, or came in on a listener that takes it with data in the SYN
+	uint64_t GetFastOpenTries() const { return( m_iFastOpenTries ); }
+	//! of those, the ones whose SYN carried data the other side accepted. counted once the handshake is done
+	uint64_t GetFastOpens() const { return( m_iFastOpens ); }
+
+	//! exponentially weighted moving average of bytes read per second, sampled once a second
+	double GetReadRate() const { return( m_fReadRate ); }
+	//! exponentially weighted moving average of bytes written per second, sampled once a second
+	double GetWriteRate() const { return( m_fWriteRate ); }
+
+private:
+	friend class Csock;
+	friend class CSocketManager;
+
+	//! closes the current sample window if a second or more has passed, and folds it into the moving averages
+	void Roll( uint64_t iNOW );
+	//! drops what only makes sense for an open socket, before it is added to a listener's totals
+	void Retire();
+
+	uint64_t	m_iSockets, m_iRetired;
+	uint64_t	m_iBytesRead, m_iBytesWritten;
+	uint64_t	m_iReadCalls, m_iWriteCalls, m_iReadEAGAIN, m_iWriteEAGAIN;
+	uint64_t	m_uSendQueue, m_uPeakSendQueue;
+	uint64_t	m_iReadShapedMS, m_iWriteShapedMS, m_iReadShapedSince, m_iWriteShapedSince;
+	uint64_t	m_iSSLHandshakes, m_iSSLHandshakeUS, m_iSSLHandshakeStart;
+	uint64_t	m_iDNSLookups, m_iDNSUS, m_iDNSStart;
+	uint64_t	m_iFastOpenTries, m_iFastOpens;
+	uint64_t	m_iWindowStart, m_iWindowRead, m_iWindowWritten;
+	double		m_fReadRate, m_fWriteRate;
+};
+
+/**
+ * @class CSSockTuning
+ * @brief socket options to set on a socket as soon as it's created, @see CSConnection::SetTuning, CSListener::SetTuning
+ *
+ * Anything not set is left to the kernel. Sockets accepted by a listener get the listener's tuning.
+ * The TCP options are skipped on datagram sockets, options the platform doesn't have are ignored.
+ *
+ * @code
+ * CSSockTuning cBulk;
+ * cBulk.SetSendBuffer( 4 * 1024 * 1024 );
+ * cBulk.SetKeepAlive( true, 60, 10, 6 );
+ * cListen.SetTuning( cBulk );
+ * @endcode
+ */
+class CS_EXPORT CSSockTuning
+{
+public:
+	CSSockTuning();
+
+	//! SO_SNDBUF in bytes, the kernel doubles it for its own bookkeeping
+	void SetSendBuffer( int iBytes ) { m_iSendBuffer = iBytes; }
+	int GetSendBuffer() const { return( m_iSendBuffer ); }
+	//! SO_RCVBUF in bytes, set on a listener it also decides the window scale of accepted connections
+	void SetRecvBuffer( int iBytes ) { m_iRecvBuffer = iBytes; }
+	int GetRecvBuffer() const { return( m_iRecvBuffer ); }
+	//! TCP_NODELAY, true sends small writes right away instead of waiting on Nagle
+	void SetNoDelay( bool b ) { m_iNoDelay = ( b ? 1 : 0 ); }
+	//! 1 or 0 as set, -1 if left alone
+	int GetNoDelay() const { return( m_iNoDelay ); }
+	//! TCP_QUICKACK, the kernel falls back to delayed ACKs on its own, so this only holds for the start of the connection
+	void SetQuickAck( bool b ) { m_iQuickAck = ( b ? 1 : 0 ); }
+	int GetQuickAck() const { return( m_iQuickAck ); }
+	/**
+	 * @brief SO_KEEPALIVE and its timing
+	 * @param b turns keepalive probes on or off
+	 * @param iIdle TCP_KEEPIDLE, seconds of silence before the first probe, -1 keeps the kernel's
+	 * @param iInterval TCP_KEEPINTVL, seconds between probes, -1 keeps the kernel's
+	 * @param iCount TCP_KEEPCNT, unanswered probes before the connection is dropped, -1 keeps the kernel's
+	 */
+	void SetKeepAlive( bool b, int iIdle = -1, int iInterval = -1, int iCount = -1 );
+	int GetKeepAlive() const { return( m_iKeepAlive ); }
+	int GetKeepIdle() const { return( m_iKeepIdle ); }
+	int GetKeepInterval() const { return( m_iKeepInterval ); }
+	int GetKeepCount() const { return( m_iKeepCount ); }
+	//! TCP_NOTSENT_LOWAT in bytes, how much unsent data the kernel holds before the socket stops being writable
+	void SetNotSentLowat( int iBytes ) { m_iNotSentLowat = iBytes; }
+	int GetNotSentLowat() const { return( m_iNotSentLowat ); }
+	//! SO_BUSY_POLL in microseconds, spin on the device queue for that long on blocking receives and poll()
+	void SetBusyPoll( int iMicroSecs ) { m_iBusyPoll = iMicroSecs; }
+	int GetBusyPoll() const { return( m_iBusyPoll ); }
+	//! IP_TOS, or IPV6_TCLASS on IPv6 sockets, IE 0x10 for low delay or a DSCP value shifted left by 2
+	void SetTOS( int iTOS ) { m_iTOS = iTOS; }
+	int GetTOS() const { return( m_iTOS ); }
+
+	//! true if nothing was set
+	bool IsEmpty() const;
+	/**
+	 * @brief sets everything that was set on iSock
+	 * @param iSock the socket
+	 * @param bTCP false skips the TCP options
+	 * @param bIPv6 picks IPV6_TCLASS over IP_TOS
+	 * @param bAccepted iSock was just accept()'ed from a listener with this tuning, only set what it doesn't inherit
+	 * @return false if any of them failed, the rest are still applied
+	 *
+	 * An accepted socket takes the buffer sizes, keepalive, TCP_NODELAY, TCP_NOTSENT_LOWAT, SO_BUSY_POLL and the TOS
+	 * from its listener, the ack mode starts over so TCP_QUICKACK has to be set again.
+	 */
+	bool Apply( cs_sock_t iSock, bool bTCP, bool bIPv6, bool bAccepted = false ) const;
+
+private:
+	int		m_iSendBuffer, m_iRecvBuffer, m_iNoDelay, m_iQuickAck;
+	int		m_iKeepAlive, m_iKeepIdle, m_iKeepInterval, m_iKeepCount;
+	int		m_iNotSentLowat, m_iBusyPoll, m_iTOS;
+};
+
 #ifdef HAVE_LIBSSL
 typedef int ( *FPCertVerifyCB )( int, X509_STORE_CTX * );
+
+class CSListener;
+class CSConnection;
+
+/**
+ * @class CSSSLProfile
+ * @brief refcounted, immutable set of SSL settings (cipher, key material, client cert requirements)
+ *
+ * Sockets accepted from a listener share the listener's profile instead of each holding copies of the same strings,
+ * and outbound sockets connected with the same CSConnection settings share one the manager keeps for them.
+ * Csock's setters copy the profile on write when it is shared, so SNIConfigureServer() and friends only affect
+ * the socket they are called on. The refcount is not atomic, only share a profile between sockets of the same thread.
+ */
+class CS_EXPORT CSSSLProfile
+{
+public:
+	CSSSLProfile();
+	//! builds the profile the way CSocketManager::Listen() configures an SSL listener
+	CSSSLProfile( const CSListener & cListen );
+	//! builds the profile the way CSocketManager::Connect() configures an SSL connection
+	CSSSLProfile( const CSConnection & cCon );
+
+	void Ref() { ++m_uRefs; }
+	void UnRef() { if( --m_uRefs == 0 ) delete this; }
+	bool IsShared() const { return( m_uRefs > 1 ); }
+
+	const CS_STRING & GetCipher() const { return( m_sCipherType ); }
+	const CS_STRING & GetDHParamLocation() const { return( m_sDHParamFile ); }
+	const CS_STRING & GetKeyLocation() const { return( m_sKeyFile ); }
+	const CS_STRING & GetPemLocation() const { return( m_sPemFile ); }
+	const CS_STRING & GetPemPass() const { return( m_sPemPass ); }
+	uint32_t GetRequireClientCertFlags() const { return( m_iRequireClientCertFlags ); }
+
+private:
+	friend class Csock;
+	//! profiles are created unshared, use Ref()/UnRef()
+	CSSSLProfile( const CSSSLProfile & cCopy );
+	CSSSLProfile & operator=( const CSSSLProfile & cCopy );
+	~CSSSLProfile() {}
+
+	size_t		m_uRefs;
+	CS_STRING	m_sCipherType, m_sDHParamFile, m_sKeyFile, m_sPemFile, m_sPemPass;
+	uint32_t	m_iRequireClientCertFlags;
+};
 #endif /* HAVE_LIBSSL */
 
 
+/**
+ * @class CSDatagram
+ * @brief a datagram waiting in a datagram sockets send queue, the payload lives in the send buffer
+ */
+struct CS_EXPORT CSDatagram
+{
+	size_t		m_uOffset, m_uLen;
+	//! m_iAddrLen is 0 when it goes to the connected peer
+	struct sockaddr_storage	m_cAddr;
+	socklen_t	m_iAddrLen;
+};
+
 /**
  * @class Csock
  * @brief Basic socket class.
@@ -579,6 +873,16 @@ public:
 
 	virtual ~Csock();
 
+	//! pooled allocation, @see SetCsockPoolSize
+	static void * operator new( size_t uSize );
+	static void operator delete( void * pData, size_t uSize );
+	//! same as the above, but returns NULL rather than throwing when the heap is out
+	static void * operator new( size_t uSize, const std::nothrow_t & ) CS_NOTHROW;
+	static void operator delete( void * pData, const std::nothrow_t & ) CS_NOTHROW;
+	//! declaring the pooled ones hides these, so they're brought back for derivatives that construct in place
+	static void * operator new( size_t uSize, void * pPlace ) CS_NOTHROW { return( pPlace ); }
+	static void operator delete( void * pData, void * pPlace ) CS_NOTHROW {}
+
 	/**
 	 * @brief in the event you pass this class to Copy(), you MUST call this function or
 	 * on the original Csock other wise bad side effects will happen (double deletes, weird sock closures, etc)
@@ -654,14 +958,20 @@ public:
 	    CLT_DEREFERENCE		= 3	 //!< used after copy in Csock::Dereference() to cleanup a sock thats being shutdown
 	};
 
-	Csock & operator<<( const CS_STRING & s );
-	Csock & operator<<( std::ostream & ( *io )( std::ostream & ) );
-	Csock & operator<<( int32_t i );
-	Csock & operator<<( uint32_t i );
-	Csock & operator<<( int64_t i );
-	Csock & operator<<( uint64_t i );
-	Csock & operator<<( float i );
-	Csock & operator<<( double i );
+	/**
+	 * @brief these start a CSWriteBatch, the whole sock << a << b << endl expression reaches Write() in one call once it ends
+	 *
+	 * Any stream manipulator, endl included, writes "\r\n".
+	 */
+	CSWriteBatch operator<<( const CS_STRING & s );
+	CSWriteBatch operator<<( const char * psz );
+	CSWriteBatch operator<<( std::ostream & ( *io )( std::ostream & ) );
+	CSWriteBatch operator<<( int32_t i );
+	CSWriteBatch operator<<( uint32_t i );
+	CSWriteBatch operator<<( int64_t i );
+	CSWriteBatch operator<<( uint64_t i );
+	CSWriteBatch operator<<( float i );
+	CSWriteBatch operator<<( double i );
 
 	/**
 	 * @brief Create the connection, this is used by the socket manager, and shouldn't be called directly by the user
@@ -695,7 +1005,7 @@ public:
 	 */
 	virtual bool Listen( uint16_t iPort, int iMaxConns = SOMAXCONN, const CS_STRING & sBindHost = "", uint32_t iTimeout = 0, bool bDetach = false );
 
-	//! Accept an inbound connection, this is used internally
+	//! Accept an inbound connection, this is used internally. one ConnectionFrom() refused comes back invalid with GetSockError() == 0
 	virtual cs_sock_t Accept( CS_STRING & sHost, uint16_t & iRPort );
 
 	//! Accept an inbound SSL connection, this is used internally and called after Accept
@@ -740,6 +1050,160 @@ public:
 	 */
 	virtual bool Write( const CS_STRING & sData );
 
+	/**
+	 * @brief turns on write coalescing, Write() only queues data and CSocketManager flushes it once at the end of each Loop()
+	 * @param uThreshold once this many bytes are queued Write() sends right away instead of waiting for the end of the iteration
+	 * @param bCork cork the socket (TCP_CORK/TCP_NOPUSH) while over the threshold, so only full frames leave until the flush
+	 *
+	 * This turns a handler that emits many small lines per event into one syscall and as few segments as possible.
+	 * Use Flush() for writes that can't wait for the end of the iteration.
+	 */
+	void EnableWriteCoalescing( size_t uThreshold = 16384, bool bCork = false );
+	void DisableWriteCoalescing();
+	bool GetWriteCoalescing() const { return( m_bCoalesceWrites ); }
+	//! sends everything queued right away and uncorks the socket, returns false if the write failed like Write() does
+	bool Flush();
+	//! true when coalesced data is waiting for Flush()
+	bool HasPendingWrite() const { return( m_bWritePending ); }
+
+	/**
+	 * @brief high and low watermarks on the send queue, see WriteBufferFull() and WriteBufferDrained()
+	 * @param uHigh WriteBufferFull() is called once a Write() leaves this many bytes or more queued, 0 turns the watermarks off
+	 * @param uLow WriteBufferDrained() is called once the queue is back down to this, 0 is half of uHigh
+	 */
+	void SetWriteBufferWatermarks( size_t uHigh, size_t uLow = 0 );
+	size_t GetWriteBufferHighWater() const { return( m_uWriteHighWater ); }
+	size_t GetWriteBufferLowWater() const { return( m_uWriteLowWater ); }
+	//! true from WriteBufferFull() until WriteBufferDrained()
+	bool IsWriteBufferFull() const { return( m_bWriteBufferFull ); }
+	/**
+	 * @brief ties pUpstream, the socket whose data gets written to this one, to this socket's send queue
+	 *
+	 * pUpstream stops reading when this send queue reaches the high watermark and starts again when it drains, so
+	 * a fast producer can't grow it without bound. That pause is kept apart from PauseRead(), a drain doesn't undo
+	 * the caller's own and UnPauseRead() doesn't undo the drain's. Needs SetWriteBufferWatermarks(). A socket can be upstream of only
+	 * one other, linking it again drops the previous link. Deleting either socket or passing NULL undoes the link.
+	 * For a proxy that goes both ways, link each side to the other.
+	 */
+	void SetUpstream( Csock * pUpstream );
+	Csock * GetUpstream() const { return( m_pUpstream ); }
+	//! the socket this one is linked upstream of, if any
+	Csock * GetDownstream() const { return( m_pDownstream ); }
+
+	/**
+	 * @brief low latency sending, for interactive messages sharing a connection with bulk data
+	 * @param uNotSentLowat the most unsent data the kernel may hold, as TCP_NOTSENT_LOWAT. 0 turns the mode off
+	 * @return false on datagram sockets, or if the socket is open and the kernel refused the option
+	 *
+	 * By default the kernel takes as much as its send buffer holds, which can be seconds worth on a slow path, and
+	 * anything written afterwards waits behind all of it. With this on the kernel stops taking data once uNotSentLowat
+	 * bytes of it are unsent, the rest waits in the send queue where WriteUrgent() can get ahead of it.
+	 */
+	bool SetLowLatency( size_t uNotSentLowat = 16384 );
+	size_t GetLowLatency() const { return( m_uNotSentLowat ); }
+	/**
+	 * @brief like Write(), but goes ahead of the normal data still in the send queue
+	 *
+	 * Each Write() is treated as one message that is never split, so the urgent data goes out right after the message
+	 * that is partly sent, and after any urgent data queued before it. Write() everything that has to stay together,
+	 * IE a frame header and its payload, with one call. Only does this in SetLowLatency() mode, otherwise it's Write().
+	 */
+	bool WriteUrgent( const char * data, size_t len );
+	bool WriteUrgent( const CS_STRING & sData ) { return( WriteUrgent( sData.data(), sData.size() ) ); }
+
+	/**
+	 * @brief pairs this socket with pPeer as the two sides of a TCP relay, what either one reads the other one writes
+	 * @param pPeer the other side, IE the backend connection for a client
+	 * @param bSplice move the data with splice() when both sides can, false always copies it through user space
+	 * @return false if either is already paired, is a datagram socket, or pPeer is this
+	 *
+	 * Between two plain TCP sockets on Linux the data never comes up into user space. It is splice()'d from one socket
+	 * into a pipe and from the pipe out the other socket. Otherwise, IE with SSL on either side, it's read and Write()'n
+	 * as usual. Either way ReadData()/ReadLine() don't see proxied data, anything read before the pairing stays where it
+	 * is. GetBytesRead()/GetBytesWritten(), the stats, the timeouts and rate shaping count it like any other data.
+	 * Each side is the other's upstream, see SetUpstream(), so a slow reader holds the fast side back. The watermarks
+	 * are set to the pipe size when spliced, or to 256KB when copied and nothing was set already. When one side is
+	 * deleted the other is closed once it has written everything queued for it.
+	 */
+	bool Proxy( Csock * pPeer, bool bSplice = true );
+	Csock * GetProxyPeer() const { return( m_pProxyPeer ); }
+	//! true when what this socket reads is splice()'d to its proxy peer
+	bool IsSpliced() const { return( m_pProxyPeer && m_pProxyPeer->m_aiSplicePipe[1] != -1 ); }
+	//! splices up to uLen bytes from this socket to the proxy peer, returns what Read() would. CSocketManager does this when IsSpliced()
+	cs_ssize_t SpliceRead( size_t uLen );
+
+	//! the CSocketManager pool this socket was connected for, empty if it isn't pooled. @see CSocketManager::ConnectPooled
+	const CS_STRING & GetPoolKey() const { return( m_sPoolKey ); }
+	//! true while the socket waits in its pool for CSocketManager::AcquireSock()
+	bool IsPoolIdle() const { return( m_bPoolIdle ); }
+
+	/**
+	 * @brief makes this a UDP socket, call it before Connect() or Listen(). @see CSConnection::SetDatagram, CSListener::SetDatagram
+	 *
+	 * Listening binds the port and takes datagrams from anyone, connecting only lets the peer through. Every readable event
+	 * receives up to GetDatagramBatch() datagrams with one recvmmsg() and hands them to ReadDatagram(). SendDatagram() and
+	 * Write() queue datagrams, they leave together through sendmmsg() at the end of the Loop() iteration or as soon as a
+	 * batch fills up. Use Flush() to send right away. There is no SSL on datagram sockets.
+	 */
+	void SetDatagram( bool b ) { m_bDatagram = b; }
+	bool IsDatagram() const { return( m_bDatagram ); }
+	//! how many datagrams are moved per syscall, 1 to CS_DGRAM_MAX_BATCH. Defaults to 32
+	void SetDatagramBatch( u_int uBatch );
+	u_int GetDatagramBatch() const { return( m_uDatagramBatch ); }
+	//! the largest datagram received, anything bigger is dropped and reported to SockError() as EMSGSIZE. Defaults to 2048
+	void SetMaxDatagramSize( u_int uSize );
+	u_int GetMaxDatagramSize() const { return( m_uMaxDatagram ); }
+	/**
+	 * @brief turns on UDP segmentation and receive offload (UDP_SEGMENT/UDP_GRO) where the kernel has them
+	 * @return false when they aren't available, nothing changes then
+	 *
+	 * Runs of equally sized datagrams to the same peer leave as one super packet, and the kernel coalesces trains of
+	 * received datagrams into one slot. ReadDatagram() still sees them one at a time. Receive slots grow to 64k while this is on.
+	 */
+	bool SetDatagramOffload( bool b );
+	bool GetDatagramOffload() const { return( m_bDatagramOffload ); }
+
+	/**
+	 * @brief TCP Fast Open for an outbound socket, call it before connecting. @see CSConnection::SetFastOpen
+	 *
+	 * Uses TCP_FASTOPEN_CONNECT where the kernel has it. Once the server's cookie is cached connect() returns right away,
+	 * Connected() is called before the handshake and the SYN leaves with whatever is written first, saving a round trip.
+	 * A refused connection then shows up as an error on the first read or write. Without a cookie it connects as usual
+	 * and asks for one. GetStats() counts how often the server took the data, @see CSSockStats::GetFastOpens
+	 */
+	void SetFastOpen( bool b ) { m_bFastOpen = b; }
+	bool GetFastOpen() const { return( m_bFastOpen ); }
+	//! the TCP_FASTOPEN queue of a LISTENER, IE how many connections may wait for their handshake with data. 0, the default, turns it off
+	void SetFastOpenQueue( int iQueue ) { m_iFastOpenQueue = iQueue; }
+	int GetFastOpenQueue() const { return( m_iFastOpenQueue ); }
+
+	/**
+	 * @brief socket options for this socket, @see CSSockTuning
+	 *
+	 * Applied when the socket is created, or right away when it already has one. CSocketManager sets this from
+	 * CSConnection::SetTuning and CSListener::SetTuning, the latter is passed on to every socket the listener accepts.
+	 * @return false if the socket is open and an option couldn't be set
+	 */
+	bool SetTuning( const CSSockTuning & cTuning );
+	const CSSockTuning & GetTuning() const { return( m_cTuning ); }
+	/**
+	 * @brief queues a datagram
+	 * @param pData the datagram
+	 * @param uLen its length, 0 is allowed
+	 * @param sIP numeric address to send to, empty sends to the connected peer
+	 * @param uPort port to send to
+	 * @return false if this isn't a datagram socket, sIP isn't a numeric address or uLen is larger than CS_DGRAM_MAX_SIZE
+	 */
+	bool SendDatagram( const char * pData, size_t uLen, const CS_STRING & sIP = "", uint16_t uPort = 0 );
+	bool SendDatagram( const CS_STRING & sData, const CS_STRING & sIP = "", uint16_t uPort = 0 ) { return( SendDatagram( sData.data(), sData.size(), sIP, uPort ) ); }
+	/**
+	 * @brief receives up to GetDatagramBatch() datagrams and hands each to ReadDatagram(), CSocketManager calls this
+	 * @return the bytes received, READ_EAGAIN or READ_ERR like Read()
+	 *
+	 * Errors that only concern one datagram or peer (ICMP unreachables, EMSGSIZE, ...) go to SockError() and the socket stays open.
+	 */
+	cs_ssize_t ReadDatagrams();
+
 	/**
 	 * Read from the socket
 	 * Just pass in a pointer, big enough to hold len bytes
@@ -788,6 +1252,7 @@ public:
 	//! will pause/unpause reading on this socket
 	void PauseRead();
 	void UnPauseRead();
+	//! true while reads are paused, by PauseRead() or by a full downstream, @see SetUpstream
 	bool IsReadPaused() const;
 	/**
 	 * this timeout isn't just connection timeout, but also timeout on
@@ -864,6 +1329,17 @@ public:
 	//! Get Avg Write Speed in sample milliseconds (default is 1000 milliseconds or 1 second)
 	double GetAvgWrite( uint64_t iSample = 1000 ) const;
 
+	/**
+	 * @brief snapshot of this socket's syscall, queue, shaping, handshake and throughput counters
+	 *
+	 * safe to call from any callback, CSocketManager::GetListenerStats() sums these per listener
+	 */
+	void GetStats( CSSockStats & cStats ) const;
+	//! zeroes the counters GetStats() reports, except the byte counts, @see ResetBytesRead, ResetBytesWritten
+	void ResetStats();
+	//! folds the last second of traffic into the moving averages, the manager calls this once a second (internal use only)
+	void RollStats( uint64_t iNOW ) { m_cStats.Roll( iNOW ); }
+
 	//! Returns the remote port
 	uint16_t GetRemotePort() const;
 
@@ -908,6 +1384,14 @@ public:
 	void SetPemPass( const CS_STRING & sPassword );
 	const CS_STRING & GetPemPass() const;
 
+	/**
+	 * @brief shares pProfile with this socket, replacing the cipher, key material and client cert settings
+	 * @param pProfile the profile to reference, NULL reverts to the defaults
+	 */
+	void SetSSLProfile( CSSSLProfile * pProfile );
+	//! returns the profile in use, NULL when the socket still uses the defaults
+	CSSSLProfile * GetSSLProfile() const { return( m_pSSLProfile ); }
+
 	//! Set the SSL method type
 	void SetSSLMethod( int iMethod );
 	int GetSSLMethod() const;
@@ -923,6 +1407,8 @@ public:
 
 	//! Get the send buffer
 	bool HasWriteBuffer() const;
+	//! bytes queued by Write() that haven't gone out yet, including what a proxy peer has spliced in
+	size_t GetWriteBufferSize() const { return( m_sSend.size() - m_uSendBufferPos + m_uSpliceQueued ); }
 	void ClearWriteBuffer();
 
 	//! is SSL_accept finished ?
@@ -949,7 +1435,7 @@ public:
 	//! legacy, deprecated @see SetRequireClientCertFlags
 	void SetRequiresClientCert( bool bRequiresCert );
 	//! bitwise flags, 0 means don't require cert, SSL_VERIFY_PEER verifies peers, SSL_VERIFY_FAIL_IF_NO_PEER_CERT will cause the connection to fail if no cert
-	void SetRequireClientCertFlags( uint32_t iRequireClientCertFlags ) { m_iRequireClientCertFlags = iRequireClientCertFlags; }
+	void SetRequireClientCertFlags( uint32_t iRequireClientCertFlags );
 #endif /* HAVE_LIBSSL */
 
 	//! Set The INBOUND Parent sockname
@@ -960,12 +1446,37 @@ public:
 	 * sets the rate at which we can send data
 	 * @param iBytes the amount of bytes we can write
 	 * @param iMilliseconds the amount of time we have to rate to iBytes
+	 *
+	 * This is a write token bucket refilling iBytes every iMilliseconds with a burst of iBytes, @see SetWriteRate
 	 */
 	virtual void SetRate( uint32_t iBytes, uint64_t iMilliseconds );
 
 	uint32_t GetRateBytes() const;
 	uint64_t GetRateTime() const;
 
+	/**
+	 * @brief token bucket shaping of outgoing data
+	 * @param uBytesPerSec the sustained rate, 0 turns it off
+	 * @param uBurst the most bytes that can be sent at once, 0 means one second worth
+	 *
+	 * CSocketManager chains this under the parent listener's and the manager wide limits,
+	 * @see CSocketManager::SetListenerWriteRate, CSocketManager::SetGlobalWriteRate
+	 */
+	void SetWriteRate( uint64_t uBytesPerSec, uint64_t uBurst = 0 );
+	//! token bucket shaping of incoming data, @see SetWriteRate
+	void SetReadRate( uint64_t uBytesPerSec, uint64_t uBurst = 0 );
+	CSTokenBucket & GetWriteBucket() { return( m_cWriteBucket ); }
+	CSTokenBucket & GetReadBucket() { return( m_cReadBucket ); }
+	//! returns true if shaping allows reading right now, initialize iNOW to 0 and it sets it on the first call
+	bool AllowRead( uint64_t & iNOW ) const;
+	/**
+	 * @brief milliseconds until shaping lets this socket move data again, 0 if it isn't throttled
+	 *
+	 * CSocketManager uses this to shorten the select timeout, so throttled sockets wake as the tokens refill.
+	 * Initialize iNOW to 0 and it sets it on the first call
+	 */
+	uint64_t GetShapingDelay( uint64_t & iNOW ) const;
+
 	/**
 	 * Connected event
 	 */
@@ -993,10 +1504,45 @@ public:
 	//! returns the value of m_bEnableReadLine, if ReadLine is enabled
 	bool HasReadLine() const { return( m_bEnableReadLine ); }
 
+	/**
+	 * @brief Ready to read a full length prefixed frame event, @see EnableReadFrame
+	 * @param pData the frame without its header, only valid for the duration of the call
+	 * @param uLen length of the frame
+	 */
+	virtual void ReadFrame( const char * pData, size_t uLen ) {}
+	/**
+	 * @brief delivers length prefixed frames through ReadFrame() instead of lines through ReadLine()
+	 * @param uHeaderBytes width of the length header, 1, 2, 4 or 8
+	 * @param bBigEndian byte order of the length header
+	 * @param uMaxFrame the largest frame accepted, larger ones trigger ReachedMaxBuffer() and close the socket. 0 means no limit
+	 * @return false if uHeaderBytes isn't a supported width
+	 *
+	 * The length counts the frame only, not the header. Frames that arrive whole are handed over straight from the
+	 * read block, only a frame split across reads is buffered. ReadFrame() may switch to EnableReadLine(), the bytes
+	 * after that frame then go to ReadLine(). ReadData() sees every read block either way.
+	 */
+	bool EnableReadFrame( u_int uHeaderBytes = 4, bool bBigEndian = true, uint64_t uMaxFrame = 16777216 );
+	void DisableReadFrame();
+	bool HasReadFrame() const { return( m_uFrameHeader > 0 ); }
+
+	/**
+	 * @brief a datagram arrived on a datagram socket, @see SetDatagram
+	 * @param pData the datagram, only valid for the duration of the call
+	 * @param uLen its length
+	 * @param sIP the address it came from
+	 * @param uPort the port it came from
+	 *
+	 * The default hands it to ReadData(), ReadLine() and ReadFrame() aren't used with datagrams.
+	 */
+	virtual void ReadDatagram( const char * pData, size_t uLen, const CS_STRING & sIP, uint16_t uPort ) { ReadData( pData, uLen ); }
+
 	/**
 	 * This WARNING event is called when your buffer for readline exceeds the warning threshold
 	 * and triggers this event. Either Override it and do nothing, or SetMaxBufferThreshold()
 	 * This event will only get called if m_bEnableReadLine is enabled
+	 *
+	 * With EnableReadFrame() it is called when a frame is larger than the limit. The stream can't be resynchronized
+	 * after that, the socket is closed once this returns.
 	 */
 	virtual void ReachedMaxBuffer();
 	/**
@@ -1026,6 +1572,14 @@ public:
 	 * This gets called every iteration of CSocketManager::Select() if the socket is ReadPaused
 	 */
 	virtual void ReadPaused() {}
+	/**
+	 * This gets called when a Write() leaves the send queue at or over the high watermark, see SetWriteBufferWatermarks()
+	 */
+	virtual void WriteBufferFull() {}
+	/**
+	 * This gets called when the send queue drains down to the low watermark after WriteBufferFull()
+	 */
+	virtual void WriteBufferDrained() {}
 
 #ifdef HAVE_LIBSSL
 	/**
@@ -1171,6 +1725,18 @@ public:
 
 	//! returns the number of max pending connections when type is LISTENER
 	int GetMaxConns() const { return( m_iMaxConns ); }
+	//! sets how many pending connections a LISTENER accepts per readable event, defaults to 1
+	void SetAcceptBatch( u_int uAcceptBatch ) { m_uAcceptBatch = ( uAcceptBatch ? uAcceptBatch : 1 ); }
+	u_int GetAcceptBatch() const { return( m_uAcceptBatch ); }
+	/**
+	 * @brief for a LISTENER shared by several managers, IE pre-forked workers that each run their own Loop()
+	 *
+	 * With CSOCK_USE_EPOLL only one of the waiting managers is woken for a new connection (EPOLLEXCLUSIVE) instead of
+	 * all of them racing for it. Set it before the manager first sees the listener, and fork before the first Loop()
+	 * so every worker has its own epoll set. Does nothing in other builds.
+	 */
+	void SetExclusiveAccept( bool b ) { m_bExclusiveAccept = b; }
+	bool GetExclusiveAccept() const { return( m_bExclusiveAccept ); }
 
 #ifdef HAVE_ICU
 	void SetEncoding( const CS_STRING & sEncoding );
@@ -1191,30 +1757,93 @@ public:
 #endif /* HAVE_ICU */
 
 private:
+	//! the connection pool keeps its bookkeeping in the socket, and accept fills in what it already knows
+	friend class CSocketManager;
+
 	//! making private for safety
 	Csock( const Csock & cCopy ) : CSockCommon() {}
 	//! shrink sendbuff by removing m_uSendBufferPos bytes from m_sSend
 	void ShrinkSendBuff();
 	void IncBuffPos( size_t uBytes );
+	//! does the work of Write(), which checks the watermarks after it
+	bool WriteSendBuffer( const char * data, size_t len );
+	//! calls WriteBufferFull() or WriteBufferDrained() and pauses or unpauses the upstream when the queue crosses a watermark
+	void CheckWriteWatermarks();
+	//! WriteBufferFull() and pausing the upstream
+	void SetWriteBufferFull();
+	//! holds reads for a full downstream, separate from PauseRead()
+	void SetBackPressure( bool b );
+	//! counts the connection in GetFastOpens() if the SYN's data was taken, stays pending while the handshake isn't done
+	void CheckFastOpen();
+	//! drops the message ends that were sent, @see WriteUrgent
+	void TrimSendMarks();
+	//! seeds what GetRemoteIP()/GetRemotePort() return, accept already has the address
+	void SetRemoteAddress( const CS_STRING & sIP, uint16_t uPort );
+#ifdef HAVE_LIBSSL
+	//! an SSL_ERROR_WANT_READ or SSL_ERROR_WANT_WRITE means that side of the socket has to wait for its next edge
+	void SSLWouldBlock( int iSSLError );
+#endif /* HAVE_LIBSSL */
+	//! sends what the proxy peer has spliced into our pipe
+	bool SpliceWrite();
+	bool OpenSplicePipe();
+	void CloseSplicePipe();
 	//! checks for configured protocol disabling
 
 	// NOTE! if you add any new members, be sure to add them to Copy()
 	uint16_t	m_uPort;
 	cs_sock_t	m_iReadSock, m_iWriteSock;
 	int 		m_iTimeout, m_iConnType, m_iMethod, m_iTcount, m_iMaxConns;
+	u_int		m_uAcceptBatch;
+	bool		m_bFastOpen, m_bFastOpenPending;
+	int			m_iFastOpenQueue;
+	bool		m_bExclusiveAccept;
+	//! what the last CSOCK_USE_EPOLL edges said, until a read or write hits EAGAIN. Kept in every build, only epoll uses it
+	bool		m_bReadReady, m_bWriteReady;
+	//! the fds as registered with the manager's epoll set, armed while that registration is live
+	cs_sock_t	m_iEdgeRSock, m_iEdgeWSock;
+	bool		m_bEdgeArmed, m_bEdgeQueued;
+	//! the ECT_Read and ECT_Write the manager is waiting for this time around
+	short		m_iEdgeWant;
+	CSSockTuning	m_cTuning;
+	bool		m_bCoalesceWrites, m_bCoalesceCork, m_bCorked, m_bWritePending;
+	size_t		m_uCoalesceThreshold;
+	size_t		m_uWriteHighWater, m_uWriteLowWater;
+	bool		m_bWriteBufferFull;
+	size_t		m_uNotSentLowat;
+	//! where each Write() in the send queue ends, counted from the first byte ever queued. Only kept in low latency mode
+	std::deque<uint64_t>	m_vSendMarks;
+	uint64_t	m_iSendBase, m_iUrgentEnd;
+	Csock *		m_pUpstream;
+	Csock *		m_pDownstream;
+	Csock *		m_pProxyPeer;
+	int			m_aiSplicePipe[2]; //!< carries what the proxy peer read, on its way out this socket
+	size_t		m_uSpliceQueued, m_uSpliceSize;
+	CS_STRING	m_sPoolKey;
+	bool		m_bPoolIdle;
+	uint64_t	m_iPoolIdleSince;
 	bool		m_bUseSSL, m_bIsConnected;
 	bool		m_bsslEstablished, m_bEnableReadLine, m_bPauseRead;
-	CS_STRING	m_shostname, m_sbuffer, m_sSockName, m_sDHParamFile, m_sKeyFile, m_sPemFile, m_sCipherType, m_sParentName;
-	CS_STRING	m_sSend, m_sPemPass;
+	bool		m_bBackPressure; //!< reads held by the downstream's full send queue, @see SetUpstream
+	u_int		m_uFrameHeader;
+	bool		m_bFrameBigEndian;
+	uint64_t	m_uMaxFrame;
+	bool		m_bDatagram, m_bDatagramOffload, m_bDatagramGSO;
+	u_int		m_uDatagramBatch, m_uMaxDatagram;
+	std::vector<CSDatagram>	m_vDatagrams;
+	CS_STRING	m_shostname, m_sbuffer, m_sSockName, m_sParentName;
+	CS_STRING	m_sSend;
 	ECloseType	m_eCloseType;
 
 	// initialized lazily
 	mutable uint16_t	m_iRemotePort, m_iLocalPort;
 	mutable CS_STRING	m_sLocalIP, m_sRemoteIP;
 
-	uint64_t	m_iMaxMilliSeconds, m_iLastSendTime, m_iBytesRead, m_iBytesWritten, m_iStartTime;
+	uint64_t	m_iMaxMilliSeconds, m_iBytesRead, m_iBytesWritten, m_iStartTime;
 	uint32_t	m_iMaxBytes, m_iMaxStoredBufferLength, m_iTimeoutType;
-	size_t		m_iLastSend, m_uSendBufferPos;
+	size_t		m_uSendBufferPos;
+	CSTokenBucket	m_cReadBucket, m_cWriteBucket;
+	// AllowRead()/AllowWrite() note when shaping starts and stops holding the socket back
+	mutable CSSockStats	m_cStats;
 
 	CSSockAddr 	m_address, m_bindhost;
 	bool		m_bIsIPv6, m_bSkipConnect;
@@ -1224,7 +1853,7 @@ private:
 	CS_STRING	m_sSSLBuffer;
 	SSL	*		m_ssl;
 	SSL_CTX	*	m_ssl_ctx;
-	uint32_t	m_iRequireClientCertFlags;
+	CSSSLProfile *	m_pSSLProfile;
 	u_int		m_uDisableProtocols;
 	bool		m_bNoSSLCompression;
 	bool		m_bSSLCipherServerPreference;
@@ -1233,10 +1862,27 @@ private:
 
 	void FREE_SSL();
 	void FREE_CTX();
+	//! records how long the handshake took, only the first call after it started counts
+	void SSLHandshakeDone();
 	bool ConfigureCTXOptions( SSL_CTX * pCTX );
+	//! the profile in use, or the defaults when there is none
+	const CSSSLProfile & SSLProfile() const;
+	//! returns a profile owned solely by this socket, copying a shared one first
+	CSSSLProfile & MutableSSLProfile();
 
 #endif /* HAVE_LIBSSL */
 
+	//! PushBuff() for EnableReadFrame()
+	void PushFrames( const char * data, size_t len );
+	//! hands every complete frame at the start of data to ReadFrame(), returns the bytes used
+	size_t ParseFrames( const char * data, size_t len );
+	uint64_t FrameLength( const char * pHeader ) const;
+
+	//! Write() for datagram sockets, sends what is queued. Returns false once the socket is beyond use
+	bool WriteDatagrams();
+	//! reports an error that only concerns one datagram through SockError(), returns false for errors that break the socket
+	bool DatagramError( int iErrno );
+
 	//! Create the socket
 	cs_sock_t CreateSocket( bool bListen = false, bool bUnix = false );
 	void Init( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 60 );
@@ -1261,6 +1907,48 @@ private:
 #endif
 };
 
+/**
+ * @class CSWriteBatch
+ * @brief collects a Csock::operator<<() expression and hands it to Write() in one call when the expression ends
+ *
+ * Numbers are formatted straight into an inline buffer, nothing is allocated and there are no stringstreams. An
+ * expression that outgrows the buffer is written in pieces. On a datagram socket each Write() is a datagram, so an
+ * expression that fits is exactly one.
+ */
+class CS_EXPORT CSWriteBatch
+{
+public:
+	CSWriteBatch( Csock & cSock ) : m_pSock( &cSock ), m_uLen( 0 ) {}
+	//! takes over what cCopy collected, so only one of them writes it
+	CSWriteBatch( const CSWriteBatch & cCopy );
+	~CSWriteBatch() { Flush(); }
+
+	CSWriteBatch & operator<<( const CS_STRING & s ) { Append( s.data(), s.size() ); return( *this ); }
+	CSWriteBatch & operator<<( const char * psz ) { Append( psz, strlen( psz ) ); return( *this ); }
+	CSWriteBatch & operator<<( std::ostream & ( *io )( std::ostream & ) ) { Append( "\r\n", 2 ); return( *this ); }
+	CSWriteBatch & operator<<( int32_t i ) { return( *this << ( int64_t )i ); }
+	CSWriteBatch & operator<<( uint32_t i ) { return( *this << ( uint64_t )i ); }
+	CSWriteBatch & operator<<( int64_t i );
+	CSWriteBatch & operator<<( uint64_t i );
+	CSWriteBatch & operator<<( float i ) { return( *this << ( double )i ); }
+	CSWriteBatch & operator<<( double i );
+
+	//! lets free operator<<( Csock &, ... ) overloads carry on in the middle of an expression, what came before is written first
+	operator Csock & () { Flush(); return( *m_pSock ); }
+
+	//! appends to the batch, writing what is collected first when it doesn't fit
+	void Append( const char * pData, size_t uLen );
+	//! hands everything collected so far to Write()
+	void Flush();
+
+private:
+	CSWriteBatch & operator=( const CSWriteBatch & ) { return( *this ); }
+
+	Csock *			m_pSock;
+	mutable size_t	m_uLen;
+	char			m_szBuf[512];
+};
+
 /**
  * @class CSConnection
  * @brief options for creating a connection
@@ -1279,6 +1967,8 @@ public:
 		m_iPort = iPort;
 		m_iTimeout = iTimeout;
 		m_bIsSSL = false;
+		m_bDatagram = false;
+		m_bFastOpen = false;
 #ifdef HAVE_LIBSSL
 		m_sCipher = "HIGH";
 #endif /* HAVE_LIBSSL */
@@ -1292,6 +1982,9 @@ public:
 	uint16_t GetPort() const { return( m_iPort ); }
 	int GetTimeout() const { return( m_iTimeout ); }
 	bool GetIsSSL() const { return( m_bIsSSL ); }
+	bool GetDatagram() const { return( m_bDatagram ); }
+	bool GetFastOpen() const { return( m_bFastOpen ); }
+	const CSSockTuning & GetTuning() const { return( m_cTuning ); }
 	CSSockAddr::EAFRequire GetAFRequire() const { return( m_iAFrequire ); }
 
 #ifdef HAVE_LIBSSL
@@ -1314,6 +2007,12 @@ public:
 	void SetTimeout( int i ) { m_iTimeout = i; }
 	//! set to true to enable SSL
 	void SetIsSSL( bool b ) { m_bIsSSL = b; }
+	//! set to true for a connected UDP socket, @see Csock::SetDatagram
+	void SetDatagram( bool b ) { m_bDatagram = b; }
+	//! set to true to send the first write with the SYN, @see Csock::SetFastOpen
+	void SetFastOpen( bool b ) { m_bFastOpen = b; }
+	//! socket options set as soon as the socket is created, @see CSSockTuning
+	void SetTuning( const CSSockTuning & cTuning ) { m_cTuning = cTuning; }
 	//! sets the AF family type required
 	void SetAFRequire( CSSockAddr::EAFRequire iAFRequire ) { m_iAFrequire = iAFRequire; }
 
@@ -1330,7 +2029,8 @@ protected:
 	CS_STRING	m_sHostname, m_sSockName, m_sBindHost;
 	uint16_t	m_iPort;
 	int			m_iTimeout;
-	bool		m_bIsSSL;
+	bool		m_bIsSSL, m_bDatagram, m_bFastOpen;
+	CSSockTuning	m_cTuning;
 	CSSockAddr::EAFRequire	m_iAFrequire;
 #ifdef HAVE_LIBSSL
 	CS_STRING	m_sDHParamLocation, m_sKeyLocation, m_sPemLocation, m_sPemPass, m_sCipher;
@@ -1365,7 +2065,11 @@ public:
 		m_iPort = iPort;
 		m_sBindHost = sBindHost;
 		m_bIsSSL = false;
+		m_bDatagram = false;
 		m_iMaxConns = SOMAXCONN;
+		m_uAcceptBatch = 1;
+		m_iFastOpenQueue = 0;
+		m_bExclusiveAccept = false;
 		m_iTimeout = 0;
 		m_iAFrequire = CSSockAddr::RAF_ANY;
 		m_bDetach = bDetach;
@@ -1382,7 +2086,12 @@ public:
 	const CS_STRING & GetSockName() const { return( m_sSockName ); }
 	const CS_STRING & GetBindHost() const { return( m_sBindHost ); }
 	bool GetIsSSL() const { return( m_bIsSSL ); }
+	bool GetDatagram() const { return( m_bDatagram ); }
 	int GetMaxConns() const { return( m_iMaxConns ); }
+	u_int GetAcceptBatch() const { return( m_uAcceptBatch ); }
+	int GetFastOpenQueue() const { return( m_iFastOpenQueue ); }
+	bool GetExclusiveAccept() const { return( m_bExclusiveAccept ); }
+	const CSSockTuning & GetTuning() const { return( m_cTuning ); }
 	uint32_t GetTimeout() const { return( m_iTimeout ); }
 	CSSockAddr::EAFRequire GetAFRequire() const { return( m_iAFrequire ); }
 #ifdef HAVE_LIBSSL
@@ -1402,8 +2111,18 @@ public:
 	void SetBindHost( const CS_STRING & sBindHost ) { m_sBindHost = sBindHost; }
 	//! set to true to enable SSL
 	void SetIsSSL( bool b ) { m_bIsSSL = b; }
+	//! set to true to bind a UDP socket instead of listening, @see Csock::SetDatagram
+	void SetDatagram( bool b ) { m_bDatagram = b; }
 	//! set max connections as called by accept()
 	void SetMaxConns( int i ) { m_iMaxConns = i; }
+	//! set how many pending connections are accepted per readable event, raise this to drain connect floods faster
+	void SetAcceptBatch( u_int u ) { m_uAcceptBatch = u; }
+	//! accept data in the SYN from up to this many clients waiting for their handshake, 0 turns TCP Fast Open off, @see Csock::SetFastOpenQueue
+	void SetFastOpenQueue( int i ) { m_iFastOpenQueue = i; }
+	//! only wake one of the managers sharing this listener per connection, @see Csock::SetExclusiveAccept
+	void SetExclusiveAccept( bool b ) { m_bExclusiveAccept = b; }
+	//! socket options for the listener and every socket it accepts, @see CSSockTuning
+	void SetTuning( const CSSockTuning & cTuning ) { m_cTuning = cTuning; }
 	//! sets the listen timeout. The listener class will close after timeout has been reached if not 0
 	void SetTimeout( uint32_t i ) { m_iTimeout = i; }
 	//! sets the AF family type required
@@ -1428,9 +2147,11 @@ public:
 private:
 	uint16_t	m_iPort;
 	CS_STRING	m_sSockName, m_sBindHost;
-	bool		m_bIsSSL;
-	bool		m_bDetach;
-	int			m_iMaxConns;
+	bool		m_bIsSSL, m_bDatagram;
+	bool		m_bDetach, m_bExclusiveAccept;
+	int			m_iMaxConns, m_iFastOpenQueue;
+	u_int		m_uAcceptBatch;
+	CSSockTuning	m_cTuning;
 	uint32_t	m_iTimeout;
 	CSSockAddr::EAFRequire	m_iAFrequire;
 
@@ -1452,6 +2173,148 @@ public:
 };
 #endif /* HAVE_LIBSSL */
 
+#ifdef CSOCK_LOOP_STATS
+//! sub buckets per power of two, gives the histogram about 6% precision
+#define CS_HIST_SUB_BUCKETS 16
+//! enough buckets for values up to 2^32 (a bit over an hour in microseconds), larger ones land in the last bucket
+#define CS_HIST_BUCKETS ( 29 * CS_HIST_SUB_BUCKETS )
+
+/**
+ * @class CSHistogram
+ * @brief fixed size log-linear (HDR style) histogram, recording is a couple of shifts and an increment
+ */
+class CS_EXPORT CSHistogram
+{
+public:
+	CSHistogram() { Reset(); }
+
+	void Record( uint64_t iValue );
+	void Reset();
+
+	uint64_t GetCount() const { return( m_iCount ); }
+	uint64_t GetMin() const { return( m_iCount ? m_iMin : 0 ); }
+	uint64_t GetMax() const { return( m_iMax ); }
+	uint64_t GetTotal() const { return( m_iTotal ); }
+	/**
+	 * @brief returns the value at fPercentile (IE 50.0, 99.0, 99.9)
+	 *
+	 * The result is the highest value that falls in the same bucket, so it never under reports
+	 */
+	uint64_t GetPercentile( double fPercentile ) const;
+
+private:
+	static size_t BucketIndex( uint64_t iValue );
+	static uint64_t BucketValue( size_t uIdx );
+
+	uint64_t	m_aiBuckets[CS_HIST_BUCKETS];
+	uint64_t	m_iCount, m_iMin, m_iMax, m_iTotal;
+};
+
+/**
+ * @class CSLoopStats
+ * @brief per phase timings of CSocketManager::Loop() in microseconds, @see CSocketManager::GetLoopStats
+ */
+class CS_EXPORT CSLoopStats
+{
+public:
+	enum EPhase
+	{
+		LPH_CONNSTATE	= 0,	//!< DNS, vhost binding and connecting of outbound sockets
+		LPH_GATHER		= 1,	//!< building the fd sets, this includes the sockets' crons
+		LPH_SELECTWAIT	= 2,	//!< time spent blocked in select()/poll()
+		LPH_DISPATCH	= 3,	//!< writes and accepts after select() returned
+		LPH_READ		= 4,	//!< reading and the read callbacks
+		LPH_TIMEOUTS	= 5,	//!< the timeout sweep
+		LPH_CRON		= 6,	//!< the manager's crons
+		LPH_FLUSH		= 7,	//!< flushing coalesced writes
+		LPH_TOTAL		= 8,	//!< the whole iteration
+
+		LPH_COUNT		= 9
+	};
+
+	static const char * GetPhaseName( EPhase ePhase );
+
+	const CSHistogram & GetPhase( EPhase ePhase ) const { return( m_acPhases[ePhase] ); }
+	//! number of fds select()/poll() reported ready per iteration
+	const CSHistogram & GetEvents() const { return( m_cEvents ); }
+	uint64_t GetIterations() const { return( m_acPhases[LPH_TOTAL].GetCount() ); }
+
+	void RecordPhase( EPhase ePhase, uint64_t iStart, uint64_t iEnd ) { m_acPhases[ePhase].Record( iEnd > iStart ? iEnd - iStart : 0 ); }
+	void RecordEvents( uint64_t iEvents ) { m_cEvents.Record( iEvents ); }
+	void Reset();
+
+private:
+	CSHistogram		m_acPhases[LPH_COUNT];
+	CSHistogram		m_cEvents;
+};
+#endif /* CSOCK_LOOP_STATS */
+
+/**
+ * @class CSManagerStats
+ * @brief manager wide totals, refreshed once a second by CSocketManager::Loop()
+ *
+ * Reading these is cheap no matter how many sockets there are, which is what makes it suitable for
+ * scraping, @see CMetricsSock. The socket counts and traffic are at most a second old, the accept count is live.
+ */
+class CS_EXPORT CSManagerStats
+{
+public:
+	CSManagerStats();
+
+	//! open sockets of a type, @see Csock::ETConn
+	uint64_t GetSocketsByType( int iType ) const;
+	//! open sockets in a connection state, @see Csock::ECONState
+	uint64_t GetSocketsByState( int iState ) const;
+	//! connections accepted since the manager was created
+	uint64_t GetAccepts() const { return( m_iAccepts ); }
+	//! traffic, handshake and DNS totals of every socket, open or closed
+	const CSSockStats & GetTotals() const { return( m_cTotals ); }
+	//! millitime() of the last refresh, 0 if there wasn't one yet
+	uint64_t GetUpdated() const { return( m_iUpdated ); }
+
+private:
+	friend class CSocketManager;
+
+	uint64_t	m_aiSocketsByType[Csock::INBOUND + 1];
+	uint64_t	m_aiSocketsByState[Csock::CST_OK + 1];
+	uint64_t	m_iAccepts, m_iUpdated;
+	CSSockStats	m_cTotals;
+};
+
+/**
+ * @class CSPoolStats
+ * @brief counters of the CSocketManager connection pool, for one key or all of them. @see CSocketManager::GetPoolStats
+ */
+class CS_EXPORT CSPoolStats
+{
+public:
+	CSPoolStats();
+
+	//! AcquireSock() calls that got a connection
+	uint64_t GetHits() const { return( m_iHits ); }
+	//! AcquireSock() calls that came back empty handed
+	uint64_t GetMisses() const { return( m_iMisses ); }
+	//! hits over AcquireSock() calls, 0.0 before the first one
+	double GetHitRate() const;
+	//! ConnectPooled() calls turned away by the per key limit
+	uint64_t GetRefused() const { return( m_iRefused ); }
+	//! idle connections closed because nobody wanted them for SetPoolIdleTimeout() seconds
+	uint64_t GetIdleTimeouts() const { return( m_iIdleTimeouts ); }
+	//! idle connections found closed, or talking out of turn, by the liveness probe
+	uint64_t GetProbeFailures() const { return( m_iProbeFailures ); }
+	//! connections waiting in the pool
+	uint64_t GetIdle() const { return( m_iIdle ); }
+	//! connections handed out or still connecting
+	uint64_t GetActive() const { return( m_iActive ); }
+
+	void Add( const CSPoolStats & cStats );
+
+private:
+	friend class CSocketManager;
+
+	uint64_t	m_iHits, m_iMisses, m_iRefused, m_iIdleTimeouts, m_iProbeFailures, m_iIdle, m_iActive;
+};
+
 /**
  * @class CSocketManager
  * @brief Best class to use to interact with the sockets
@@ -1604,6 +2467,80 @@ public:
 	//! Get the bytes written to all sockets current and past
 	uint64_t GetBytesWritten() const;
 
+	/**
+	 * @brief aggregate shaping of what all sockets accepted by a listener write
+	 * @param sListener the listener's sock name, matched against Csock::GetParentSockName()
+	 * @param uBytesPerSec the sustained rate shared by those sockets, 0 turns it off
+	 * @param uBurst the most bytes that can be sent at once, 0 means one second worth
+	 */
+	void SetListenerWriteRate( const CS_STRING & sListener, uint64_t uBytesPerSec, uint64_t uBurst = 0 );
+	//! aggregate shaping of what all sockets accepted by a listener read, @see SetListenerWriteRate
+	void SetListenerReadRate( const CS_STRING & sListener, uint64_t uBytesPerSec, uint64_t uBurst = 0 );
+	//! manager wide shaping of what all sockets write, @see SetListenerWriteRate
+	void SetGlobalWriteRate( uint64_t uBytesPerSec, uint64_t uBurst = 0 );
+	//! manager wide shaping of what all sockets read, @see SetListenerWriteRate
+	void SetGlobalReadRate( uint64_t uBytesPerSec, uint64_t uBurst = 0 );
+
+	/**
+	 * @brief sums Csock::GetStats() of the open sockets a listener accepted, plus the counters of the ones already closed
+	 * @param sListener the listener's sock name, matched against Csock::GetParentSockName(), empty for sockets without a listener
+	 * @param cStats filled with the totals
+	 */
+	void GetListenerStats( const CS_STRING & sListener, CSSockStats & cStats ) const;
+	//! manager wide totals, @see CSManagerStats
+	const CSManagerStats & GetManagerStats() const { return( m_cManagerStats ); }
+
+	/**
+	 * @brief connects like Connect(), into the pool of cCon's host, port, SSL and bind host
+	 * @param cCon the connection which should be established
+	 * @param pcSock the socket used for the connection, can be NULL
+	 * @return false if the pool already has SetPoolMaxPerKey() connections, pcSock is deleted then
+	 *
+	 * Pooled sockets are used as usual, when the exchange is done hand them back with ReleaseSock() rather than closing
+	 * them. The next AcquireSock() for the same key gets them, connected and past the TLS handshake.
+	 * Closing a pooled socket, or losing it any other way, frees its place in the pool.
+	 */
+	bool ConnectPooled( const CSConnection & cCon, Csock * pcSock = NULL );
+	/**
+	 * @brief takes an idle connection out of cCon's pool
+	 * @return the most recently released connection that is still alive, NULL if there isn't one
+	 *
+	 * Each candidate gets a liveness probe first, a peek at the socket that must find nothing to read. Ones the server
+	 * closed, or that have data nobody asked for, are closed. The socket comes back the way it was released, same
+	 * object and callbacks, with its timeout restarted.
+	 */
+	Csock * AcquireSock( const CSConnection & cCon );
+	/**
+	 * @brief hands a socket from ConnectPooled() or AcquireSock() back to its pool
+	 *
+	 * It's closed instead if it isn't pooled, isn't connected, is being closed or proxied, holds part of a line or
+	 * frame that ReadLine()/ReadFrame() haven't had yet, or its pool already holds SetPoolMaxIdle() idle connections.
+	 * Idle sockets get no ReadData()/Timeout() calls, anything arriving on one but TLS housekeeping closes it. Reads
+	 * paused with PauseRead() are resumed and SetUpstream() links in either direction are dropped.
+	 */
+	void ReleaseSock( Csock * pcSock );
+	//! connections per pool key, idle ones included, 0 means no limit which is the default
+	void SetPoolMaxPerKey( u_int uMax ) { m_uPoolMaxPerKey = uMax; }
+	u_int GetPoolMaxPerKey() const { return( m_uPoolMaxPerKey ); }
+	//! idle connections kept per pool key, 16 by default
+	void SetPoolMaxIdle( u_int uMax ) { m_uPoolMaxIdle = uMax; }
+	u_int GetPoolMaxIdle() const { return( m_uPoolMaxIdle ); }
+	//! seconds an idle connection is kept, 60 by default, 0 keeps them until the server closes them
+	void SetPoolIdleTimeout( u_int uSeconds ) { m_uPoolIdleTimeout = uSeconds; }
+	u_int GetPoolIdleTimeout() const { return( m_uPoolIdleTimeout ); }
+	//! the key ConnectPooled() files cCon under
+	static CS_STRING GetPoolKey( const CSConnection & cCon );
+	//! totals of every pool
+	void GetPoolStats( CSPoolStats & cStats ) const;
+	//! counters of cCon's pool, false if it never had a connection
+	bool GetPoolStats( const CSConnection & cCon, CSPoolStats & cStats ) const;
+
+#ifdef CSOCK_LOOP_STATS
+	//! snapshot of the Loop() phase timings, only available when built with CSOCK_LOOP_STATS
+	void GetLoopStats( CSLoopStats & cStats ) const { cStats = m_cLoopStats; }
+	void ResetLoopStats() { m_cLoopStats.Reset(); }
+#endif /* CSOCK_LOOP_STATS */
+
 	//! this is a strict wrapper around C-api select(). Added in the event you need to do special work here
 	enum ECheckType
 	{
@@ -1632,6 +2569,45 @@ private:
 	//! internal use only
 	virtual void SelectSock( std::map<Csock *, EMessages> & mpeSocks, EMessages eErrno, Csock * pcSock );
 
+	//! chains the socket's buckets under its listener's or the manager wide ones
+	void LinkShaping( Csock * pcSock );
+	CSTokenBucket & GetListenerBucket( std::map<CS_STRING, CSTokenBucket> & mscBuckets, CSTokenBucket & cGlobal, const CS_STRING & sListener );
+	//! rolls every socket's moving averages and recounts the manager wide totals
+	void RefreshStats( uint64_t iNOW );
+	//! true if an idle pooled socket has nothing to say, TLS records that carry no data are consumed
+	bool ProbePooled( Csock * pcSock );
+	//! drops a socket that is being deleted from its pool
+	void UnlinkPooled( Csock * pcSock );
+#ifdef CSOCK_USE_EPOLL
+	//! adds the socket's fds to the epoll set once it's connecting or connected, and again if they change
+	void EdgeWatch( Csock * pcSock );
+	//! forgets a socket that is being deleted
+	void EdgeForget( Csock * pcSock );
+	//! the socket an armed fd belongs to, NULL for fds poll() has to look at
+	Csock * EdgeSock( cs_sock_t iFd ) const;
+	//! lines the socket up for this Select() if it's ready for what it wants
+	void EdgeQueue( Csock * pcSock );
+	//! empties the line after a failed wait, the next Select() lines them up again
+	void EdgeDrop();
+#endif /* CSOCK_USE_EPOLL */
+	//! FDSetCheck() for a socket's own fds, with CSOCK_USE_EPOLL an armed socket only records what it wants
+	void WatchFD( Csock * pcSock, cs_sock_t iFd, std::map< cs_sock_t, short > & miiReadyFds, ECheckType eType );
+
+	class CSPool
+	{
+	public:
+		CSPool() : m_uConns( 0 ) {}
+
+		std::vector<Csock *>	m_vIdle; //!< most recently released last
+		u_int					m_uConns;
+		CSPoolStats				m_cStats;
+	};
+	void GetPoolStats( const CSPool & cPool, CSPoolStats & cStats ) const;
+#ifdef HAVE_LIBSSL
+	//! the shared profile for cCon's SSL settings, made on first use
+	CSSSLProfile * GetSSLProfile( const CSConnection & cCon );
+#endif /* HAVE_LIBSSL */
+
 	////////
 	// Connection State Functions
 
@@ -1642,6 +2618,28 @@ private:
 	uint64_t		m_iBytesRead;
 	uint64_t		m_iBytesWritten;
 	uint64_t		m_iSelectWait;
+
+	CSTokenBucket	m_cGlobalReadBucket, m_cGlobalWriteBucket;
+	std::map<CS_STRING, CSTokenBucket>	m_mscListenerReadBuckets, m_mscListenerWriteBuckets;
+	//! counters of closed sockets, by listener
+	std::map<CS_STRING, CSSockStats>	m_mscRetiredStats;
+	CSSockStats		m_cRetiredStats;
+	CSManagerStats	m_cManagerStats;
+	std::map<CS_STRING, CSPool>	m_mscPools;
+	u_int			m_uPoolMaxPerKey, m_uPoolMaxIdle, m_uPoolIdleTimeout;
+#ifdef HAVE_LIBSSL
+	//! profiles outbound sockets share, by SSL settings. each holds a reference
+	std::map<CS_STRING, CSSSLProfile *>	m_mspSSLProfiles;
+#endif /* HAVE_LIBSSL */
+#ifdef CSOCK_USE_EPOLL
+	int				m_iEpollFD;
+	std::map<cs_sock_t, Csock *>	m_mpEdgeSocks;
+	std::vector<struct epoll_event>	m_vEpollEvents;
+	std::vector<Csock *>	m_vEdgeReady;
+#endif /* CSOCK_USE_EPOLL */
+#ifdef CSOCK_LOOP_STATS
+	CSLoopStats		m_cLoopStats;
+#endif /* CSOCK_LOOP_STATS */
 };
 
 
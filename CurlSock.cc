@@ -30,28 +30,277 @@
  * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include "CurlSock.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <unistd.h>
+#endif /* _WIN32 */
 
 #ifndef _NO_CSOCKET_NS
 namespace Csocket
 {
 #endif /* _NO_CSOCKET_NS */
 
+//! O_DIRECT wants the buffer, length and file offset aligned to the logical block size, this covers any of them
+#define CS_CURL_DIRECT_ALIGN 4096
+#define CS_CURL_DIRECT_BUFFER ( 1024 * 1024 )
+//! a paused transfer has no fd to wake the manager, CanResume() is polled at least this often (ms) while one is
+#define CS_CURL_PAUSE_POLL 10
+
+CCurlFDSink::CCurlFDSink( int iFD, bool bCloseWhenDone )
+{
+	m_iFD = iFD;
+	m_bCloseWhenDone = bCloseWhenDone;
+	m_bDirect = false;
+	m_bPreallocate = false;
+	m_bStarted = false;
+	m_iErrno = 0;
+	m_iBytesWritten = 0;
+	m_pDirectBuf = NULL;
+	m_uDirectLen = 0;
+}
+
+CCurlFDSink::~CCurlFDSink()
+{
+	free( m_pDirectBuf );
+	if( m_bCloseWhenDone && m_iFD >= 0 )
+		close( m_iFD );
+}
+
+bool CCurlFDSink::Open( const CS_STRING & sPath, int iMode )
+{
+	if( m_bCloseWhenDone && m_iFD >= 0 )
+		close( m_iFD );
+	m_iFD = open( sPath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, iMode );
+	m_bCloseWhenDone = true;
+	if( m_iFD < 0 )
+	{
+		m_iErrno = errno;
+		return( false );
+	}
+	if( m_bDirect )
+	{
+		m_bDirect = false;
+		return( SetDirect( true ) );
+	}
+	return( true );
+}
+
+bool CCurlFDSink::SetDirect( bool bDirect )
+{
+#ifdef O_DIRECT
+	if( m_iFD < 0 )
+	{
+		// picked up by Open()
+		m_bDirect = bDirect;
+		return( true );
+	}
+	if( bDirect == m_bDirect )
+		return( true );
+	// the staging buffer has to be flushed before the fd's mode changes under it
+	if( m_bStarted )
+		return( false );
+	int iFlags = fcntl( m_iFD, F_GETFL );
+	if( iFlags < 0 || fcntl( m_iFD, F_SETFL, bDirect ? ( iFlags | O_DIRECT ) : ( iFlags & ~O_DIRECT ) ) != 0 )
+		return( false );
+	if( bDirect && !m_pDirectBuf )
+	{
+		void * pBuf = NULL;
+		if( posix_memalign( &pBuf, CS_CURL_DIRECT_ALIGN, CS_CURL_DIRECT_BUFFER ) != 0 )
+		{
+			fcntl( m_iFD, F_SETFL, iFlags );
+			return( false );
+		}
+		m_pDirectBuf = ( char * )pBuf;
+	}
+	m_bDirect = bDirect;
+	return( true );
+#else
+	return( !bDirect );
+#endif /* O_DIRECT */
+}
+
+bool CCurlFDSink::WriteAll( const char * pData, size_t uBytes )
+{
+	while( uBytes > 0 )
+	{
+		cs_ssize_t iRet = write( m_iFD, pData, uBytes );
+		if( iRet < 0 )
+		{
+			if( errno == EINTR )
+				continue;
+			m_iErrno = errno;
+			return( false );
+		}
+		pData += iRet;
+		uBytes -= ( size_t )iRet;
+		m_iBytesWritten += ( uint64_t )iRet;
+	}
+	return( true );
+}
+
+size_t CCurlFDSink::Write( CURL * pCURL, const char * pData, size_t uBytes )
+{
+	if( m_iFD < 0 || m_iErrno != 0 )
+		return( 0 );
+	if( !m_bStarted )
+	{
+		m_bStarted = true;
+#if defined( __linux__ ) && defined( FALLOC_FL_KEEP_SIZE ) && LIBCURL_VERSION_NUM >= 0x073700
+		curl_off_t iLength = -1;
+		if( m_bPreallocate && curl_easy_getinfo( pCURL, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &iLength ) == CURLE_OK && iLength > 0 )
+		{
+			// only a hint, if the filesystem can't do it the writes still go through
+			off_t iOffset = lseek( m_iFD, 0, SEEK_CUR );
+			if( iOffset >= 0 )
+				fallocate( m_iFD, FALLOC_FL_KEEP_SIZE, iOffset, ( off_t )iLength );
+		}
+#endif /* __linux__ && FALLOC_FL_KEEP_SIZE */
+	}
+	if( !m_bDirect )
+		return( WriteAll( pData, uBytes ) ? uBytes : 0 );
+
+	size_t uLeft = uBytes;
+	while( uLeft > 0 )
+	{
+		size_t uCopy = std::min( uLeft, ( size_t )CS_CURL_DIRECT_BUFFER - m_uDirectLen );
+		memcpy( m_pDirectBuf + m_uDirectLen, pData, uCopy );
+		m_uDirectLen += uCopy;
+		pData += uCopy;
+		uLeft -= uCopy;
+		if( m_uDirectLen == CS_CURL_DIRECT_BUFFER )
+		{
+			if( !WriteAll( m_pDirectBuf, m_uDirectLen ) )
+				return( 0 );
+			m_uDirectLen = 0;
+		}
+	}
+	return( uBytes );
+}
+
+void CCurlFDSink::Finish( CURL * pCURL, CURLcode eResult )
+{
+#ifdef O_DIRECT
+	if( !m_bDirect || m_uDirectLen == 0 || m_iErrno != 0 )
+		return;
+	size_t uAligned = m_uDirectLen - ( m_uDirectLen % CS_CURL_DIRECT_ALIGN );
+	if( uAligned > 0 && !WriteAll( m_pDirectBuf, uAligned ) )
+		return;
+	if( uAligned < m_uDirectLen )
+	{
+		// O_DIRECT can't write a partial block, the tail goes through the page cache
+		int iFlags = fcntl( m_iFD, F_GETFL );
+		if( iFlags >= 0 && fcntl( m_iFD, F_SETFL, iFlags & ~O_DIRECT ) == 0 )
+			m_bDirect = false;
+		WriteAll( m_pDirectBuf + uAligned, m_uDirectLen - uAligned );
+	}
+	m_uDirectLen = 0;
+#endif /* O_DIRECT */
+}
+
+CCurlSockSink::CCurlSockSink( Csock * pTarget, size_t uHighWater, size_t uLowWater )
+{
+	m_pTarget = pTarget;
+	m_uHighWater = uHighWater;
+	m_uLowWater = ( uLowWater ? uLowWater : uHighWater / 2 );
+}
+
+size_t CCurlSockSink::Write( CURL * pCURL, const char * pData, size_t uBytes )
+{
+	if( !m_pTarget || m_pTarget->IsClosed() )
+		return( 0 );
+	if( m_pTarget->GetWriteBufferSize() >= m_uHighWater )
+		return( CURL_WRITEFUNC_PAUSE );
+	return( m_pTarget->Write( pData, uBytes ) ? uBytes : 0 );
+}
+
+bool CCurlSockSink::CanResume()
+{
+	// a target that has gone away resumes too, so the next chunk can fail the transfer
+	return( !m_pTarget || m_pTarget->IsClosed() || m_pTarget->GetWriteBufferSize() <= m_uLowWater );
+}
+
+CCurlBufferSink::CCurlBufferSink( size_t uMax, bool bPauseWhenFull )
+{
+	m_uPos = 0;
+	m_uMax = uMax;
+	m_bPauseWhenFull = bPauseWhenFull;
+	m_bOverflowed = false;
+	m_uHeld = 0;
+}
+
+void CCurlBufferSink::Consume( size_t uBytes )
+{
+	m_uPos += std::min( uBytes, GetSize() );
+	if( m_uPos == m_sBuffer.size() )
+	{
+		m_sBuffer.clear();
+		m_uPos = 0;
+	}
+}
+
+size_t CCurlBufferSink::Write( CURL * pCURL, const char * pData, size_t uBytes )
+{
+	// an empty buffer always takes the chunk, libcurl hands over up to CURL_MAX_WRITE_SIZE at a time and a
+	// smaller uMax would otherwise keep the transfer paused for good
+	if( GetSize() + uBytes > m_uMax && !( m_bPauseWhenFull && GetSize() == 0 ) )
+	{
+		if( m_bPauseWhenFull )
+		{
+			m_uHeld = uBytes;
+			return( CURL_WRITEFUNC_PAUSE );
+		}
+		m_bOverflowed = true;
+		return( 0 );
+	}
+	if( m_uPos > 0 && m_sBuffer.size() + uBytes > m_uMax )
+	{
+		// slide what's left to the front rather than let the string grow past uMax
+		m_sBuffer.erase( 0, m_uPos );
+		m_uPos = 0;
+	}
+	m_sBuffer.append( pData, uBytes );
+	m_uHeld = 0;
+	return( uBytes );
+}
+
+bool CCurlBufferSink::CanResume()
+{
+	// only once the held chunk fits, otherwise it's handed straight back and the transfer pauses again
+	return( GetSize() == 0 || GetSize() + m_uHeld <= m_uMax );
+}
+
 CCurlSock::CCurlSock()
 {
-	m_iTimeout_ms = -1;
 	m_pMultiHandle = NULL;
+	m_bTimerSet = false;
+	m_iTimerDeadline = 0;
+	m_uMaxIdle = 16;
+	m_iMaxHostConns = 0;
+	m_iMaxTotalConns = 0;
+	m_iMaxCachedConns = 0;
+	m_iMaxIdleAge = 0;
+	m_iMaxLifetime = 0;
 }
 
 CCurlSock::~CCurlSock()
 {
-	for( std::map< CURL *, bool >::iterator it = m_pcbCurlHandles.begin(); it != m_pcbCurlHandles.end(); ++it )
+	for( std::set< CURL * >::iterator it = m_spActive.begin(); it != m_spActive.end(); ++it )
 	{
-		CURL * pCurl = it->first;
+		CURL * pCurl = *it;
 		if( m_pMultiHandle )
 			curl_multi_remove_handle( m_pMultiHandle, pCurl );
 		curl_easy_cleanup( pCurl );
 	}
-	m_pcbCurlHandles.clear();
+	m_spActive.clear();
+	for( size_t a = 0; a < m_vIdle.size(); ++a )
+		curl_easy_cleanup( m_vIdle[a] );
+	m_vIdle.clear();
+	for( std::map< CURL *, CCurlSink * >::iterator it = m_mpSinks.begin(); it != m_mpSinks.end(); ++it )
+		CS_Delete( it->second );
+	m_mpSinks.clear();
+	m_vPaused.clear();
 	if( m_pMultiHandle )
 	{
 		curl_multi_cleanup( m_pMultiHandle );
@@ -59,94 +308,223 @@ CCurlSock::~CCurlSock()
 	}
 }
 
-bool CCurlSock::GatherFDsForSelect( std::map< int, int16_t > & miiReadyFds, long & iTimeoutMS )
+bool CCurlSock::GatherFDsForSelect( std::map< cs_sock_t, short > & miiReadyFds, long & iTimeoutMS )
 {
-	if( m_pMultiHandle )
-	{
-		// look for any timeout changes, and any fd changes
-		int iRunningHandles = 0;
-		curl_multi_socket_action( m_pMultiHandle, CURL_SOCKET_TIMEOUT, 0, &iRunningHandles );
+	iTimeoutMS = -1;
+	if( !m_pMultiHandle )
+		return( m_bEnabled );
 
-		if( iRunningHandles >= 1 )
-		{
-			// this means there is a request working
-			size_t uNumFDs = m_miiMonitorFDs.size();
-			if( uNumFDs > 0 )
-			{
-				// the call back came through and there are fd's to work on
-
-				int * aiFDs = ( int * )malloc( sizeof( int ) * uNumFDs );
-				int * pTmp = aiFDs;
-				// cycle through the available fd's and get the specific actions needed to proceed, need to copy as m_miiMonitorFDs might change during the callback
-				for( std::map< int, int16_t >::iterator it = m_miiMonitorFDs.begin(); it != m_miiMonitorFDs.end(); ++it, ++pTmp )
-					*pTmp = it->first;
-				pTmp = aiFDs;
-				for( size_t uCount = 0; uCount < uNumFDs; ++uCount, ++pTmp )
-					curl_multi_socket_action( m_pMultiHandle, aiFDs[uCount], 0, &iRunningHandles );
-				free( aiFDs );
-
-				// cycle through any additional fd's and set them into Csocket to monitor
-				for( std::map< int, int16_t >::iterator it = m_miiMonitorFDs.begin(); it != m_miiMonitorFDs.end(); ++it )
-				{
-					if( it->second > 0 )
-						miiReadyFds[it->first] = it->second;
-				}
-			}
-
-			// change the timeout if reqested to do so
-			if( m_iTimeout_ms >= 0 )
-				iTimeoutMS = m_iTimeout_ms;
-		}
-		// check for anything complete
-		CURLMsg * pMSG = NULL;
-		int iNumMsgQueue = 0;
-		do
+	if( !m_vPaused.empty() )
+		ResumePaused();
+
+	if( m_bTimerSet )
+	{
+		uint64_t iNow = millitime();
+		if( iNow >= m_iTimerDeadline )
 		{
-			pMSG = curl_multi_info_read( m_pMultiHandle, &iNumMsgQueue );
-			if( pMSG && pMSG->msg == CURLMSG_DONE )
-			{
-				OnCURLComplete( pMSG->easy_handle );
-				m_pcbCurlHandles.at( pMSG->easy_handle ) = false;
-			}
+			// the timer is the only thing that drives libcurl without an fd having fired. it may set a new one
+			m_bTimerSet = false;
+			int iRunningHandles = 0;
+			curl_multi_socket_action( m_pMultiHandle, CURL_SOCKET_TIMEOUT, 0, &iRunningHandles );
+			ReadCompleted();
 		}
-		while( pMSG && iNumMsgQueue > 0 );
+		if( m_bTimerSet )
+			iTimeoutMS = ( long )( m_iTimerDeadline > iNow ? m_iTimerDeadline - iNow : 0 );
+	}
+	if( !m_vPaused.empty() && ( iTimeoutMS < 0 || iTimeoutMS > CS_CURL_PAUSE_POLL ) )
+		iTimeoutMS = CS_CURL_PAUSE_POLL;
 
+	for( std::map< cs_sock_t, short >::iterator it = m_miiMonitorFDs.begin(); it != m_miiMonitorFDs.end(); ++it )
+	{
+		if( it->second > 0 )
+			miiReadyFds[it->first] = it->second;
 	}
 
 	return( m_bEnabled );
 }
 
-CURL * CCurlSock::Retr( const CS_STRING & sURL, const CS_STRING & sReferrer )
+bool CCurlSock::CheckFDs( const std::map< cs_sock_t, short > & miiReadyFds )
 {
-	CURL * pCURL = NULL;
-	if( !m_pMultiHandle )
+	if( !m_pMultiHandle || m_miiMonitorFDs.empty() )
+		return( m_bEnabled );
+
+	// collect first, libcurl adds and removes fd's from m_miiMonitorFDs while it works
+	m_vFired.clear();
+	for( std::map< cs_sock_t, short >::iterator it = m_miiMonitorFDs.begin(); it != m_miiMonitorFDs.end(); ++it )
 	{
-		m_pMultiHandle = curl_multi_init();
-		// assign the next functions to get information about the internal fd's and the suggested timeout
-		curl_multi_setopt( m_pMultiHandle, CURLMOPT_SOCKETFUNCTION, CCurlSock::SetupSock );
-		curl_multi_setopt( m_pMultiHandle, CURLMOPT_SOCKETDATA, this );
-		curl_multi_setopt( m_pMultiHandle, CURLMOPT_TIMERFUNCTION, CCurlSock::SetupTimer );
-		curl_multi_setopt( m_pMultiHandle, CURLMOPT_TIMERDATA, this );
+		std::map< cs_sock_t, short >::const_iterator itFD = miiReadyFds.find( it->first );
+		if( itFD == miiReadyFds.end() )
+			continue;
+		int iEvents = 0;
+		if( itFD->second & CSocketManager::ECT_Read )
+			iEvents |= CURL_CSELECT_IN;
+		if( itFD->second & CSocketManager::ECT_Write )
+			iEvents |= CURL_CSELECT_OUT;
+		if( iEvents )
+			m_vFired.push_back( std::make_pair( it->first, iEvents ) );
 	}
-	for( std::map< CURL *, bool >::iterator it = m_pcbCurlHandles.begin(); it != m_pcbCurlHandles.end(); ++it )
+	if( m_vFired.empty() )
+		return( m_bEnabled );
+
+	int iRunningHandles = 0;
+	for( size_t a = 0; a < m_vFired.size(); ++a )
+		curl_multi_socket_action( m_pMultiHandle, m_vFired[a].first, m_vFired[a].second, &iRunningHandles );
+	ReadCompleted();
+
+	return( m_bEnabled );
+}
+
+void CCurlSock::ReadCompleted()
+{
+	CURLMsg * pMSG = NULL;
+	int iNumMsgQueue = 0;
+	while( ( pMSG = curl_multi_info_read( m_pMultiHandle, &iNumMsgQueue ) ) )
 	{
-		if( !it->second )
+		if( pMSG->msg != CURLMSG_DONE )
+			continue;
+		// pMSG is gone once the handle is removed
+		CURL * pCURL = pMSG->easy_handle;
+		CURLcode eResult = pMSG->data.result;
+		curl_multi_remove_handle( m_pMultiHandle, pCURL );
+		m_spActive.erase( pCURL );
+		std::vector< CURL * >::iterator itPaused = std::find( m_vPaused.begin(), m_vPaused.end(), pCURL );
+		if( itPaused != m_vPaused.end() )
+			m_vPaused.erase( itPaused );
+		std::map< CURL *, CCurlSink * >::iterator itSink = m_mpSinks.find( pCURL );
+		if( itSink != m_mpSinks.end() )
+			itSink->second->Finish( pCURL, eResult );
+		OnCURLComplete( pCURL );
+		// looked up again, OnCURLComplete may have done anything to the map
+		itSink = m_mpSinks.find( pCURL );
+		if( itSink != m_mpSinks.end() )
 		{
-			pCURL = it->first;
-			curl_easy_reset( pCURL );
-			break;
+			CS_Delete( itSink->second );
+			m_mpSinks.erase( itSink );
 		}
+		ReleaseHandle( pCURL );
+	}
+}
+
+void CCurlSock::ResumePaused()
+{
+	// resuming hands the held chunk straight back to the sink, which may pause the transfer again
+	std::vector< CURL * > vPaused;
+	vPaused.swap( m_vPaused );
+	for( size_t a = 0; a < vPaused.size(); ++a )
+	{
+		std::map< CURL *, CCurlSink * >::iterator itSink = m_mpSinks.find( vPaused[a] );
+		if( itSink == m_mpSinks.end() || itSink->second->CanResume() )
+			curl_easy_pause( vPaused[a], CURLPAUSE_CONT );
+		else
+			m_vPaused.push_back( vPaused[a] );
+	}
+	ReadCompleted();
+}
+
+bool CCurlSock::SetSink( CURL * pCURL, CCurlSink * pSink )
+{
+	if( m_spActive.find( pCURL ) == m_spActive.end() )
+	{
+		CS_Delete( pSink );
+		return( false );
+	}
+	std::map< CURL *, CCurlSink * >::iterator it = m_mpSinks.find( pCURL );
+	if( it != m_mpSinks.end() )
+	{
+		CS_Delete( it->second );
+		m_mpSinks.erase( it );
+	}
+	if( pSink )
+		m_mpSinks[pCURL] = pSink;
+	return( true );
+}
+
+CCurlSink * CCurlSock::GetSink( CURL * pCURL ) const
+{
+	std::map< CURL *, CCurlSink * >::const_iterator it = m_mpSinks.find( pCURL );
+	return( it != m_mpSinks.end() ? it->second : NULL );
+}
+
+void CCurlSock::ReleaseHandle( CURL * pCURL )
+{
+	if( m_vIdle.size() < m_uMaxIdle )
+		m_vIdle.push_back( pCURL );
+	else
+		curl_easy_cleanup( pCURL );
+}
+
+void CCurlSock::InitMulti()
+{
+	m_pMultiHandle = curl_multi_init();
+	// assign the next functions to get information about the internal fd's and the suggested timeout
+	curl_multi_setopt( m_pMultiHandle, CURLMOPT_SOCKETFUNCTION, CCurlSock::SetupSock );
+	curl_multi_setopt( m_pMultiHandle, CURLMOPT_SOCKETDATA, this );
+	curl_multi_setopt( m_pMultiHandle, CURLMOPT_TIMERFUNCTION, CCurlSock::SetupTimer );
+	curl_multi_setopt( m_pMultiHandle, CURLMOPT_TIMERDATA, this );
+	SetMaxHostConnections( m_iMaxHostConns );
+	SetMaxTotalConnections( m_iMaxTotalConns );
+	SetMaxCachedConnections( m_iMaxCachedConns );
+}
+
+void CCurlSock::SetMaxIdleHandles( size_t uMax )
+{
+	m_uMaxIdle = uMax;
+	while( m_vIdle.size() > m_uMaxIdle )
+	{
+		curl_easy_cleanup( m_vIdle.front() );
+		m_vIdle.erase( m_vIdle.begin() );
 	}
+}
+
+void CCurlSock::SetMaxHostConnections( long iMax )
+{
+	m_iMaxHostConns = iMax;
+	if( m_pMultiHandle )
+		curl_multi_setopt( m_pMultiHandle, CURLMOPT_MAX_HOST_CONNECTIONS, m_iMaxHostConns );
+}
+
+void CCurlSock::SetMaxTotalConnections( long iMax )
+{
+	m_iMaxTotalConns = iMax;
+	if( m_pMultiHandle )
+		curl_multi_setopt( m_pMultiHandle, CURLMOPT_MAX_TOTAL_CONNECTIONS, m_iMaxTotalConns );
+}
+
+void CCurlSock::SetMaxCachedConnections( long iMax )
+{
+	m_iMaxCachedConns = iMax;
+	if( m_pMultiHandle && m_iMaxCachedConns > 0 )
+		curl_multi_setopt( m_pMultiHandle, CURLMOPT_MAXCONNECTS, m_iMaxCachedConns );
+}
+
+void CCurlSock::SetMaxConnectionAge( long iIdleSecs, long iLifeSecs )
+{
+	m_iMaxIdleAge = iIdleSecs;
+	m_iMaxLifetime = iLifeSecs;
+}
 
-	if( !pCURL )
+CURL * CCurlSock::Retr( const CS_STRING & sURL, const CS_STRING & sReferrer )
+{
+	if( !m_pMultiHandle )
+		InitMulti();
+
+	CURL * pCURL = NULL;
+	if( !m_vIdle.empty() )
+	{
+		// the most recently finished handle, its connection is the likeliest to still be good
+		pCURL = m_vIdle.back();
+		m_vIdle.pop_back();
+		curl_easy_reset( pCURL );
+	}
+	else
 	{
 		pCURL = curl_easy_init();
+		if( !pCURL )
+			return( NULL );
+		// empty string means enable cookie handling. the cookie engine survives curl_easy_reset(), only do this once
+		curl_easy_setopt( pCURL, CURLOPT_COOKIEFILE, "" );
 	}
-	m_pcbCurlHandles[pCURL] = false;
-	// prepare the handle, this is just a proof of concept, so doing it right here
-	// you can create a CURL handle for each query, re-use them (to persist connections), drop them off, etc
-	// the easiest method if you are serially retrieving documents is to do them through one CURL handle
-	// otherwise you can make a pool of handles, etc using curl_multi_info_read to see which is ready and so forth
+
 // curl_easy_setopt( pCURL, CURLOPT_VERBOSE, 1 );
 	curl_easy_setopt( pCURL, CURLOPT_FOLLOWLOCATION, 1 );
 	curl_easy_setopt( pCURL, CURLOPT_HTTP_VERSION, CURL_HTTP_VERSION_1_1 );
@@ -154,20 +532,29 @@ CURL * CCurlSock::Retr( const CS_STRING & sURL, const CS_STRING & sReferrer )
 	curl_easy_setopt( pCURL, CURLOPT_SSL_VERIFYPEER, 0 );
 	curl_easy_setopt( pCURL, CURLOPT_WRITEFUNCTION, CCurlSock::WriteData );
 	curl_easy_setopt( pCURL, CURLOPT_HEADERFUNCTION, CCurlSock::WriteHeader );
-	curl_easy_setopt( pCURL, CURLOPT_COOKIEFILE, "" ); // empty string means enable cookie handling
+#if LIBCURL_VERSION_NUM >= 0x074100
+	if( m_iMaxIdleAge > 0 )
+		curl_easy_setopt( pCURL, CURLOPT_MAXAGE_CONN, m_iMaxIdleAge );
+#endif /* LIBCURL_VERSION_NUM >= 0x074100 */
+#if LIBCURL_VERSION_NUM >= 0x075000
+	if( m_iMaxLifetime > 0 )
+		curl_easy_setopt( pCURL, CURLOPT_MAXLIFETIME_CONN, m_iMaxLifetime );
+#endif /* LIBCURL_VERSION_NUM >= 0x075000 */
 
 	// send curl back as the argument to the functions,
 	// and tie this class as a reference to that object for function calls
 	curl_easy_setopt( pCURL, CURLOPT_WRITEDATA, pCURL );
 	curl_easy_setopt( pCURL, CURLOPT_WRITEHEADER, pCURL );
 	curl_easy_setopt( pCURL, CURLOPT_PRIVATE, this );
-	curl_multi_add_handle( m_pMultiHandle, pCURL );
 
-	if( curl_easy_setopt( pCURL, CURLOPT_URL, sURL.c_str() ) != CURLE_OK )
-		return( NULL );
-	if( !sReferrer.empty() && curl_easy_setopt( pCURL, CURLOPT_REFERER, sReferrer.c_str() ) != CURLE_OK )
+	if( curl_easy_setopt( pCURL, CURLOPT_URL, sURL.c_str() ) != CURLE_OK
+		|| ( !sReferrer.empty() && curl_easy_setopt( pCURL, CURLOPT_REFERER, sReferrer.c_str() ) != CURLE_OK )
+		|| curl_multi_add_handle( m_pMultiHandle, pCURL ) != CURLM_OK )
+	{
+		ReleaseHandle( pCURL );
 		return( NULL );
-	m_pcbCurlHandles[pCURL] = true;
+	}
+	m_spActive.insert( pCURL );
 	return( pCURL );
 }
 
@@ -180,7 +567,15 @@ size_t CCurlSock::WriteData( void * pData, size_t uSize, size_t uNemb, void * pC
 	assert( pManager );
 	size_t uBytes = uSize * uNemb;
 //cout.write( (const char *)pData, uBytes );
-	return( pManager->OnBody( pCURL, ( const char * )pData, uBytes ) );
+	if( pManager->m_mpSinks.empty() )
+		return( pManager->OnBody( pCURL, ( const char * )pData, uBytes ) );
+	std::map< CURL *, CCurlSink * >::iterator it = pManager->m_mpSinks.find( pCURL );
+	if( it == pManager->m_mpSinks.end() )
+		return( pManager->OnBody( pCURL, ( const char * )pData, uBytes ) );
+	size_t uRet = it->second->Write( pCURL, ( const char * )pData, uBytes );
+	if( uRet == CURL_WRITEFUNC_PAUSE )
+		pManager->m_vPaused.push_back( pCURL );
+	return( uRet );
 }
 
 size_t CCurlSock::WriteHeader( void * pData, size_t uSize, size_t uNemb, void * pCBPtr )
@@ -223,7 +618,10 @@ int CCurlSock::SetupSock( CURL * pCurl, curl_socket_t iFD, int iWhat, void * pCB
 int CCurlSock::SetupTimer( CURLM * pMulti, long iTimeoutMS, void * pCBPtr )
 {
 	CCurlSock * pManager = static_cast< CCurlSock * >( pCBPtr );
-	pManager->SetTimeoutMS( iTimeoutMS );
+	// -1 cancels the timer, 0 means as soon as possible which is the next GatherFDsForSelect()
+	pManager->m_bTimerSet = ( iTimeoutMS >= 0 );
+	if( pManager->m_bTimerSet )
+		pManager->m_iTimerDeadline = millitime() + ( uint64_t )iTimeoutMS;
 	return( 0 );
 }
 
@@ -40,18 +40,164 @@ namespace Csocket
 {
 #endif /* _NO_CSOCKET_NS */
 
+/**
+ * @class CCurlSink
+ * @brief takes the body of a CCurlSock transfer in place of OnBody(), see CCurlSock::SetSink()
+ *
+ * A sink sees each chunk as it comes off the wire so nothing has to hold on to the whole document. It can have libcurl
+ * hold a chunk by returning CURL_WRITEFUNC_PAUSE from Write(), CCurlSock then polls CanResume() before every select
+ * and offers the same chunk again once it returns true.
+ */
+class CS_EXPORT CCurlSink
+{
+public:
+	CCurlSink() {}
+	virtual ~CCurlSink() {}
+
+	/**
+	 * @brief takes a chunk of the body
+	 * @return uBytes when it was all taken, CURL_WRITEFUNC_PAUSE to have it offered again later, anything else fails the transfer with CURLE_WRITE_ERROR
+	 */
+	virtual size_t Write( CURL * pCURL, const char * pData, size_t uBytes ) = 0;
+	//! polled every loop, and at least every 10ms, while the transfer is paused. return true to have the held chunk offered again
+	virtual bool CanResume() { return( true ); }
+	//! called once the transfer is over, before OnCURLComplete()
+	virtual void Finish( CURL * pCURL, CURLcode eResult ) {}
+};
+
+/**
+ * @class CCurlFDSink
+ * @brief writes the body to a file descriptor
+ *
+ * With SetDirect() the writes bypass the page cache through O_DIRECT, the body is gathered into block aligned
+ * chunks and the unaligned tail is written after dropping O_DIRECT in Finish(). The fd's offset has to be block
+ * aligned when the transfer starts. With SetPreallocate() the space for the Content-Length is reserved on the first
+ * chunk. Both are Linux only and quietly do nothing elsewhere.
+ */
+class CS_EXPORT CCurlFDSink : public CCurlSink
+{
+public:
+	/**
+	 * @param iFD where the body goes, or -1 to Open() a file later
+	 * @param bCloseWhenDone close iFD when the sink is deleted
+	 */
+	CCurlFDSink( int iFD = -1, bool bCloseWhenDone = false );
+	virtual ~CCurlFDSink();
+
+	//! creates or truncates sPath to write to, the sink owns the fd
+	bool Open( const CS_STRING & sPath, int iMode = 0644 );
+	//! switch O_DIRECT on or off, false if the fd or the filesystem won't do it
+	bool SetDirect( bool bDirect );
+	bool GetDirect() const { return( m_bDirect ); }
+	//! reserve the Content-Length with fallocate() before writing
+	void SetPreallocate( bool bPreallocate ) { m_bPreallocate = bPreallocate; }
+	bool GetPreallocate() const { return( m_bPreallocate ); }
+
+	int GetFD() const { return( m_iFD ); }
+	//! errno of the write that failed, 0 if none did
+	int GetErrno() const { return( m_iErrno ); }
+	//! bytes that made it to the fd
+	uint64_t GetBytesWritten() const { return( m_iBytesWritten ); }
+
+	virtual size_t Write( CURL * pCURL, const char * pData, size_t uBytes );
+	virtual void Finish( CURL * pCURL, CURLcode eResult );
+
+private:
+	bool WriteAll( const char * pData, size_t uBytes );
+
+	int			m_iFD;
+	bool		m_bCloseWhenDone;
+	bool		m_bDirect;
+	bool		m_bPreallocate;
+	bool		m_bStarted;
+	int			m_iErrno;
+	uint64_t	m_iBytesWritten;
+	char *		m_pDirectBuf; //!< block aligned staging for O_DIRECT
+	size_t		m_uDirectLen;
+};
+
+/**
+ * @class CCurlSockSink
+ * @brief forwards the body to a Csock, IE a proxy
+ *
+ * Once the target has uHighWater bytes or more waiting in its send queue the transfer is paused, and it picks up again
+ * when the queue is down to uLowWater. The target has to outlive the transfer, SetTarget( NULL ) if it goes away
+ * first and the transfer fails on its next chunk.
+ */
+class CS_EXPORT CCurlSockSink : public CCurlSink
+{
+public:
+	//! uLowWater of 0 is half of uHighWater
+	CCurlSockSink( Csock * pTarget, size_t uHighWater = 256 * 1024, size_t uLowWater = 0 );
+
+	void SetTarget( Csock * pTarget ) { m_pTarget = pTarget; }
+	Csock * GetTarget() const { return( m_pTarget ); }
+
+	virtual size_t Write( CURL * pCURL, const char * pData, size_t uBytes );
+	virtual bool CanResume();
+
+private:
+	Csock *		m_pTarget;
+	size_t		m_uHighWater;
+	size_t		m_uLowWater;
+};
+
+/**
+ * @class CCurlBufferSink
+ * @brief keeps the body in memory, but never more than uMax bytes of it
+ *
+ * Without bPauseWhenFull a body that outgrows uMax fails the transfer. With it the transfer is paused until
+ * Consume() makes room, for callers that work through the body as it arrives. libcurl won't split a chunk, so an
+ * empty buffer takes the next one whole and may hold up to CURL_MAX_WRITE_SIZE (16KB) when uMax is smaller.
+ */
+class CS_EXPORT CCurlBufferSink : public CCurlSink
+{
+public:
+	CCurlBufferSink( size_t uMax, bool bPauseWhenFull = false );
+
+	//! the unconsumed part of the body
+	const char * GetData() const { return( m_sBuffer.data() + m_uPos ); }
+	size_t GetSize() const { return( m_sBuffer.size() - m_uPos ); }
+	//! drop uBytes from the front once they've been dealt with
+	void Consume( size_t uBytes );
+	//! true when the body outgrew the buffer and the transfer was failed
+	bool IsOverflowed() const { return( m_bOverflowed ); }
+
+	virtual size_t Write( CURL * pCURL, const char * pData, size_t uBytes );
+	//! true once the chunk the transfer was paused on fits
+	virtual bool CanResume();
+
+private:
+	CS_STRING	m_sBuffer;
+	size_t		m_uPos;
+	size_t		m_uMax;
+	bool		m_bPauseWhenFull;
+	bool		m_bOverflowed;
+	size_t		m_uHeld; //!< size of the chunk the transfer is paused on
+};
+
 /**
  * @class CCurlSock
  * @brief Csocket style wrapper around libcurl-multi
  *
  * http://curl.haxx.se/libcurl/c/libcurl-multi.html
- * This isn't finished, but this is my basic approach. I added a means to which Csocket can
- * monitor file descriptors it doesn't directly control. This class hooks into that by virtue
- * of a callback "GatherFDsForSelect" and ties that libcurl-multi. When Csocket looks for fd's to
- * monitor, this class calls "curl_multi_socket_action" which does a couple things ...
- * - 1. Calls our CURL callback CCurlSock::SetupSock to let us know the FD's and what they should be monitored for
- * - 2. Calls our CURL callback CCurlSock::SetupTimer which lets us know the maxium wait time for activity
- * - 3. Process any handles that are in a ready state
+ * Csocket can monitor file descriptors it doesn't directly control, this class ties that to the
+ * curl_multi_socket_action() interface. libcurl tells us what to watch and for how long through
+ * two callbacks ...
+ * - 1. CCurlSock::SetupSock adds and removes the fd's and the events they should be monitored for
+ * - 2. CCurlSock::SetupTimer sets the deadline libcurl wants to be woken up at
+ *
+ * GatherFDsForSelect() only hands those fd's and the time left on the deadline to the manager, which folds it into
+ * its select timeout. libcurl is driven for an fd only when the manager reports it ready, and with CURL_SOCKET_TIMEOUT
+ * only once the deadline has passed. Finished transfers are handed to OnCURLComplete().
+ *
+ * CURL handles are pooled. Once a transfer completes its handle goes on an idle list and is picked up again by the
+ * next Retr(), up to SetMaxIdleHandles(). Connections live in the multi handle's cache, shared by every handle, and
+ * are reused according to SetMaxHostConnections(), SetMaxTotalConnections(), SetMaxCachedConnections() and
+ * SetMaxConnectionAge().
+ *
+ * By default the body is handed to OnBody() a chunk at a time. SetSink() sends it to a CCurlSink instead, to write it
+ * to a file, forward it to another socket, or keep a bounded amount of it in memory.
  *
  * The end point here is a non-blocking method to fetch documents via CURL within Csocket
  */
@@ -61,22 +207,63 @@ public:
 	CCurlSock();
 	virtual ~CCurlSock();
 
-	//! the hook we tie into to get events from csocket
-	virtual bool GatherFDsForSelect( std::map< int, int16_t > & miiReadyFds, long & iTimeoutMS );
-	//! reimplement this to do nothing as its not needed
-	virtual bool CheckFDs( const std::map< int, int16_t > & miiReadyFds ) { return( m_bEnabled ); }
+	//! hands the manager the fd's libcurl is waiting on and the time left until its timer is due, firing the timer when it is
+	virtual bool GatherFDsForSelect( std::map< cs_sock_t, short > & miiReadyFds, long & iTimeoutMS );
+	//! drives libcurl for the fd's that fired, and nothing else
+	virtual bool CheckFDs( const std::map< cs_sock_t, short > & miiReadyFds );
 
 	/**
 	 * @brief initiates a GET style transfer, but the process doesn't get started until the next GatherFDsForSelect() is called
 	 * @param sURL the target document
 	 * @param sReferrer the referring URL
+	 * @return the handle running the transfer, or NULL if it couldn't be set up
 	 *
 	 * Its important to check the man page on curl_easy_setopt for the various variables. Certain data is tracked and some is not.
 	 * - CURLOPT_POSTFIELDS used to posting data. It is NOT copied by libcurl, so you have to track it until OnCURLComplete is called and the tranfer is complete
 	 * - CURLOPT_HTTPPOST used for multipart post. The linked list passed to this needs to be tracked, and following OnCURLComplete you should set CURLOPT_HTTPPOST with null and then free your data
+	 *
+	 * The handle goes back to the pool once OnCURLComplete returns, don't hold on to it past that.
 	 */
 	CURL * Retr( const CS_STRING & sURL, const CS_STRING & sReferrer = "" );
 
+	/**
+	 * @brief sends the body of a transfer to pSink instead of OnBody()
+	 * @param pCURL a handle returned by Retr() that hasn't completed yet
+	 * @param pSink the sink, owned by this from here on and deleted after OnCURLComplete() returns
+	 * @return false if pCURL isn't a transfer in progress, pSink is deleted
+	 */
+	bool SetSink( CURL * pCURL, CCurlSink * pSink );
+	//! the sink set for pCURL, NULL if there isn't one. Still good during OnCURLComplete()
+	CCurlSink * GetSink( CURL * pCURL ) const;
+
+	//! the number of transfers in progress
+	size_t GetActiveHandles() const { return( m_spActive.size() ); }
+	//! the number of transfers paused by their sink
+	size_t GetPausedHandles() const { return( m_vPaused.size() ); }
+	//! the number of finished CURL handles waiting to be reused
+	size_t GetIdleHandles() const { return( m_vIdle.size() ); }
+
+	//! how many finished CURL handles to keep for reuse, the rest are cleaned up. Defaults to 16
+	void SetMaxIdleHandles( size_t uMax );
+	size_t GetMaxIdleHandles() const { return( m_uMaxIdle ); }
+	//! CURLMOPT_MAX_HOST_CONNECTIONS, the most connections open to any one host. Transfers over it wait for one to free up. 0 (the default) is unlimited
+	void SetMaxHostConnections( long iMax );
+	long GetMaxHostConnections() const { return( m_iMaxHostConns ); }
+	//! CURLMOPT_MAX_TOTAL_CONNECTIONS, the most connections open at once. 0 (the default) is unlimited
+	void SetMaxTotalConnections( long iMax );
+	long GetMaxTotalConnections() const { return( m_iMaxTotalConns ); }
+	//! CURLMOPT_MAXCONNECTS, how many idle connections are kept for reuse. 0 (the default) leaves it to libcurl
+	void SetMaxCachedConnections( long iMax );
+	long GetMaxCachedConnections() const { return( m_iMaxCachedConns ); }
+	/**
+	 * @brief limits how long a connection is reused for, set on every transfer started after this
+	 * @param iIdleSecs CURLOPT_MAXAGE_CONN, connections idle for longer than this aren't reused. 0 leaves the libcurl default
+	 * @param iLifeSecs CURLOPT_MAXLIFETIME_CONN, connections older than this aren't reused. 0 (the default) is unlimited
+	 *
+	 * Either is ignored when libcurl is too old to support it.
+	 */
+	void SetMaxConnectionAge( long iIdleSecs, long iLifeSecs = 0 );
+
 protected:
 	//! called when the transfer associate with this CURL object is completed
 	virtual void OnCURLComplete( CURL * pCURL ) = 0;
@@ -92,14 +279,29 @@ private:
 	static int SetupSock( CURL * pCurlHandle, curl_socket_t iFD, int iWhat, void * pcbPtr, void * pSockPtr );
 	static int SetupTimer( CURLM * pMulti, long iTimeout_ms, void * pcdPtr );
 
-	void SetTimeoutMS( long iTimeoutMS )
-	{
-		m_iTimeout_ms = iTimeoutMS;
-	}
+	//! creates the multi handle and applies the connection limits
+	void InitMulti();
+	//! hands every finished transfer to OnCURLComplete and returns its handle to the pool
+	void ReadCompleted();
+	//! offers held chunks again to the sinks that are ready for them
+	void ResumePaused();
+	//! puts a handle that is no longer in the multi handle back on the idle list, or cleans it up if that is full
+	void ReleaseHandle( CURL * pCURL );
 
-	long 		m_iTimeout_ms; 	//!< current timeout to use
 	CURLM * 	m_pMultiHandle; //!< the main multi handle
-	std::map< CURL *, bool > m_pcbCurlHandles; //!< map of CURL objects to bools. If the bool is true then that object is in use
+	bool		m_bTimerSet; //!< true when libcurl has a timer pending
+	uint64_t	m_iTimerDeadline; //!< millitime() at which libcurl wants CURL_SOCKET_TIMEOUT
+	std::set< CURL * > m_spActive; //!< handles with a transfer in progress
+	std::vector< CURL * > m_vIdle; //!< finished handles, most recently used last
+	std::map< CURL *, CCurlSink * > m_mpSinks; //!< transfers whose body goes to a sink
+	std::vector< CURL * > m_vPaused; //!< transfers whose sink returned CURL_WRITEFUNC_PAUSE
+	std::vector< std::pair< cs_sock_t, int > > m_vFired; //!< scratch for CheckFDs, fd's that fired and their CURL_CSELECT_* mask
+	size_t		m_uMaxIdle;
+	long		m_iMaxHostConns;
+	long		m_iMaxTotalConns;
+	long		m_iMaxCachedConns;
+	long		m_iMaxIdleAge;
+	long		m_iMaxLifetime;
 };
 
 #ifndef _NO_CSOCKET_NS
@@ -0,0 +1,783 @@
+/**
+ * @file HTTPSock.cc
+ * @author Jim Hull <csocket@jimloco.com>
+ *
+ *    Copyright (c) 1999-2012 Jim Hull <csocket@jimloco.com>
+ *    All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list
+ * of conditions and the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+ * Redistributions in any form must be accompanied by information on how to obtain
+ * complete source code for this software and any accompanying software that uses this software.
+ * The source code must either be included in the distribution or be available for no more than
+ * the cost of distribution plus a nominal fee, and must be freely redistributable
+ * under reasonable conditions. For an executable file, complete source code means the source
+ * code for all modules it contains. It does not include source code for modules or files
+ * that typically accompany the major components of the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE,
+ * OR NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OF THIS SOFTWARE BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "HTTPSock.h"
+
+#ifndef _NO_CSOCKET_NS
+namespace Csocket
+{
+#endif /* _NO_CSOCKET_NS */
+
+static inline char LowerCase( char c )
+{
+	return( ( c >= 'A' && c <= 'Z' ) ? ( char )( c + ( 'a' - 'A' ) ) : c );
+}
+
+static inline bool IsSpace( char c )
+{
+	return( c == ' ' || c == '\t' );
+}
+
+//! control characters other than tab, none of them may appear in a field value
+static inline bool IsCTL( char c )
+{
+	return( ( ( unsigned char )c < 0x20 && c != '\t' ) || c == 0x7f );
+}
+
+static bool SpanEqualsNoCase( const char * pData, size_t uLen, const char * pszOther )
+{
+	size_t a = 0;
+	for( ; a < uLen; ++a )
+	{
+		if( pszOther[a] == 0 || LowerCase( pData[a] ) != LowerCase( pszOther[a] ) )
+			return( false );
+	}
+	return( pszOther[a] == 0 );
+}
+
+//! true if the comma separated list pData holds the token pszToken, case insensitive
+static bool ListHasToken( const char * pData, size_t uLen, const char * pszToken )
+{
+	size_t uPos = 0;
+	while( uPos < uLen )
+	{
+		size_t uEnd = uPos;
+		while( uEnd < uLen && pData[uEnd] != ',' )
+			uEnd++;
+		size_t uStart = uPos;
+		while( uStart < uEnd && IsSpace( pData[uStart] ) )
+			uStart++;
+		size_t uStop = uEnd;
+		while( uStop > uStart && IsSpace( pData[uStop - 1] ) )
+			uStop--;
+		if( SpanEqualsNoCase( pData + uStart, uStop - uStart, pszToken ) )
+			return( true );
+		uPos = uEnd + 1;
+	}
+	return( false );
+}
+
+bool CSHTTPSpan::Equals( const char * pszOther ) const
+{
+	return( strlen( pszOther ) == m_uLen && ( m_uLen == 0 || memcmp( m_pData, pszOther, m_uLen ) == 0 ) );
+}
+
+bool CSHTTPSpan::EqualsNoCase( const char * pszOther ) const
+{
+	return( SpanEqualsNoCase( m_pData, m_uLen, pszOther ) );
+}
+
+bool CSHTTPSpan::HasToken( const char * pszToken ) const
+{
+	return( ListHasToken( m_pData, m_uLen, pszToken ) );
+}
+
+bool CSHTTPRequest::GetHeader( const char * pszName, CSHTTPSpan & cValue ) const
+{
+	for( size_t a = 0; a < m_vHeaders.size(); ++a )
+	{
+		if( m_vHeaders[a].first.EqualsNoCase( pszName ) )
+		{
+			cValue = m_vHeaders[a].second;
+			return( true );
+		}
+	}
+	return( false );
+}
+
+CHTTPSock::CHTTPSock( int iTimeout ) : Csock( iTimeout )
+{
+	InitHTTP();
+}
+
+CHTTPSock::CHTTPSock( const CS_STRING & sHostname, uint16_t uPort, int iTimeout ) : Csock( sHostname, uPort, iTimeout )
+{
+	InitHTTP();
+}
+
+void CHTTPSock::InitHTTP()
+{
+	m_uMaxHeader = 16384;
+	m_uMaxBody = 1048576;
+	m_uMinorVersion = 1;
+	m_bKeepAlive = true;
+	m_bHead = false;
+	m_bInParse = false;
+	m_bPaused = false;
+	m_bUpgraded = false;
+	m_eResponse = RSP_NONE;
+	ResetRequest();
+	EnableWriteCoalescing();
+}
+
+void CHTTPSock::ResetRequest()
+{
+	m_vHeaders.clear();
+	m_sBody.clear();
+	m_cMethod.m_uPos = m_cMethod.m_uLen = 0;
+	m_cTarget.m_uPos = m_cTarget.m_uLen = 0;
+	m_cFirstChunk.m_uPos = m_cFirstChunk.m_uLen = 0;
+	m_uScanned = 0;
+	m_uHeadLen = 0;
+	m_uChunkPos = 0;
+	m_uTrailerPos = 0;
+	m_uChunks = 0;
+	m_uRequestLen = 0;
+	m_uContentLength = 0;
+	m_uBodyLen = 0;
+	m_uError = 0;
+	m_bChunked = false;
+	m_bTrailers = false;
+	m_bExpectContinue = false;
+}
+
+void CHTTPSock::HTTPRequest( const CSHTTPRequest & cRequest )
+{
+	Respond( 404, "text/plain", "Not Found\n" );
+}
+
+void CHTTPSock::ReadData( const char * data, size_t len )
+{
+	if( m_bUpgraded )
+	{
+		UpgradedData( data, len );
+		return;
+	}
+	if( IsClosed() )
+		return;
+
+	if( !m_sBuffer.empty() || m_eResponse != RSP_NONE )
+	{
+		m_sBuffer.append( data, len );
+		if( m_eResponse == RSP_NONE )
+		{
+			size_t uUsed = ParseRequests( m_sBuffer.data(), m_sBuffer.size() );
+			m_sBuffer.erase( 0, uUsed );
+		}
+		else if( m_sBuffer.size() > m_uMaxHeader && !IsReadPaused() )
+		{
+			// still answering, don't let a client that keeps pipelining grow the buffer without end
+			PauseRead();
+			m_bPaused = true;
+		}
+		return;
+	}
+
+	size_t uUsed = ParseRequests( data, len );
+	if( uUsed < len && !IsClosed() )
+		m_sBuffer.append( data + uUsed, len - uUsed );
+}
+
+size_t CHTTPSock::ParseRequests( const char * data, size_t len )
+{
+	m_bInParse = true;
+	size_t uUsed = 0;
+	while( m_eResponse == RSP_NONE && !m_bUpgraded && !IsClosed() && uUsed < len )
+	{
+		if( m_uScanned == 0 )
+		{
+			// stray line breaks in between requests are allowed
+			while( uUsed < len && ( data[uUsed] == '\r' || data[uUsed] == '\n' ) )
+				uUsed++;
+			if( uUsed == len )
+				break;
+		}
+
+		EParse eParse = ParseRequest( data + uUsed, len - uUsed );
+		if( eParse == PRS_MORE )
+			break;
+		if( eParse == PRS_ERROR )
+		{
+			Fail( m_uError );
+			uUsed = len;
+			break;
+		}
+
+		size_t uRequestLen = m_uRequestLen;
+		Deliver( data + uUsed );
+		uUsed += uRequestLen;
+	}
+	m_bInParse = false;
+
+	if( m_bUpgraded && uUsed < len )
+	{
+		// whatever followed the request already belongs to the new protocol
+		UpgradedData( data + uUsed, len - uUsed );
+		uUsed = len;
+	}
+	else if( IsClosed() )
+	{
+		// whatever was pipelined behind the last response is never going to be answered. data may be m_sBuffer,
+		// the callers only erase uUsed bytes from it afterwards
+		m_sBuffer.clear();
+	}
+	return( uUsed );
+}
+
+CHTTPSock::EParse CHTTPSock::ParseRequest( const char * pBase, size_t uLen )
+{
+	if( m_uHeadLen == 0 )
+	{
+		// look for the empty line that ends the headers, carrying on from where the last read stopped
+		size_t uPos = m_uScanned;
+		for( ;; )
+		{
+			const char * pEOL = ( const char * )memchr( pBase + uPos, '\n', uLen - uPos );
+			if( !pEOL )
+			{
+				m_uScanned = uPos;
+				if( uLen > m_uMaxHeader )
+				{
+					m_uError = 431;
+					return( PRS_ERROR );
+				}
+				return( PRS_MORE );
+			}
+			size_t uEOL = ( size_t )( pEOL - pBase );
+			if( uEOL >= m_uMaxHeader )
+			{
+				m_uError = 431;
+				return( PRS_ERROR );
+			}
+			if( uPos > 0 && ( uEOL == uPos || ( uEOL == uPos + 1 && pBase[uPos] == '\r' ) ) )
+			{
+				m_uHeadLen = uEOL + 1;
+				break;
+			}
+			uPos = uEOL + 1;
+			m_uScanned = uPos;
+		}
+
+		if( !ParseHead( pBase ) )
+			return( PRS_ERROR );
+		m_uChunkPos = m_uHeadLen;
+	}
+
+	if( m_bExpectContinue )
+	{
+		m_bExpectContinue = false;
+		if( m_bChunked || uLen - m_uHeadLen < m_uContentLength )
+		{
+			static const char szContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+			Write( szContinue, sizeof( szContinue ) - 1 );
+		}
+	}
+
+	if( m_bChunked )
+	{
+		if( ParseChunks( pBase, uLen ) )
+			return( PRS_DONE );
+		return( m_uError ? PRS_ERROR : PRS_MORE );
+	}
+
+	if( uLen - m_uHeadLen < m_uContentLength )
+		return( PRS_MORE );
+	m_uRequestLen = m_uHeadLen + ( size_t )m_uContentLength;
+	return( PRS_DONE );
+}
+
+bool CHTTPSock::ParseHead( const char * pBase )
+{
+	m_uError = 400;
+
+	// the request line, IE "GET /index.html HTTP/1.1"
+	const char * pEOL = ( const char * )memchr( pBase, '\n', m_uHeadLen );
+	size_t uLineEnd = ( size_t )( pEOL - pBase );
+	size_t uNext = uLineEnd + 1;
+	if( uLineEnd > 0 && pBase[uLineEnd - 1] == '\r' )
+		uLineEnd--;
+	const char * pMethodEnd = ( const char * )memchr( pBase, ' ', uLineEnd );
+	if( !pMethodEnd || pMethodEnd == pBase )
+		return( false );
+	m_cMethod.m_uPos = 0;
+	m_cMethod.m_uLen = ( size_t )( pMethodEnd - pBase );
+	m_cTarget.m_uPos = m_cMethod.m_uLen + 1;
+	const char * pTargetEnd = ( const char * )memchr( pBase + m_cTarget.m_uPos, ' ', uLineEnd - m_cTarget.m_uPos );
+	if( !pTargetEnd || pTargetEnd == pBase + m_cTarget.m_uPos )
+		return( false );
+	m_cTarget.m_uLen = ( size_t )( pTargetEnd - pBase ) - m_cTarget.m_uPos;
+	size_t uVersion = m_cTarget.m_uPos + m_cTarget.m_uLen + 1;
+	if( uLineEnd - uVersion != 8 || memcmp( pBase + uVersion, "HTTP/", 5 ) != 0 )
+		return( false );
+	if( pBase[uVersion + 5] != '1' || pBase[uVersion + 6] != '.' || ( pBase[uVersion + 7] != '0' && pBase[uVersion + 7] != '1' ) )
+	{
+		m_uError = 505;
+		return( false );
+	}
+	m_uMinorVersion = ( u_int )( pBase[uVersion + 7] - '0' );
+
+	bool bContentLength = false, bTransferEncoding = false, bClose = false, bKeepAlive = false;
+	while( uNext < m_uHeadLen )
+	{
+		size_t uPos = uNext;
+		pEOL = ( const char * )memchr( pBase + uPos, '\n', m_uHeadLen - uPos );
+		uLineEnd = ( size_t )( pEOL - pBase );
+		uNext = uLineEnd + 1;
+		if( uLineEnd > uPos && pBase[uLineEnd - 1] == '\r' )
+			uLineEnd--;
+		if( uLineEnd == uPos )
+			break;	// the empty line at the end
+
+		// obsolete line folding is rejected, as is whitespace in front of the colon
+		const char * pColon = ( const char * )memchr( pBase + uPos, ':', uLineEnd - uPos );
+		if( !pColon || pColon == pBase + uPos || IsSpace( pBase[uPos] ) || IsSpace( pColon[-1] ) )
+			return( false );
+		size_t uColon = ( size_t )( pColon - pBase );
+		size_t uValue = uColon + 1;
+		while( uValue < uLineEnd && IsSpace( pBase[uValue] ) )
+			uValue++;
+		size_t uValueEnd = uLineEnd;
+		while( uValueEnd > uValue && IsSpace( pBase[uValueEnd - 1] ) )
+			uValueEnd--;
+		for( size_t a = uValue; a < uValueEnd; ++a )
+		{
+			if( IsCTL( pBase[a] ) )
+				return( false );
+		}
+
+		std::pair<CSpanPos, CSpanPos> cHeader;
+		cHeader.first.m_uPos = uPos;
+		cHeader.first.m_uLen = uColon - uPos;
+		cHeader.second.m_uPos = uValue;
+		cHeader.second.m_uLen = uValueEnd - uValue;
+		m_vHeaders.push_back( cHeader );
+
+		const char * pName = pBase + uPos;
+		const char * pValue = pBase + uValue;
+		size_t uNameLen = cHeader.first.m_uLen;
+		size_t uValueLen = cHeader.second.m_uLen;
+		if( SpanEqualsNoCase( pName, uNameLen, "content-length" ) )
+		{
+			if( uValueLen == 0 || uValueLen > 18 )
+				return( false );
+			uint64_t uLength = 0;
+			for( size_t a = 0; a < uValueLen; ++a )
+			{
+				if( pValue[a] < '0' || pValue[a] > '9' )
+					return( false );
+				uLength = uLength * 10 + ( uint64_t )( pValue[a] - '0' );
+			}
+			// differing duplicates leave no way of knowing where the body ends
+			if( bContentLength && uLength != m_uContentLength )
+				return( false );
+			bContentLength = true;
+			m_uContentLength = uLength;
+		}
+		else if( SpanEqualsNoCase( pName, uNameLen, "transfer-encoding" ) )
+		{
+			// chunked has to be the last coding, anything else can't be framed
+			size_t uLast = uValueLen;
+			while( uLast > 0 && pValue[uLast - 1] != ',' )
+				uLast--;
+			if( !ListHasToken( pValue + uLast, uValueLen - uLast, "chunked" ) )
+			{
+				m_uError = 501;
+				return( false );
+			}
+			bTransferEncoding = true;
+			m_bChunked = true;
+		}
+		else if( SpanEqualsNoCase( pName, uNameLen, "connection" ) )
+		{
+			bClose = bClose || ListHasToken( pValue, uValueLen, "close" );
+			bKeepAlive = bKeepAlive || ListHasToken( pValue, uValueLen, "keep-alive" );
+		}
+		else if( SpanEqualsNoCase( pName, uNameLen, "expect" ) )
+		{
+			if( !SpanEqualsNoCase( pValue, uValueLen, "100-continue" ) )
+			{
+				m_uError = 417;
+				return( false );
+			}
+			m_bExpectContinue = ( m_uMinorVersion > 0 );
+		}
+	}
+
+	// both at once is how requests get smuggled past proxies
+	if( bContentLength && bTransferEncoding )
+		return( false );
+	if( m_uContentLength > m_uMaxBody )
+	{
+		m_uError = 413;
+		return( false );
+	}
+
+	m_bKeepAlive = ( m_uMinorVersion > 0 ? !bClose : ( bKeepAlive && !bClose ) );
+	m_bHead = ( m_cMethod.m_uLen == 4 && memcmp( pBase, "HEAD", 4 ) == 0 );
+	m_uError = 0;
+	return( true );
+}
+
+bool CHTTPSock::ParseChunks( const char * pBase, size_t uLen )
+{
+	for( ;; )
+	{
+		const char * pEOL = ( const char * )memchr( pBase + m_uChunkPos, '\n', uLen - m_uChunkPos );
+		if( m_bTrailers )
+		{
+			// trailers are skipped, up to the empty line that ends the request
+			if( !pEOL )
+			{
+				if( uLen - m_uTrailerPos > m_uMaxHeader )
+					m_uError = 431;
+				return( false );
+			}
+			size_t uLineStart = m_uChunkPos;
+			size_t uLineEnd = ( size_t )( pEOL - pBase );
+			m_uChunkPos = uLineEnd + 1;
+			if( uLineEnd == uLineStart || ( uLineEnd == uLineStart + 1 && pBase[uLineStart] == '\r' ) )
+			{
+				m_uRequestLen = m_uChunkPos;
+				return( true );
+			}
+			if( m_uChunkPos - m_uTrailerPos > m_uMaxHeader )
+			{
+				m_uError = 431;
+				return( false );
+			}
+			continue;
+		}
+
+		// the chunk size line, IE "1a2b;name=value\r\n"
+		if( !pEOL )
+		{
+			if( uLen - m_uChunkPos > 1024 )
+				m_uError = 400;
+			return( false );
+		}
+		size_t uData = ( size_t )( pEOL - pBase ) + 1;
+		uint64_t uSize = 0;
+		size_t uDigits = 0;
+		for( size_t uPos = m_uChunkPos; uPos < uData; ++uPos, ++uDigits )
+		{
+			char c = LowerCase( pBase[uPos] );
+			if( c >= '0' && c <= '9' )
+				uSize = ( uSize << 4 ) | ( uint64_t )( c - '0' );
+			else if( c >= 'a' && c <= 'f' )
+				uSize = ( uSize << 4 ) | ( uint64_t )( c - 'a' + 10 );
+			else
+				break;
+		}
+		if( uDigits == 0 || uDigits > 15 )
+		{
+			m_uError = 400;
+			return( false );
+		}
+
+		if( uSize == 0 )
+		{
+			m_bTrailers = true;
+			m_uChunkPos = uData;
+			m_uTrailerPos = uData;
+			continue;
+		}
+
+		if( m_uBodyLen + uSize > m_uMaxBody )
+		{
+			m_uError = 413;
+			return( false );
+		}
+		if( uLen - uData < uSize + 1 )
+			return( false );
+		size_t uEnd = uData + ( size_t )uSize;
+		size_t uNext = uEnd + 1;
+		if( pBase[uEnd] == '\r' )
+		{
+			if( uLen - uEnd < 2 )
+				return( false );
+			uNext = uEnd + 2;
+			uEnd++;
+		}
+		if( pBase[uEnd] != '\n' )
+		{
+			m_uError = 400;
+			return( false );
+		}
+
+		// a body sent as a single chunk is handed over where it is, more than one has to be joined up
+		if( ++m_uChunks == 1 )
+		{
+			m_cFirstChunk.m_uPos = uData;
+			m_cFirstChunk.m_uLen = ( size_t )uSize;
+		}
+		else
+		{
+			if( m_uChunks == 2 )
+				m_sBody.append( pBase + m_cFirstChunk.m_uPos, m_cFirstChunk.m_uLen );
+			m_sBody.append( pBase + uData, ( size_t )uSize );
+		}
+		m_uBodyLen += uSize;
+		m_uChunkPos = uNext;
+	}
+}
+
+void CHTTPSock::Deliver( const char * pBase )
+{
+	m_cRequest.m_cMethod = CSHTTPSpan( pBase + m_cMethod.m_uPos, m_cMethod.m_uLen );
+	m_cRequest.m_cTarget = CSHTTPSpan( pBase + m_cTarget.m_uPos, m_cTarget.m_uLen );
+	const char * pQuery = ( const char * )memchr( m_cRequest.m_cTarget.data(), '?', m_cTarget.m_uLen );
+	if( pQuery )
+	{
+		size_t uPathLen = ( size_t )( pQuery - m_cRequest.m_cTarget.data() );
+		m_cRequest.m_cPath = CSHTTPSpan( m_cRequest.m_cTarget.data(), uPathLen );
+		m_cRequest.m_cQuery = CSHTTPSpan( pQuery + 1, m_cTarget.m_uLen - uPathLen - 1 );
+	}
+	else
+	{
+		m_cRequest.m_cPath = m_cRequest.m_cTarget;
+		m_cRequest.m_cQuery = CSHTTPSpan();
+	}
+
+	m_cRequest.m_vHeaders.clear();
+	for( size_t a = 0; a < m_vHeaders.size(); ++a )
+	{
+		m_cRequest.m_vHeaders.push_back( std::make_pair( CSHTTPSpan( pBase + m_vHeaders[a].first.m_uPos, m_vHeaders[a].first.m_uLen ),
+			CSHTTPSpan( pBase + m_vHeaders[a].second.m_uPos, m_vHeaders[a].second.m_uLen ) ) );
+	}
+
+	if( !m_bChunked )
+		m_cRequest.m_cBody = CSHTTPSpan( pBase + m_uHeadLen, ( size_t )m_uContentLength );
+	else if( m_uChunks <= 1 )
+		m_cRequest.m_cBody = CSHTTPSpan( pBase + m_cFirstChunk.m_uPos, m_cFirstChunk.m_uLen );
+	else
+		m_cRequest.m_cBody = CSHTTPSpan( m_sBody.data(), m_sBody.size() );
+
+	m_cRequest.m_uMinorVersion = m_uMinorVersion;
+	m_cRequest.m_bKeepAlive = m_bKeepAlive;
+	m_cRequest.m_bChunked = m_bChunked;
+
+	m_eResponse = RSP_PENDING;
+	HTTPRequest( m_cRequest );
+	ResetRequest();
+}
+
+void CHTTPSock::WriteHead( u_int uStatus, const CS_STRING & sContentType, const CS_STRING & sHeaders, const char * pszFraming )
+{
+	char szStatus[16];
+	snprintf( szStatus, sizeof( szStatus ), "%03u ", uStatus );
+	m_sHead.assign( "HTTP/1.1 " ).append( szStatus ).append( GetReason( uStatus ) ).append( "\r\n" );
+	if( !sContentType.empty() )
+		m_sHead.append( "Content-Type: " ).append( sContentType ).append( "\r\n" );
+	m_sHead.append( pszFraming );
+	m_sHead.append( sHeaders );
+	if( !m_bKeepAlive )
+		m_sHead.append( "Connection: close\r\n" );
+	else if( m_uMinorVersion == 0 )
+		m_sHead.append( "Connection: keep-alive\r\n" );
+	m_sHead.append( "\r\n" );
+	Write( m_sHead.data(), m_sHead.size() );
+}
+
+bool CHTTPSock::Respond( u_int uStatus, const CS_STRING & sContentType, const char * pBody, size_t uLen, const CS_STRING & sHeaders )
+{
+	if( m_eResponse != RSP_PENDING )
+		return( false );
+
+	// these never carry a body
+	if( uStatus == 204 || uStatus == 304 || ( uStatus >= 100 && uStatus < 200 ) )
+	{
+		WriteHead( uStatus, sContentType, sHeaders, "" );
+	}
+	else
+	{
+		char szLength[48];
+		snprintf( szLength, sizeof( szLength ), "Content-Length: %llu\r\n", ( unsigned long long )uLen );
+		WriteHead( uStatus, sContentType, sHeaders, szLength );
+		if( !m_bHead && uLen > 0 )
+			Write( pBody, uLen );
+	}
+	FinishResponse();
+	return( true );
+}
+
+bool CHTTPSock::SwitchProtocols( const CS_STRING & sProtocol, const CS_STRING & sHeaders )
+{
+	if( m_eResponse != RSP_PENDING )
+		return( false );
+
+	m_sHead.assign( "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: " ).append( sProtocol ).append( "\r\n" );
+	m_sHead.append( sHeaders ).append( "\r\n" );
+	Write( m_sHead.data(), m_sHead.size() );
+	m_eResponse = RSP_NONE;
+	m_bUpgraded = true;
+	if( m_bPaused )
+	{
+		m_bPaused = false;
+		UnPauseRead();
+	}
+
+	// a switch made after HTTPRequest() returned hands over what was buffered in the meantime
+	if( !m_bInParse && !m_sBuffer.empty() )
+	{
+		CS_STRING sRest;
+		sRest.swap( m_sBuffer );
+		UpgradedData( sRest.data(), sRest.size() );
+	}
+	return( true );
+}
+
+bool CHTTPSock::BeginChunked( u_int uStatus, const CS_STRING & sContentType, const CS_STRING & sHeaders )
+{
+	if( m_eResponse != RSP_PENDING )
+		return( false );
+
+	if( m_uMinorVersion == 0 )
+	{
+		// without chunks closing the connection is the only way to mark the end of the body
+		m_bKeepAlive = false;
+		m_eResponse = RSP_RAW;
+		WriteHead( uStatus, sContentType, sHeaders, "" );
+	}
+	else
+	{
+		m_eResponse = RSP_CHUNKED;
+		WriteHead( uStatus, sContentType, sHeaders, "Transfer-Encoding: chunked\r\n" );
+	}
+	return( true );
+}
+
+bool CHTTPSock::WriteChunk( const char * pData, size_t uLen )
+{
+	if( m_eResponse != RSP_CHUNKED && m_eResponse != RSP_RAW )
+		return( false );
+	// an empty chunk would end the body
+	if( uLen == 0 || m_bHead )
+		return( true );
+
+	if( m_eResponse == RSP_CHUNKED )
+	{
+		char szSize[32];
+		int iSize = snprintf( szSize, sizeof( szSize ), "%llx\r\n", ( unsigned long long )uLen );
+		Write( szSize, ( size_t )iSize );
+		Write( pData, uLen );
+		return( Write( "\r\n", 2 ) );
+	}
+	return( Write( pData, uLen ) );
+}
+
+bool CHTTPSock::EndChunked()
+{
+	if( m_eResponse != RSP_CHUNKED && m_eResponse != RSP_RAW )
+		return( false );
+	if( m_eResponse == RSP_CHUNKED && !m_bHead )
+		Write( "0\r\n\r\n", 5 );
+	FinishResponse();
+	return( true );
+}
+
+void CHTTPSock::FinishResponse()
+{
+	m_eResponse = RSP_NONE;
+	if( !m_bKeepAlive )
+	{
+		// HTTPRequest() may still be running with spans into m_sBuffer, ParseRequests() drops it once the loop is done
+		Close( CLT_AFTERWRITE );
+		if( !m_bInParse )
+			m_sBuffer.clear();
+		return;
+	}
+	Resume();
+}
+
+void CHTTPSock::Fail( u_int uStatus )
+{
+	ResetRequest();
+	m_bKeepAlive = false;
+	m_bHead = false;
+	m_eResponse = RSP_PENDING;
+	CS_STRING sBody( GetReason( uStatus ) );
+	sBody.append( 1, '\n' );
+	Respond( uStatus, "text/plain", sBody );
+}
+
+void CHTTPSock::Resume()
+{
+	// a response that finishes inside HTTPRequest() is picked up by the parse loop that called it
+	if( m_bInParse || IsClosed() )
+		return;
+
+	if( !m_sBuffer.empty() )
+	{
+		size_t uUsed = ParseRequests( m_sBuffer.data(), m_sBuffer.size() );
+		m_sBuffer.erase( 0, uUsed );
+	}
+	if( m_bPaused && m_eResponse == RSP_NONE && !IsClosed() )
+	{
+		m_bPaused = false;
+		UnPauseRead();
+	}
+}
+
+const char * CHTTPSock::GetReason( u_int uStatus )
+{
+	switch( uStatus )
+	{
+		case 100: return( "Continue" );
+		case 101: return( "Switching Protocols" );
+		case 200: return( "OK" );
+		case 201: return( "Created" );
+		case 202: return( "Accepted" );
+		case 204: return( "No Content" );
+		case 206: return( "Partial Content" );
+		case 301: return( "Moved Permanently" );
+		case 302: return( "Found" );
+		case 303: return( "See Other" );
+		case 304: return( "Not Modified" );
+		case 307: return( "Temporary Redirect" );
+		case 308: return( "Permanent Redirect" );
+		case 400: return( "Bad Request" );
+		case 401: return( "Unauthorized" );
+		case 403: return( "Forbidden" );
+		case 404: return( "Not Found" );
+		case 405: return( "Method Not Allowed" );
+		case 408: return( "Request Timeout" );
+		case 409: return( "Conflict" );
+		case 411: return( "Length Required" );
+		case 413: return( "Content Too Large" );
+		case 414: return( "URI Too Long" );
+		case 415: return( "Unsupported Media Type" );
+		case 417: return( "Expectation Failed" );
+		case 426: return( "Upgrade Required" );
+		case 429: return( "Too Many Requests" );
+		case 431: return( "Request Header Fields Too Large" );
+		case 500: return( "Internal Server Error" );
+		case 501: return( "Not Implemented" );
+		case 502: return( "Bad Gateway" );
+		case 503: return( "Service Unavailable" );
+		case 504: return( "Gateway Timeout" );
+		case 505: return( "HTTP Version Not Supported" );
+	}
+	return( "Unknown" );
+}
+
+#ifndef _NO_CSOCKET_NS
+};
+#endif /* _NO_CSOCKET_NS */
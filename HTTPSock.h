@@ -0,0 +1,255 @@
+/**
+ * @file HTTPSock.h
+ * @author Jim Hull <csocket@jimloco.com>
+ *
+ *    Copyright (c) 1999-2012 Jim Hull <csocket@jimloco.com>
+ *    All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list
+ * of conditions and the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+ * Redistributions in any form must be accompanied by information on how to obtain
+ * complete source code for this software and any accompanying software that uses this software.
+ * The source code must either be included in the distribution or be available for no more than
+ * the cost of distribution plus a nominal fee, and must be freely redistributable
+ * under reasonable conditions. For an executable file, complete source code means the source
+ * code for all modules it contains. It does not include source code for modules or files
+ * that typically accompany the major components of the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE,
+ * OR NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OF THIS SOFTWARE BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef HAVE_HTTPSOCK_H
+#define HAVE_HTTPSOCK_H
+
+#include "Csocket.h"
+
+#ifndef _NO_CSOCKET_NS
+namespace Csocket
+{
+#endif /* _NO_CSOCKET_NS */
+
+/**
+ * @class CSHTTPSpan
+ * @brief a run of bytes inside a request, nothing is copied so it is only valid while the request is
+ */
+class CS_EXPORT CSHTTPSpan
+{
+public:
+	CSHTTPSpan() : m_pData( NULL ), m_uLen( 0 ) {}
+	CSHTTPSpan( const char * pData, size_t uLen ) : m_pData( pData ), m_uLen( uLen ) {}
+
+	const char * data() const { return( m_pData ); }
+	size_t size() const { return( m_uLen ); }
+	bool empty() const { return( m_uLen == 0 ); }
+	CS_STRING str() const { return( m_uLen ? CS_STRING( m_pData, m_uLen ) : CS_STRING() ); }
+
+	bool Equals( const char * pszOther ) const;
+	//! case insensitive compare, for header names and tokens
+	bool EqualsNoCase( const char * pszOther ) const;
+	//! true if this comma separated list, IE a Connection header, holds pszToken. case insensitive
+	bool HasToken( const char * pszToken ) const;
+
+private:
+	const char *	m_pData;
+	size_t			m_uLen;
+};
+
+/**
+ * @class CSHTTPRequest
+ * @brief a parsed request as handed to CHTTPSock::HTTPRequest()
+ *
+ * Every span points into the socket's read buffer, copy whatever has to outlive the HTTPRequest() call.
+ */
+class CS_EXPORT CSHTTPRequest
+{
+public:
+	CSHTTPRequest() : m_uMinorVersion( 1 ), m_bKeepAlive( true ), m_bChunked( false ) {}
+
+	//! IE "GET"
+	const CSHTTPSpan & GetMethod() const { return( m_cMethod ); }
+	//! the request target as sent, IE "/path?query"
+	const CSHTTPSpan & GetTarget() const { return( m_cTarget ); }
+	//! the target up to the '?'
+	const CSHTTPSpan & GetPath() const { return( m_cPath ); }
+	//! everything after the '?', empty without one
+	const CSHTTPSpan & GetQuery() const { return( m_cQuery ); }
+	//! 0 for HTTP/1.0, 1 for HTTP/1.1
+	u_int GetMinorVersion() const { return( m_uMinorVersion ); }
+
+	size_t GetHeaderCount() const { return( m_vHeaders.size() ); }
+	const CSHTTPSpan & GetHeaderName( size_t uIdx ) const { return( m_vHeaders[uIdx].first ); }
+	const CSHTTPSpan & GetHeaderValue( size_t uIdx ) const { return( m_vHeaders[uIdx].second ); }
+	//! the first header called pszName, case insensitive. returns false if there isn't one
+	bool GetHeader( const char * pszName, CSHTTPSpan & cValue ) const;
+
+	//! the body, decoded if it was sent chunked
+	const CSHTTPSpan & GetBody() const { return( m_cBody ); }
+	//! whether the connection stays open after the response, from the version and the Connection header
+	bool GetKeepAlive() const { return( m_bKeepAlive ); }
+	//! true if the body arrived with Transfer-Encoding: chunked
+	bool IsChunked() const { return( m_bChunked ); }
+
+private:
+	friend class CHTTPSock;
+
+	CSHTTPSpan		m_cMethod, m_cTarget, m_cPath, m_cQuery, m_cBody;
+	std::vector<std::pair<CSHTTPSpan, CSHTTPSpan> >	m_vHeaders;
+	u_int			m_uMinorVersion;
+	bool			m_bKeepAlive, m_bChunked;
+};
+
+/**
+ * @class CHTTPSock
+ * @brief an HTTP/1.1 server connection, override HTTPRequest() and answer with Respond() or the chunked calls
+ *
+ * Requests are parsed incrementally straight out of the read block. Only a request that is split across reads
+ * is buffered, and the parser picks up where it stopped instead of starting over. Keep-alive and pipelining are
+ * supported, pipelined requests are handed over one at a time and in order: the next one waits until the current
+ * response is finished, which may happen after HTTPRequest() returned. Request bodies may be chunked, responses
+ * may be too with BeginChunked().
+ *
+ * Write coalescing is turned on, so the status line, headers and body of a response, and the responses to a batch
+ * of pipelined requests, leave in as few writes as possible at the end of the Loop() iteration.
+ *
+ * @code
+ * class CHelloSock : public CHTTPSock
+ * {
+ * public:
+ *	CHelloSock( int iTimeout = 60 ) : CHTTPSock( iTimeout ) {}
+ *	CHelloSock( const CS_STRING & sHostname, uint16_t uPort ) : CHTTPSock( sHostname, uPort ) {}
+ *	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CHelloSock( sHostname, uPort ) ); }
+ *	virtual void HTTPRequest( const CSHTTPRequest & cRequest ) { Respond( 200, "text/plain", "hello\n" ); }
+ * };
+ * @endcode
+ */
+class CS_EXPORT CHTTPSock : public Csock
+{
+public:
+	CHTTPSock( int iTimeout = 60 );
+	CHTTPSock( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 60 );
+
+	/**
+	 * @brief a complete request arrived, answer it now or later with Respond() or BeginChunked()
+	 *
+	 * the default answers 404
+	 */
+	virtual void HTTPRequest( const CSHTTPRequest & cRequest );
+
+	/**
+	 * @brief sends a complete response to the current request, Content-Length is filled in
+	 * @param uStatus the status code, IE 200
+	 * @param sContentType the Content-Type, left out when empty
+	 * @param pBody the body, left out for HEAD requests
+	 * @param uLen length of the body
+	 * @param sHeaders extra header lines, each one ending in "\r\n"
+	 * @return false if there is no request waiting for a response
+	 */
+	bool Respond( u_int uStatus, const CS_STRING & sContentType, const char * pBody, size_t uLen, const CS_STRING & sHeaders = "" );
+	bool Respond( u_int uStatus, const CS_STRING & sContentType, const CS_STRING & sBody, const CS_STRING & sHeaders = "" )
+	{
+		return( Respond( uStatus, sContentType, sBody.data(), sBody.length(), sHeaders ) );
+	}
+
+	/**
+	 * @brief starts a response with a body of unknown length, follow up with WriteChunk() and EndChunked()
+	 *
+	 * HTTP/1.0 clients can't take chunks, they get the body as is and the connection is closed once it is done
+	 */
+	bool BeginChunked( u_int uStatus, const CS_STRING & sContentType, const CS_STRING & sHeaders = "" );
+	bool WriteChunk( const char * pData, size_t uLen );
+	bool WriteChunk( const CS_STRING & sData ) { return( WriteChunk( sData.data(), sData.length() ) ); }
+	//! finishes the chunked response and moves on to the next pipelined request
+	bool EndChunked();
+
+	//! true between HTTPRequest() and the end of its response
+	bool IsResponding() const { return( m_eResponse != RSP_NONE ); }
+
+	/**
+	 * @brief answers the current request with 101 Switching Protocols and stops speaking HTTP
+	 * @param sProtocol what goes in the Upgrade header, IE "websocket"
+	 * @param sHeaders extra header lines, each one ending in "\r\n"
+	 * @return false if there is no request waiting for a response
+	 *
+	 * everything read after the request, including what already arrived with it, goes to UpgradedData()
+	 */
+	bool SwitchProtocols( const CS_STRING & sProtocol, const CS_STRING & sHeaders = "" );
+	//! true once SwitchProtocols() was called
+	bool IsUpgraded() const { return( m_bUpgraded ); }
+	//! the data read after SwitchProtocols()
+	virtual void UpgradedData( const char * data, size_t len ) {}
+
+	//! requests with a longer request line and headers are answered 431 and the connection is closed
+	void SetMaxHeaderSize( size_t uMax ) { m_uMaxHeader = uMax; }
+	size_t GetMaxHeaderSize() const { return( m_uMaxHeader ); }
+	//! requests with a larger body are answered 413 and the connection is closed
+	void SetMaxBodySize( uint64_t uMax ) { m_uMaxBody = uMax; }
+	uint64_t GetMaxBodySize() const { return( m_uMaxBody ); }
+
+	//! the reason phrase for uStatus, IE "Not Found" for 404
+	static const char * GetReason( u_int uStatus );
+
+	virtual void ReadData( const char * data, size_t len );
+
+private:
+	enum EParse
+	{
+		PRS_MORE,	//!< the request isn't complete yet
+		PRS_DONE,	//!< m_uRequestLen bytes make up the request
+		PRS_ERROR	//!< the request can't be served, m_uError is the status to answer with
+	};
+
+	enum EResponse
+	{
+		RSP_NONE,		//!< not answering anything
+		RSP_PENDING,	//!< HTTPRequest() was called, nothing sent yet
+		RSP_CHUNKED,	//!< in between BeginChunked() and EndChunked()
+		RSP_RAW			//!< chunked for an HTTP/1.0 client, the body is sent as is
+	};
+
+	void InitHTTP();
+	//! hands every complete request at the start of data to HTTPRequest(), returns the bytes used
+	size_t ParseRequests( const char * data, size_t len );
+	//! continues parsing the request at the start of pBase, all state is relative to pBase so it survives buffering
+	EParse ParseRequest( const char * pBase, size_t uLen );
+	bool ParseHead( const char * pBase );
+	bool ParseChunks( const char * pBase, size_t uLen );
+	void Deliver( const char * pBase );
+	void ResetRequest();
+	void WriteHead( u_int uStatus, const CS_STRING & sContentType, const CS_STRING & sHeaders, const char * pszFraming );
+	void FinishResponse();
+	void Fail( u_int uStatus );
+	void Resume();
+
+	struct CSpanPos
+	{
+		size_t	m_uPos, m_uLen;
+	};
+
+	CS_STRING		m_sBuffer, m_sBody, m_sHead;
+	CSHTTPRequest	m_cRequest;
+	CSpanPos		m_cMethod, m_cTarget, m_cFirstChunk;
+	std::vector<std::pair<CSpanPos, CSpanPos> >	m_vHeaders;
+	size_t			m_uMaxHeader, m_uScanned, m_uHeadLen, m_uChunkPos, m_uTrailerPos, m_uChunks, m_uRequestLen;
+	uint64_t		m_uMaxBody, m_uContentLength, m_uBodyLen;
+	u_int			m_uError, m_uMinorVersion;
+	bool			m_bChunked, m_bTrailers, m_bKeepAlive, m_bHead, m_bExpectContinue;
+	bool			m_bInParse, m_bPaused, m_bUpgraded;
+	EResponse		m_eResponse;
+};
+
+#ifndef _NO_CSOCKET_NS
+};
+#endif /* _NO_CSOCKET_NS */
+
+#endif /* HAVE_HTTPSOCK_H */
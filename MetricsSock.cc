@@ -0,0 +1,326 @@
+/**
+ * @file MetricsSock.cc
+ * @author Jim Hull <csocket@jimloco.com>
+ *
+ *    Copyright (c) 1999-2012 Jim Hull <csocket@jimloco.com>
+ *    All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list
+ * of conditions and the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+ * Redistributions in any form must be accompanied by information on how to obtain
+ * complete source code for this software and any accompanying software that uses this software.
+ * The source code must either be included in the distribution or be available for no more than
+ * the cost of distribution plus a nominal fee, and must be freely redistributable
+ * under reasonable conditions. For an executable file, complete source code means the source
+ * code for all modules it contains. It does not include source code for modules or files
+ * that typically accompany the major components of the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE,
+ * OR NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OF THIS SOFTWARE BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "MetricsSock.h"
+
+#ifndef _NO_CSOCKET_NS
+namespace Csocket
+{
+#endif /* _NO_CSOCKET_NS */
+
+static void AppendFamily( CS_STRING & sOut, const char * pszName, const char * pszType, const char * pszHelp )
+{
+	sOut.append( "# TYPE " ).append( pszName ).append( 1, ' ' ).append( pszType ).append( 1, '\n' );
+	sOut.append( "# HELP " ).append( pszName ).append( 1, ' ' ).append( pszHelp ).append( 1, '\n' );
+}
+
+static void AppendName( CS_STRING & sOut, const char * pszName, const char * pszSuffix, const CS_STRING & sLabels )
+{
+	sOut.append( pszName );
+	if( pszSuffix )
+		sOut.append( pszSuffix );
+	if( !sLabels.empty() )
+		sOut.append( 1, '{' ).append( sLabels ).append( 1, '}' );
+	sOut.append( 1, ' ' );
+}
+
+static void AppendSample( CS_STRING & sOut, const char * pszName, const char * pszSuffix, const CS_STRING & sLabels, uint64_t iValue )
+{
+	char szValue[32];
+	snprintf( szValue, sizeof( szValue ), "%llu\n", ( unsigned long long )iValue );
+	AppendName( sOut, pszName, pszSuffix, sLabels );
+	sOut.append( szValue );
+}
+
+//! microseconds rendered as seconds, without going through floating point
+static void AppendSeconds( CS_STRING & sOut, const char * pszName, const char * pszSuffix, const CS_STRING & sLabels, uint64_t iMicroSeconds )
+{
+	char szValue[48];
+	snprintf( szValue, sizeof( szValue ), "%llu.%06llu\n", ( unsigned long long )( iMicroSeconds / 1000000 ), ( unsigned long long )( iMicroSeconds % 1000000 ) );
+	AppendName( sOut, pszName, pszSuffix, sLabels );
+	sOut.append( szValue );
+}
+
+static void AppendRate( CS_STRING & sOut, const char * pszName, const CS_STRING & sLabels, double fValue )
+{
+	char szValue[48];
+	snprintf( szValue, sizeof( szValue ), "%.1f\n", fValue );
+	AppendName( sOut, pszName, NULL, sLabels );
+	sOut.append( szValue );
+}
+
+static CS_STRING Label( const char * pszName, const char * pszValue )
+{
+	CS_STRING sLabel( pszName );
+	sLabel.append( "=\"" ).append( pszValue ).append( 1, '"' );
+	return( sLabel );
+}
+
+#ifdef CSOCK_LOOP_STATS
+static void AppendHistogram( CS_STRING & sOut, const char * pszName, const CS_STRING & sLabels, const CSHistogram & cHist, bool bSeconds )
+{
+	static const char * apszQuantiles[] = { "0.5", "0.9", "0.99", "0.999" };
+	static const double afPercentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+	for( size_t a = 0; a < sizeof( afPercentiles ) / sizeof( afPercentiles[0] ); ++a )
+	{
+		CS_STRING sQuantile( sLabels );
+		if( !sQuantile.empty() )
+			sQuantile.append( 1, ',' );
+		sQuantile.append( Label( "quantile", apszQuantiles[a] ) );
+		if( bSeconds )
+			AppendSeconds( sOut, pszName, NULL, sQuantile, cHist.GetPercentile( afPercentiles[a] ) );
+		else
+			AppendSample( sOut, pszName, NULL, sQuantile, cHist.GetPercentile( afPercentiles[a] ) );
+	}
+	if( bSeconds )
+		AppendSeconds( sOut, pszName, "_sum", sLabels, cHist.GetTotal() );
+	else
+		AppendSample( sOut, pszName, "_sum", sLabels, cHist.GetTotal() );
+	AppendSample( sOut, pszName, "_count", sLabels, cHist.GetCount() );
+}
+#endif /* CSOCK_LOOP_STATS */
+
+//! everything but the closing "# EOF"
+static void AppendManagerMetrics( const CSocketManager & cManager, CS_STRING & sOut )
+{
+	const CSManagerStats & cStats = cManager.GetManagerStats();
+	const CSSockStats & cTotals = cStats.GetTotals();
+	CS_STRING sNone;
+
+	AppendFamily( sOut, "csocket_sockets", "gauge", "Open sockets by type." );
+	AppendSample( sOut, "csocket_sockets", NULL, Label( "type", "outbound" ), cStats.GetSocketsByType( Csock::OUTBOUND ) );
+	AppendSample( sOut, "csocket_sockets", NULL, Label( "type", "listener" ), cStats.GetSocketsByType( Csock::LISTENER ) );
+	AppendSample( sOut, "csocket_sockets", NULL, Label( "type", "inbound" ), cStats.GetSocketsByType( Csock::INBOUND ) );
+
+	AppendFamily( sOut, "csocket_socket_states", "gauge", "Open sockets by connection state." );
+	AppendSample( sOut, "csocket_socket_states", NULL, Label( "state", "dns" ), cStats.GetSocketsByState( Csock::CST_DNS ) );
+	AppendSample( sOut, "csocket_socket_states", NULL, Label( "state", "bindvhost" ), cStats.GetSocketsByState( Csock::CST_BINDVHOST ) );
+	AppendSample( sOut, "csocket_socket_states", NULL, Label( "state", "destdns" ), cStats.GetSocketsByState( Csock::CST_DESTDNS ) );
+	AppendSample( sOut, "csocket_socket_states", NULL, Label( "state", "connect" ), cStats.GetSocketsByState( Csock::CST_CONNECT ) );
+	AppendSample( sOut, "csocket_socket_states", NULL, Label( "state", "connectssl" ), cStats.GetSocketsByState( Csock::CST_CONNECTSSL ) );
+	AppendSample( sOut, "csocket_socket_states", NULL, Label( "state", "ok" ), cStats.GetSocketsByState( Csock::CST_OK ) );
+
+	AppendFamily( sOut, "csocket_accepts", "counter", "Connections accepted." );
+	AppendSample( sOut, "csocket_accepts", "_total", sNone, cStats.GetAccepts() );
+
+	AppendFamily( sOut, "csocket_closed_sockets", "counter", "Sockets closed, listeners excluded." );
+	AppendSample( sOut, "csocket_closed_sockets", "_total", sNone, cTotals.GetRetired() );
+
+	AppendFamily( sOut, "csocket_bytes", "counter", "Bytes moved by all sockets, open and closed." );
+	AppendSample( sOut, "csocket_bytes", "_total", Label( "direction", "read" ), cTotals.GetBytesRead() );
+	AppendSample( sOut, "csocket_bytes", "_total", Label( "direction", "written" ), cTotals.GetBytesWritten() );
+
+	AppendFamily( sOut, "csocket_syscalls", "counter", "read() and write() calls, SSL_read() and SSL_write() included." );
+	AppendSample( sOut, "csocket_syscalls", "_total", Label( "direction", "read" ), cTotals.GetReadCalls() );
+	AppendSample( sOut, "csocket_syscalls", "_total", Label( "direction", "written" ), cTotals.GetWriteCalls() );
+
+	AppendFamily( sOut, "csocket_would_block", "counter", "Reads and writes that returned EAGAIN." );
+	AppendSample( sOut, "csocket_would_block", "_total", Label( "direction", "read" ), cTotals.GetReadEAGAIN() );
+	AppendSample( sOut, "csocket_would_block", "_total", Label( "direction", "written" ), cTotals.GetWriteEAGAIN() );
+
+	AppendFamily( sOut, "csocket_send_queue_bytes", "gauge", "Bytes waiting in the send buffers of open sockets." );
+	AppendSample( sOut, "csocket_send_queue_bytes", NULL, sNone, cTotals.GetSendQueue() );
+
+	AppendFamily( sOut, "csocket_throughput_bytes_per_second", "gauge", "Moving average of the throughput of open sockets." );
+	AppendRate( sOut, "csocket_throughput_bytes_per_second", Label( "direction", "read" ), cTotals.GetReadRate() );
+	AppendRate( sOut, "csocket_throughput_bytes_per_second", Label( "direction", "written" ), cTotals.GetWriteRate() );
+
+	AppendFamily( sOut, "csocket_shaped_seconds", "counter", "Time sockets were held back by rate shaping." );
+	AppendSeconds( sOut, "csocket_shaped_seconds", "_total", Label( "direction", "read" ), cTotals.GetReadShapedMS() * 1000 );
+	AppendSeconds( sOut, "csocket_shaped_seconds", "_total", Label( "direction", "written" ), cTotals.GetWriteShapedMS() * 1000 );
+
+	AppendFamily( sOut, "csocket_tls_handshake_seconds", "summary", "Completed TLS handshakes and the time they took." );
+	AppendSeconds( sOut, "csocket_tls_handshake_seconds", "_sum", sNone, cTotals.GetSSLHandshakeUS() );
+	AppendSample( sOut, "csocket_tls_handshake_seconds", "_count", sNone, cTotals.GetSSLHandshakes() );
+
+	AppendFamily( sOut, "csocket_dns_lookup_seconds", "summary", "Completed DNS lookups and the time they took." );
+	AppendSeconds( sOut, "csocket_dns_lookup_seconds", "_sum", sNone, cTotals.GetDNSUS() );
+	AppendSample( sOut, "csocket_dns_lookup_seconds", "_count", sNone, cTotals.GetDNSLookups() );
+
+	AppendFamily( sOut, "csocket_fast_open_tries", "counter", "Connections made with TCP Fast Open, or accepted by a listener that takes it." );
+	AppendSample( sOut, "csocket_fast_open_tries", "_total", sNone, cTotals.GetFastOpenTries() );
+	AppendFamily( sOut, "csocket_fast_open_accepted", "counter", "TCP Fast Open connections whose SYN data was accepted." );
+	AppendSample( sOut, "csocket_fast_open_accepted", "_total", sNone, cTotals.GetFastOpens() );
+
+	CSPoolStats cPool;
+	cManager.GetPoolStats( cPool );
+	AppendFamily( sOut, "csocket_pool_connections", "gauge", "Pooled outbound connections, waiting in the pool or handed out." );
+	AppendSample( sOut, "csocket_pool_connections", NULL, Label( "state", "idle" ), cPool.GetIdle() );
+	AppendSample( sOut, "csocket_pool_connections", NULL, Label( "state", "active" ), cPool.GetActive() );
+
+	AppendFamily( sOut, "csocket_pool_acquires", "counter", "AcquireSock() calls, by whether an idle connection was there." );
+	AppendSample( sOut, "csocket_pool_acquires", "_total", Label( "result", "hit" ), cPool.GetHits() );
+	AppendSample( sOut, "csocket_pool_acquires", "_total", Label( "result", "miss" ), cPool.GetMisses() );
+
+	AppendFamily( sOut, "csocket_pool_evictions", "counter", "Idle pooled connections closed." );
+	AppendSample( sOut, "csocket_pool_evictions", "_total", Label( "reason", "idle_timeout" ), cPool.GetIdleTimeouts() );
+	AppendSample( sOut, "csocket_pool_evictions", "_total", Label( "reason", "probe" ), cPool.GetProbeFailures() );
+
+	AppendFamily( sOut, "csocket_pool_refused", "counter", "ConnectPooled() calls over the per key connection limit." );
+	AppendSample( sOut, "csocket_pool_refused", "_total", sNone, cPool.GetRefused() );
+
+#ifdef CSOCK_LOOP_STATS
+	CSLoopStats cLoop;
+	cManager.GetLoopStats( cLoop );
+	AppendFamily( sOut, "csocket_loop_phase_seconds", "summary", "Time spent in each phase of Loop()." );
+	for( int iPhase = 0; iPhase < CSLoopStats::LPH_COUNT; ++iPhase )
+	{
+		CSLoopStats::EPhase ePhase = ( CSLoopStats::EPhase )iPhase;
+		AppendHistogram( sOut, "csocket_loop_phase_seconds", Label( "phase", CSLoopStats::GetPhaseName( ePhase ) ), cLoop.GetPhase( ePhase ), true );
+	}
+	AppendFamily( sOut, "csocket_loop_ready_fds", "summary", "File descriptors select() or poll() reported ready per Loop()." );
+	AppendHistogram( sOut, "csocket_loop_ready_fds", sNone, cLoop.GetEvents(), false );
+#endif /* CSOCK_LOOP_STATS */
+}
+
+CMetricsSock::CMetricsSock( CSocketManager * pManager, int iTimeout ) : Csock( iTimeout )
+{
+	m_pManager = pManager;
+	m_uHeaderLines = 0;
+	m_bReplied = false;
+	m_pListener = NULL;
+	EnableReadLine();
+}
+
+CMetricsSock::CMetricsSock( CSocketManager * pManager, const CS_STRING & sHostname, uint16_t uPort, int iTimeout )
+	: Csock( sHostname, uPort, iTimeout )
+{
+	m_pManager = pManager;
+	m_uHeaderLines = 0;
+	m_bReplied = false;
+	m_pListener = NULL;
+	EnableReadLine();
+}
+
+CMetricsSock::~CMetricsSock()
+{
+	if( m_pListener )
+		m_pListener->m_ssConnections.erase( this );
+	for( std::set<CMetricsSock *>::iterator it = m_ssConnections.begin(); it != m_ssConnections.end(); ++it )
+		( *it )->m_pListener = NULL;
+}
+
+bool CMetricsSock::ListenMetrics( CSocketManager * pManager, uint16_t uPort, const CS_STRING & sBindHost, uint16_t * piRandPort )
+{
+	CSListener cListen( uPort, sBindHost );
+	cListen.SetSockName( "metrics" );
+	return( pManager->Listen( cListen, new CMetricsSock( pManager ), piRandPort ) );
+}
+
+void CMetricsSock::Render( const CSocketManager & cManager, CS_STRING & sOut )
+{
+	AppendManagerMetrics( cManager, sOut );
+	sOut.append( "# EOF\n" );
+}
+
+Csock * CMetricsSock::GetSockObj( const CS_STRING & sHostname, uint16_t uPort )
+{
+	// a plain CMetricsSock, a subclass' AppendMetrics() is reached through m_pListener
+	CMetricsSock * pSock = new CMetricsSock( m_pManager, sHostname, uPort );
+	pSock->m_pListener = this;
+	m_ssConnections.insert( pSock );
+	return( pSock );
+}
+
+void CMetricsSock::ReadLine( const CS_STRING & sLine )
+{
+	// one request per connection, anything pipelined behind it is ignored
+	if( m_bReplied )
+		return;
+
+	CS_STRING::size_type uLen = sLine.length();
+	while( uLen > 0 && ( sLine[uLen - 1] == '\n' || sLine[uLen - 1] == '\r' ) )
+		uLen--;
+
+	if( m_sMethod.empty() )
+	{
+		// the request line, IE "GET /metrics HTTP/1.1"
+		CS_STRING::size_type uMethodEnd = sLine.find( ' ' );
+		if( uMethodEnd == CS_STRING::npos || uMethodEnd == 0 || uMethodEnd >= uLen )
+		{
+			Reply( "400 Bad Request", "text/plain", "Bad Request\n" );
+			return;
+		}
+		m_sMethod = sLine.substr( 0, uMethodEnd );
+		CS_STRING::size_type uPathEnd = sLine.find_first_of( " ?", uMethodEnd + 1 );
+		if( uPathEnd == CS_STRING::npos || uPathEnd > uLen )
+			uPathEnd = uLen;
+		m_sPath = sLine.substr( uMethodEnd + 1, uPathEnd - uMethodEnd - 1 );
+		return;
+	}
+
+	if( uLen > 0 )
+	{
+		// none of the headers matter, just don't let them go on forever
+		if( ++m_uHeaderLines > 100 )
+			Close();
+		return;
+	}
+
+	if( m_sMethod != "GET" )
+	{
+		Reply( "405 Method Not Allowed", "text/plain", "Method Not Allowed\n" );
+	}
+	else if( m_sPath != "/metrics" )
+	{
+		Reply( "404 Not Found", "text/plain", "Not Found\n" );
+	}
+	else
+	{
+		CS_STRING sBody;
+		AppendManagerMetrics( *m_pManager, sBody );
+		( m_pListener ? m_pListener : this )->AppendMetrics( sBody );
+		sBody.append( "# EOF\n" );
+		Reply( "200 OK", "application/openmetrics-text; version=1.0.0; charset=utf-8", sBody );
+	}
+}
+
+void CMetricsSock::ReachedMaxBuffer()
+{
+	Close();
+}
+
+void CMetricsSock::Reply( const CS_STRING & sStatus, const CS_STRING & sContentType, const CS_STRING & sBody )
+{
+	char szLength[32];
+	snprintf( szLength, sizeof( szLength ), "%llu", ( unsigned long long )sBody.length() );
+	CS_STRING sReply( "HTTP/1.1 " );
+	sReply.append( sStatus ).append( "\r\nContent-Type: " ).append( sContentType );
+	sReply.append( "\r\nContent-Length: " ).append( szLength ).append( "\r\nConnection: close\r\n\r\n" );
+	sReply.append( sBody );
+	m_bReplied = true;
+	Write( sReply );
+	Close( CLT_AFTERWRITE );
+}
+
+#ifndef _NO_CSOCKET_NS
+};
+#endif /* _NO_CSOCKET_NS */
@@ -0,0 +1,101 @@
+/**
+ * @file MetricsSock.h
+ * @author Jim Hull <csocket@jimloco.com>
+ *
+ *    Copyright (c) 1999-2012 Jim Hull <csocket@jimloco.com>
+ *    All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list
+ * of conditions and the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+ * Redistributions in any form must be accompanied by information on how to obtain
+ * complete source code for this software and any accompanying software that uses this software.
+ * The source code must either be included in the distribution or be available for no more than
+ * the cost of distribution plus a nominal fee, and must be freely redistributable
+ * under reasonable conditions. For an executable file, complete source code means the source
+ * code for all modules it contains. It does not include source code for modules or files
+ * that typically accompany the major components of the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE,
+ * OR NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OF THIS SOFTWARE BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef HAVE_METRICSSOCK_H
+#define HAVE_METRICSSOCK_H
+
+#include "Csocket.h"
+
+#ifndef _NO_CSOCKET_NS
+namespace Csocket
+{
+#endif /* _NO_CSOCKET_NS */
+
+/**
+ * @class CMetricsSock
+ * @brief serves CSocketManager statistics as OpenMetrics text over HTTP, for Prometheus and friends to scrape
+ *
+ * Everything is rendered from CSManagerStats, the CSPoolStats totals and, when built with CSOCK_LOOP_STATS, CSLoopStats.
+ * They are kept up to date as the manager goes, so a scrape costs the same no matter how many sockets it holds.
+ *
+ * @code
+ * CMetricsSock::ListenMetrics( &cManager, 9100 );
+ * @endcode
+ *
+ * Only GET /metrics is answered, one request per connection. A subclass only needs to override AppendMetrics(), the
+ * connections accepted by its listener render through the listener.
+ */
+class CS_EXPORT CMetricsSock : public Csock
+{
+public:
+	CMetricsSock( CSocketManager * pManager, int iTimeout = 30 );
+	CMetricsSock( CSocketManager * pManager, const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 30 );
+	virtual ~CMetricsSock();
+
+	/**
+	 * @brief starts a metrics listener on pManager
+	 * @param pManager the manager to report on, the listener is added to it too
+	 * @param uPort the port to listen on, 0 picks a random one
+	 * @param sBindHost the address to listen on, defaults to loopback only
+	 * @param piRandPort if uPort is 0, this is set to the port that was picked
+	 * @return true if the listener is up
+	 */
+	static bool ListenMetrics( CSocketManager * pManager, uint16_t uPort, const CS_STRING & sBindHost = "127.0.0.1", uint16_t * piRandPort = NULL );
+
+	//! renders the OpenMetrics exposition of cManager, including the closing "# EOF"
+	static void Render( const CSocketManager & cManager, CS_STRING & sOut );
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort );
+	virtual void ReadLine( const CS_STRING & sLine );
+	virtual void ReachedMaxBuffer();
+
+protected:
+	//! override to add metric families of your own, called before the closing "# EOF" is appended
+	virtual void AppendMetrics( CS_STRING & sOut ) {}
+
+private:
+	void Reply( const CS_STRING & sStatus, const CS_STRING & sContentType, const CS_STRING & sBody );
+
+	CSocketManager *	m_pManager;
+	CS_STRING			m_sMethod, m_sPath;
+	u_int				m_uHeaderLines;
+	bool				m_bReplied;
+	//! the listener that accepted this connection, its AppendMetrics() is the one that runs
+	CMetricsSock *		m_pListener;
+	//! on a listener, the connections that point back at it
+	std::set<CMetricsSock *>	m_ssConnections;
+};
+
+#ifndef _NO_CSOCKET_NS
+};
+#endif /* _NO_CSOCKET_NS */
+
+#endif /* HAVE_METRICSSOCK_H */
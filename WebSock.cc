@@ -0,0 +1,851 @@
+/**
+ * @file WebSock.cc
+ * @author Jim Hull <csocket@jimloco.com>
+ *
+ *    Copyright (c) 1999-2012 Jim Hull <csocket@jimloco.com>
+ *    All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list
+ * of conditions and the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+ * Redistributions in any form must be accompanied by information on how to obtain
+ * complete source code for this software and any accompanying software that uses this software.
+ * The source code must either be included in the distribution or be available for no more than
+ * the cost of distribution plus a nominal fee, and must be freely redistributable
+ * under reasonable conditions. For an executable file, complete source code means the source
+ * code for all modules it contains. It does not include source code for modules or files
+ * that typically accompany the major components of the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE,
+ * OR NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OF THIS SOFTWARE BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "WebSock.h"
+
+#ifndef _NO_CSOCKET_NS
+namespace Csocket
+{
+#endif /* _NO_CSOCKET_NS */
+
+class CWebSockPing : public CCron
+{
+public:
+	CWebSockPing( CWebSock * pSock ) : CCron(), m_pSock( pSock ) { SetName( "websocket-ping" ); }
+
+protected:
+	virtual void RunJob() { m_pSock->PingTimer(); }
+
+private:
+	CWebSock *	m_pSock;
+};
+
+static inline uint32_t RotateLeft( uint32_t uValue, int iBits )
+{
+	return( ( uValue << iBits ) | ( uValue >> ( 32 - iBits ) ) );
+}
+
+//! only ever hashes the handshake key, so small beats fast
+static void HashSHA1( const unsigned char * pData, size_t uLen, unsigned char aDigest[20] )
+{
+	uint32_t aState[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	uint64_t uBits = ( uint64_t )uLen * 8;
+	size_t uTotal = ( ( uLen + 8 ) / 64 + 1 ) * 64;
+	for( size_t uBlock = 0; uBlock < uTotal; uBlock += 64 )
+	{
+		uint32_t aWords[80];
+		for( size_t a = 0; a < 64; ++a )
+		{
+			size_t uPos = uBlock + a;
+			uint32_t uByte = 0;
+			if( uPos < uLen )
+				uByte = pData[uPos];
+			else if( uPos == uLen )
+				uByte = 0x80;
+			else if( uPos >= uTotal - 8 )
+				uByte = ( uint32_t )( ( uBits >> ( 8 * ( uTotal - 1 - uPos ) ) ) & 0xff );
+			if( a % 4 == 0 )
+				aWords[a / 4] = 0;
+			aWords[a / 4] |= uByte << ( 8 * ( 3 - a % 4 ) );
+		}
+		for( size_t a = 16; a < 80; ++a )
+			aWords[a] = RotateLeft( aWords[a - 3] ^ aWords[a - 8] ^ aWords[a - 14] ^ aWords[a - 16], 1 );
+
+		uint32_t uA = aState[0], uB = aState[1], uC = aState[2], uD = aState[3], uE = aState[4];
+		for( size_t a = 0; a < 80; ++a )
+		{
+			uint32_t uF, uK;
+			if( a < 20 )
+			{
+				uF = ( uB & uC ) | ( ~uB & uD );
+				uK = 0x5A827999;
+			}
+			else if( a < 40 )
+			{
+				uF = uB ^ uC ^ uD;
+				uK = 0x6ED9EBA1;
+			}
+			else if( a < 60 )
+			{
+				uF = ( uB & uC ) | ( uB & uD ) | ( uC & uD );
+				uK = 0x8F1BBCDC;
+			}
+			else
+			{
+				uF = uB ^ uC ^ uD;
+				uK = 0xCA62C1D6;
+			}
+			uint32_t uTemp = RotateLeft( uA, 5 ) + uF + uE + uK + aWords[a];
+			uE = uD;
+			uD = uC;
+			uC = RotateLeft( uB, 30 );
+			uB = uA;
+			uA = uTemp;
+		}
+		aState[0] += uA;
+		aState[1] += uB;
+		aState[2] += uC;
+		aState[3] += uD;
+		aState[4] += uE;
+	}
+	for( size_t a = 0; a < 20; ++a )
+		aDigest[a] = ( unsigned char )( aState[a / 4] >> ( 8 * ( 3 - a % 4 ) ) );
+}
+
+static void Base64( const unsigned char * pData, size_t uLen, CS_STRING & sOut )
+{
+	static const char szTable[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	sOut.clear();
+	for( size_t a = 0; a < uLen; a += 3 )
+	{
+		uint32_t uGroup = ( uint32_t )pData[a] << 16;
+		if( a + 1 < uLen )
+			uGroup |= ( uint32_t )pData[a + 1] << 8;
+		if( a + 2 < uLen )
+			uGroup |= pData[a + 2];
+		sOut.append( 1, szTable[( uGroup >> 18 ) & 0x3f] );
+		sOut.append( 1, szTable[( uGroup >> 12 ) & 0x3f] );
+		sOut.append( 1, a + 1 < uLen ? szTable[( uGroup >> 6 ) & 0x3f] : '=' );
+		sOut.append( 1, a + 2 < uLen ? szTable[uGroup & 0x3f] : '=' );
+	}
+}
+
+#ifdef HAVE_ZLIB
+static CS_STRING Trim( const CS_STRING & sIn )
+{
+	CS_STRING::size_type uStart = sIn.find_first_not_of( " \t" );
+	if( uStart == CS_STRING::npos )
+		return( "" );
+	return( sIn.substr( uStart, sIn.find_last_not_of( " \t" ) - uStart + 1 ) );
+}
+#endif /* HAVE_ZLIB */
+
+static bool ValidCloseCode( uint16_t uCode )
+{
+	if( uCode >= 3000 && uCode <= 4999 )
+		return( true );
+	return( uCode >= 1000 && uCode <= 1014 && uCode != 1004 && uCode != 1005 && uCode != 1006 );
+}
+
+CWebSock::CWebSock( int iTimeout ) : CHTTPSock( iTimeout )
+{
+	InitWebSock();
+}
+
+CWebSock::CWebSock( const CS_STRING & sHostname, uint16_t uPort, int iTimeout ) : CHTTPSock( sHostname, uPort, iTimeout )
+{
+	InitWebSock();
+}
+
+CWebSock::~CWebSock()
+{
+#ifdef HAVE_ZLIB
+	FreeZlib();
+#endif /* HAVE_ZLIB */
+}
+
+void CWebSock::InitWebSock()
+{
+	m_uHeaderHave = 0;
+	m_uMaskPos = 0;
+	m_uCompressThreshold = 64;
+	m_uRemaining = 0;
+	m_uMaxMessage = 16777216;
+	m_uOpcode = 0;
+	m_uMessageOpcode = 0;
+	m_bInFrame = false;
+	m_bFin = false;
+	m_bCompressed = false;
+	m_bMessageCompressed = false;
+	m_bCloseSent = false;
+	m_bAwaitingPong = false;
+#ifdef HAVE_ZLIB
+	m_bAllowDeflate = true;
+	m_pInflate = NULL;
+	m_pDeflate = NULL;
+#else
+	m_bAllowDeflate = false;
+#endif /* HAVE_ZLIB */
+	m_bDeflate = false;
+	m_bServerNoContext = false;
+	m_bClientNoContext = false;
+	m_iServerWindowBits = 15;
+	m_pPing = NULL;
+}
+
+CS_STRING CWebSock::AcceptKey( const CS_STRING & sKey )
+{
+	CS_STRING sInput( sKey );
+	sInput.append( "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" );
+	unsigned char aDigest[20];
+	HashSHA1( ( const unsigned char * )sInput.data(), sInput.size(), aDigest );
+	CS_STRING sAccept;
+	Base64( aDigest, sizeof( aDigest ), sAccept );
+	return( sAccept );
+}
+
+void CWebSock::Unmask( char * pData, size_t uLen, const unsigned char * pMask, size_t uOffset )
+{
+	// the mask repeats every 4 bytes, so lined up against uOffset it makes a 64 bit key
+	unsigned char aKey[8];
+	for( size_t a = 0; a < sizeof( aKey ); ++a )
+		aKey[a] = pMask[( uOffset + a ) & 3];
+	uint64_t uKey;
+	memcpy( &uKey, aKey, sizeof( uKey ) );
+
+	size_t uPos = 0;
+	for( ; uPos + 32 <= uLen; uPos += 32 )
+	{
+		uint64_t aWords[4];
+		memcpy( aWords, pData + uPos, sizeof( aWords ) );
+		aWords[0] ^= uKey;
+		aWords[1] ^= uKey;
+		aWords[2] ^= uKey;
+		aWords[3] ^= uKey;
+		memcpy( pData + uPos, aWords, sizeof( aWords ) );
+	}
+	for( ; uPos + 8 <= uLen; uPos += 8 )
+	{
+		uint64_t uWord;
+		memcpy( &uWord, pData + uPos, sizeof( uWord ) );
+		uWord ^= uKey;
+		memcpy( pData + uPos, &uWord, sizeof( uWord ) );
+	}
+	for( ; uPos < uLen; ++uPos )
+		pData[uPos] = ( char )( pData[uPos] ^ aKey[uPos & 7] );
+}
+
+bool CWebSock::IsValidUTF8( const char * pData, size_t uLen )
+{
+	const unsigned char * pBytes = ( const unsigned char * )pData;
+	size_t uPos = 0;
+	while( uPos < uLen )
+	{
+		// plain ASCII goes 8 bytes at a time
+		if( uPos + 8 <= uLen )
+		{
+			uint64_t uWord;
+			memcpy( &uWord, pBytes + uPos, sizeof( uWord ) );
+			if( ( uWord & 0x8080808080808080ULL ) == 0 )
+			{
+				uPos += 8;
+				continue;
+			}
+		}
+
+		unsigned char uLead = pBytes[uPos];
+		if( uLead < 0x80 )
+		{
+			uPos++;
+			continue;
+		}
+
+		size_t uFollow;
+		uint32_t uCode, uMin;
+		if( ( uLead & 0xE0 ) == 0xC0 )
+		{
+			uFollow = 1;
+			uCode = uLead & 0x1F;
+			uMin = 0x80;
+		}
+		else if( ( uLead & 0xF0 ) == 0xE0 )
+		{
+			uFollow = 2;
+			uCode = uLead & 0x0F;
+			uMin = 0x800;
+		}
+		else if( ( uLead & 0xF8 ) == 0xF0 )
+		{
+			uFollow = 3;
+			uCode = uLead & 0x07;
+			uMin = 0x10000;
+		}
+		else
+		{
+			return( false );
+		}
+
+		if( uLen - uPos - 1 < uFollow )
+			return( false );
+		for( size_t a = 1; a <= uFollow; ++a )
+		{
+			unsigned char uByte = pBytes[uPos + a];
+			if( ( uByte & 0xC0 ) != 0x80 )
+				return( false );
+			uCode = ( uCode << 6 ) | ( uByte & 0x3F );
+		}
+		// overlong forms, surrogates and anything past the last plane
+		if( uCode < uMin || uCode > 0x10FFFF || ( uCode >= 0xD800 && uCode <= 0xDFFF ) )
+			return( false );
+		uPos += uFollow + 1;
+	}
+	return( true );
+}
+
+void CWebSock::HTTPRequest( const CSHTTPRequest & cRequest )
+{
+	CSHTTPSpan cUpgrade, cConnection, cVersion, cKey;
+	if( !cRequest.GetHeader( "Upgrade", cUpgrade ) || !cUpgrade.HasToken( "websocket" )
+	        || !cRequest.GetHeader( "Connection", cConnection ) || !cConnection.HasToken( "upgrade" ) )
+	{
+		Respond( 426, "text/plain", "Upgrade Required\n", "Upgrade: websocket\r\n" );
+		return;
+	}
+	if( !cRequest.GetMethod().Equals( "GET" ) || cRequest.GetMinorVersion() < 1 )
+	{
+		Respond( 400, "text/plain", "Bad Request\n" );
+		return;
+	}
+	if( !cRequest.GetHeader( "Sec-WebSocket-Version", cVersion ) || !cVersion.Equals( "13" ) )
+	{
+		Respond( 426, "text/plain", "Upgrade Required\n", "Sec-WebSocket-Version: 13\r\n" );
+		return;
+	}
+	// 16 random bytes, base64 encoded
+	if( !cRequest.GetHeader( "Sec-WebSocket-Key", cKey ) || cKey.size() != 24 )
+	{
+		Respond( 400, "text/plain", "Bad Request\n" );
+		return;
+	}
+	if( !WebSocketRequest( cRequest ) )
+	{
+		Respond( 403, "text/plain", "Forbidden\n" );
+		return;
+	}
+
+	CS_STRING sHeaders( "Sec-WebSocket-Accept: " );
+	sHeaders.append( AcceptKey( cKey.str() ) ).append( "\r\n" );
+	if( !m_sProtocol.empty() )
+		sHeaders.append( "Sec-WebSocket-Protocol: " ).append( m_sProtocol ).append( "\r\n" );
+	CSHTTPSpan cExtensions;
+	CS_STRING sDeflate;
+	if( m_bAllowDeflate && cRequest.GetHeader( "Sec-WebSocket-Extensions", cExtensions ) && NegotiateDeflate( cExtensions, sDeflate ) )
+		sHeaders.append( "Sec-WebSocket-Extensions: " ).append( sDeflate ).append( "\r\n" );
+
+	SwitchProtocols( "websocket", sHeaders );
+	WebSocketOpened();
+}
+
+bool CWebSock::NegotiateDeflate( const CSHTTPSpan & cOffers, CS_STRING & sResponse )
+{
+#ifdef HAVE_ZLIB
+	// IE "permessage-deflate; client_max_window_bits, permessage-deflate", take the first offer we can honour
+	CS_STRING sOffers( cOffers.str() );
+	CS_STRING::size_type uPos = 0;
+	while( uPos <= sOffers.size() )
+	{
+		CS_STRING::size_type uComma = sOffers.find( ',', uPos );
+		if( uComma == CS_STRING::npos )
+			uComma = sOffers.size();
+		CS_STRING sOffer( sOffers.substr( uPos, uComma - uPos ) );
+		uPos = uComma + 1;
+
+		CS_STRING::size_type uParam = sOffer.find( ';' );
+		CS_STRING sName( Trim( sOffer.substr( 0, uParam ) ) );
+		if( !CSHTTPSpan( sName.data(), sName.size() ).EqualsNoCase( "permessage-deflate" ) )
+			continue;
+
+		bool bServerNoContext = false, bClientNoContext = false, bUsable = true;
+		int iServerWindowBits = 15;
+		sResponse = "permessage-deflate";
+		while( uParam != CS_STRING::npos && bUsable )
+		{
+			CS_STRING::size_type uNext = sOffer.find( ';', uParam + 1 );
+			CS_STRING sParam( Trim( sOffer.substr( uParam + 1, uNext == CS_STRING::npos ? CS_STRING::npos : uNext - uParam - 1 ) ) );
+			uParam = uNext;
+
+			CS_STRING sValue;
+			CS_STRING::size_type uEquals = sParam.find( '=' );
+			if( uEquals != CS_STRING::npos )
+			{
+				sValue = Trim( sParam.substr( uEquals + 1 ) );
+				sParam = Trim( sParam.substr( 0, uEquals ) );
+				if( sValue.size() >= 2 && sValue[0] == '"' && sValue[sValue.size() - 1] == '"' )
+					sValue = sValue.substr( 1, sValue.size() - 2 );
+			}
+
+			if( sParam == "server_no_context_takeover" && sValue.empty() && !bServerNoContext )
+			{
+				bServerNoContext = true;
+				sResponse.append( "; server_no_context_takeover" );
+			}
+			else if( sParam == "client_no_context_takeover" && sValue.empty() && !bClientNoContext )
+			{
+				bClientNoContext = true;
+				sResponse.append( "; client_no_context_takeover" );
+			}
+			else if( sParam == "server_max_window_bits" && iServerWindowBits == 15 )
+			{
+				// zlib quietly turns a window of 8 bits into 9, which the client couldn't inflate
+				int iBits = atoi( sValue.c_str() );
+				if( iBits < 9 || iBits > 15 )
+					bUsable = false;
+				iServerWindowBits = iBits;
+				sResponse.append( "; server_max_window_bits=" ).append( sValue );
+			}
+			else if( sParam == "client_max_window_bits" )
+			{
+				// a full window inflates whatever the client picks
+				if( !sValue.empty() && ( atoi( sValue.c_str() ) < 8 || atoi( sValue.c_str() ) > 15 ) )
+					bUsable = false;
+			}
+			else
+			{
+				bUsable = false;
+			}
+		}
+		if( !bUsable )
+			continue;
+
+		m_bDeflate = true;
+		m_bServerNoContext = bServerNoContext;
+		m_bClientNoContext = bClientNoContext;
+		m_iServerWindowBits = iServerWindowBits;
+		return( true );
+	}
+#endif /* HAVE_ZLIB */
+	return( false );
+}
+
+void CWebSock::UpgradedData( const char * data, size_t len )
+{
+	while( len > 0 && !IsClosed() )
+	{
+		if( !m_bInFrame )
+		{
+			// the header is 2 to 14 bytes, the second byte says how many. it may well be split across reads
+			size_t uNeed = 2;
+			if( m_uHeaderHave >= 2 )
+			{
+				u_int uLen7 = m_aHeader[1] & 0x7f;
+				uNeed += ( uLen7 == 126 ? 2 : ( uLen7 == 127 ? 8 : 0 ) ) + ( m_aHeader[1] & 0x80 ? 4 : 0 );
+			}
+			size_t uTake = ( uNeed - m_uHeaderHave < len ? uNeed - m_uHeaderHave : len );
+			memcpy( m_aHeader + m_uHeaderHave, data, uTake );
+			m_uHeaderHave += uTake;
+			data += uTake;
+			len -= uTake;
+			if( m_uHeaderHave < uNeed || ( uNeed == 2 && ( m_aHeader[1] & 0x80 || ( m_aHeader[1] & 0x7f ) >= 126 ) ) )
+				continue;
+			if( !ParseFrameHeader() )
+				return;
+			continue;
+		}
+
+		// stream the payload into place as it comes, unmasking on the way
+		size_t uTake = ( m_uRemaining < len ? ( size_t )m_uRemaining : len );
+		CS_STRING & sDest = ( m_uOpcode >= 8 ? m_sControl : m_sMessage );
+		size_t uOld = sDest.size();
+		sDest.append( data, uTake );
+		Unmask( &sDest[uOld], uTake, m_aMask, m_uMaskPos );
+		m_uMaskPos += uTake;
+		m_uRemaining -= uTake;
+		data += uTake;
+		len -= uTake;
+		if( m_uRemaining == 0 )
+			FrameDone();
+	}
+}
+
+bool CWebSock::ParseFrameHeader()
+{
+	m_uHeaderHave = 0;
+	m_bFin = ( m_aHeader[0] & 0x80 ) != 0;
+	m_bCompressed = ( m_aHeader[0] & 0x40 ) != 0;
+	m_uOpcode = m_aHeader[0] & 0x0f;
+
+	// clients have to mask every frame, and RSV2/RSV3 belong to extensions we never agree to
+	if( ( m_aHeader[0] & 0x30 ) || !( m_aHeader[1] & 0x80 ) )
+	{
+		ProtocolError( WSC_PROTOCOL_ERROR );
+		return( false );
+	}
+
+	uint64_t uLen = m_aHeader[1] & 0x7f;
+	size_t uPos = 2;
+	if( uLen == 126 )
+	{
+		uLen = ( ( uint64_t )m_aHeader[2] << 8 ) | m_aHeader[3];
+		uPos = 4;
+	}
+	else if( uLen == 127 )
+	{
+		uLen = 0;
+		for( uPos = 2; uPos < 10; ++uPos )
+			uLen = ( uLen << 8 ) | m_aHeader[uPos];
+		if( uLen >> 63 )
+		{
+			ProtocolError( WSC_PROTOCOL_ERROR );
+			return( false );
+		}
+	}
+	memcpy( m_aMask, m_aHeader + uPos, sizeof( m_aMask ) );
+
+	if( m_uOpcode >= 8 )
+	{
+		// control frames may arrive in between the fragments of a message, but can't be fragmented themselves
+		if( m_uOpcode > 10 || !m_bFin || uLen > 125 || m_bCompressed )
+		{
+			ProtocolError( WSC_PROTOCOL_ERROR );
+			return( false );
+		}
+		m_sControl.clear();
+	}
+	else
+	{
+		if( m_uOpcode == 0 )
+		{
+			if( m_uMessageOpcode == 0 || m_bCompressed )
+			{
+				ProtocolError( WSC_PROTOCOL_ERROR );
+				return( false );
+			}
+		}
+		else if( m_uOpcode <= 2 && m_uMessageOpcode == 0 && ( !m_bCompressed || m_bDeflate ) )
+		{
+			m_uMessageOpcode = m_uOpcode;
+			m_bMessageCompressed = m_bCompressed;
+		}
+		else
+		{
+			ProtocolError( WSC_PROTOCOL_ERROR );
+			return( false );
+		}
+		if( m_sMessage.size() + uLen > m_uMaxMessage )
+		{
+			ProtocolError( WSC_TOO_BIG );
+			return( false );
+		}
+	}
+
+	m_uRemaining = uLen;
+	m_uMaskPos = 0;
+	m_bInFrame = true;
+	if( m_uRemaining == 0 )
+		FrameDone();
+	return( !IsClosed() );
+}
+
+void CWebSock::FrameDone()
+{
+	m_bInFrame = false;
+	switch( m_uOpcode )
+	{
+		case 8:
+		{
+			uint16_t uCode = WSC_NO_STATUS;
+			CS_STRING sReason;
+			if( m_sControl.size() == 1 )
+			{
+				ProtocolError( WSC_PROTOCOL_ERROR );
+				return;
+			}
+			if( m_sControl.size() >= 2 )
+			{
+				uCode = ( uint16_t )( ( ( unsigned char )m_sControl[0] << 8 ) | ( unsigned char )m_sControl[1] );
+				if( !ValidCloseCode( uCode ) )
+				{
+					ProtocolError( WSC_PROTOCOL_ERROR );
+					return;
+				}
+				sReason = m_sControl.substr( 2 );
+				if( !IsValidUTF8( sReason.data(), sReason.size() ) )
+				{
+					ProtocolError( WSC_INVALID_DATA );
+					return;
+				}
+			}
+			// echo the code back and hang up, we are the server so we close first
+			if( !m_bCloseSent )
+			{
+				char aCode[2] = { ( char )( uCode == WSC_NO_STATUS ? WSC_NORMAL >> 8 : uCode >> 8 ), ( char )( uCode == WSC_NO_STATUS ? WSC_NORMAL & 0xff : uCode & 0xff ) };
+				SendFrame( 8, aCode, sizeof( aCode ), false );
+				m_bCloseSent = true;
+			}
+			Close( CLT_AFTERWRITE );
+			WebSocketClosed( uCode, sReason );
+			break;
+		}
+		case 9:
+			SendFrame( 10, m_sControl.data(), m_sControl.size(), false );
+			break;
+		case 10:
+			m_bAwaitingPong = false;
+			break;
+		default:
+			if( m_bFin )
+				MessageDone();
+			break;
+	}
+}
+
+void CWebSock::MessageDone()
+{
+	const CS_STRING * pMessage = &m_sMessage;
+#ifdef HAVE_ZLIB
+	if( m_bMessageCompressed )
+	{
+		if( !Inflate( m_sMessage, m_sInflated ) )
+			return;
+		pMessage = &m_sInflated;
+	}
+#endif /* HAVE_ZLIB */
+
+	bool bBinary = ( m_uMessageOpcode == 2 );
+	m_uMessageOpcode = 0;
+	if( !bBinary && !IsValidUTF8( pMessage->data(), pMessage->size() ) )
+	{
+		ProtocolError( WSC_INVALID_DATA );
+		return;
+	}
+	ReadMessage( *pMessage, bBinary );
+	m_sMessage.clear();
+	m_sInflated.clear();
+}
+
+bool CWebSock::SendFrame( u_int uOpcode, const char * pData, size_t uLen, bool bCompressed )
+{
+	if( !IsUpgraded() || m_bCloseSent )
+		return( false );
+
+	// server frames go out unmasked
+	unsigned char aHead[10];
+	size_t uHead = 2;
+	aHead[0] = ( unsigned char )( 0x80 | uOpcode | ( bCompressed ? 0x40 : 0 ) );
+	if( uLen < 126 )
+	{
+		aHead[1] = ( unsigned char )uLen;
+	}
+	else if( uLen <= 0xffff )
+	{
+		aHead[1] = 126;
+		aHead[2] = ( unsigned char )( uLen >> 8 );
+		aHead[3] = ( unsigned char )uLen;
+		uHead = 4;
+	}
+	else
+	{
+		aHead[1] = 127;
+		for( size_t a = 0; a < 8; ++a )
+			aHead[2 + a] = ( unsigned char )( ( uint64_t )uLen >> ( 8 * ( 7 - a ) ) );
+		uHead = 10;
+	}
+	bool bRet = Write( ( const char * )aHead, uHead );
+	if( uLen > 0 )
+		bRet = Write( pData, uLen ) && bRet;
+	return( bRet );
+}
+
+bool CWebSock::SendMessage( const char * pData, size_t uLen, bool bBinary )
+{
+	u_int uOpcode = ( bBinary ? 2 : 1 );
+#ifdef HAVE_ZLIB
+	if( m_bDeflate && uLen >= m_uCompressThreshold && IsWebSocketOpen() )
+	{
+		if( !Deflate( pData, uLen, m_sDeflated ) )
+			return( false );
+		return( SendFrame( uOpcode, m_sDeflated.data(), m_sDeflated.size(), true ) );
+	}
+#endif /* HAVE_ZLIB */
+	return( SendFrame( uOpcode, pData, uLen, false ) );
+}
+
+bool CWebSock::SendPing( const CS_STRING & sPayload )
+{
+	if( sPayload.size() > 125 )
+		return( false );
+	return( SendFrame( 9, sPayload.data(), sPayload.size(), false ) );
+}
+
+void CWebSock::CloseWebSocket( uint16_t uCode, const CS_STRING & sReason )
+{
+	if( !IsUpgraded() || m_bCloseSent )
+		return;
+
+	CS_STRING sPayload( 2, '\0' );
+	sPayload[0] = ( char )( uCode >> 8 );
+	sPayload[1] = ( char )( uCode & 0xff );
+	// a control frame carries 125 bytes at most, and the reason has to stay valid UTF-8 when it is cut short
+	size_t uReason = sReason.size();
+	if( uReason > 123 )
+	{
+		uReason = 123;
+		while( uReason > 0 && ( ( unsigned char )sReason[uReason] & 0xc0 ) == 0x80 )
+			uReason--;
+	}
+	sPayload.append( sReason, 0, uReason );
+	SendFrame( 8, sPayload.data(), sPayload.size(), false );
+	m_bCloseSent = true;
+	Close( CLT_AFTERWRITE );
+	WebSocketClosed( uCode, sReason );
+}
+
+void CWebSock::ProtocolError( uint16_t uCode )
+{
+	m_sMessage.clear();
+	m_uMessageOpcode = 0;
+	CloseWebSocket( uCode );
+}
+
+void CWebSock::SetPingInterval( int iSeconds )
+{
+	if( m_pPing )
+	{
+		DelCronByAddr( m_pPing );
+		m_pPing = NULL;
+	}
+	m_bAwaitingPong = false;
+	if( iSeconds <= 0 )
+		return;
+	m_pPing = new CWebSockPing( this );
+	m_pPing->Start( ( double )iSeconds );
+	AddCron( m_pPing );
+}
+
+void CWebSock::PingTimer()
+{
+	if( !IsWebSocketOpen() )
+		return;
+	if( m_bAwaitingPong )
+	{
+		// the other end stopped answering, there's no point in a closing handshake
+		m_bCloseSent = true;
+		Close();
+		WebSocketClosed( WSC_ABNORMAL, "ping timeout" );
+		return;
+	}
+	m_bAwaitingPong = SendPing();
+}
+
+#ifdef HAVE_ZLIB
+bool CWebSock::Inflate( const CS_STRING & sIn, CS_STRING & sOut )
+{
+	if( !m_pInflate )
+	{
+		m_pInflate = new z_stream;
+		memset( m_pInflate, 0, sizeof( z_stream ) );
+		if( inflateInit2( m_pInflate, -15 ) != Z_OK )
+		{
+			delete m_pInflate;
+			m_pInflate = NULL;
+			ProtocolError( WSC_INTERNAL_ERROR );
+			return( false );
+		}
+	}
+
+	// the sender strips the empty block Z_SYNC_FLUSH leaves at the end of every message, put it back
+	static const unsigned char aTail[4] = { 0x00, 0x00, 0xff, 0xff };
+	char aBuffer[16384];
+	sOut.clear();
+	for( int iPass = 0; iPass < 2; ++iPass )
+	{
+		m_pInflate->next_in = ( Bytef * )( iPass == 0 ? sIn.data() : ( const char * )aTail );
+		m_pInflate->avail_in = ( uInt )( iPass == 0 ? sIn.size() : sizeof( aTail ) );
+		do
+		{
+			m_pInflate->next_out = ( Bytef * )aBuffer;
+			m_pInflate->avail_out = sizeof( aBuffer );
+			int iRet = inflate( m_pInflate, Z_SYNC_FLUSH );
+			if( iRet != Z_OK && iRet != Z_BUF_ERROR )
+			{
+				ProtocolError( WSC_INVALID_DATA );
+				return( false );
+			}
+			size_t uHave = sizeof( aBuffer ) - m_pInflate->avail_out;
+			// a small message can inflate to a huge one, hold it to the same limit
+			if( sOut.size() + uHave > m_uMaxMessage )
+			{
+				ProtocolError( WSC_TOO_BIG );
+				return( false );
+			}
+			sOut.append( aBuffer, uHave );
+		} while( m_pInflate->avail_out == 0 );
+	}
+	if( m_bClientNoContext )
+		inflateReset( m_pInflate );
+	return( true );
+}
+
+bool CWebSock::Deflate( const char * pData, size_t uLen, CS_STRING & sOut )
+{
+	if( !m_pDeflate )
+	{
+		m_pDeflate = new z_stream;
+		memset( m_pDeflate, 0, sizeof( z_stream ) );
+		if( deflateInit2( m_pDeflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -m_iServerWindowBits, 8, Z_DEFAULT_STRATEGY ) != Z_OK )
+		{
+			delete m_pDeflate;
+			m_pDeflate = NULL;
+			return( false );
+		}
+	}
+
+	char aBuffer[16384];
+	sOut.clear();
+	m_pDeflate->next_in = ( Bytef * )pData;
+	m_pDeflate->avail_in = ( uInt )uLen;
+	do
+	{
+		m_pDeflate->next_out = ( Bytef * )aBuffer;
+		m_pDeflate->avail_out = sizeof( aBuffer );
+		int iRet = deflate( m_pDeflate, Z_SYNC_FLUSH );
+		if( iRet != Z_OK && iRet != Z_BUF_ERROR )
+			return( false );
+		sOut.append( aBuffer, sizeof( aBuffer ) - m_pDeflate->avail_out );
+	} while( m_pDeflate->avail_out == 0 );
+
+	if( sOut.size() >= 4 )
+		sOut.resize( sOut.size() - 4 );
+	if( m_bServerNoContext )
+		deflateReset( m_pDeflate );
+	return( true );
+}
+
+void CWebSock::FreeZlib()
+{
+	if( m_pInflate )
+	{
+		inflateEnd( m_pInflate );
+		delete m_pInflate;
+		m_pInflate = NULL;
+	}
+	if( m_pDeflate )
+	{
+		deflateEnd( m_pDeflate );
+		delete m_pDeflate;
+		m_pDeflate = NULL;
+	}
+}
+#endif /* HAVE_ZLIB */
+
+#ifndef _NO_CSOCKET_NS
+};
+#endif /* _NO_CSOCKET_NS */
@@ -0,0 +1,196 @@
+/**
+ * @file WebSock.h
+ * @author Jim Hull <csocket@jimloco.com>
+ *
+ *    Copyright (c) 1999-2012 Jim Hull <csocket@jimloco.com>
+ *    All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without modification,
+ * are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+ * list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice, this list
+ * of conditions and the following disclaimer in the documentation and/or other materials
+ * provided with the distribution.
+ * Redistributions in any form must be accompanied by information on how to obtain
+ * complete source code for this software and any accompanying software that uses this software.
+ * The source code must either be included in the distribution or be available for no more than
+ * the cost of distribution plus a nominal fee, and must be freely redistributable
+ * under reasonable conditions. For an executable file, complete source code means the source
+ * code for all modules it contains. It does not include source code for modules or files
+ * that typically accompany the major components of the operating system on which the executable file runs.
+ *
+ * THIS SOFTWARE IS PROVIDED ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING,
+ * BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE,
+ * OR NON-INFRINGEMENT, ARE DISCLAIMED. IN NO EVENT SHALL THE AUTHORS OF THIS SOFTWARE BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE,
+ * EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef HAVE_WEBSOCK_H
+#define HAVE_WEBSOCK_H
+
+#include "HTTPSock.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif /* HAVE_ZLIB */
+
+#ifndef _NO_CSOCKET_NS
+namespace Csocket
+{
+#endif /* _NO_CSOCKET_NS */
+
+class CWebSockPing;
+
+/**
+ * @class CWebSock
+ * @brief an RFC 6455 WebSocket server connection, messages arrive through ReadMessage() the way lines arrive through ReadLine()
+ *
+ * The connection starts out as a CHTTPSock, a valid upgrade request is answered and from then on frames are parsed
+ * as they stream in. Payloads are unmasked a word at a time straight into the message buffer, so no frame is held
+ * back waiting for its end and fragmented messages are joined in place. Pings are answered, and with
+ * SetPingInterval() sent, without any of it reaching the subclass.
+ *
+ * When built with HAVE_ZLIB permessage-deflate (RFC 7692) is negotiated if the client offers it.
+ *
+ * @code
+ * class CEchoWebSock : public CWebSock
+ * {
+ * public:
+ *	CEchoWebSock( int iTimeout = 60 ) : CWebSock( iTimeout ) {}
+ *	CEchoWebSock( const CS_STRING & sHostname, uint16_t uPort ) : CWebSock( sHostname, uPort ) {}
+ *	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CEchoWebSock( sHostname, uPort ) ); }
+ *	virtual void ReadMessage( const CS_STRING & sMessage, bool bBinary ) { SendMessage( sMessage, bBinary ); }
+ * };
+ * @endcode
+ */
+class CS_EXPORT CWebSock : public CHTTPSock
+{
+public:
+	CWebSock( int iTimeout = 60 );
+	CWebSock( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 60 );
+	virtual ~CWebSock();
+
+	//! close codes, @see CloseWebSocket, WebSocketClosed
+	enum ECloseCode
+	{
+		WSC_NORMAL			= 1000,
+		WSC_GOING_AWAY		= 1001,
+		WSC_PROTOCOL_ERROR	= 1002,
+		WSC_UNSUPPORTED		= 1003,
+		WSC_NO_STATUS		= 1005,	//!< reported when the close frame had no code, never sent
+		WSC_ABNORMAL		= 1006,	//!< reported when a ping went unanswered, never sent
+		WSC_INVALID_DATA	= 1007,
+		WSC_POLICY			= 1008,
+		WSC_TOO_BIG			= 1009,
+		WSC_INTERNAL_ERROR	= 1011
+	};
+
+	/**
+	 * @brief called with the upgrade request before it is accepted, return false to answer 403 instead
+	 *
+	 * check the path and Origin here, and pick a subprotocol with SetProtocol()
+	 */
+	virtual bool WebSocketRequest( const CSHTTPRequest & cRequest ) { return( true ); }
+	//! the upgrade went through, messages can be sent from here on
+	virtual void WebSocketOpened() {}
+	/**
+	 * @brief a complete message arrived
+	 * @param sMessage the message, decompressed. text messages are valid UTF-8
+	 * @param bBinary true for binary messages, false for text
+	 */
+	virtual void ReadMessage( const CS_STRING & sMessage, bool bBinary ) {}
+	//! the closing handshake happened or failed, called once. the socket closes once the close frame is written
+	virtual void WebSocketClosed( uint16_t uCode, const CS_STRING & sReason ) {}
+
+	//! sends a message in one frame, compressed when permessage-deflate is on and it is at least GetCompressThreshold() long
+	bool SendMessage( const char * pData, size_t uLen, bool bBinary = false );
+	bool SendMessage( const CS_STRING & sMessage, bool bBinary = false ) { return( SendMessage( sMessage.data(), sMessage.length(), bBinary ) ); }
+	//! up to 125 bytes of payload
+	bool SendPing( const CS_STRING & sPayload = "" );
+	//! starts the closing handshake, WebSocketClosed() is called right away
+	void CloseWebSocket( uint16_t uCode = WSC_NORMAL, const CS_STRING & sReason = "" );
+
+	//! true from the upgrade until the closing handshake
+	bool IsWebSocketOpen() const { return( IsUpgraded() && !m_bCloseSent ); }
+
+	//! the subprotocol to accept, call from WebSocketRequest()
+	void SetProtocol( const CS_STRING & sProtocol ) { m_sProtocol = sProtocol; }
+	const CS_STRING & GetProtocol() const { return( m_sProtocol ); }
+
+	//! messages larger than this, after decompression, close the connection with WSC_TOO_BIG
+	void SetMaxMessageSize( uint64_t uMax ) { m_uMaxMessage = uMax; }
+	uint64_t GetMaxMessageSize() const { return( m_uMaxMessage ); }
+
+	/**
+	 * @brief sends a ping every iSeconds and closes the connection if the previous one wasn't answered, 0 turns it off
+	 *
+	 * runs off a cron on this socket, so it is driven by CSocketManager::Loop()
+	 */
+	void SetPingInterval( int iSeconds );
+
+	//! whether permessage-deflate is offered back to clients, on by default when built with HAVE_ZLIB
+	void SetDeflate( bool b ) { m_bAllowDeflate = b; }
+	//! true if permessage-deflate was negotiated
+	bool IsDeflate() const { return( m_bDeflate ); }
+	//! messages shorter than this are sent uncompressed, compressing them usually makes them larger
+	void SetCompressThreshold( size_t uThreshold ) { m_uCompressThreshold = uThreshold; }
+	size_t GetCompressThreshold() const { return( m_uCompressThreshold ); }
+
+	/**
+	 * @brief performs the upgrade, anything else is answered 426 Upgrade Required
+	 *
+	 * to serve plain HTTP on the same port, override this and pass the upgrade requests on to CWebSock::HTTPRequest()
+	 */
+	virtual void HTTPRequest( const CSHTTPRequest & cRequest );
+	virtual void UpgradedData( const char * data, size_t len );
+
+	//! the Sec-WebSocket-Accept value for sKey
+	static CS_STRING AcceptKey( const CS_STRING & sKey );
+	//! XORs pData with the 4 byte mask, starting uOffset bytes into it
+	static void Unmask( char * pData, size_t uLen, const unsigned char * pMask, size_t uOffset );
+	static bool IsValidUTF8( const char * pData, size_t uLen );
+
+private:
+	friend class CWebSockPing;
+
+	void InitWebSock();
+	bool ParseFrameHeader();
+	void FrameDone();
+	void MessageDone();
+	bool SendFrame( u_int uOpcode, const char * pData, size_t uLen, bool bCompressed );
+	void ProtocolError( uint16_t uCode );
+	void PingTimer();
+	bool NegotiateDeflate( const CSHTTPSpan & cOffers, CS_STRING & sResponse );
+#ifdef HAVE_ZLIB
+	bool Inflate( const CS_STRING & sIn, CS_STRING & sOut );
+	bool Deflate( const char * pData, size_t uLen, CS_STRING & sOut );
+	void FreeZlib();
+#endif /* HAVE_ZLIB */
+
+	unsigned char	m_aHeader[14];
+	unsigned char	m_aMask[4];
+	size_t			m_uHeaderHave, m_uMaskPos, m_uCompressThreshold;
+	uint64_t		m_uRemaining, m_uMaxMessage;
+	u_int			m_uOpcode, m_uMessageOpcode;
+	bool			m_bInFrame, m_bFin, m_bCompressed, m_bMessageCompressed;
+	bool			m_bCloseSent, m_bAwaitingPong, m_bAllowDeflate, m_bDeflate;
+	bool			m_bServerNoContext, m_bClientNoContext;
+	int				m_iServerWindowBits;
+	CS_STRING		m_sMessage, m_sControl, m_sInflated, m_sProtocol;
+	CWebSockPing *	m_pPing;
+#ifdef HAVE_ZLIB
+	z_stream *		m_pInflate;
+	z_stream *		m_pDeflate;
+	CS_STRING		m_sDeflated;
+#endif /* HAVE_ZLIB */
+};
+
+#ifndef _NO_CSOCKET_NS
+};
+#endif /* _NO_CSOCKET_NS */
+
+#endif /* HAVE_WEBSOCK_H */
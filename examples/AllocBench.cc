@@ -0,0 +1,126 @@
+/**
+ * counts heap allocations per accepted connection, with and without the Csock pool
+ *
+ * usage: AllocBench [connections per round] [rounds] [accepts per wakeup]
+ */
+#include <Csocket.h>
+#define BENCH_COUNT_ALLOCS
+#include "bench.h"
+#include <stdlib.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif /* _WIN32 */
+
+static size_t g_uInbound = 0;
+// allocations are counted from the first accept of a Loop() until Loop() returns, so the per iteration cost of building the fd sets is left out
+static bool g_bCounting = false;
+static uint64_t g_iMark = 0;
+
+class CBenchSock : public Csock
+{
+public:
+	CBenchSock( int iTimeout = 60 ) : Csock( iTimeout ) {}
+	CBenchSock( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 60 ) : Csock( sHostname, uPort, iTimeout ) {}
+	virtual ~CBenchSock() { if( GetType() == INBOUND ) g_uInbound--; }
+
+	virtual bool ConnectionFrom( const CS_STRING & sHost, uint16_t uPort )
+	{
+		if( !g_bCounting )
+		{
+			g_bCounting = true;
+			g_iMark = g_iAllocs;
+		}
+		return( true );
+	}
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort )
+	{
+		g_uInbound++;
+		// nothrow goes through the same pool, NULL would leave the accept to CSocketManager::GetSockObj
+		return( new( std::nothrow ) CBenchSock( sHostname, uPort ) );
+	}
+};
+
+static bool ConnectClients( std::vector<int> & vFDs, size_t uCount, uint16_t uPort )
+{
+	struct sockaddr_in cAddr;
+	memset( &cAddr, 0, sizeof( cAddr ) );
+	cAddr.sin_family = AF_INET;
+	cAddr.sin_port = htons( uPort );
+	cAddr.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	for( size_t a = 0; a < uCount; ++a )
+	{
+		int iFD = ( int )socket( AF_INET, SOCK_STREAM, 0 );
+		if( iFD < 0 || connect( iFD, ( struct sockaddr * )&cAddr, sizeof( cAddr ) ) != 0 )
+			return( false );
+		vFDs.push_back( iFD );
+	}
+	return( true );
+}
+
+static uint64_t g_iLoops = 0;
+
+static double RunRound( CSocketManager & cManager, size_t uCount, uint16_t uPort )
+{
+	std::vector<int> vFDs;
+	if( !ConnectClients( vFDs, uCount, uPort ) )
+	{
+		cerr << "connect failed" << endl;
+		exit( 1 );
+	}
+
+	uint64_t iAllocs = 0;
+	while( g_uInbound < uCount )
+	{
+		cManager.Loop();
+		g_iLoops++;
+		if( g_bCounting )
+		{
+			iAllocs += g_iAllocs - g_iMark;
+			g_bCounting = false;
+		}
+	}
+
+	for( size_t a = 0; a < vFDs.size(); ++a )
+		close( vFDs[a] );
+	while( g_uInbound > 0 )
+		cManager.Loop();
+
+	return( ( double )iAllocs / ( double )uCount );
+}
+
+int main( int argc, char ** argv )
+{
+	size_t uCount = argc > 1 ? ( size_t )atoi( argv[1] ) : 200;
+	size_t uRounds = argc > 2 ? ( size_t )atoi( argv[2] ) : 5;
+	u_int uAcceptBatch = argc > 3 ? ( u_int )atoi( argv[3] ) : 1;
+
+	InitCsocket();
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 1000 );
+
+	uint16_t uPort = 0;
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetAcceptBatch( uAcceptBatch );
+	if( !cManager.Listen( cListen, new CBenchSock(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		return( 1 );
+	}
+
+	for( int iPool = 0; iPool < 2; ++iPool )
+	{
+		SetCsockPoolSize( iPool ? uCount : 0 );
+		RunRound( cManager, uCount, uPort ); // warm up, fills the pool
+		double fTotal = 0;
+		g_iLoops = 0;
+		for( size_t a = 0; a < uRounds; ++a )
+			fTotal += RunRound( cManager, uCount, uPort );
+		cout << "pool=" << ( iPool ? "on" : "off" ) << " connections=" << uCount << " rounds=" << uRounds
+			<< " allocs/accept=" << fTotal / ( double )uRounds << " loops/round=" << g_iLoops / uRounds << endl;
+	}
+	SetCsockPoolSize( 0 );
+
+	ShutdownCsocket();
+	return( 0 );
+}
@@ -0,0 +1,186 @@
+/**
+ * connection lifecycle rate over loopback: plain Connect()+Connected()+Close() cycles and TLS handshakes
+ *
+ * usage: ConnectBench [seconds per run] [connections in flight] [modes, IE tcp,rsa2048,rsa4096,ecdsa]
+ *
+ * a tls cycle sends a byte and waits for the echo before closing, so both ends have finished the handshake.
+ * the certificates are ConnectBench-<mode>.pem, 'make ConnectBench-certs' generates them.
+ * results are printed as one JSON object per run on stdout, cpu_us_per_cycle covers both ends since they share the process.
+ */
+#include <Csocket.h>
+#include "bench.h"
+#include <stdlib.h>
+#include <signal.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif /* _WIN32 */
+
+static bool g_bPing = false;
+static size_t g_uInFlight = 0;
+static uint64_t g_iCycles = 0;
+static uint64_t g_iErrors = 0;
+static std::vector<uint32_t> g_vLatency;
+
+class CStormServer : public Csock
+{
+public:
+	CStormServer( int iTimeout = 0 ) : Csock( iTimeout ) {}
+	CStormServer( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 10 ) : Csock( sHostname, uPort, iTimeout ) {}
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CStormServer( sHostname, uPort ) ); }
+	virtual void ReadData( const char * data, size_t len ) { Write( data, len ); }
+};
+
+class CStormClient : public Csock
+{
+public:
+	CStormClient() : Csock( 10 )
+	{
+		m_iStart = microtime();
+		m_bDone = false;
+		g_uInFlight++;
+	}
+	virtual ~CStormClient()
+	{
+		g_uInFlight--;
+	}
+
+	virtual void Connected()
+	{
+		if( g_bPing )
+			Write( "x", 1 );
+		else
+			Done();
+	}
+	virtual void ReadData( const char * data, size_t len ) { Done(); }
+
+	virtual void SockError( int iErrno, const CS_STRING & sDescription ) { Failed(); }
+	virtual void ConnectionRefused() { Failed(); }
+	virtual void Timeout() { Failed(); }
+
+private:
+	void Done()
+	{
+		if( m_bDone )
+			return;
+		m_bDone = true;
+		g_iCycles++;
+		g_vLatency.push_back( ( uint32_t )( microtime() - m_iStart ) );
+		Close();
+	}
+	void Failed()
+	{
+		if( m_bDone )
+			return;
+		m_bDone = true;
+		g_iErrors++;
+	}
+
+	uint64_t	m_iStart;
+	bool		m_bDone;
+};
+
+static bool RunMode( const CS_STRING & sMode, size_t uParallel, uint64_t iMillis )
+{
+	bool bSSL = ( sMode != "tcp" );
+	CS_STRING sPem = "ConnectBench-" + sMode + ".pem";
+	if( bSSL && access( sPem.c_str(), R_OK ) != 0 )
+	{
+		cout << "{\"mode\":\"" << sMode << "\",\"skipped\":\"" << sPem << " is missing\"}" << endl;
+		return( true );
+	}
+
+	g_bPing = bSSL;
+	g_iCycles = 0;
+	g_iErrors = 0;
+	g_vLatency.clear();
+
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 1000 );
+
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetMaxConns( SOMAXCONN );
+	cListen.SetAcceptBatch( 64 );
+	if( bSSL )
+	{
+		cListen.SetIsSSL( true );
+		cListen.SetPemLocation( sPem );
+	}
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, new CStormServer(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		return( false );
+	}
+
+	// slow handshakes can take longer than the whole run, keep going until every slot completed at least once
+	uint64_t iCPUStart = CPUTime();
+	uint64_t iStart = millitime();
+	while( ( millitime() - iStart < iMillis || g_iCycles + g_iErrors < uParallel ) && millitime() - iStart < 60000 )
+	{
+		while( g_uInFlight < uParallel )
+		{
+			CSConnection cConn( "127.0.0.1", uPort );
+			cConn.SetIsSSL( bSSL );
+			cManager.Connect( cConn, new CStormClient() );
+		}
+		cManager.Loop();
+	}
+	uint64_t iElapsed = millitime() - iStart;
+	uint64_t iCPU = CPUTime() - iCPUStart;
+	uint64_t iCycles = g_iCycles;
+
+	// let whatever is in flight finish so the next run starts clean
+	iStart = millitime();
+	while( g_uInFlight > 0 && millitime() - iStart < 5000 )
+		cManager.Loop();
+	cManager.clear();
+
+	double fSecs = ( double )iElapsed / 1000.0;
+	cout << "{\"mode\":\"" << sMode << "\""
+		<< ",\"parallel\":" << uParallel
+		<< ",\"seconds\":" << fSecs
+		<< ",\"cycles\":" << iCycles
+		<< ",\"errors\":" << g_iErrors
+		<< ",\"cycles_per_sec\":" << ( double )iCycles / fSecs
+		<< ",\"cpu_us_per_cycle\":" << ( iCycles ? ( double )iCPU / ( double )iCycles : 0.0 )
+		<< ",\"p50_us\":" << Percentile( g_vLatency, 50.0 )
+		<< ",\"p99_us\":" << Percentile( g_vLatency, 99.0 )
+		<< "}" << endl;
+	return( true );
+}
+
+int main( int argc, char ** argv )
+{
+	uint64_t iMillis = argc > 1 ? ( uint64_t )( atof( argv[1] ) * 1000.0 ) : 1000;
+	size_t uParallel = argc > 2 ? ( size_t )atoi( argv[2] ) : 32;
+	CS_STRING sModes( argc > 3 ? argv[3] : "tcp,rsa2048,rsa4096,ecdsa" );
+
+#ifndef CSOCK_USE_POLL
+	if( uParallel * 2 + 16 > FD_SETSIZE )
+	{
+		cerr << "that many connections in flight don't fit in select(), build with CSOCK_USE_POLL" << endl;
+		return( 1 );
+	}
+#endif /* CSOCK_USE_POLL */
+
+	InitCsocket();
+	RaiseFDLimit();
+#ifndef _WIN32
+	signal( SIGPIPE, SIG_IGN );
+#endif /* _WIN32 */
+
+	CS_STRING::size_type uPos = 0;
+	while( uPos < sModes.size() )
+	{
+		CS_STRING::size_type uComma = sModes.find( ',', uPos );
+		if( uComma == CS_STRING::npos )
+			uComma = sModes.size();
+		if( !RunMode( sModes.substr( uPos, uComma - uPos ), uParallel, iMillis ) )
+			return( 1 );
+		uPos = uComma + 1;
+	}
+
+	ShutdownCsocket();
+	return( 0 );
+}
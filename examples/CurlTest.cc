@@ -0,0 +1,169 @@
+/**
+ * CCurlSock checks against a CHTTPSock on loopback, exits non zero on the first one that fails
+ */
+#include <HTTPSock.h>
+#include <CurlSock.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static bool g_bFailed = false;
+
+#define CHECK( x ) do { if( !( x ) ) { cerr << __FILE__ << ":" << __LINE__ << " failed: " #x << endl; g_bFailed = true; } } while( 0 )
+
+//! 256KB that isn't the same all the way through, so a dropped or repeated chunk shows
+static const CS_STRING & BigBody()
+{
+	static CS_STRING sBody;
+	if( sBody.empty() )
+	{
+		for( unsigned int a = 0; sBody.size() < 256 * 1024; ++a )
+			sBody += ( char )( 'a' + a % 26 + ( a / 4096 ) % 3 );
+	}
+	return( sBody );
+}
+
+class CServerSock : public CHTTPSock
+{
+public:
+	CServerSock( int iTimeout = 60 ) : CHTTPSock( iTimeout ) {}
+	CServerSock( const CS_STRING & sHostname, uint16_t uPort ) : CHTTPSock( sHostname, uPort ) {}
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CServerSock( sHostname, uPort ) ); }
+
+	virtual void HTTPRequest( const CSHTTPRequest & cRequest )
+	{
+		if( cRequest.GetPath().Equals( "/big" ) )
+			Respond( 200, "application/octet-stream", BigBody() );
+		else
+			Respond( 200, "text/plain", "small\n" );
+	}
+};
+
+class CTestCurl : public CCurlSock
+{
+public:
+	CTestCurl() : m_iCompleted( 0 ), m_pBufferSink( NULL ) {}
+
+	//! drains the buffer sink a bit at a time, the way a caller working through the body would
+	void Drain()
+	{
+		if( m_pBufferSink )
+		{
+			size_t uBytes = std::min( m_pBufferSink->GetSize(), ( size_t )4096 );
+			m_sBody.append( m_pBufferSink->GetData(), uBytes );
+			m_pBufferSink->Consume( uBytes );
+		}
+	}
+
+	int			m_iCompleted;
+	long		m_iResponseCode;
+	long		m_iConnects;
+	CS_STRING	m_sBody;
+	CCurlBufferSink * m_pBufferSink;
+
+protected:
+	virtual void OnCURLComplete( CURL * pCURL )
+	{
+		m_iCompleted++;
+		m_iResponseCode = 0;
+		m_iConnects = -1;
+		curl_easy_getinfo( pCURL, CURLINFO_RESPONSE_CODE, &m_iResponseCode );
+		curl_easy_getinfo( pCURL, CURLINFO_NUM_CONNECTS, &m_iConnects );
+		if( m_pBufferSink )
+		{
+			CHECK( GetSink( pCURL ) == m_pBufferSink );
+			m_sBody.append( m_pBufferSink->GetData(), m_pBufferSink->GetSize() );
+			m_pBufferSink = NULL;
+		}
+	}
+	virtual size_t OnBody( CURL * pCURL, const char * pData, size_t uBytes )
+	{
+		m_sBody.append( pData, uBytes );
+		return( uBytes );
+	}
+};
+
+//! runs the manager until pCurl has finished iCompleted transfers, false if it took longer than iMaxMS
+static bool Run( CSocketManager & cManager, CTestCurl * pCurl, int iCompleted, uint64_t iMaxMS )
+{
+	uint64_t iStart = millitime();
+	while( pCurl->m_iCompleted < iCompleted && millitime() - iStart < iMaxMS )
+	{
+		cManager.Loop();
+		pCurl->Drain();
+	}
+	return( pCurl->m_iCompleted >= iCompleted );
+}
+
+int main( int argc, char ** argv )
+{
+	InitCsocket();
+	curl_global_init( CURL_GLOBAL_ALL );
+	CSocketManager cManager;
+	// longer than the small transfers get, one that only moves when select() times out fails
+	cManager.SetSelectTimeout( 500000 );
+	CSListener cListen( 0, "127.0.0.1" );
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, new CServerSock(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		return( 1 );
+	}
+	char szBase[64];
+	snprintf( szBase, sizeof( szBase ), "http://127.0.0.1:%u", ( unsigned int )uPort );
+	CS_STRING sBase( szBase );
+
+	CTestCurl * pCurl = new CTestCurl();
+	cManager.MonitorFD( pCurl );
+
+	// the readiness path, every step is driven by the fd firing or libcurl's timer
+	CURL * pFirst = pCurl->Retr( sBase + "/small" );
+	CHECK( pFirst != NULL );
+	CHECK( pCurl->GetActiveHandles() == 1 );
+	CHECK( Run( cManager, pCurl, 1, 250 ) );
+	CHECK( pCurl->m_iResponseCode == 200 );
+	CHECK( pCurl->m_sBody == "small\n" );
+	CHECK( pCurl->GetActiveHandles() == 0 );
+	CHECK( pCurl->GetIdleHandles() == 1 );
+
+	// the handle comes off the idle list and the connection out of the multi handle's cache
+	pCurl->m_sBody.clear();
+	CURL * pSecond = pCurl->Retr( sBase + "/small" );
+	CHECK( pSecond == pFirst );
+	CHECK( pCurl->GetIdleHandles() == 0 );
+	CHECK( Run( cManager, pCurl, 2, 250 ) );
+	CHECK( pCurl->m_sBody == "small\n" );
+	CHECK( pCurl->m_iConnects == 0 );
+	CHECK( pCurl->GetIdleHandles() == 1 );
+
+	// a pausing buffer sink smaller than a libcurl chunk, drained 4KB a loop
+	pCurl->m_sBody.clear();
+	CURL * pBig = pCurl->Retr( sBase + "/big" );
+	pCurl->m_pBufferSink = new CCurlBufferSink( 1024, true );
+	CHECK( pCurl->SetSink( pBig, pCurl->m_pBufferSink ) );
+	CHECK( Run( cManager, pCurl, 3, 5000 ) );
+	CHECK( pCurl->m_iResponseCode == 200 );
+	CHECK( pCurl->m_sBody == BigBody() );
+	CHECK( pCurl->GetPausedHandles() == 0 );
+
+	// the file sink
+	char szPath[] = "/tmp/CurlTest.XXXXXX";
+	int iFD = mkstemp( szPath );
+	CHECK( iFD >= 0 );
+	unlink( szPath );
+	CCurlFDSink * pFDSink = new CCurlFDSink( iFD );
+	CHECK( pCurl->SetSink( pCurl->Retr( sBase + "/big" ), pFDSink ) );
+	CHECK( Run( cManager, pCurl, 4, 5000 ) );
+	struct stat cStat;
+	CHECK( fstat( iFD, &cStat ) == 0 && ( size_t )cStat.st_size == BigBody().size() );
+	close( iFD );
+	CHECK( pCurl->GetIdleHandles() >= 1 );
+
+	cManager.Cleanup();
+	curl_global_cleanup();
+	ShutdownCsocket();
+	if( g_bFailed )
+		return( 1 );
+	cout << "CurlTest passed" << endl;
+	return( 0 );
+}
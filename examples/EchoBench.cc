@@ -0,0 +1,235 @@
+/**
+ * echo throughput and round trip latency over loopback, server and load clients share one manager
+ *
+ * usage: EchoBench [seconds per run] [connections, IE 1,10,100] [message sizes, IE 64,16384] [ssl: off|on|both]
+ *
+ * every connection keeps one message in flight, so msgs/s is round trips per second.
+ * cpu/msg covers both ends since they run in the same process.
+ * counts that don't fit under FD_SETSIZE need a poll() build (CSOCK_USE_POLL), the run is skipped otherwise.
+ */
+#include <Csocket.h>
+#include "bench.h"
+#include <stdlib.h>
+#include <signal.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <netinet/tcp.h>
+#endif /* _WIN32 */
+
+static size_t g_uMsgSize = 64;
+static size_t g_uConnected = 0;
+static size_t g_uInbound = 0;
+static bool g_bRunning = false;
+static uint64_t g_iMessages = 0;
+static std::vector<uint32_t> g_vRTT;
+static CS_STRING g_sPayload;
+
+//! measure the engine, not Nagle's algorithm waiting on delayed ACKs
+static void NoDelay( Csock * pSock )
+{
+#ifndef _WIN32
+	int iOn = 1;
+	setsockopt( pSock->GetRSock(), IPPROTO_TCP, TCP_NODELAY, &iOn, sizeof( iOn ) );
+#endif /* _WIN32 */
+}
+
+class CEchoServer : public Csock
+{
+public:
+	CEchoServer( int iTimeout = 0 ) : Csock( iTimeout ) {}
+	CEchoServer( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 0 ) : Csock( sHostname, uPort, iTimeout ) { g_uInbound++; }
+	virtual ~CEchoServer() { if( GetType() == INBOUND ) g_uInbound--; }
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CEchoServer( sHostname, uPort ) ); }
+	virtual void Connected() { NoDelay( this ); }
+	virtual void ReadData( const char * data, size_t len ) { Write( data, len ); }
+};
+
+class CEchoClient : public Csock
+{
+public:
+	CEchoClient() : Csock( 0 )
+	{
+		m_uReceived = 0;
+		m_iSent = 0;
+		m_bFirst = true;
+		m_bConnected = false;
+	}
+	virtual ~CEchoClient()
+	{
+		if( m_bConnected )
+			g_uConnected--;
+	}
+
+	virtual void Connected()
+	{
+		m_bConnected = true;
+		g_uConnected++;
+		NoDelay( this );
+	}
+
+	void Send()
+	{
+		m_uReceived = 0;
+		m_iSent = microtime();
+		Write( g_sPayload );
+	}
+
+	virtual void ReadData( const char * data, size_t len )
+	{
+		m_uReceived += len;
+		if( m_uReceived < g_uMsgSize )
+			return;
+		// the first round trip also finishes the SSL handshake, keep it out of the latency figures
+		if( !m_bFirst )
+			g_vRTT.push_back( ( uint32_t )( microtime() - m_iSent ) );
+		m_bFirst = false;
+		g_iMessages++;
+		if( g_bRunning )
+			Send();
+	}
+
+private:
+	size_t		m_uReceived;
+	uint64_t	m_iSent;
+	bool		m_bFirst, m_bConnected;
+};
+
+static void ParseList( const char * pszList, std::vector<size_t> & vValues )
+{
+	vValues.clear();
+	CS_STRING sList( pszList );
+	CS_STRING::size_type uPos = 0;
+	while( uPos < sList.size() )
+	{
+		CS_STRING::size_type uComma = sList.find( ',', uPos );
+		if( uComma == CS_STRING::npos )
+			uComma = sList.size();
+		size_t uValue = ( size_t )atol( sList.substr( uPos, uComma - uPos ).c_str() );
+		if( uValue > 0 )
+			vValues.push_back( uValue );
+		uPos = uComma + 1;
+	}
+}
+
+static bool RunOne( size_t uConns, size_t uSize, bool bSSL, uint64_t iMillis )
+{
+	g_uMsgSize = uSize;
+	g_sPayload.assign( uSize, 'x' );
+	g_iMessages = 0;
+	g_vRTT.clear();
+	g_bRunning = false;
+
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 10000 );
+
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetMaxConns( uConns > SOMAXCONN ? ( int )uConns : SOMAXCONN );
+	cListen.SetAcceptBatch( 64 );
+	if( bSSL )
+	{
+		cListen.SetIsSSL( true );
+		cListen.SetPemLocation( "ReceiveTest.pem" );
+	}
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, new CEchoServer(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		return( false );
+	}
+
+	std::vector<CEchoClient *> vClients;
+	for( size_t a = 0; a < uConns; ++a )
+	{
+		CSConnection cConn( "127.0.0.1", uPort );
+		cConn.SetIsSSL( bSSL );
+		CEchoClient * pClient = new CEchoClient();
+		cManager.Connect( cConn, pClient );
+		vClients.push_back( pClient );
+	}
+
+	// SSL handshakes are expensive, give each connection some room
+	uint64_t iStart = millitime();
+	uint64_t iSetupLimit = 10000 + ( bSSL ? 200 : 10 ) * ( uint64_t )uConns;
+	while( ( g_uConnected < uConns || g_uInbound < uConns ) && millitime() - iStart < iSetupLimit )
+		cManager.Loop();
+	uint64_t iSetup = millitime() - iStart;
+	if( g_uConnected < uConns || g_uInbound < uConns )
+	{
+		cerr << "only " << g_uConnected << " clients and " << g_uInbound << " servers of " << uConns << " connections came up" << endl;
+		return( false );
+	}
+
+	g_bRunning = true;
+	for( size_t a = 0; a < vClients.size(); ++a )
+		vClients[a]->Send();
+
+	uint64_t iCPUStart = CPUTime();
+	iStart = millitime();
+	uint64_t iMsgStart = g_iMessages;
+	while( millitime() - iStart < iMillis )
+		cManager.Loop();
+	uint64_t iElapsed = millitime() - iStart;
+	uint64_t iCPU = CPUTime() - iCPUStart;
+	uint64_t iMessages = g_iMessages - iMsgStart;
+	g_bRunning = false;
+
+	double fSecs = ( double )iElapsed / 1000.0;
+	double fMsgs = ( double )iMessages / fSecs;
+	cout << "ssl=" << ( bSSL ? "on " : "off" ) << " conns=" << uConns << " size=" << uSize
+		<< " msgs/s=" << ( uint64_t )fMsgs
+		<< " MB/s=" << fMsgs * ( double )uSize / ( 1024.0 * 1024.0 )
+		<< " p50=" << Percentile( g_vRTT, 50.0 ) << "us"
+		<< " p99=" << Percentile( g_vRTT, 99.0 ) << "us"
+		<< " cpu/msg=" << ( iMessages ? ( double )iCPU / ( double )iMessages : 0.0 ) << "us"
+		<< " setup=" << iSetup << "ms" << endl;
+
+	cManager.clear();
+	return( true );
+}
+
+int main( int argc, char ** argv )
+{
+	uint64_t iMillis = argc > 1 ? ( uint64_t )( atof( argv[1] ) * 1000.0 ) : 1000;
+	std::vector<size_t> vConns, vSizes;
+	ParseList( argc > 2 ? argv[2] : "1,10,100", vConns );
+	ParseList( argc > 3 ? argv[3] : "64,16384", vSizes );
+	CS_STRING sSSL( argc > 4 ? argv[4] : "both" );
+
+	InitCsocket();
+	RaiseFDLimit();
+#ifndef _WIN32
+	signal( SIGPIPE, SIG_IGN );
+	// each connection takes two descriptors, one on each end
+#endif /* _WIN32 */
+
+	bool bHavePem = ( access( "ReceiveTest.pem", R_OK ) == 0 );
+	for( int iSSL = 0; iSSL < 2; ++iSSL )
+	{
+		if( ( iSSL && sSSL == "off" ) || ( !iSSL && sSSL == "on" ) )
+			continue;
+		if( iSSL && !bHavePem )
+		{
+			cerr << "ReceiveTest.pem is missing, skipping the SSL runs" << endl;
+			continue;
+		}
+		for( size_t c = 0; c < vConns.size(); ++c )
+		{
+#ifndef CSOCK_USE_POLL
+			if( vConns[c] * 2 + 16 > FD_SETSIZE )
+			{
+				cerr << "conns=" << vConns[c] << " doesn't fit in select(), skipped" << endl;
+				continue;
+			}
+#endif /* CSOCK_USE_POLL */
+			for( size_t s = 0; s < vSizes.size(); ++s )
+			{
+				if( !RunOne( vConns[c], vSizes[s], iSSL != 0, iMillis ) )
+					return( 1 );
+			}
+		}
+	}
+
+	ShutdownCsocket();
+	return( 0 );
+}
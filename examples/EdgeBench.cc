@@ -0,0 +1,233 @@
+/**
+ * the event backend with many idle connections, and with one listener shared by forked workers
+ *
+ * usage: EdgeBench [seconds per run] [idle connections, IE 0,1000,4000] [workers]
+ *
+ * build it three ways to compare, plain for select(), with CSOCK_USE_POLL and with CSOCK_USE_EPOLL ('make EdgeBench-poll
+ * EdgeBench-epoll'). the idle runs keep a few echo pairs busy next to connections that never say anything, cpu is
+ * user+sys for the whole process. the shared runs fork workers that all Loop() on the same listener while the parent
+ * connects and disconnects one client at a time. wasted counts the times a worker was woken and found nothing to
+ * accept, read or close, IE lost the race for a connection. exclusive=on is Csock::SetExclusiveAccept(), it only
+ * changes anything with epoll.
+ */
+#include <Csocket.h>
+#include "bench.h"
+#include <stdlib.h>
+#include <signal.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <sys/wait.h>
+#endif /* _WIN32 */
+
+#if defined( CSOCK_USE_EPOLL )
+static const char * g_szBackend = "epoll";
+#elif defined( CSOCK_USE_POLL )
+static const char * g_szBackend = "poll";
+#else
+static const char * g_szBackend = "select";
+#endif
+
+static const size_t BUSY_PAIRS = 8;
+static uint64_t g_iMessages = 0;
+static uint64_t g_iEchoes = 0;
+static uint64_t g_iAccepts = 0;
+static bool g_bRunning = false;
+
+class CEchoSock : public Csock
+{
+public:
+	CEchoSock( int iTimeout = 0 ) : Csock( iTimeout ) {}
+	CEchoSock( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 0 ) : Csock( sHostname, uPort, iTimeout ) { g_iAccepts++; }
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CEchoSock( sHostname, uPort ) ); }
+	virtual void ReadData( const char * data, size_t len )
+	{
+		g_iEchoes++;
+		Write( data, len );
+	}
+};
+
+class CPingSock : public Csock
+{
+public:
+	CPingSock() : Csock( 0 ) {}
+
+	virtual void Connected() { Write( "ping", 4 ); }
+	virtual void ReadData( const char * data, size_t len )
+	{
+		g_iMessages++;
+		if( g_bRunning )
+			Write( data, len );
+	}
+};
+
+//! connects, waits for one echo, then hangs up
+class COnceSock : public Csock
+{
+public:
+	COnceSock( bool * pbDone ) : Csock( 10 ), m_pbDone( pbDone ) {}
+	virtual ~COnceSock() { *m_pbDone = true; }
+
+	virtual void Connected() { Write( "x", 1 ); }
+	virtual void ReadData( const char * data, size_t len ) { Close(); }
+
+private:
+	bool *	m_pbDone;
+};
+
+static void RunIdle( size_t uIdle, uint64_t iMillis )
+{
+#ifndef CSOCK_USE_POLL
+	if( uIdle * 2 + BUSY_PAIRS * 2 + 16 > FD_SETSIZE )
+	{
+		cout << "backend=" << g_szBackend << " idle=" << uIdle << " skipped, doesn't fit in select()" << endl;
+		return;
+	}
+#endif /* CSOCK_USE_POLL */
+	CSocketManager cManager;
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetAcceptBatch( 64 );
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, new CEchoSock(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		exit( 1 );
+	}
+	CSConnection cCon( "127.0.0.1", uPort );
+	for( size_t a = 0; a < uIdle; ++a )
+		cManager.Connect( cCon, new Csock( 0 ) );
+	// everyone connected and accepted before the busy ones start
+	while( cManager.size() < uIdle * 2 + 1 )
+		cManager.Loop();
+
+	g_bRunning = true;
+	g_iMessages = 0;
+	for( size_t a = 0; a < BUSY_PAIRS; ++a )
+		cManager.Connect( cCon, new CPingSock() );
+
+	uint64_t iLoops = 0;
+	uint64_t iCPUStart = CPUTime();
+	uint64_t iStart = millitime();
+	uint64_t iNow = iStart;
+	while( iNow - iStart < iMillis )
+	{
+		cManager.Loop();
+		iLoops++;
+		iNow = millitime();
+	}
+	uint64_t iCPU = CPUTime() - iCPUStart;
+	g_bRunning = false;
+
+	double fSecs = ( double )( iNow - iStart ) / 1000.0;
+	cout << "backend=" << g_szBackend << " idle=" << uIdle
+		<< " msgs/s=" << ( uint64_t )( ( double )g_iMessages / fSecs )
+		<< " cpu-us/msg=" << ( g_iMessages ? ( double )iCPU / ( double )g_iMessages : 0.0 )
+		<< " us/loop=" << ( iLoops ? ( double )( iNow - iStart ) * 1000.0 / ( double )iLoops : 0.0 ) << endl;
+}
+
+static void RunShared( u_int uWorkers, bool bExclusive, uint64_t iMillis )
+{
+#ifndef _WIN32
+	CSocketManager * pWorkers = new CSocketManager();
+	pWorkers->SetSelectTimeout( 1000000 );
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetExclusiveAccept( bExclusive );
+	uint16_t uPort = 0;
+	if( !pWorkers->Listen( cListen, new CEchoSock(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		exit( 1 );
+	}
+
+	int aiPipe[2];
+	if( pipe( aiPipe ) != 0 )
+	{
+		cerr << "pipe failed" << endl;
+		exit( 1 );
+	}
+	std::vector<pid_t> vPids;
+	for( u_int a = 0; a < uWorkers; ++a )
+	{
+		pid_t iPid = fork();
+		if( iPid == 0 )
+		{
+			close( aiPipe[0] );
+			// the manager was never looped before the fork, so each worker gets an epoll set of its own
+			uint64_t aiCounts[2] = { 0, 0 };
+			g_iEchoes = 0;
+			uint64_t iEnd = millitime() + iMillis + 500;
+			while( millitime() < iEnd )
+			{
+				uint64_t iWork = g_iAccepts + g_iEchoes;
+				size_t uSocks = pWorkers->size();
+				pWorkers->Loop();
+				if( pWorkers->GetErrno() == CSocketManager::SUCCESS && iWork == g_iAccepts + g_iEchoes && uSocks == pWorkers->size() )
+					aiCounts[0]++;
+				aiCounts[1] += g_iEchoes;
+				g_iEchoes = 0;
+			}
+			if( write( aiPipe[1], aiCounts, sizeof( aiCounts ) ) != ( ssize_t )sizeof( aiCounts ) )
+				_exit( 1 );
+			_exit( 0 );
+		}
+		vPids.push_back( iPid );
+	}
+	close( aiPipe[1] );
+	// the parent only connects, the listener is the workers'
+	CS_Delete( pWorkers );
+
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 1000 );
+	CSConnection cCon( "127.0.0.1", uPort, 10 );
+	uint64_t iConns = 0;
+	uint64_t iStart = millitime();
+	while( millitime() - iStart < iMillis )
+	{
+		bool bDone = false;
+		cManager.Connect( cCon, new COnceSock( &bDone ) );
+		while( !bDone )
+			cManager.Loop();
+		iConns++;
+	}
+
+	uint64_t iWasted = 0;
+	uint64_t iEchoes = 0;
+	for( size_t a = 0; a < vPids.size(); ++a )
+	{
+		uint64_t aiCounts[2];
+		if( read( aiPipe[0], aiCounts, sizeof( aiCounts ) ) == ( ssize_t )sizeof( aiCounts ) )
+		{
+			iWasted += aiCounts[0];
+			iEchoes += aiCounts[1];
+		}
+		waitpid( vPids[a], NULL, 0 );
+	}
+	close( aiPipe[0] );
+	cout << "backend=" << g_szBackend << " workers=" << uWorkers << " exclusive=" << ( bExclusive ? "on" : "off" )
+		<< " conns=" << iConns << " echoed=" << iEchoes
+		<< " wasted-wakeups/conn=" << ( iConns ? ( double )iWasted / ( double )iConns : 0.0 ) << endl;
+#endif /* _WIN32 */
+}
+
+int main( int argc, char ** argv )
+{
+	uint64_t iMillis = argc > 1 ? ( uint64_t )( atof( argv[1] ) * 1000.0 ) : 1000;
+	CS_STRING sIdle( argc > 2 ? argv[2] : "0,1000,4000" );
+	u_int uWorkers = ( u_int )( argc > 3 ? atoi( argv[3] ) : 4 );
+
+	InitCsocket();
+	RaiseFDLimit();
+#ifndef _WIN32
+	signal( SIGPIPE, SIG_IGN );
+#endif /* _WIN32 */
+	while( !sIdle.empty() )
+	{
+		CS_STRING::size_type uComma = sIdle.find( ',' );
+		RunIdle( ( size_t )atoi( sIdle.substr( 0, uComma ).c_str() ), iMillis );
+		sIdle = ( uComma == CS_STRING::npos ? "" : sIdle.substr( uComma + 1 ) );
+	}
+	RunShared( uWorkers, false, iMillis );
+	RunShared( uWorkers, true, iMillis );
+	ShutdownCsocket();
+	return( 0 );
+}
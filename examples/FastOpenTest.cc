@@ -0,0 +1,144 @@
+/**
+ * TCP Fast Open accounting over loopback, both ends of a plain connection to a Fast Open listener and of one that
+ * sends its data in the SYN, exits non zero on the first check that fails. Skipped where the kernel doesn't do Fast
+ * Open for clients and servers (net.ipv4.tcp_fastopen without both 1 and 2 set)
+ */
+#include <Csocket.h>
+#include <stdio.h>
+
+static bool g_bFailed = false;
+static bool g_bDone = false;
+static CS_STRING g_sReceived;
+
+#define CHECK( x ) do { if( !( x ) ) { cerr << __FILE__ << ":" << __LINE__ << " failed: " #x << endl; g_bFailed = true; } } while( 0 )
+
+//! takes whatever comes in and never answers, so nothing the client counts can come from a read
+class CServerSock : public Csock
+{
+public:
+	CServerSock( int iTimeout = 60 ) : Csock( iTimeout ) {}
+	CServerSock( const CS_STRING & sHostname, uint16_t uPort ) : Csock( sHostname, uPort ) {}
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CServerSock( sHostname, uPort ) ); }
+
+	virtual void ReadData( const char * data, size_t len ) { g_sReceived.append( data, len ); }
+};
+
+class CClientSock : public Csock
+{
+public:
+	CClientSock() : Csock( 10 ) {}
+
+	virtual void Connected() { Write( "hello" ); }
+	virtual void Disconnected() { g_bDone = true; }
+	virtual void ConnectionRefused() { g_bDone = true; }
+	virtual void Timeout() { g_bDone = true; }
+};
+
+static CSSockStats Stats( Csock * pSock )
+{
+	CSSockStats cStats;
+	pSock->GetStats( cStats );
+	return( cStats );
+}
+
+static bool FastOpenEnabled()
+{
+	FILE * pFile = fopen( "/proc/sys/net/ipv4/tcp_fastopen", "r" );
+	if( !pFile )
+		return( false );
+	int iMode = 0;
+	if( fscanf( pFile, "%d", &iMode ) != 1 )
+		iMode = 0;
+	fclose( pFile );
+	return( ( iMode & 3 ) == 3 );
+}
+
+//! connects, waits for the server to have the client's hello and the client's handshake to be over, and hands back both ends
+static void Exchange( CSocketManager & cManager, uint16_t uPort, bool bFastOpen, Csock * & pClient, Csock * & pAccepted )
+{
+	g_bDone = false;
+	g_sReceived.clear();
+	CSConnection cCon( "127.0.0.1", uPort );
+	cCon.SetFastOpen( bFastOpen );
+	pClient = new CClientSock();
+	cManager.Connect( cCon, pClient );
+	pAccepted = NULL;
+	uint64_t iStart = millitime();
+	while( !g_bDone && ( g_sReceived != "hello" || !pAccepted ) && millitime() - iStart < 5000 )
+	{
+		cManager.Loop();
+		for( size_t a = 0; a < cManager.size(); ++a )
+		{
+			if( cManager[a]->GetType() == Csock::INBOUND && !cManager[a]->IsClosed() )
+				pAccepted = cManager[a];
+		}
+	}
+	// the SYN-ACK is in by now, give the client the loop that notices
+	for( int a = 0; a < 5; ++a )
+		cManager.Loop();
+	CHECK( g_sReceived == "hello" );
+	CHECK( pAccepted != NULL );
+}
+
+//! closes both ends of what Exchange() set up
+static void Finish( CSocketManager & cManager, Csock * pClient, Csock * pAccepted )
+{
+	pClient->Close();
+	if( pAccepted )
+		pAccepted->Close();
+	for( int a = 0; a < 5; ++a )
+		cManager.Loop();
+}
+
+int main( int argc, char ** argv )
+{
+	if( !FastOpenEnabled() )
+	{
+		cout << "FastOpenTest skipped, net.ipv4.tcp_fastopen needs 3" << endl;
+		return( 0 );
+	}
+	InitCsocket();
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 100000 );
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetAFRequire( CSSockAddr::RAF_INET );
+	cListen.SetFastOpenQueue( 16 );
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, new CServerSock(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		return( 1 );
+	}
+
+	// a plain connect, the listener takes Fast Open but this SYN had nothing in it
+	Csock * pClient = NULL, * pAccepted = NULL;
+	Exchange( cManager, uPort, false, pClient, pAccepted );
+	CHECK( Stats( pClient ).GetFastOpenTries() == 0 );
+	if( pAccepted )
+	{
+		CHECK( Stats( pAccepted ).GetFastOpenTries() == 0 );
+		CHECK( Stats( pAccepted ).GetFastOpens() == 0 );
+	}
+	Finish( cManager, pClient, pAccepted );
+
+	// the kernel keeps the cookie per address, this makes sure there is one
+	Exchange( cManager, uPort, true, pClient, pAccepted );
+	Finish( cManager, pClient, pAccepted );
+
+	// the hello goes in the SYN. the server never answers, the client counts it off the handshake alone
+	Exchange( cManager, uPort, true, pClient, pAccepted );
+	CHECK( Stats( pClient ).GetFastOpenTries() == 1 );
+	CHECK( Stats( pClient ).GetFastOpens() == 1 );
+	CHECK( pClient->GetBytesRead() == 0 );
+	if( pAccepted )
+	{
+		CHECK( Stats( pAccepted ).GetFastOpenTries() == 1 );
+		CHECK( Stats( pAccepted ).GetFastOpens() == 1 );
+	}
+
+	ShutdownCsocket();
+	if( g_bFailed )
+		return( 1 );
+	cout << "FastOpenTest passed" << endl;
+	return( 0 );
+}
@@ -0,0 +1,96 @@
+/**
+ * Csock::operator<<() formatting cost, no sockets involved
+ *
+ * usage: FormatBench [seconds per case]
+ *
+ * builds a status line of five numbers the old way, a stringstream and a Write() per value, and as one
+ * sock << a << b << ... << endl expression. the socket has no fd, each Write() still costs a failing write()
+ * so the syscall count matches a connected socket.
+ */
+#include <Csocket.h>
+#define BENCH_COUNT_ALLOCS
+#include "bench.h"
+#include <stdlib.h>
+
+class CCountSock : public Csock
+{
+public:
+	CCountSock() : Csock( 0 ), m_iWrites( 0 ) {}
+
+	virtual bool Write( const char * data, size_t len )
+	{
+		m_iWrites++;
+		return( Csock::Write( data, len ) );
+	}
+	virtual bool Write( const CS_STRING & sData ) { return( Write( sData.data(), sData.size() ) ); }
+
+	uint64_t	m_iWrites;
+};
+
+//! what every numeric operator<< used to do
+template<typename T> static void StreamWrite( Csock & cSock, T tValue )
+{
+	std::stringstream s;
+	s << tValue;
+	cSock.Write( s.str() );
+}
+
+static void RunCase( bool bBatch, uint64_t iMillis )
+{
+	CCountSock cSock;
+	uint64_t iLines = 0;
+	uint64_t iAllocStart = g_iAllocs;
+	uint64_t iStart = microtime();
+	uint64_t iElapsed = 0;
+	do
+	{
+		for( int a = 0; a < 1000; ++a )
+		{
+			uint32_t uConns = ( uint32_t )( iLines & 0xffff );
+			int64_t iDelta = -( int64_t )iLines;
+			uint64_t iBytes = iLines * 1448;
+			double fLoad = ( double )( iLines % 1000 ) / 7.0;
+			if( bBatch )
+			{
+				cSock << "STAT " << uConns << " " << iDelta << " " << iBytes << " " << fLoad << " " << ( int32_t )a << endl;
+			}
+			else
+			{
+				cSock.Write( "STAT " );
+				StreamWrite( cSock, uConns );
+				cSock.Write( " " );
+				StreamWrite( cSock, iDelta );
+				cSock.Write( " " );
+				StreamWrite( cSock, iBytes );
+				cSock.Write( " " );
+				StreamWrite( cSock, fLoad );
+				cSock.Write( " " );
+				StreamWrite( cSock, ( int32_t )a );
+				cSock.Write( "\r\n" );
+			}
+			iLines++;
+		}
+		// nothing is connected, so the send queue only grows. keep its memory, drop the contents
+		cSock.ClearWriteBuffer();
+		iElapsed = microtime() - iStart;
+	} while( iElapsed < iMillis * 1000 );
+	uint64_t iAllocs = g_iAllocs - iAllocStart;
+
+	double fSecs = ( double )iElapsed / 1000000.0;
+	cout << "path=" << ( bBatch ? "batch" : "stringstream" )
+		<< " lines/s=" << ( uint64_t )( ( double )iLines / fSecs )
+		<< " ns/line=" << ( double )iElapsed * 1000.0 / ( double )iLines
+		<< " allocs/line=" << ( double )iAllocs / ( double )iLines
+		<< " writes/line=" << ( double )cSock.m_iWrites / ( double )iLines << endl;
+}
+
+int main( int argc, char ** argv )
+{
+	uint64_t iMillis = argc > 1 ? ( uint64_t )( atof( argv[1] ) * 1000.0 ) : 500;
+
+	InitCsocket();
+	RunCase( false, iMillis );
+	RunCase( true, iMillis );
+	ShutdownCsocket();
+	return( 0 );
+}
@@ -0,0 +1,288 @@
+/**
+ * keep-alive HTTP request rate over loopback, CHTTPSock against a ReadLine() based server like the ones it replaces
+ *
+ * usage: HTTPBench [seconds per run] [connections, IE 1,10,100] [pipeline depth, IE 1,16] [server: readline|http|both]
+ *
+ * every connection sends depth requests back to back and waits for all the responses before sending the next batch,
+ * so latency is per batch. both servers send byte for byte the same response, the clients only count bytes.
+ * cpu/req and allocs/req cover both ends since they run in the same process.
+ */
+#include <HTTPSock.h>
+#define BENCH_COUNT_ALLOCS
+#include "bench.h"
+#include <stdlib.h>
+#include <signal.h>
+#ifndef _WIN32
+#include <unistd.h>
+#include <netinet/tcp.h>
+#endif /* _WIN32 */
+
+static const char g_szRequest[] = "GET /hello?name=bench HTTP/1.1\r\nHost: 127.0.0.1\r\nUser-Agent: HTTPBench\r\nAccept: */*\r\n\r\n";
+static const char g_szBody[] = "hello, world\n";
+static CS_STRING g_sResponse;
+static CS_STRING g_sBatch;
+static size_t g_uConnected = 0;
+static bool g_bRunning = false;
+static uint64_t g_iRequests = 0;
+static std::vector<uint32_t> g_vRTT;
+
+//! measure the servers, not Nagle's algorithm holding back the second of two small writes
+static void NoDelay( Csock * pSock )
+{
+#ifndef _WIN32
+	int iOn = 1;
+	setsockopt( pSock->GetRSock(), IPPROTO_TCP, TCP_NODELAY, &iOn, sizeof( iOn ) );
+#endif /* _WIN32 */
+}
+
+//! the way our services answer today, one ReadLine() per request and header line
+class CLineServer : public Csock
+{
+public:
+	CLineServer( int iTimeout = 0 ) : Csock( iTimeout ) { Setup(); }
+	CLineServer( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 0 ) : Csock( sHostname, uPort, iTimeout ) { Setup(); }
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CLineServer( sHostname, uPort ) ); }
+	virtual void Connected() { NoDelay( this ); }
+
+	virtual void ReadLine( const CS_STRING & sLine )
+	{
+		CS_STRING::size_type uLen = sLine.length();
+		while( uLen > 0 && ( sLine[uLen - 1] == '\n' || sLine[uLen - 1] == '\r' ) )
+			uLen--;
+
+		if( m_sMethod.empty() )
+		{
+			CS_STRING::size_type uMethodEnd = sLine.find( ' ' );
+			if( uMethodEnd == CS_STRING::npos || uMethodEnd >= uLen )
+			{
+				Close();
+				return;
+			}
+			m_sMethod = sLine.substr( 0, uMethodEnd );
+			CS_STRING::size_type uPathEnd = sLine.find_first_of( " ?", uMethodEnd + 1 );
+			if( uPathEnd == CS_STRING::npos || uPathEnd > uLen )
+				uPathEnd = uLen;
+			m_sPath = sLine.substr( uMethodEnd + 1, uPathEnd - uMethodEnd - 1 );
+			return;
+		}
+
+		if( uLen > 0 )
+			return;
+
+		Write( g_sResponse );
+		m_sMethod.clear();
+		m_sPath.clear();
+	}
+
+private:
+	void Setup()
+	{
+		EnableReadLine();
+		SetMaxBufferThreshold( 16384 );
+	}
+
+	CS_STRING	m_sMethod, m_sPath;
+};
+
+class CHTTPServer : public CHTTPSock
+{
+public:
+	CHTTPServer( int iTimeout = 0 ) : CHTTPSock( iTimeout ) {}
+	CHTTPServer( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 0 ) : CHTTPSock( sHostname, uPort, iTimeout ) {}
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CHTTPServer( sHostname, uPort ) ); }
+	virtual void Connected() { NoDelay( this ); }
+
+	virtual void HTTPRequest( const CSHTTPRequest & cRequest )
+	{
+		if( cRequest.GetPath().Equals( "/hello" ) )
+			Respond( 200, "text/plain", g_szBody, sizeof( g_szBody ) - 1 );
+		else
+			Respond( 404, "text/plain", "Not Found\n" );
+	}
+};
+
+class CBenchClient : public Csock
+{
+public:
+	CBenchClient( size_t uDepth ) : Csock( 0 )
+	{
+		m_uDepth = uDepth;
+		m_uExpected = 0;
+		m_uReceived = 0;
+		m_iSent = 0;
+		m_bConnected = false;
+	}
+	virtual ~CBenchClient()
+	{
+		if( m_bConnected )
+			g_uConnected--;
+	}
+
+	virtual void Connected()
+	{
+		m_bConnected = true;
+		g_uConnected++;
+		NoDelay( this );
+	}
+
+	void Send()
+	{
+		m_uReceived = 0;
+		m_uExpected = m_uDepth * g_sResponse.size();
+		m_iSent = microtime();
+		Write( g_sBatch.data(), m_uDepth * ( sizeof( g_szRequest ) - 1 ) );
+	}
+
+	virtual void ReadData( const char * data, size_t len )
+	{
+		m_uReceived += len;
+		if( m_uReceived < m_uExpected )
+			return;
+		g_vRTT.push_back( ( uint32_t )( microtime() - m_iSent ) );
+		g_iRequests += m_uDepth;
+		if( g_bRunning )
+			Send();
+	}
+
+private:
+	size_t		m_uDepth, m_uExpected, m_uReceived;
+	uint64_t	m_iSent;
+	bool		m_bConnected;
+};
+
+static void ParseList( const char * pszList, std::vector<size_t> & vValues )
+{
+	vValues.clear();
+	CS_STRING sList( pszList );
+	CS_STRING::size_type uPos = 0;
+	while( uPos < sList.size() )
+	{
+		CS_STRING::size_type uComma = sList.find( ',', uPos );
+		if( uComma == CS_STRING::npos )
+			uComma = sList.size();
+		size_t uValue = ( size_t )atol( sList.substr( uPos, uComma - uPos ).c_str() );
+		if( uValue > 0 )
+			vValues.push_back( uValue );
+		uPos = uComma + 1;
+	}
+}
+
+static bool RunOne( bool bHTTP, size_t uConns, size_t uDepth, uint64_t iMillis )
+{
+	g_iRequests = 0;
+	g_vRTT.clear();
+	g_vRTT.reserve( 1 << 20 );
+	g_bRunning = false;
+	g_sBatch.clear();
+	for( size_t a = 0; a < uDepth; ++a )
+		g_sBatch.append( g_szRequest, sizeof( g_szRequest ) - 1 );
+
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 10000 );
+
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetMaxConns( uConns > SOMAXCONN ? ( int )uConns : SOMAXCONN );
+	uint16_t uPort = 0;
+	Csock * pListener = bHTTP ? ( Csock * )new CHTTPServer() : ( Csock * )new CLineServer();
+	if( !cManager.Listen( cListen, pListener, &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		return( false );
+	}
+
+	std::vector<CBenchClient *> vClients;
+	for( size_t a = 0; a < uConns; ++a )
+	{
+		CSConnection cConn( "127.0.0.1", uPort );
+		CBenchClient * pClient = new CBenchClient( uDepth );
+		cManager.Connect( cConn, pClient );
+		vClients.push_back( pClient );
+	}
+
+	uint64_t iStart = millitime();
+	while( g_uConnected < uConns && millitime() - iStart < 10000 )
+		cManager.Loop();
+	if( g_uConnected < uConns )
+	{
+		cerr << "only " << g_uConnected << " of " << uConns << " connections came up" << endl;
+		return( false );
+	}
+
+	// one batch to warm up the buffers on both ends
+	g_bRunning = true;
+	for( size_t a = 0; a < vClients.size(); ++a )
+		vClients[a]->Send();
+	while( g_iRequests < uConns * uDepth && millitime() - iStart < 10000 )
+		cManager.Loop();
+	g_vRTT.clear();
+
+	uint64_t iCPUStart = CPUTime();
+	uint64_t iAllocStart = g_iAllocs;
+	iStart = millitime();
+	uint64_t iRequestStart = g_iRequests;
+	while( millitime() - iStart < iMillis )
+		cManager.Loop();
+	uint64_t iElapsed = millitime() - iStart;
+	uint64_t iCPU = CPUTime() - iCPUStart;
+	uint64_t iAllocs = g_iAllocs - iAllocStart;
+	uint64_t iRequests = g_iRequests - iRequestStart;
+	g_bRunning = false;
+
+	double fSecs = ( double )iElapsed / 1000.0;
+	cout << "server=" << ( bHTTP ? "http    " : "readline" ) << " conns=" << uConns << " depth=" << uDepth
+		<< " req/s=" << ( uint64_t )( ( double )iRequests / fSecs )
+		<< " p50=" << Percentile( g_vRTT, 50.0 ) << "us"
+		<< " p99=" << Percentile( g_vRTT, 99.0 ) << "us"
+		<< " cpu/req=" << ( iRequests ? ( double )iCPU / ( double )iRequests : 0.0 ) << "us"
+		<< " allocs/req=" << ( iRequests ? ( double )iAllocs / ( double )iRequests : 0.0 ) << endl;
+
+	cManager.clear();
+	return( true );
+}
+
+int main( int argc, char ** argv )
+{
+	uint64_t iMillis = argc > 1 ? ( uint64_t )( atof( argv[1] ) * 1000.0 ) : 1000;
+	std::vector<size_t> vConns, vDepths;
+	ParseList( argc > 2 ? argv[2] : "1,10,100", vConns );
+	ParseList( argc > 3 ? argv[3] : "1,16", vDepths );
+	CS_STRING sServer( argc > 4 ? argv[4] : "both" );
+
+	// exactly what CHTTPSock::Respond() sends for a keep-alive HTTP/1.1 request
+	char szLength[32];
+	snprintf( szLength, sizeof( szLength ), "%u", ( u_int )( sizeof( g_szBody ) - 1 ) );
+	g_sResponse = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: ";
+	g_sResponse.append( szLength ).append( "\r\n\r\n" ).append( g_szBody );
+
+	InitCsocket();
+	RaiseFDLimit();
+#ifndef _WIN32
+	signal( SIGPIPE, SIG_IGN );
+#endif /* _WIN32 */
+
+	for( size_t c = 0; c < vConns.size(); ++c )
+	{
+#ifndef CSOCK_USE_POLL
+		if( vConns[c] * 2 + 16 > FD_SETSIZE )
+		{
+			cerr << "conns=" << vConns[c] << " doesn't fit in select(), skipped" << endl;
+			continue;
+		}
+#endif /* CSOCK_USE_POLL */
+		for( size_t d = 0; d < vDepths.size(); ++d )
+		{
+			for( int iHTTP = 0; iHTTP < 2; ++iHTTP )
+			{
+				if( ( iHTTP && sServer == "readline" ) || ( !iHTTP && sServer == "http" ) )
+					continue;
+				if( !RunOne( iHTTP != 0, vConns[c], vDepths[d], iMillis ) )
+					return( 1 );
+			}
+		}
+	}
+
+	ShutdownCsocket();
+	return( 0 );
+}
@@ -0,0 +1,114 @@
+/**
+ * CHTTPSock checks over loopback, exits non zero on the first one that fails
+ */
+#include <HTTPSock.h>
+
+static bool g_bFailed = false;
+static bool g_bDone = false;
+static CS_STRING g_sResponse;
+static int g_iRequests = 0;
+
+#define CHECK( x ) do { if( !( x ) ) { cerr << __FILE__ << ":" << __LINE__ << " failed: " #x << endl; g_bFailed = true; } } while( 0 )
+
+class CSpanSock : public CHTTPSock
+{
+public:
+	CSpanSock( int iTimeout = 60 ) : CHTTPSock( iTimeout ) {}
+	CSpanSock( const CS_STRING & sHostname, uint16_t uPort ) : CHTTPSock( sHostname, uPort ) {}
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CSpanSock( sHostname, uPort ) ); }
+
+	virtual void HTTPRequest( const CSHTTPRequest & cRequest )
+	{
+		g_iRequests++;
+		CHECK( !cRequest.GetKeepAlive() );
+		Respond( 200, "text/plain", "bye\n" );
+		// the spans have to hold up for the whole call, not just until the response is out
+		CSHTTPSpan cValue;
+		CHECK( cRequest.GetMethod().Equals( "GET" ) );
+		CHECK( cRequest.GetPath().Equals( "/split" ) );
+		CHECK( cRequest.GetHeader( "X-Test", cValue ) && cValue.Equals( "keep-me" ) );
+		CHECK( cRequest.GetBody().empty() );
+	}
+};
+
+class CClientSock : public Csock
+{
+public:
+	CClientSock() : Csock( 10 ) {}
+
+	virtual void ReadData( const char * data, size_t len ) { g_sResponse.append( data, len ); }
+	virtual void Disconnected() { g_bDone = true; }
+	virtual void ConnectionRefused() { g_bDone = true; }
+	virtual void Timeout() { g_bDone = true; }
+};
+
+//! a Connection: close request that arrives in two reads, so it is parsed out of the socket's own buffer
+static void TestSpansAfterClose( CSocketManager & cManager, uint16_t uPort )
+{
+	g_bDone = false;
+	g_sResponse.clear();
+	CClientSock * pClient = new CClientSock();
+	cManager.Connect( CSConnection( "127.0.0.1", uPort ), pClient );
+	while( !pClient->IsConnected() && !g_bDone )
+		cManager.Loop();
+	pClient->Write( "GET /split HTTP/1.1\r\nHost: 127.0.0.1\r\nX-Test: keep-me\r\n" );
+	for( int a = 0; a < 10; ++a )
+		cManager.Loop();
+	pClient->Write( "Connection: close\r\n\r\n" );
+	uint64_t iStart = millitime();
+	while( !g_bDone && millitime() - iStart < 5000 )
+		cManager.Loop();
+	CHECK( g_bDone );
+	CHECK( g_sResponse.compare( 0, 15, "HTTP/1.1 200 OK" ) == 0 );
+	CHECK( g_sResponse.find( "Connection: close\r\n" ) != CS_STRING::npos );
+	CHECK( g_sResponse.find( "\r\n\r\nbye\n" ) != CS_STRING::npos );
+}
+
+//! a NUL in a header value, the request is refused before HTTPRequest() sees it
+static void TestControlInValue( CSocketManager & cManager, uint16_t uPort )
+{
+	g_bDone = false;
+	g_sResponse.clear();
+	int iRequests = g_iRequests;
+	CClientSock * pClient = new CClientSock();
+	cManager.Connect( CSConnection( "127.0.0.1", uPort ), pClient );
+	while( !pClient->IsConnected() && !g_bDone )
+		cManager.Loop();
+	static const char szRequest[] = "GET /split HTTP/1.1\r\nHost: 127.0.0.1\r\nX-Test: keep-me\0abc\r\nConnection: close\r\n\r\n";
+	pClient->Write( szRequest, sizeof( szRequest ) - 1 );
+	uint64_t iStart = millitime();
+	while( !g_bDone && millitime() - iStart < 5000 )
+		cManager.Loop();
+	CHECK( g_bDone );
+	CHECK( g_sResponse.compare( 0, 12, "HTTP/1.1 400" ) == 0 );
+	CHECK( g_iRequests == iRequests );
+}
+
+int main( int argc, char ** argv )
+{
+	InitCsocket();
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 1000 );
+	CSListener cListen( 0, "127.0.0.1" );
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, new CSpanSock(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		return( 1 );
+	}
+
+	// a NUL inside the span doesn't end the compare
+	CHECK( CSHTTPSpan( "13\0abc", 6 ).Equals( "13" ) == false );
+	CHECK( CSHTTPSpan( "13", 2 ).Equals( "13" ) );
+	CHECK( CSHTTPSpan( "13", 2 ).Equals( "130" ) == false );
+	CHECK( CSHTTPSpan().Equals( "" ) );
+
+	TestSpansAfterClose( cManager, uPort );
+	TestControlInValue( cManager, uPort );
+
+	ShutdownCsocket();
+	if( g_bFailed )
+		return( 1 );
+	cout << "HTTPTest passed" << endl;
+	return( 0 );
+}
@@ -0,0 +1,153 @@
+/**
+ * latency of small interactive messages sent behind bulk data on the same connection, over loopback
+ *
+ * usage: LatencyBench [seconds per run] [receiver MB/s]
+ *
+ * the sender keeps bulk frames queued at all times and sends a timestamped ping frame every 10ms, the receiver reads
+ * at a fixed rate so the connection is always backed up. default is what Write() has always done, lowat is
+ * SetLowLatency() with the pings still sent by Write(), urgent is SetLowLatency() with the pings sent by WriteUrgent().
+ * latency is from the ping's Write() to its ReadFrame(), the first quarter of each run is left out.
+ */
+#include <Csocket.h>
+#include "bench.h"
+#include <stdlib.h>
+#include <signal.h>
+
+static const size_t BULK_FRAME = 65536;
+
+static std::vector<uint64_t> g_vLatencies;
+static uint64_t g_iBulkBytes = 0;
+static uint64_t g_iMeasureFrom = 0;
+
+static CS_STRING Frame( char cType, const CS_STRING & sPayload )
+{
+	uint32_t uLen = ( uint32_t )( sPayload.size() + 1 );
+	CS_STRING sFrame;
+	sFrame += ( char )( ( uLen >> 24 ) & 0xff );
+	sFrame += ( char )( ( uLen >> 16 ) & 0xff );
+	sFrame += ( char )( ( uLen >> 8 ) & 0xff );
+	sFrame += ( char )( uLen & 0xff );
+	sFrame += cType;
+	sFrame += sPayload;
+	return( sFrame );
+}
+
+class CSlowReader : public Csock
+{
+public:
+	CSlowReader( int iTimeout = 0 ) : Csock( iTimeout ) {}
+	CSlowReader( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 0 ) : Csock( sHostname, uPort, iTimeout ) {}
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort )
+	{
+		CSlowReader * pSock = new CSlowReader( sHostname, uPort );
+		pSock->EnableReadFrame( 4 );
+		return( pSock );
+	}
+
+	virtual void ReadFrame( const char * pData, size_t uLen )
+	{
+		if( uLen == 0 )
+			return;
+		if( pData[0] != 'P' )
+		{
+			g_iBulkBytes += uLen;
+			return;
+		}
+		uint64_t iSent = 0;
+		memcpy( &iSent, pData + 1, std::min( uLen - 1, sizeof( iSent ) ) );
+		uint64_t iNow = microtime();
+		if( iSent >= g_iMeasureFrom )
+			g_vLatencies.push_back( iNow - iSent );
+	}
+};
+
+static void RunCase( const CS_STRING & sMode, uint64_t iMillis, uint64_t iRate )
+{
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 1000 );
+	g_vLatencies.clear();
+	g_iBulkBytes = 0;
+
+	// a small receive window, so what piles up is on the sending side where the sender can do something about it
+	CSSockTuning cReadTuning;
+	cReadTuning.SetRecvBuffer( 65536 );
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetTuning( cReadTuning );
+	CSlowReader * pListener = new CSlowReader();
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, pListener, &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		exit( 1 );
+	}
+
+	CSConnection cCon( "127.0.0.1", uPort, 0 );
+	Csock * pSender = new Csock( 0 );
+	if( sMode != "default" )
+		pSender->SetLowLatency();
+	cManager.Connect( cCon, pSender );
+
+	Csock * pReader = NULL;
+	while( !pReader || !pSender->IsConnected() )
+	{
+		cManager.Loop();
+		for( size_t a = 0; a < cManager.size() && !pReader; ++a )
+		{
+			if( cManager[a] != pSender && cManager[a] != pListener && cManager[a]->GetType() == Csock::INBOUND )
+				pReader = cManager[a];
+		}
+	}
+	pReader->SetReadRate( iRate );
+
+	CS_STRING sBulk = Frame( 'B', CS_STRING( BULK_FRAME, 'x' ) );
+	uint64_t iStart = microtime();
+	g_iMeasureFrom = iStart + iMillis * 250;
+	uint64_t iBulkFrom = 0;
+	uint64_t iNextPing = iStart;
+	uint64_t iNow = iStart;
+	while( iNow - iStart < iMillis * 1000 )
+	{
+		// four frames' worth waiting in user space is plenty to keep the kernel fed
+		while( pSender->GetWriteBufferSize() < 4 * sBulk.size() )
+			pSender->Write( sBulk );
+		if( iNow >= iNextPing )
+		{
+			CS_STRING sPing = Frame( 'P', CS_STRING( ( const char * )&iNow, sizeof( iNow ) ) );
+			if( sMode == "urgent" )
+				pSender->WriteUrgent( sPing );
+			else
+				pSender->Write( sPing );
+			iNextPing = iNow + 10000;
+		}
+		cManager.Loop();
+		iNow = microtime();
+		if( iBulkFrom == 0 && iNow >= g_iMeasureFrom )
+			iBulkFrom = g_iBulkBytes;
+	}
+
+	double fSecs = ( double )( iNow - g_iMeasureFrom ) / 1000000.0;
+	size_t uPings = g_vLatencies.size();
+	cout << "mode=" << sMode
+		<< " pings=" << uPings
+		<< " p50-ms=" << ( double )Percentile( g_vLatencies, 50.0 ) / 1000.0
+		<< " p99-ms=" << ( double )Percentile( g_vLatencies, 99.0 ) / 1000.0
+		<< " max-ms=" << ( double )Percentile( g_vLatencies, 100.0 ) / 1000.0
+		<< " bulk-MB/s=" << ( double )( g_iBulkBytes - iBulkFrom ) / fSecs / ( 1024.0 * 1024.0 ) << endl;
+}
+
+int main( int argc, char ** argv )
+{
+	uint64_t iMillis = argc > 1 ? ( uint64_t )( atof( argv[1] ) * 1000.0 ) : 4000;
+	uint64_t iRate = ( uint64_t )( ( argc > 2 ? atof( argv[2] ) : 20.0 ) * 1024.0 * 1024.0 );
+
+	InitCsocket();
+#ifndef _WIN32
+	signal( SIGPIPE, SIG_IGN );
+#endif /* _WIN32 */
+	RunCase( "default", iMillis, iRate );
+	RunCase( "lowat", iMillis, iRate );
+	RunCase( "urgent", iMillis, iRate );
+	ShutdownCsocket();
+	return( 0 );
+}
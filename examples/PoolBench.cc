@@ -0,0 +1,176 @@
+/**
+ * short request/response exchanges over loopback, a new connection for each one vs CSocketManager's connection pool
+ *
+ * usage: PoolBench [seconds per run] [requests in flight] [modes, IE tcp,ecdsa]
+ *
+ * a request is one byte out and its echo back. without the pool every request pays for connect() and, for tls, the
+ * handshake, with it the same few connections are acquired and released over and over. the tls modes use the
+ * ConnectBench-<mode>.pem certificates, 'make ConnectBench-certs' generates them.
+ * cpu is user+sys for the whole process, server included.
+ */
+#include <Csocket.h>
+#include "bench.h"
+#include <stdlib.h>
+#include <signal.h>
+#ifndef _WIN32
+#include <unistd.h>
+#endif /* _WIN32 */
+
+static CSocketManager * g_pManager = NULL;
+static bool g_bPooled = false;
+static size_t g_uInFlight = 0;
+static uint64_t g_iRequests = 0;
+static uint64_t g_iErrors = 0;
+static uint64_t g_iConnects = 0;
+
+class CReplySock : public Csock
+{
+public:
+	CReplySock( int iTimeout = 0 ) : Csock( iTimeout ) {}
+	CReplySock( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 0 ) : Csock( sHostname, uPort, iTimeout ) {}
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CReplySock( sHostname, uPort ) ); }
+	virtual void ReadData( const char * data, size_t len ) { Write( data, len ); }
+};
+
+class CRequestSock : public Csock
+{
+public:
+	CRequestSock() : Csock( 10 ), m_bBusy( true ) { g_iConnects++; }
+
+	void Request()
+	{
+		m_bBusy = true;
+		Write( "x", 1 );
+	}
+
+	virtual void Connected() { Request(); }
+	virtual void ReadData( const char * data, size_t len )
+	{
+		if( !m_bBusy )
+			return;
+		m_bBusy = false;
+		g_iRequests++;
+		g_uInFlight--;
+		if( g_bPooled )
+			g_pManager->ReleaseSock( this );
+		else
+			Close();
+	}
+
+	virtual void SockError( int iErrno, const CS_STRING & sDescription ) { Failed(); }
+	virtual void ConnectionRefused() { Failed(); }
+	virtual void Timeout() { Failed(); }
+	virtual void Disconnected() { Failed(); }
+
+private:
+	void Failed()
+	{
+		if( !m_bBusy )
+			return;
+		m_bBusy = false;
+		g_iErrors++;
+		g_uInFlight--;
+	}
+
+	bool	m_bBusy;
+};
+
+static void RunCase( const CS_STRING & sMode, bool bPooled, size_t uParallel, uint64_t iMillis )
+{
+	bool bSSL = ( sMode != "tcp" );
+	CS_STRING sPem = "ConnectBench-" + sMode + ".pem";
+	if( bSSL && access( sPem.c_str(), R_OK ) != 0 )
+	{
+		cout << "mode=" << sMode << " pool=" << ( bPooled ? "on" : "off" ) << " skipped, " << sPem << " is missing" << endl;
+		return;
+	}
+
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 1000 );
+	cManager.SetPoolMaxPerKey( ( u_int )uParallel );
+	g_pManager = &cManager;
+	g_bPooled = bPooled;
+	g_uInFlight = 0;
+	g_iRequests = 0;
+	g_iErrors = 0;
+	g_iConnects = 0;
+
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetMaxConns( SOMAXCONN );
+	if( bSSL )
+	{
+		cListen.SetIsSSL( true );
+		cListen.SetPemLocation( sPem );
+	}
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, new CReplySock(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		exit( 1 );
+	}
+	CSConnection cCon( "127.0.0.1", uPort, 10 );
+	cCon.SetIsSSL( bSSL );
+
+	uint64_t iCPUStart = CPUTime();
+	uint64_t iStart = millitime();
+	uint64_t iNow = iStart;
+	while( iNow - iStart < iMillis )
+	{
+		while( g_uInFlight < uParallel )
+		{
+			g_uInFlight++;
+			if( !bPooled )
+			{
+				cManager.Connect( cCon, new CRequestSock() );
+				continue;
+			}
+			CRequestSock * pSock = ( CRequestSock * )cManager.AcquireSock( cCon );
+			if( pSock )
+				pSock->Request();
+			else if( !cManager.ConnectPooled( cCon, new CRequestSock() ) )
+			{
+				// every connection of the key is busy, wait for one to come back
+				g_uInFlight--;
+				break;
+			}
+		}
+		cManager.Loop();
+		iNow = millitime();
+	}
+	uint64_t iCPU = CPUTime() - iCPUStart;
+	uint64_t iRequests = g_iRequests;
+
+	CSPoolStats cStats;
+	cManager.GetPoolStats( cStats );
+	double fSecs = ( double )( iNow - iStart ) / 1000.0;
+	cout << "mode=" << sMode << " pool=" << ( bPooled ? "on" : "off" ) << " parallel=" << uParallel
+		<< " req/s=" << ( double )iRequests / fSecs
+		<< " cpu-us/req=" << ( iRequests ? ( double )iCPU / ( double )iRequests : 0.0 )
+		<< " connects=" << g_iConnects
+		<< " hit-rate=" << cStats.GetHitRate()
+		<< " errors=" << g_iErrors << endl;
+	g_pManager = NULL;
+}
+
+int main( int argc, char ** argv )
+{
+	uint64_t iMillis = argc > 1 ? ( uint64_t )( atof( argv[1] ) * 1000.0 ) : 1000;
+	size_t uParallel = argc > 2 ? ( size_t )atoi( argv[2] ) : 8;
+	CS_STRING sModes( argc > 3 ? argv[3] : "tcp,ecdsa" );
+
+	InitCsocket();
+#ifndef _WIN32
+	signal( SIGPIPE, SIG_IGN );
+#endif /* _WIN32 */
+	while( !sModes.empty() )
+	{
+		CS_STRING::size_type uComma = sModes.find( ',' );
+		CS_STRING sMode = sModes.substr( 0, uComma );
+		sModes = ( uComma == CS_STRING::npos ? "" : sModes.substr( uComma + 1 ) );
+		RunCase( sMode, false, uParallel, iMillis );
+		RunCase( sMode, true, uParallel, iMillis );
+	}
+	ShutdownCsocket();
+	return( 0 );
+}
@@ -0,0 +1,160 @@
+/**
+ * TCP relay throughput, clients -> proxy -> echo backend -> proxy -> clients, all over loopback in one manager
+ *
+ * usage: ProxyBench [seconds per run] [connections]
+ *
+ * each client keeps a window of data in flight and counts what comes back. copy is the proxy moving every byte
+ * through user space with Read()/Write(), splice is Csock::Proxy() moving it with splice() through a pipe.
+ * cpu is user+sys for the whole process, clients and backend included, so the difference is all the proxy's.
+ */
+#include <Csocket.h>
+#include "bench.h"
+#include <stdlib.h>
+#include <signal.h>
+
+static CSocketManager * g_pManager = NULL;
+static uint16_t g_uBackendPort = 0;
+static bool g_bSplice = true;
+static uint64_t g_iReceived = 0;
+
+class CEchoSock : public Csock
+{
+public:
+	CEchoSock( int iTimeout = 0 ) : Csock( iTimeout ) {}
+	CEchoSock( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 0 ) : Csock( sHostname, uPort, iTimeout ) {}
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CEchoSock( sHostname, uPort ) ); }
+	virtual void ReadData( const char * data, size_t len ) { Write( data, len ); }
+};
+
+class CBackendSock : public Csock
+{
+public:
+	CBackendSock( Csock * pClient ) : Csock( 0 ), m_pClient( pClient ) {}
+	virtual ~CBackendSock()
+	{
+		if( m_pClient )
+			m_pClient->Close();
+	}
+
+	virtual void Connected()
+	{
+		m_pClient->Proxy( this, g_bSplice );
+		m_pClient->UnPauseRead();
+		// from here on the pairing closes the client
+		m_pClient = NULL;
+	}
+
+private:
+	Csock *	m_pClient;
+};
+
+class CProxySock : public Csock
+{
+public:
+	CProxySock( int iTimeout = 0 ) : Csock( iTimeout ) {}
+	CProxySock( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 0 ) : Csock( sHostname, uPort, iTimeout ) {}
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CProxySock( sHostname, uPort ) ); }
+	virtual void Connected()
+	{
+		// hold the client until there is somewhere to send what it says
+		PauseRead();
+		CSConnection cCon( "127.0.0.1", g_uBackendPort );
+		g_pManager->Connect( cCon, new CBackendSock( this ) );
+	}
+};
+
+class CBlastSock : public Csock
+{
+public:
+	CBlastSock() : Csock( 0 ), m_iSent( 0 ), m_iReceived( 0 ), m_sChunk( 65536, 'x' ) {}
+
+	virtual void Connected() { Pump(); }
+	virtual void ReadData( const char * data, size_t len )
+	{
+		m_iReceived += len;
+		g_iReceived += len;
+		Pump();
+	}
+	void Pump()
+	{
+		// 1MB in flight each way is enough to keep loopback busy
+		while( m_iSent - m_iReceived < 1024 * 1024 )
+		{
+			Write( m_sChunk );
+			m_iSent += m_sChunk.size();
+		}
+	}
+
+private:
+	uint64_t	m_iSent, m_iReceived;
+	CS_STRING	m_sChunk;
+};
+
+static void RunCase( bool bSplice, u_int uConns, uint64_t iMillis )
+{
+	CSocketManager cManager;
+	g_pManager = &cManager;
+	g_bSplice = bSplice;
+	g_iReceived = 0;
+
+	CSListener cBackend( 0, "127.0.0.1" );
+	CSListener cProxy( 0, "127.0.0.1" );
+	uint16_t uProxyPort = 0;
+	if( !cManager.Listen( cBackend, new CEchoSock(), &g_uBackendPort ) || !cManager.Listen( cProxy, new CProxySock(), &uProxyPort ) )
+	{
+		cerr << "listen failed" << endl;
+		exit( 1 );
+	}
+	for( u_int a = 0; a < uConns; ++a )
+	{
+		CSConnection cCon( "127.0.0.1", uProxyPort );
+		cManager.Connect( cCon, new CBlastSock() );
+	}
+
+	// let everyone connect and get going before the clock starts
+	uint64_t iWarmup = millitime();
+	while( g_iReceived == 0 && millitime() - iWarmup < 5000 )
+		cManager.Loop();
+
+	uint64_t iStartReceived = g_iReceived;
+	uint64_t iStartCPU = CPUTime();
+	uint64_t iStart = millitime();
+	uint64_t iNow = iStart;
+	while( iNow - iStart < iMillis )
+	{
+		cManager.Loop();
+		iNow = millitime();
+	}
+	double fCPU = ( double )( CPUTime() - iStartCPU ) / 1000000.0;
+	double fSecs = ( double )( iNow - iStart ) / 1000.0;
+	double fMB = ( double )( g_iReceived - iStartReceived ) / ( 1024.0 * 1024.0 );
+
+	u_int uSpliced = 0;
+	for( size_t a = 0; a < cManager.size(); ++a )
+	{
+		if( cManager[a]->IsSpliced() )
+			uSpliced++;
+	}
+	cout << "mode=" << ( bSplice ? "splice" : "copy" ) << " conns=" << uConns
+		<< " MB/s=" << fMB / fSecs
+		<< " cpu-ms/MB=" << ( fMB > 0 ? fCPU * 1000.0 / fMB : 0.0 )
+		<< " spliced-socks=" << uSpliced << endl;
+	g_pManager = NULL;
+}
+
+int main( int argc, char ** argv )
+{
+	uint64_t iMillis = argc > 1 ? ( uint64_t )( atof( argv[1] ) * 1000.0 ) : 1000;
+	u_int uConns = ( u_int )( argc > 2 ? atoi( argv[2] ) : 4 );
+
+	InitCsocket();
+#ifndef _WIN32
+	signal( SIGPIPE, SIG_IGN );
+#endif /* _WIN32 */
+	RunCase( false, uConns, iMillis );
+	RunCase( true, uConns, iMillis );
+	ShutdownCsocket();
+	return( 0 );
+}
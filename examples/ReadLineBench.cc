@@ -0,0 +1,116 @@
+/**
+ * ReadLine() framing throughput, feeds synthetic buffers straight into Csock::PushBuff() without any sockets
+ *
+ * usage: ReadLineBench [seconds per case]
+ *
+ * sweeps line length, LF vs CRLF and how the input is cut up into reads. reads of one segment split lines across
+ * PushBuff() calls, the same way a busy socket hands them over. when built with HAVE_ICU every case also runs
+ * with SetEncoding( "ISO-8859-1" ).
+ */
+#include <Csocket.h>
+#define BENCH_COUNT_ALLOCS
+#include "bench.h"
+#include <stdlib.h>
+
+class CLineSock : public Csock
+{
+public:
+	CLineSock() : Csock( 0 )
+	{
+		m_iLines = 0;
+		m_iBytes = 0;
+		EnableReadLine();
+		SetMaxBufferThreshold( 0 );
+	}
+
+	virtual void ReadLine( const CS_STRING & sLine )
+	{
+		m_iLines++;
+		m_iBytes += sLine.size();
+	}
+
+	uint64_t	m_iLines, m_iBytes;
+};
+
+static void BuildInput( CS_STRING & sInput, size_t uLineLen, bool bCRLF, size_t uTarget )
+{
+	sInput.clear();
+	sInput.reserve( uTarget + uLineLen + 2 );
+	size_t uLine = 0;
+	while( sInput.size() < uTarget )
+	{
+		// vary the content a little so nothing gets lucky with repeated patterns
+		for( size_t a = 0; a < uLineLen; ++a )
+			sInput.append( 1, ( char )( 'a' + ( ( a + uLine ) % 26 ) ) );
+		if( bCRLF )
+			sInput.append( 1, '\r' );
+		sInput.append( 1, '\n' );
+		uLine++;
+	}
+}
+
+static void RunCase( size_t uLineLen, bool bCRLF, size_t uChunk, const char * pszChunkName, const char * pszEncoding, uint64_t iMillis )
+{
+	CS_STRING sInput;
+	BuildInput( sInput, uLineLen, bCRLF, 4 * 1024 * 1024 );
+
+	CLineSock cSock;
+#ifdef HAVE_ICU
+	if( pszEncoding )
+		cSock.SetEncoding( pszEncoding );
+#endif /* HAVE_ICU */
+
+	size_t uStep = ( uChunk ? uChunk : uLineLen + ( bCRLF ? 2 : 1 ) );
+	uint64_t iAllocStart = g_iAllocs;
+	uint64_t iStart = microtime();
+	uint64_t iElapsed = 0;
+	uint64_t iFed = 0;
+	do
+	{
+		for( size_t uPos = 0; uPos < sInput.size(); uPos += uStep )
+		{
+			size_t uLen = ( sInput.size() - uPos < uStep ? sInput.size() - uPos : uStep );
+			cSock.PushBuff( sInput.data() + uPos, uLen );
+		}
+		iFed += sInput.size();
+		iElapsed = microtime() - iStart;
+	} while( iElapsed < iMillis * 1000 );
+	uint64_t iAllocs = g_iAllocs - iAllocStart;
+
+	double fSecs = ( double )iElapsed / 1000000.0;
+	cout << "line=" << uLineLen << " eol=" << ( bCRLF ? "crlf" : "lf" ) << " reads=" << pszChunkName
+		<< " encoding=" << ( pszEncoding ? pszEncoding : "none" )
+		<< " lines/s=" << ( uint64_t )( ( double )cSock.m_iLines / fSecs )
+		<< " MB/s=" << ( double )iFed / fSecs / ( 1024.0 * 1024.0 )
+		<< " allocs/line=" << ( cSock.m_iLines ? ( double )iAllocs / ( double )cSock.m_iLines : 0.0 ) << endl;
+}
+
+int main( int argc, char ** argv )
+{
+	uint64_t iMillis = argc > 1 ? ( uint64_t )( atof( argv[1] ) * 1000.0 ) : 250;
+
+	static const size_t auLineLens[] = { 16, 80, 512, 4096 };
+	static const size_t auChunks[] = { 0, 1448, 16384 };
+	static const char * apszChunkNames[] = { "line", "segment", "block" };
+	const char * apszEncodings[] = {
+		NULL,
+#ifdef HAVE_ICU
+		"ISO-8859-1",
+#endif /* HAVE_ICU */
+	};
+
+	InitCsocket();
+	for( size_t e = 0; e < sizeof( apszEncodings ) / sizeof( apszEncodings[0] ); ++e )
+	{
+		for( size_t l = 0; l < sizeof( auLineLens ) / sizeof( auLineLens[0] ); ++l )
+		{
+			for( int iCRLF = 0; iCRLF < 2; ++iCRLF )
+			{
+				for( size_t c = 0; c < sizeof( auChunks ) / sizeof( auChunks[0] ); ++c )
+					RunCase( auLineLens[l], iCRLF != 0, auChunks[c], apszChunkNames[c], apszEncodings[e], iMillis );
+			}
+		}
+	}
+	ShutdownCsocket();
+	return( 0 );
+}
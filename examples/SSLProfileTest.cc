@@ -0,0 +1,90 @@
+/**
+ * CSSSLProfile sharing over loopback TLS, exits non zero on the first check that fails. Needs ReceiveTest.pem, which
+ * 'make' generates
+ */
+#include <Csocket.h>
+
+static bool g_bFailed = false;
+static int g_iEchoed = 0;
+
+#define CHECK( x ) do { if( !( x ) ) { cerr << __FILE__ << ":" << __LINE__ << " failed: " #x << endl; g_bFailed = true; } } while( 0 )
+
+//! the server end, echoes what it reads
+class CServerSock : public Csock
+{
+public:
+	CServerSock( int iTimeout = 60 ) : Csock( iTimeout ) {}
+	CServerSock( const CS_STRING & sHostname, uint16_t uPort ) : Csock( sHostname, uPort ) {}
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CServerSock( sHostname, uPort ) ); }
+
+	virtual void ReadData( const char * data, size_t len ) { Write( data, len ); }
+};
+
+class CClientSock : public Csock
+{
+public:
+	CClientSock() : Csock( 10 ) {}
+
+	virtual void Connected() { Write( "x" ); }
+	virtual void ReadData( const char * data, size_t len ) { g_iEchoed++; }
+};
+
+int main( int argc, char ** argv )
+{
+	InitCsocket();
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 10000 );
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetIsSSL( true );
+	cListen.SetPemLocation( "ReceiveTest.pem" );
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, new CServerSock(), &uPort ) )
+	{
+		cerr << "listen failed, is there a ReceiveTest.pem?" << endl;
+		return( 1 );
+	}
+
+	// the same settings share one profile
+	CSConnection cCon( "127.0.0.1", uPort );
+	cCon.SetIsSSL( true );
+	CClientSock * pFirst = new CClientSock();
+	CClientSock * pSecond = new CClientSock();
+	cManager.Connect( cCon, pFirst );
+	cManager.Connect( cCon, pSecond );
+	CHECK( pFirst->GetSSLProfile() != NULL );
+	CHECK( pFirst->GetSSLProfile() == pSecond->GetSSLProfile() );
+	CHECK( pFirst->GetCipher() == cCon.GetCipher() );
+
+	// different settings get their own
+	CSConnection cOther( cCon );
+	cOther.SetCipher( "ALL" );
+	CClientSock * pOther = new CClientSock();
+	cManager.Connect( cOther, pOther );
+	CHECK( pOther->GetSSLProfile() != pFirst->GetSSLProfile() );
+	CHECK( pOther->GetCipher() == "ALL" );
+
+	// a socket that was set up before Connect() keeps its own, with the connection's settings on top
+	CClientSock * pOwn = new CClientSock();
+	pOwn->SetPemPass( "secret" );
+	CSSSLProfile * pOwnProfile = pOwn->GetSSLProfile();
+	cManager.Connect( cCon, pOwn );
+	CHECK( pOwn->GetSSLProfile() == pOwnProfile );
+	CHECK( pOwn->GetPemPass() == "secret" );
+	CHECK( pOwn->GetCipher() == cCon.GetCipher() );
+
+	// overriding a shared profile copies it
+	pSecond->SetCipher( "ALL" );
+	CHECK( pSecond->GetSSLProfile() != pFirst->GetSSLProfile() );
+	CHECK( pFirst->GetCipher() == cCon.GetCipher() );
+
+	uint64_t iStart = millitime();
+	while( g_iEchoed < 4 && millitime() - iStart < 5000 )
+		cManager.Loop();
+	CHECK( g_iEchoed == 4 );
+
+	ShutdownCsocket();
+	if( g_bFailed )
+		return( 1 );
+	cout << "SSLProfileTest passed" << endl;
+	return( 0 );
+}
@@ -0,0 +1,116 @@
+/**
+ * CSSockTuning checks over loopback, reads every option back with getsockopt() on both ends of a connection, exits
+ * non zero on the first one that fails
+ */
+#include <Csocket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+
+static bool g_bFailed = false;
+static bool g_bDone = false;
+
+#define CHECK( x ) do { if( !( x ) ) { cerr << __FILE__ << ":" << __LINE__ << " failed: " #x << endl; g_bFailed = true; } } while( 0 )
+
+class CTuneSock : public Csock
+{
+public:
+	CTuneSock( int iTimeout = 60 ) : Csock( iTimeout ) {}
+	CTuneSock( const CS_STRING & sHostname, uint16_t uPort ) : Csock( sHostname, uPort ) {}
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CTuneSock( sHostname, uPort ) ); }
+
+	virtual void Disconnected() { g_bDone = true; }
+	virtual void ConnectionRefused() { g_bDone = true; }
+	virtual void Timeout() { g_bDone = true; }
+};
+
+static int GetOption( cs_sock_t iSock, int iLevel, int iName )
+{
+	int iValue = -1;
+	socklen_t uLen = sizeof( iValue );
+	if( getsockopt( iSock, iLevel, iName, &iValue, &uLen ) != 0 )
+		return( -1 );
+	return( iValue );
+}
+
+static void CheckTuning( const char * szWhich, cs_sock_t iSock, bool bQuickAck )
+{
+	cerr << "checking " << szWhich << endl;
+	// the kernel doubles the buffer sizes for its own bookkeeping
+	CHECK( GetOption( iSock, SOL_SOCKET, SO_SNDBUF ) >= 256 * 1024 );
+	CHECK( GetOption( iSock, SOL_SOCKET, SO_RCVBUF ) >= 128 * 1024 );
+	CHECK( GetOption( iSock, IPPROTO_TCP, TCP_NODELAY ) == 1 );
+	CHECK( GetOption( iSock, SOL_SOCKET, SO_KEEPALIVE ) == 1 );
+	CHECK( GetOption( iSock, IPPROTO_IP, IP_TOS ) == 0x10 );
+#ifdef TCP_KEEPIDLE
+	CHECK( GetOption( iSock, IPPROTO_TCP, TCP_KEEPIDLE ) == 61 );
+	CHECK( GetOption( iSock, IPPROTO_TCP, TCP_KEEPINTVL ) == 11 );
+	CHECK( GetOption( iSock, IPPROTO_TCP, TCP_KEEPCNT ) == 7 );
+#endif /* TCP_KEEPIDLE */
+#ifdef TCP_NOTSENT_LOWAT
+	CHECK( GetOption( iSock, IPPROTO_TCP, TCP_NOTSENT_LOWAT ) == 32 * 1024 );
+#endif /* TCP_NOTSENT_LOWAT */
+#ifdef TCP_QUICKACK
+	// a fresh socket reads back as quick ack on, off is the one that shows it was set. the handshake resets it on
+	// an outbound socket, which had it set before connect()
+	if( bQuickAck )
+		CHECK( GetOption( iSock, IPPROTO_TCP, TCP_QUICKACK ) == 0 );
+#endif /* TCP_QUICKACK */
+}
+
+int main( int argc, char ** argv )
+{
+	InitCsocket();
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 100000 );
+
+	CSSockTuning cTuning;
+	cTuning.SetSendBuffer( 128 * 1024 );
+	cTuning.SetRecvBuffer( 64 * 1024 );
+	cTuning.SetNoDelay( true );
+	cTuning.SetQuickAck( false );
+	cTuning.SetKeepAlive( true, 61, 11, 7 );
+	cTuning.SetNotSentLowat( 32 * 1024 );
+	cTuning.SetTOS( 0x10 );
+
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetAFRequire( CSSockAddr::RAF_INET );
+	cListen.SetTuning( cTuning );
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, new CTuneSock(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		return( 1 );
+	}
+
+	CSConnection cCon( "127.0.0.1", uPort );
+	cCon.SetAFRequire( CSSockAddr::RAF_INET );
+	cCon.SetTuning( cTuning );
+	CTuneSock * pClient = new CTuneSock();
+	cManager.Connect( cCon, pClient );
+
+	Csock * pAccepted = NULL;
+	uint64_t iStart = millitime();
+	while( !g_bDone && ( !pClient->IsConnected() || !pAccepted ) && millitime() - iStart < 5000 )
+	{
+		cManager.Loop();
+		for( size_t a = 0; a < cManager.size(); ++a )
+		{
+			if( cManager[a]->GetType() == Csock::INBOUND )
+				pAccepted = cManager[a];
+		}
+	}
+	CHECK( pClient->IsConnected() );
+	CHECK( pAccepted != NULL );
+	if( pClient->IsConnected() )
+		CheckTuning( "outbound", pClient->GetRSock(), false );
+	// TCP_QUICKACK is the one option it doesn't inherit from the listener
+	if( pAccepted )
+		CheckTuning( "accepted", pAccepted->GetRSock(), true );
+
+	ShutdownCsocket();
+	if( g_bFailed )
+		return( 1 );
+	cout << "TuneTest passed" << endl;
+	return( 0 );
+}
@@ -0,0 +1,147 @@
+/**
+ * datagram throughput over loopback, a connected sender blasts at a bound receiver in the same manager
+ *
+ * usage: UDPBench [seconds per run] [datagram sizes, IE 64,1400]
+ *
+ * the sender keeps a window of datagrams in flight so the receive buffer never overflows, lost counts what went
+ * missing anyway. batch=1 is one recvfrom()/sendto() worth of work per datagram, batch=32 uses recvmmsg()/sendmmsg().
+ * the offload runs add UDP GSO/GRO and are skipped where the kernel doesn't have them.
+ */
+#include <Csocket.h>
+#include <stdlib.h>
+#include <signal.h>
+
+static uint64_t g_iReceived = 0;
+static uint64_t g_iReceivedBytes = 0;
+
+class CSinkSock : public Csock
+{
+public:
+	CSinkSock() : Csock( 0 ) {}
+
+	virtual void ReadDatagram( const char * pData, size_t uLen, const CS_STRING & sIP, uint16_t uPort )
+	{
+		g_iReceived++;
+		g_iReceivedBytes += uLen;
+	}
+};
+
+static void RunCase( size_t uSize, u_int uBatch, bool bOffload, uint64_t iMillis )
+{
+	CSocketManager cManager;
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetDatagram( true );
+	CSinkSock * pSink = new CSinkSock();
+	pSink->SetDatagramBatch( uBatch );
+	if( bOffload && !pSink->SetDatagramOffload( true ) )
+	{
+		CS_Delete( pSink );
+		cout << "size=" << uSize << " batch=" << uBatch << " offload=on skipped, no UDP GSO/GRO here" << endl;
+		return;
+	}
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, pSink, &uPort ) )
+	{
+		cerr << "bind failed" << endl;
+		exit( 1 );
+	}
+
+	CSConnection cCon( "127.0.0.1", uPort, 0 );
+	cCon.SetDatagram( true );
+	Csock * pBlast = new Csock( 0 );
+	pBlast->SetDatagramBatch( uBatch );
+	pBlast->SetDatagramOffload( bOffload );
+	cManager.Connect( cCon, pBlast );
+
+	// small enough that neither end ever drops on a healthy loopback
+	const uint64_t iWindow = 256;
+	CS_STRING sPayload( uSize, 'x' );
+	g_iReceived = 0;
+	g_iReceivedBytes = 0;
+	uint64_t iSent = 0;
+	uint64_t iLost = 0;
+	uint64_t iStart = millitime();
+	uint64_t iProgress = iStart;
+	uint64_t iLastReceived = 0;
+	uint64_t iNow = iStart;
+	CSSockStats cSinkStart, cBlastStart;
+	bool bStarted = false;
+	while( iNow - iStart < iMillis )
+	{
+		if( !bStarted && pBlast->IsConnected() )
+		{
+			// don't bill the connect to either side
+			pSink->GetStats( cSinkStart );
+			pBlast->GetStats( cBlastStart );
+			bStarted = true;
+		}
+		while( iSent - g_iReceived - iLost < iWindow )
+		{
+			pBlast->SendDatagram( sPayload );
+			iSent++;
+		}
+		cManager.Loop();
+		iNow = millitime();
+		if( g_iReceived != iLastReceived )
+		{
+			iLastReceived = g_iReceived;
+			iProgress = iNow;
+		}
+		else if( iNow - iProgress > 50 )
+		{
+			// nothing for a while, whatever is still in flight isn't coming
+			iLost = iSent - g_iReceived;
+			iProgress = iNow;
+		}
+	}
+
+	CSSockStats cSink, cBlast;
+	pSink->GetStats( cSink );
+	pBlast->GetStats( cBlast );
+	uint64_t iReads = cSink.GetReadCalls() - cSinkStart.GetReadCalls();
+	uint64_t iWrites = cBlast.GetWriteCalls() - cBlastStart.GetWriteCalls();
+	double fSecs = ( double )( iNow - iStart ) / 1000.0;
+	double fReceived = ( g_iReceived ? ( double )g_iReceived : 1.0 );
+	cout << "size=" << uSize << " batch=" << uBatch << " offload=" << ( bOffload ? "on" : "off" )
+		<< " dgrams/s=" << ( uint64_t )( ( double )g_iReceived / fSecs )
+		<< " MB/s=" << ( double )g_iReceivedBytes / fSecs / ( 1024.0 * 1024.0 )
+		<< " reads/dgram=" << ( double )iReads / fReceived
+		<< " writes/dgram=" << ( double )iWrites / fReceived
+		<< " lost=" << iLost << endl;
+}
+
+int main( int argc, char ** argv )
+{
+	uint64_t iMillis = argc > 1 ? ( uint64_t )( atof( argv[1] ) * 1000.0 ) : 1000;
+	std::vector<size_t> vSizes;
+	if( argc > 2 )
+	{
+		for( const char * p = argv[2]; *p; )
+		{
+			vSizes.push_back( ( size_t )atoi( p ) );
+			while( *p && *p != ',' )
+				p++;
+			if( *p )
+				p++;
+		}
+	}
+	else
+	{
+		vSizes.push_back( 64 );
+		vSizes.push_back( 512 );
+		vSizes.push_back( 1400 );
+	}
+
+	InitCsocket();
+#ifndef _WIN32
+	signal( SIGPIPE, SIG_IGN );
+#endif /* _WIN32 */
+	for( size_t s = 0; s < vSizes.size(); ++s )
+	{
+		RunCase( vSizes[s], 1, false, iMillis );
+		RunCase( vSizes[s], 32, false, iMillis );
+		RunCase( vSizes[s], 32, true, iMillis );
+	}
+	ShutdownCsocket();
+	return( 0 );
+}
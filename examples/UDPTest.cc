@@ -0,0 +1,68 @@
+/**
+ * datagram socket checks over loopback, exits non zero on the first one that fails
+ */
+#include <Csocket.h>
+
+static bool g_bFailed = false;
+static std::vector<CS_STRING> g_vReceived;
+static int g_iTooBig = 0;
+
+#define CHECK( x ) do { if( !( x ) ) { cerr << __FILE__ << ":" << __LINE__ << " failed: " #x << endl; g_bFailed = true; } } while( 0 )
+
+class CSinkSock : public Csock
+{
+public:
+	CSinkSock() : Csock( 0 ) {}
+
+	virtual void ReadDatagram( const char * pData, size_t uLen, const CS_STRING & sIP, uint16_t uPort ) { g_vReceived.push_back( CS_STRING( pData, uLen ) ); }
+	virtual void SockError( int iErrno, const CS_STRING & sDescription )
+	{
+		if( iErrno == EMSGSIZE )
+			g_iTooBig++;
+	}
+};
+
+int main( int argc, char ** argv )
+{
+	InitCsocket();
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 10000 );
+	CSListener cListen( 0, "127.0.0.1" );
+	cListen.SetDatagram( true );
+	CSinkSock * pSink = new CSinkSock();
+	pSink->SetMaxDatagramSize( 100 );
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, pSink, &uPort ) )
+	{
+		cerr << "bind failed" << endl;
+		return( 1 );
+	}
+
+	CSConnection cCon( "127.0.0.1", uPort, 0 );
+	cCon.SetDatagram( true );
+	Csock * pSend = new Csock( 0 );
+	cManager.Connect( cCon, pSend );
+	uint64_t iStart = millitime();
+	while( !pSend->IsConnected() && millitime() - iStart < 5000 )
+		cManager.Loop();
+	CHECK( pSend->IsConnected() );
+
+	// the one in the middle doesn't fit the receive slot, it's dropped instead of cut
+	pSend->SendDatagram( CS_STRING( 50, 'a' ) );
+	pSend->SendDatagram( CS_STRING( 500, 'b' ) );
+	pSend->SendDatagram( CS_STRING( 100, 'c' ) );
+	pSend->Flush();
+	iStart = millitime();
+	while( g_vReceived.size() + g_iTooBig < 3 && millitime() - iStart < 5000 )
+		cManager.Loop();
+	CHECK( g_vReceived.size() == 2 );
+	CHECK( g_iTooBig == 1 );
+	CHECK( g_vReceived.size() == 2 && g_vReceived[0] == CS_STRING( 50, 'a' ) && g_vReceived[1] == CS_STRING( 100, 'c' ) );
+	CHECK( !pSink->IsClosed() );
+
+	ShutdownCsocket();
+	if( g_bFailed )
+		return( 1 );
+	cout << "UDPTest passed" << endl;
+	return( 0 );
+}
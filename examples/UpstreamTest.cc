@@ -0,0 +1,126 @@
+/**
+ * SetUpstream() backpressure against PauseRead() over loopback, exits non zero on the first check that fails
+ */
+#include <Csocket.h>
+#include <algorithm>
+
+static bool g_bFailed = false;
+static std::vector<Csock *> g_vAccepted;
+static CS_STRING g_sUpstream;
+
+#define CHECK( x ) do { if( !( x ) ) { cerr << __FILE__ << ":" << __LINE__ << " failed: " #x << endl; g_bFailed = true; } } while( 0 )
+
+//! the server end, throws away what it reads
+class CServerSock : public Csock
+{
+public:
+	CServerSock( int iTimeout = 60 ) : Csock( iTimeout ) {}
+	CServerSock( const CS_STRING & sHostname, uint16_t uPort ) : Csock( sHostname, uPort ) {}
+	virtual ~CServerSock() { g_vAccepted.erase( std::remove( g_vAccepted.begin(), g_vAccepted.end(), this ), g_vAccepted.end() ); }
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort )
+	{
+		CServerSock * pSock = new CServerSock( sHostname, uPort );
+		g_vAccepted.push_back( pSock );
+		return( pSock );
+	}
+};
+
+class CUpstreamSock : public Csock
+{
+public:
+	CUpstreamSock() : Csock( 60 ) {}
+	virtual void ReadData( const char * data, size_t len ) { g_sUpstream.append( data, len ); }
+};
+
+static void Run( CSocketManager & cManager, int iLoops )
+{
+	for( int a = 0; a < iLoops; ++a )
+		cManager.Loop();
+}
+
+//! connects pSock and hands back the server end of it
+static Csock * Connect( CSocketManager & cManager, uint16_t uPort, Csock * pSock )
+{
+	size_t uAccepted = g_vAccepted.size();
+	cManager.Connect( CSConnection( "127.0.0.1", uPort ), pSock );
+	uint64_t iStart = millitime();
+	while( ( !pSock->IsConnected() || g_vAccepted.size() == uAccepted ) && millitime() - iStart < 5000 )
+		cManager.Loop();
+	CHECK( pSock->IsConnected() && g_vAccepted.size() > uAccepted );
+	return( g_vAccepted.empty() ? NULL : g_vAccepted.back() );
+}
+
+//! fills pDown's send queue past its high watermark and keeps it there, the other end doesn't read
+static void Fill( CSocketManager & cManager, Csock * pDown, Csock * pDownServer )
+{
+	pDownServer->PauseRead();
+	pDown->Write( CS_STRING( 32 * 1024 * 1024, 'x' ) );
+	Run( cManager, 10 );
+	CHECK( pDown->IsWriteBufferFull() );
+}
+
+//! lets the other end read until pDown's send queue is empty
+static void Drain( CSocketManager & cManager, Csock * pDown, Csock * pDownServer )
+{
+	pDownServer->UnPauseRead();
+	uint64_t iStart = millitime();
+	while( pDown->GetWriteBufferSize() > 0 && millitime() - iStart < 10000 )
+		cManager.Loop();
+	CHECK( !pDown->IsWriteBufferFull() );
+}
+
+int main( int argc, char ** argv )
+{
+	InitCsocket();
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 10000 );
+	CSListener cListen( 0, "127.0.0.1" );
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, new CServerSock(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		return( 1 );
+	}
+
+	CUpstreamSock * pUp = new CUpstreamSock();
+	Csock * pUpServer = Connect( cManager, uPort, pUp );
+	Csock * pDown = new Csock( 60 );
+	Csock * pDownServer = Connect( cManager, uPort, pDown );
+	if( !pUpServer || !pDownServer )
+		return( 1 );
+	pDown->SetWriteBufferWatermarks( 1024 * 1024 );
+	pDown->SetUpstream( pUp );
+
+	// paused by the caller while the downstream is full, the drain doesn't resume it
+	Fill( cManager, pDown, pDownServer );
+	CHECK( pUp->IsReadPaused() );
+	pUp->PauseRead();
+	Drain( cManager, pDown, pDownServer );
+	CHECK( pUp->IsReadPaused() );
+	pUpServer->Write( "one" );
+	Run( cManager, 10 );
+	CHECK( g_sUpstream.empty() );
+	pUp->UnPauseRead();
+	CHECK( !pUp->IsReadPaused() );
+	Run( cManager, 10 );
+	CHECK( g_sUpstream == "one" );
+
+	// the caller's UnPauseRead() doesn't resume it while the downstream is still full
+	Fill( cManager, pDown, pDownServer );
+	pUp->PauseRead();
+	pUp->UnPauseRead();
+	CHECK( pUp->IsReadPaused() );
+	pUpServer->Write( "two" );
+	Run( cManager, 10 );
+	CHECK( g_sUpstream == "one" );
+	Drain( cManager, pDown, pDownServer );
+	CHECK( !pUp->IsReadPaused() );
+	Run( cManager, 10 );
+	CHECK( g_sUpstream == "onetwo" );
+
+	ShutdownCsocket();
+	if( g_bFailed )
+		return( 1 );
+	cout << "UpstreamTest passed" << endl;
+	return( 0 );
+}
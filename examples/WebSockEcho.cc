@@ -0,0 +1,55 @@
+/**
+ * WebSocket echo server, point a browser or any RFC 6455 client at ws://127.0.0.1:<port>/
+ *
+ * usage: WebSockEcho [port]
+ *
+ * text and binary messages come back as they were sent. idle clients are pinged every 30 seconds.
+ */
+#include <WebSock.h>
+#include <stdlib.h>
+#include <signal.h>
+
+class CEchoWebSock : public CWebSock
+{
+public:
+	CEchoWebSock( int iTimeout = 0 ) : CWebSock( iTimeout ) {}
+	CEchoWebSock( const CS_STRING & sHostname, uint16_t uPort, int iTimeout = 0 ) : CWebSock( sHostname, uPort, iTimeout ) {}
+
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CEchoWebSock( sHostname, uPort ) ); }
+
+	virtual void WebSocketOpened()
+	{
+		cout << GetRemoteIP() << ":" << GetRemotePort() << " connected" << ( IsDeflate() ? " with permessage-deflate" : "" ) << endl;
+		SetPingInterval( 30 );
+	}
+	virtual void ReadMessage( const CS_STRING & sMessage, bool bBinary ) { SendMessage( sMessage, bBinary ); }
+	virtual void WebSocketClosed( uint16_t uCode, const CS_STRING & sReason )
+	{
+		cout << GetRemoteIP() << ":" << GetRemotePort() << " closed " << uCode << " " << sReason << endl;
+	}
+};
+
+int main( int argc, char ** argv )
+{
+	uint16_t uPort = ( uint16_t )( argc > 1 ? atoi( argv[1] ) : 8080 );
+
+	InitCsocket();
+#ifndef _WIN32
+	signal( SIGPIPE, SIG_IGN );
+#endif /* _WIN32 */
+
+	CSocketManager cManager;
+	CSListener cListen( uPort, "127.0.0.1" );
+	uint16_t uRandPort = 0;
+	if( !cManager.Listen( cListen, new CEchoWebSock(), &uRandPort ) )
+	{
+		cerr << "listen failed" << endl;
+		return( 1 );
+	}
+	cout << "listening on ws://127.0.0.1:" << ( uPort ? uPort : uRandPort ) << "/" << endl;
+	while( true )
+		cManager.Loop();
+
+	ShutdownCsocket();
+	return( 0 );
+}
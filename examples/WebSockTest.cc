@@ -0,0 +1,163 @@
+/**
+ * CWebSock handshake and framing checks against a hand rolled client over loopback, exits non zero on the first one
+ * that fails
+ */
+#include <WebSock.h>
+
+static bool g_bFailed = false;
+static bool g_bDone = false;
+
+#define CHECK( x ) do { if( !( x ) ) { cerr << __FILE__ << ":" << __LINE__ << " failed: " #x << endl; g_bFailed = true; } } while( 0 )
+
+//! 100 two byte characters, cutting it at 123 bytes lands in the middle of one
+static CS_STRING LongReason()
+{
+	CS_STRING sReason;
+	for( int a = 0; a < 100; ++a )
+		sReason.append( "\xc3\xa9" );
+	return( sReason );
+}
+
+class CTestWebSock : public CWebSock
+{
+public:
+	CTestWebSock( int iTimeout = 60 ) : CWebSock( iTimeout ) {}
+	CTestWebSock( const CS_STRING & sHostname, uint16_t uPort ) : CWebSock( sHostname, uPort ) {}
+	virtual Csock * GetSockObj( const CS_STRING & sHostname, uint16_t uPort ) { return( new CTestWebSock( sHostname, uPort ) ); }
+
+	virtual void ReadMessage( const CS_STRING & sMessage, bool bBinary )
+	{
+		if( sMessage == "close" )
+			CloseWebSocket( WSC_NORMAL, LongReason() );
+		else
+			SendMessage( sMessage, bBinary );
+	}
+};
+
+//! a client frame, always masked
+static CS_STRING ClientFrame( unsigned char uFirst, const CS_STRING & sPayload )
+{
+	static const unsigned char auMask[4] = { 0x12, 0x34, 0x56, 0x78 };
+	CS_STRING sFrame( 1, ( char )uFirst );
+	sFrame += ( char )( 0x80 | sPayload.size() );
+	sFrame.append( ( const char * )auMask, 4 );
+	for( size_t a = 0; a < sPayload.size(); ++a )
+		sFrame += ( char )( sPayload[a] ^ auMask[a % 4] );
+	return( sFrame );
+}
+
+class CClientSock : public Csock
+{
+public:
+	CClientSock() : Csock( 10 ) {}
+
+	virtual void ReadData( const char * data, size_t len ) { m_sIn.append( data, len ); }
+	virtual void Disconnected() { g_bDone = true; }
+	virtual void ConnectionRefused() { g_bDone = true; }
+	virtual void Timeout() { g_bDone = true; }
+
+	//! takes one server frame off the front of what was read, false if there isn't a whole one yet
+	bool NextFrame( unsigned char & uFirst, CS_STRING & sPayload )
+	{
+		if( m_sIn.size() < 2 )
+			return( false );
+		size_t uLen = ( unsigned char )m_sIn[1];
+		// the server never masks and nothing in here is longer than 125 bytes
+		CHECK( uLen <= 125 );
+		if( m_sIn.size() < 2 + uLen )
+			return( false );
+		uFirst = ( unsigned char )m_sIn[0];
+		sPayload = m_sIn.substr( 2, uLen );
+		m_sIn.erase( 0, 2 + uLen );
+		return( true );
+	}
+
+	CS_STRING	m_sIn;
+};
+
+static void Run( CSocketManager & cManager, CClientSock * pClient, size_t uWant )
+{
+	uint64_t iStart = millitime();
+	while( !g_bDone && pClient->m_sIn.size() < uWant && millitime() - iStart < 5000 )
+		cManager.Loop();
+}
+
+//! true if sText is whole UTF-8 sequences, which is all the cut needs to keep intact
+static bool WholeUTF8( const CS_STRING & sText )
+{
+	size_t a = 0;
+	while( a < sText.size() )
+	{
+		unsigned char uLead = ( unsigned char )sText[a];
+		size_t uSeq = ( uLead < 0x80 ? 1 : ( uLead >= 0xf0 ? 4 : ( uLead >= 0xe0 ? 3 : ( uLead >= 0xc0 ? 2 : 0 ) ) ) );
+		if( uSeq == 0 || a + uSeq > sText.size() )
+			return( false );
+		for( size_t b = 1; b < uSeq; ++b )
+		{
+			if( ( ( unsigned char )sText[a + b] & 0xc0 ) != 0x80 )
+				return( false );
+		}
+		a += uSeq;
+	}
+	return( true );
+}
+
+int main( int argc, char ** argv )
+{
+	InitCsocket();
+	CSocketManager cManager;
+	cManager.SetSelectTimeout( 1000 );
+	CSListener cListen( 0, "127.0.0.1" );
+	uint16_t uPort = 0;
+	if( !cManager.Listen( cListen, new CTestWebSock(), &uPort ) )
+	{
+		cerr << "listen failed" << endl;
+		return( 1 );
+	}
+
+	CClientSock * pClient = new CClientSock();
+	cManager.Connect( CSConnection( "127.0.0.1", uPort ), pClient );
+	while( !pClient->IsConnected() && !g_bDone )
+		cManager.Loop();
+
+	// the handshake, with the key and answer from RFC 6455 section 1.3
+	pClient->Write( "GET /chat HTTP/1.1\r\nHost: 127.0.0.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n" );
+	uint64_t iStart = millitime();
+	while( !g_bDone && pClient->m_sIn.find( "\r\n\r\n" ) == CS_STRING::npos && millitime() - iStart < 5000 )
+		cManager.Loop();
+	CS_STRING::size_type uHeadEnd = pClient->m_sIn.find( "\r\n\r\n" );
+	CHECK( uHeadEnd != CS_STRING::npos );
+	CS_STRING sHead = pClient->m_sIn.substr( 0, uHeadEnd + 4 );
+	pClient->m_sIn.erase( 0, uHeadEnd + 4 );
+	CHECK( sHead.compare( 0, 12, "HTTP/1.1 101" ) == 0 );
+	CHECK( sHead.find( "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n" ) != CS_STRING::npos );
+
+	// a text message in two fragments with a ping in between, the pong comes back first
+	pClient->Write( ClientFrame( 0x01, "hel" ) + ClientFrame( 0x89, "p" ) + ClientFrame( 0x80, "lo" ) );
+	Run( cManager, pClient, 3 + 7 );
+	unsigned char uFirst = 0;
+	CS_STRING sPayload;
+	CHECK( pClient->NextFrame( uFirst, sPayload ) && uFirst == 0x8a && sPayload == "p" );
+	CHECK( pClient->NextFrame( uFirst, sPayload ) && uFirst == 0x81 && sPayload == "hello" );
+
+	// the close reason is cut to fit a control frame, on a character boundary
+	pClient->Write( ClientFrame( 0x81, "close" ) );
+	Run( cManager, pClient, 2 + 2 + 122 );
+	CHECK( pClient->NextFrame( uFirst, sPayload ) && uFirst == 0x88 );
+	CHECK( sPayload.size() >= 2 && sPayload.size() <= 125 );
+	CHECK( sPayload.size() >= 2 && ( ( unsigned char )sPayload[0] << 8 | ( unsigned char )sPayload[1] ) == CWebSock::WSC_NORMAL );
+	CHECK( sPayload.size() >= 2 && WholeUTF8( sPayload.substr( 2 ) ) );
+	CHECK( sPayload.size() == 2 + 122 );
+
+	iStart = millitime();
+	while( !g_bDone && millitime() - iStart < 5000 )
+		cManager.Loop();
+	CHECK( g_bDone );
+
+	ShutdownCsocket();
+	if( g_bFailed )
+		return( 1 );
+	cout << "WebSockTest passed" << endl;
+	return( 0 );
+}
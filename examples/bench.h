@@ -0,0 +1,89 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+/**
+ * bits the benchmarks share, include it from the bench's .cc only
+ *
+ * define BENCH_COUNT_ALLOCS before including it to replace the global operator new/delete with ones that count
+ * into g_iAllocs, that can only be done once per program.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <vector>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif /* _WIN32 */
+
+#ifdef BENCH_COUNT_ALLOCS
+#if __cplusplus >= 201103L
+#define CS_BAD_ALLOC_SPEC
+#define CS_NOTHROW_SPEC noexcept
+#else
+#define CS_BAD_ALLOC_SPEC throw( std::bad_alloc )
+#define CS_NOTHROW_SPEC throw()
+#endif
+
+static uint64_t g_iAllocs = 0;
+
+void * operator new( size_t uSize ) CS_BAD_ALLOC_SPEC
+{
+	g_iAllocs++;
+	void * pData = malloc( uSize ? uSize : 1 );
+	if( !pData )
+		throw std::bad_alloc();
+	return( pData );
+}
+
+void operator delete( void * pData ) CS_NOTHROW_SPEC
+{
+	free( pData );
+}
+
+#if __cpp_sized_deallocation
+void operator delete( void * pData, size_t uSize ) CS_NOTHROW_SPEC
+{
+	free( pData );
+}
+#endif /* __cpp_sized_deallocation */
+#endif /* BENCH_COUNT_ALLOCS */
+
+//! user+sys time of the whole process in microseconds, 0 where getrusage() isn't around
+static inline uint64_t CPUTime()
+{
+#ifndef _WIN32
+	struct rusage cUsage;
+	if( getrusage( RUSAGE_SELF, &cUsage ) != 0 )
+		return( 0 );
+	return( ( uint64_t )cUsage.ru_utime.tv_sec * 1000000 + ( uint64_t )cUsage.ru_utime.tv_usec
+		+ ( uint64_t )cUsage.ru_stime.tv_sec * 1000000 + ( uint64_t )cUsage.ru_stime.tv_usec );
+#else
+	return( 0 );
+#endif /* _WIN32 */
+}
+
+//! the fPercentile (0 - 100) value of vValues, 0 if it's empty. reorders vValues
+template<typename T>
+static inline T Percentile( std::vector<T> & vValues, double fPercentile )
+{
+	if( vValues.empty() )
+		return( 0 );
+	size_t uIdx = ( size_t )( ( double )( vValues.size() - 1 ) * fPercentile / 100.0 );
+	std::nth_element( vValues.begin(), vValues.begin() + ( long )uIdx, vValues.end() );
+	return( vValues[uIdx] );
+}
+
+//! raises the soft fd limit to the hard one, the connection floods need more than the usual 1024
+static inline void RaiseFDLimit()
+{
+#ifndef _WIN32
+	struct rlimit cLimit;
+	if( getrlimit( RLIMIT_NOFILE, &cLimit ) == 0 && cLimit.rlim_cur < cLimit.rlim_max )
+	{
+		cLimit.rlim_cur = cLimit.rlim_max;
+		setrlimit( RLIMIT_NOFILE, &cLimit );
+	}
+#endif /* _WIN32 */
+}
+
+#endif /* _BENCH_H */